@@ -13,7 +13,20 @@
         "src/util.cc",
         "src/time_util.cc",
         "src/audio_decode_thread.cc",
-        "src/audio_encode_thread.cc"
+        "src/audio_encode_thread.cc",
+        "src/audio_level.cc",
+        "src/pcm_ring_buffer.cc",
+        "src/buffered_audio.cc",
+        "src/time_stretch.cc",
+        "src/pcm_output_ring.cc",
+        "src/jitter_buffer.cc",
+        "src/node_dispatcher.cc",
+        "src/packet_pool.cc",
+        "src/ogg_parser.cc",
+        "src/clip_cache.cc",
+        "src/mixer.cc",
+        "src/group_mixer_thread.cc",
+        "src/voice_activity.cc"
       ],
       "link_settings": {
         "ldflags": [
@@ -1,16 +1,22 @@
+#include <math.h>
 #include <node_api.h>
 
 #include "audio_decode_thread.h"
 #include "buffer_ready_node_callback.h"
 #include "demuxer.h"
+#include "jitter_buffer.h"
+#include "packet_pool.h"
 #include "thread_messages.h"
 #include "node_errors.h"
 #include "util.h"
 #include "thread_with_promise_result.h"
 #include "time_util.h"
+#include "voice_activity.h"
 
 extern "C" {
   #include "libavutil/time.h"
+  #include <libavutil/mathematics.h>
+  #include <libswresample/swresample.h>
   #include <opus/opus.h>
 }
 
@@ -19,40 +25,1193 @@ extern "C" {
 #define OPUS_FRAME_DURATION_MS 20
 #define OPUS_MAX_FRAME_SIZE (960 * 6)  // Max frame size for opus
 
-// Copied from libavcodec/libopus.c
-static int ff_opus_error_to_averror(int err) {
-  switch (err) {
-    case OPUS_BAD_ARG:
-      return AVERROR(EINVAL);
-    case OPUS_BUFFER_TOO_SMALL:
-      return AVERROR_UNKNOWN;
-    case OPUS_INTERNAL_ERROR:
-      return AVERROR(EFAULT);
-    case OPUS_INVALID_PACKET:
-      return AVERROR_INVALIDDATA;
-    case OPUS_UNIMPLEMENTED:
-      return AVERROR(ENOSYS);
-    case OPUS_INVALID_STATE:
-      return AVERROR_UNKNOWN;
-    case OPUS_ALLOC_FAIL:
+static size_t secondsToPacketCount(double seconds) {
+  return (size_t)(seconds / 0.02);
+}
+
+// How often the thread checks maxLatencyMs while a chunk is partially filled
+#define LATENCY_POLL_INTERVAL (5 * 1000)
+
+// How far the timestamps can run ahead of the wall clock across a gap before
+// it's treated as a discontinuity rather than a pause. Packets that were held
+// up by the network arrive late, so this must cover jitter.
+#define DISCONTINUITY_TOLERANCE (1 * MICROSECONDS)
+
+enum GapType {
+  GAP_LOSS,
+  GAP_SILENCE,
+  GAP_DISCONTINUITY,
+};
+
+// Short gaps are packet loss, and are worth concealing. Longer ones are a
+// pause by the sender (DTX, a muted microphone, or time between segments) if
+// the timestamps advanced about as fast as the wall clock did. Otherwise the
+// timeline jumped, e.g. because the sender restarted.
+static GapType classify_gap(int64_t pts_gap, int64_t elapsed, int64_t max_conceal) {
+  if (pts_gap <= max_conceal) {
+    return GAP_LOSS;
+  }
+
+  if (av_rescale(pts_gap, MICROSECONDS, OUTPUT_SAMPLE_RATE) > elapsed + DISCONTINUITY_TOLERANCE) {
+    return GAP_DISCONTINUITY;
+  }
+
+  return GAP_SILENCE;
+}
+
+// Opus can decode to these rates directly. Anything else is decoded at 48kHz
+// and resampled.
+static bool is_opus_sample_rate(int sample_rate) {
+  return sample_rate == 8000 || sample_rate == 12000 || sample_rate == 16000 || sample_rate == 24000 || sample_rate == 48000;
+}
+
+static int decode_sample_rate_for(int sample_rate) {
+  return is_opus_sample_rate(sample_rate) ? sample_rate : OUTPUT_SAMPLE_RATE;
+}
+
+// Enough 10ms frames for a second of pre-roll
+#define PRE_ROLL_MAX_FRAMES 100
+
+// A frame held back by the voice activity gate, in case speech starts soon
+struct PreRollFrame {
+  uint8_t *data;
+  unsigned int data_size;
+  int count;
+  int64_t pts;
+  int64_t duration;
+  int64_t sender_time;
+  int64_t received_at;
+};
+
+// Decoded audio on its way to JavaScript. Buffers come from a pool that is
+// owned by this thread, and go back to it when JavaScript releases them.
+struct AudioOutput {
+  DispatchSource *callback;
+
+  // Index of the sink that this output feeds, or -1 for the main output
+  int sink;
+
+  // Where chunks that the callback couldn't take are counted, or NULL
+  int32_t *control;
+
+  // Frames are also written here when it's set
+  const PcmOutputRing *ring;
+  DispatchSource *reader_wakeup;
+
+  int channels;
+  bool use_float;
+  int sample_rate;
+
+  // Bytes per sample, for all channels
+  int sample_size;
+
+  // Opus RTP ticks per sample at the decode rate
+  int pts_scale;
+
+  // Samples per chunk, or 0 to send each frame as it's decoded
+  int chunk_samples;
+
+  // Microseconds that a partial chunk can wait for more audio, or 0
+  int64_t max_latency;
+
+  // Send silence and discontinuity events to the callback
+  bool gap_events;
+
+  // Converts from the decode rate to sample_rate, or NULL if they are the same
+  SwrContext *swr;
+
+  // Most samples that one frame can produce at sample_rate
+  int max_output_samples;
+
+  AVBufferPool *pool;
+
+  // When possible, frames are decoded straight into this block and sent as is.
+  // It's kept for the next frame if decoding fails.
+  AVBufferRef *frame;
+
+  // Otherwise, frames are decoded here and then resampled, copied into the
+  // chunk, or written to the ring. Sinks are never decoded into.
+  uint8_t *decoder_output;
+
+  // Resampled audio that is copied into the chunk or written to the ring
+  uint8_t *resampled;
+
+  // The chunk being filled
+  AVBufferRef *chunk;
+  int samples;
+  int64_t pts;
+  int64_t started_at;
+
+  // pts that would follow the last frame, to detect gaps within a chunk
+  int64_t next_pts;
+
+  // pts that follows the last frame written, whether it was sent or not
+  int64_t end_pts;
+
+  // Timestamps of the next frame that is written, see AudioBuffer
+  int64_t sender_time;
+  int64_t received_at;
+
+  // Timestamps of the chunk being filled
+  int64_t chunk_sender_time;
+  int64_t chunk_received_at;
+
+  // Detects speech in each frame, or NULL
+  VoiceActivityDetector *vad;
+
+  // Send speech start and end events to the callback
+  bool speech_events;
+
+  // Only send audio to the callback while speech is in progress. The frames
+  // before it starts are held in pre_roll, a ring of up to max_pre_roll ticks
+  // of audio.
+  bool vad_gate;
+  PreRollFrame *pre_roll;
+  int pre_roll_start;
+  int pre_roll_count;
+  int64_t pre_roll_duration;
+  int64_t max_pre_roll;
+};
+
+// The decoded frames have decode_channels channels of float or int16 samples
+// at decode_sample_rate. Only a sink's channels and format can differ from
+// them.
+static int init_audio_output(AudioOutput *output, int decode_sample_rate, int decode_channels, bool decode_float) {
+  int ret;
+
+  output->sample_size = output->channels * (output->use_float ? sizeof(float) : sizeof(int16_t));
+  output->max_output_samples = OPUS_MAX_FRAME_SIZE;
+
+  if (output->sample_rate != decode_sample_rate || output->channels != decode_channels || output->use_float != decode_float) {
+    AVChannelLayout out_layout;
+    AVChannelLayout in_layout;
+    av_channel_layout_default(&out_layout, output->channels);
+    av_channel_layout_default(&in_layout, decode_channels);
+    enum AVSampleFormat out_fmt = output->use_float ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
+    enum AVSampleFormat in_fmt = decode_float ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
+
+    ret = swr_alloc_set_opts2(&output->swr,
+                              &out_layout, out_fmt, output->sample_rate,
+                              &in_layout, in_fmt, decode_sample_rate,
+                              0, NULL);
+    if (ret < 0) {
+      return ret;
+    }
+
+    ret = swr_init(output->swr);
+    if (ret < 0) {
+      return ret;
+    }
+
+    output->max_output_samples = swr_get_out_samples(output->swr, OPUS_MAX_FRAME_SIZE);
+  }
+
+  size_t block_samples = output->chunk_samples > 0 ? output->chunk_samples : output->max_output_samples;
+
+  output->pool = av_buffer_pool_init(block_samples * output->sample_size, NULL);
+  if (output->pool == NULL) {
+    return AVERROR(ENOMEM);
+  }
+
+  if (output->sink < 0 && (output->chunk_samples > 0 || output->ring != NULL || output->swr != NULL)) {
+    output->decoder_output = (uint8_t *)av_malloc(OPUS_MAX_FRAME_SIZE * output->sample_size);
+    if (output->decoder_output == NULL) {
       return AVERROR(ENOMEM);
-    default:
-      return AVERROR(EINVAL);
+    }
+  }
+
+  if (output->swr != NULL && (output->chunk_samples > 0 || output->ring != NULL)) {
+    output->resampled = (uint8_t *)av_malloc(output->max_output_samples * output->sample_size);
+    if (output->resampled == NULL) {
+      return AVERROR(ENOMEM);
+    }
+  }
+
+  if (output->vad_gate && output->max_pre_roll > 0) {
+    output->pre_roll = (PreRollFrame *)av_calloc(PRE_ROLL_MAX_FRAMES, sizeof(PreRollFrame));
+    if (output->pre_roll == NULL) {
+      return AVERROR(ENOMEM);
+    }
   }
+
+  return 0;
 }
 
-static size_t secondsToPacketCount(double seconds) {
-  return (size_t)(seconds / 0.02);
+static void free_audio_output(AudioOutput *output) {
+  av_buffer_unref(&output->frame);
+  av_buffer_unref(&output->chunk);
+  av_freep(&output->decoder_output);
+  av_freep(&output->resampled);
+  swr_free(&output->swr);
+  voice_activity_free(&output->vad);
+
+  if (output->pre_roll != NULL) {
+    for (int i = 0; i < PRE_ROLL_MAX_FRAMES; i++) {
+      av_freep(&output->pre_roll[i].data);
+    }
+    av_freep(&output->pre_roll);
+  }
+
+  // Blocks that JavaScript still holds keep the pool alive until they are freed
+  av_buffer_pool_uninit(&output->pool);
+}
+
+// Returns the block that the next frame will be sent in, or NULL if out of
+// memory.
+static AVBufferRef *get_frame_block(AudioOutput *output) {
+  if (output->frame == NULL) {
+    output->frame = av_buffer_pool_get(output->pool);
+  }
+  return output->frame;
+}
+
+// Returns where the next frame should be decoded to, which has room for
+// OPUS_MAX_FRAME_SIZE samples, or NULL if out of memory.
+static uint8_t *get_decode_buffer(AudioOutput *output) {
+  if (output->decoder_output != NULL) {
+    return output->decoder_output;
+  }
+
+  AVBufferRef *block = get_frame_block(output);
+  return block != NULL ? block->data : NULL;
+}
+
+// Decodes a packet into get_decode_buffer(), or conceals a lost one if data is
+// NULL. Returns the number of samples per channel at the decode rate, or an
+// Opus error code.
+static int decode_frame(OpusDecoder *decoder, AudioOutput *output, const uint8_t *data, int size, int max_samples, int decode_fec) {
+  uint8_t *buffer = get_decode_buffer(output);
+  if (buffer == NULL) {
+    return OPUS_ALLOC_FAIL;
+  }
+
+  if (output->use_float) {
+    return opus_decode_float(decoder, data, size, (float *)buffer, max_samples, decode_fec);
+  } else {
+    return opus_decode(decoder, data, size, (opus_int16 *)buffer, max_samples, decode_fec);
+  }
+}
+
+// Writes `count` samples of silence at the decode rate to get_decode_buffer(),
+// in place of decode_frame(). Returns count, or OPUS_ALLOC_FAIL.
+static int silence_frame(AudioOutput *output, int count) {
+  uint8_t *buffer = get_decode_buffer(output);
+  if (buffer == NULL) {
+    return OPUS_ALLOC_FAIL;
+  }
+
+  memset(buffer, 0, count * output->sample_size);
+  return count;
+}
+
+// Passes audio or an event to the callback, which takes ownership of its buffer
+// even if it fails. The queue only fills up if the event loop is blocked.
+static void send_audio_buffer(AudioOutput *output, AudioBuffer *audio_buffer) {
+  audio_buffer->sink = output->sink;
+
+  int ret = send_callback_for_many(output->callback, audio_buffer);
+  if (ret == AVERROR(EAGAIN) && output->control != NULL && audio_buffer->type == AUDIO_BUFFER_DATA) {
+    __atomic_add_fetch(&output->control[DECODER_CONTROL_DROPPED_CHUNKS], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void send_chunk(AudioOutput *output) {
+  if (output->samples == 0) {
+    return;
+  }
+
+  AudioBuffer audio_buffer;
+  audio_buffer.type = AUDIO_BUFFER_DATA;
+  audio_buffer.buf = output->chunk;
+  audio_buffer.len = output->samples * output->sample_size;
+  audio_buffer.pts = output->pts;
+  audio_buffer.sender_time = output->chunk_sender_time;
+  audio_buffer.received_at = output->chunk_received_at;
+  send_audio_buffer(output, &audio_buffer);
+
+  output->chunk = NULL;
+  output->samples = 0;
+}
+
+static void wake_ring_reader(AudioOutput *output) {
+  if (output->reader_wakeup != NULL && pcm_output_ring_take_reader_waiting(output->ring)) {
+    dispatcher_wake(output->reader_wakeup);
+  }
+}
+
+// Sends an event that has no audio. A partial chunk is sent first, so the
+// event stays in order with the audio around it.
+static void send_event(AudioOutput *output, AudioBufferType type, int64_t pts, int64_t duration) {
+  send_chunk(output);
+
+  AudioBuffer audio_buffer;
+  audio_buffer.type = type;
+  audio_buffer.buf = NULL;
+  audio_buffer.len = 0;
+  audio_buffer.pts = pts;
+  audio_buffer.duration_ms = duration * 1000.0 / OUTPUT_SAMPLE_RATE;
+  audio_buffer.sender_time = AV_NOPTS_VALUE;
+  audio_buffer.received_at = AV_NOPTS_VALUE;
+  send_audio_buffer(output, &audio_buffer);
+}
+
+static void send_speech_event(AudioOutput *output, AudioBufferType type, int64_t pts) {
+  if (output->callback != NULL && output->speech_events) {
+    send_event(output, type, pts, 0);
+  }
+}
+
+static void clear_pre_roll(AudioOutput *output) {
+  output->pre_roll_start = 0;
+  output->pre_roll_count = 0;
+  output->pre_roll_duration = 0;
+}
+
+// Tells JavaScript about a gap that wasn't concealed. Speech can't continue
+// across it, and the pre-roll from before it is stale.
+static void send_gap_event(AudioOutput *output, AudioBufferType type, int64_t pts, int64_t duration) {
+  if (output->vad != NULL) {
+    if (voice_activity_interrupt(output->vad)) {
+      send_speech_event(output, AUDIO_BUFFER_SPEECH_END, pts);
+    }
+    clear_pre_roll(output);
+  }
+
+  if (output->callback != NULL && output->gap_events) {
+    send_event(output, type, pts, duration);
+  }
+}
+
+// Sends `count` samples at the output rate to JavaScript, either as a frame of
+// its own or in chunks. duration is in pts ticks.
+static void deliver_audio(AudioOutput *output, const uint8_t *data, int count, int64_t pts, int64_t duration, int64_t sender_time, int64_t received_at) {
+  if (output->chunk_samples == 0) {
+    AVBufferRef *block = get_frame_block(output);
+    if (block == NULL) {
+      fprintf(stderr, "audio_decode_thread: failed to allocate frame\n");
+      return;
+    }
+    if (block->data != data) {
+      memcpy(block->data, data, count * output->sample_size);
+    }
+
+    AudioBuffer audio_buffer;
+    audio_buffer.type = AUDIO_BUFFER_DATA;
+    audio_buffer.buf = block;
+    audio_buffer.len = count * output->sample_size;
+    audio_buffer.pts = pts;
+    audio_buffer.sender_time = sender_time;
+    audio_buffer.received_at = received_at;
+    send_audio_buffer(output, &audio_buffer);
+
+    output->frame = NULL;
+    return;
+  }
+
+  // A chunk only holds contiguous audio, so that its pts describes all of it
+  if (output->samples > 0 && pts != output->next_pts) {
+    send_chunk(output);
+  }
+  output->next_pts = pts + duration;
+
+  int written = 0;
+  while (written < count) {
+    if (output->chunk == NULL) {
+      output->chunk = av_buffer_pool_get(output->pool);
+      if (output->chunk == NULL) {
+        fprintf(stderr, "audio_decode_thread: failed to allocate chunk\n");
+        return;
+      }
+      output->pts = pts + av_rescale(written, OUTPUT_SAMPLE_RATE, output->sample_rate);
+      output->started_at = av_gettime_relative();
+      output->chunk_sender_time = sender_time != AV_NOPTS_VALUE ? sender_time + av_rescale(written, MICROSECONDS, output->sample_rate) : AV_NOPTS_VALUE;
+      output->chunk_received_at = received_at;
+    }
+
+    int to_copy = output->chunk_samples - output->samples;
+    if (to_copy > count - written) {
+      to_copy = count - written;
+    }
+
+    memcpy(output->chunk->data + output->samples * output->sample_size, data + written * output->sample_size, to_copy * output->sample_size);
+    output->samples += to_copy;
+    written += to_copy;
+
+    if (output->samples == output->chunk_samples) {
+      send_chunk(output);
+    }
+  }
+}
+
+// Holds a frame that the gate kept back, dropping the oldest frames once there
+// is more than max_pre_roll of them.
+static void stash_pre_roll(AudioOutput *output, const uint8_t *data, int count, int64_t pts, int64_t duration) {
+  if (output->pre_roll == NULL) {
+    return;
+  }
+
+  while (output->pre_roll_count > 0 &&
+         (output->pre_roll_count == PRE_ROLL_MAX_FRAMES || output->pre_roll_duration + duration > output->max_pre_roll)) {
+    output->pre_roll_duration -= output->pre_roll[output->pre_roll_start].duration;
+    output->pre_roll_start = (output->pre_roll_start + 1) % PRE_ROLL_MAX_FRAMES;
+    output->pre_roll_count--;
+  }
+
+  if (duration > output->max_pre_roll) {
+    return;
+  }
+
+  PreRollFrame *frame = &output->pre_roll[(output->pre_roll_start + output->pre_roll_count) % PRE_ROLL_MAX_FRAMES];
+  av_fast_malloc(&frame->data, &frame->data_size, count * output->sample_size);
+  if (frame->data == NULL) {
+    fprintf(stderr, "audio_decode_thread: failed to allocate pre-roll\n");
+    return;
+  }
+
+  memcpy(frame->data, data, count * output->sample_size);
+  frame->count = count;
+  frame->pts = pts;
+  frame->duration = duration;
+  frame->sender_time = output->sender_time;
+  frame->received_at = output->received_at;
+
+  output->pre_roll_count++;
+  output->pre_roll_duration += duration;
+}
+
+static void flush_pre_roll(AudioOutput *output) {
+  for (int i = 0; i < output->pre_roll_count; i++) {
+    const PreRollFrame *frame = &output->pre_roll[(output->pre_roll_start + i) % PRE_ROLL_MAX_FRAMES];
+    deliver_audio(output, frame->data, frame->count, frame->pts, frame->duration, frame->sender_time, frame->received_at);
+  }
+  clear_pre_roll(output);
+}
+
+// Returns the frame that decode_frame() just decoded into the main output
+static const uint8_t *decoded_frame(const AudioOutput *output) {
+  return output->decoder_output != NULL ? output->decoder_output : output->frame->data;
+}
+
+// Converts `count` decoded samples to the output's rate, channels and format.
+// Returns the number of samples at the output rate and sets *data to them, or
+// returns a negative error code.
+static int convert_audio(AudioOutput *output, const uint8_t *decoded, int count, const uint8_t **data) {
+  if (output->swr == NULL) {
+    *data = decoded;
+    return count;
+  }
+
+  uint8_t *destination = output->resampled;
+  if (destination == NULL) {
+    AVBufferRef *block = get_frame_block(output);
+    if (block == NULL) {
+      fprintf(stderr, "audio_decode_thread: failed to allocate frame\n");
+      return AVERROR(ENOMEM);
+    }
+    destination = block->data;
+  }
+
+  count = swr_convert(output->swr, &destination, output->max_output_samples, &decoded, count);
+  if (count < 0) {
+    fprintf(stderr, "audio_decode_thread: swr_convert failed [%d]\n", count);
+    return count;
+  }
+
+  *data = destination;
+  return count;
+}
+
+// Sends the frame of `count` samples that decode_frame() just decoded. Its
+// timestamps are taken from output->sender_time and output->received_at.
+static void write_audio(AudioOutput *output, int count, int64_t pts, int flags) {
+  const int64_t duration = (int64_t)count * output->pts_scale;
+
+  output->end_pts = pts + duration;
+
+  // Speech is detected at the decode rate, before resampling
+  VoiceActivityEvent speech = VOICE_ACTIVITY_NONE;
+  if (output->vad != NULL) {
+    speech = voice_activity_process(output->vad, decoded_frame(output), count, output->channels, output->use_float, OUTPUT_SAMPLE_RATE / output->pts_scale);
+    if (voice_activity_speaking(output->vad)) {
+      flags |= PCM_OUTPUT_RING_FLAG_SPEECH;
+    }
+  }
+
+  const uint8_t *data;
+  count = convert_audio(output, decoded_frame(output), count, &data);
+  if (count < 0) {
+    return;
+  }
+
+  if (output->ring != NULL && count > 0) {
+    pcm_output_ring_write(output->ring, (const int16_t *)data, count * output->channels, pts, flags);
+    wake_ring_reader(output);
+  }
+
+  if (output->callback == NULL || count == 0) {
+    return;
+  }
+
+  if (speech == VOICE_ACTIVITY_START) {
+    // The pre-roll follows the event, so its pts is earlier than the event's
+    send_speech_event(output, AUDIO_BUFFER_SPEECH_START, pts);
+    flush_pre_roll(output);
+  } else if (speech == VOICE_ACTIVITY_END) {
+    // Speech ended with the hangover, before this frame
+    send_speech_event(output, AUDIO_BUFFER_SPEECH_END, pts);
+  }
+
+  if (output->vad_gate && !voice_activity_speaking(output->vad)) {
+    stash_pre_roll(output, data, count, pts, duration);
+    return;
+  }
+
+  deliver_audio(output, data, count, pts, duration, output->sender_time, output->received_at);
+}
+
+// Sends a frame of the main output's decoded audio to a sink. Sinks get every
+// frame, whether or not the main output is gated on speech.
+static void write_sink_audio(AudioOutput *sink, const AudioOutput *source, int count, int64_t pts) {
+  const int64_t duration = (int64_t)count * sink->pts_scale;
+
+  const uint8_t *data;
+  int converted = convert_audio(sink, decoded_frame(source), count, &data);
+  if (converted <= 0) {
+    return;
+  }
+
+  deliver_audio(sink, data, converted, pts, duration, source->sender_time, source->received_at);
+}
+
+// Returns when a partial chunk has to be sent, or AV_NOPTS_VALUE
+static int64_t chunk_deadline(const AudioOutput *output) {
+  if (output->samples == 0 || output->max_latency == 0) {
+    return AV_NOPTS_VALUE;
+  }
+  return output->started_at + output->max_latency;
+}
+
+// Waits for the next message, or until deadline if it isn't AV_NOPTS_VALUE.
+// Returns AVERROR(EAGAIN) if the deadline passed first.
+static int receive_message(AVThreadMessageQueue *message_queue, ThreadMessage *thread_message, int64_t deadline) {
+  if (deadline == AV_NOPTS_VALUE) {
+    return av_thread_message_queue_recv(message_queue, thread_message, 0);
+  }
+
+  while (true) {
+    int ret = av_thread_message_queue_recv(message_queue, thread_message, AV_THREAD_MESSAGE_NONBLOCK);
+    if (ret != AVERROR(EAGAIN)) {
+      return ret;
+    }
+
+    int64_t wait = deadline - av_gettime_relative();
+    if (wait <= 0) {
+      return AVERROR(EAGAIN);
+    }
+
+    av_usleep(wait < LATENCY_POLL_INTERVAL ? wait : LATENCY_POLL_INTERVAL);
+  }
+}
+
+struct DecoderState {
+  OpusDecoder *opus_decoder;
+  AudioOutput output;
+
+  // Fed from the frames that are decoded for output
+  AudioOutput sinks[DECODER_MAX_SINKS];
+  int sink_count;
+
+  int pts_scale;
+  int64_t max_conceal;
+  bool fill_silence;
+
+  int64_t expected_pts;
+  int last_frame_size;
+  int64_t last_packet_received_at;
+
+  // Maps a pts to the sender's wall clock. From the RTCP sender report that
+  // FFmpeg attaches to each packet, or AV_NOPTS_VALUE until there is one.
+  int64_t sender_time_base;
+  int64_t sender_pts_base;
+
+  int64_t total_samples_decoded;
+  int64_t total_packets_decoded;
+  int64_t total_missing_frames;
+  int64_t total_silence_samples;
+  int64_t total_discontinuities;
+  int64_t total_paused_packets;
+
+  // Set while JavaScript has paused decoding. Packets are still received, but
+  // are only used to keep track of the sender.
+  bool paused;
+
+  // Set when decoding resumes, until the next frame is emitted. The Opus state
+  // was reset, and the audio is discontinuous with what came before.
+  bool resumed;
+};
+
+// Writes the frame that was just decoded to every output. The sinks go first,
+// since the main output can send the block that the frame was decoded into.
+static void write_frame(DecoderState *state, int count, int64_t pts, int flags) {
+  for (int i = 0; i < state->sink_count && count > 0; i++) {
+    write_sink_audio(&state->sinks[i], &state->output, count, pts);
+  }
+  write_audio(&state->output, count, pts, flags);
+}
+
+// Returns when the first partial chunk of any output has to be sent, or
+// AV_NOPTS_VALUE
+static int64_t next_chunk_deadline(const DecoderState *state) {
+  int64_t deadline = chunk_deadline(&state->output);
+  for (int i = 0; i < state->sink_count; i++) {
+    int64_t due = chunk_deadline(&state->sinks[i]);
+    if (deadline == AV_NOPTS_VALUE || (due != AV_NOPTS_VALUE && due < deadline)) {
+      deadline = due;
+    }
+  }
+  return deadline;
+}
+
+// Sends the partial chunks that have waited for maxLatencyMs by now
+static void send_late_chunks(DecoderState *state, int64_t now) {
+  int64_t due = chunk_deadline(&state->output);
+  if (due != AV_NOPTS_VALUE && due <= now) {
+    send_chunk(&state->output);
+  }
+
+  for (int i = 0; i < state->sink_count; i++) {
+    due = chunk_deadline(&state->sinks[i]);
+    if (due != AV_NOPTS_VALUE && due <= now) {
+      send_chunk(&state->sinks[i]);
+    }
+  }
+}
+
+// Monotonic time at which the demuxer read a packet, or AV_NOPTS_VALUE
+static int64_t packet_received_at(const AVPacket *pkt) {
+  return pkt->opaque != NULL ? (int64_t)(intptr_t)pkt->opaque : AV_NOPTS_VALUE;
+}
+
+// The RTP demuxer attaches the sender's wall clock time of each packet's
+// timestamp, based on the latest RTCP sender report, as producer reference
+// time side data.
+static void update_sender_clock(DecoderState *state, const AVPacket *pkt) {
+  size_t size = 0;
+  const AVProducerReferenceTime *prft = (const AVProducerReferenceTime *)av_packet_get_side_data(pkt, AV_PKT_DATA_PRFT, &size);
+  if (prft != NULL && size >= sizeof(AVProducerReferenceTime)) {
+    state->sender_time_base = prft->wallclock;
+    state->sender_pts_base = pkt->pts;
+  }
+}
+
+// Sets the timestamps of the next frame written, which starts at source_pts
+static void set_frame_times(DecoderState *state, int64_t source_pts, int64_t received_at) {
+  state->output.sender_time = state->sender_time_base != AV_NOPTS_VALUE
+    ? state->sender_time_base + av_rescale(source_pts - state->sender_pts_base, MICROSECONDS, OUTPUT_SAMPLE_RATE)
+    : AV_NOPTS_VALUE;
+  state->output.received_at = received_at;
+}
+
+// Decodes a packet, after filling in any gap before it. Takes ownership of pkt.
+static void decode_packet(DecoderState *state, AVPacket *pkt) {
+  OpusDecoder *opus_decoder = state->opus_decoder;
+  AudioOutput *output = &state->output;
+  const int pts_scale = state->pts_scale;
+  const int64_t expected_pts = state->expected_pts;
+
+  int64_t pkt_pts = pkt->pts;
+  int packet_flags = 0;
+
+  update_sender_clock(state, pkt);
+
+  int64_t received_at = av_gettime_relative();
+  int64_t elapsed = received_at - state->last_packet_received_at;
+  state->last_packet_received_at = received_at;
+
+  // Detect gaps in PTS timestamps
+  GapType gap_type = GAP_LOSS;
+  if (expected_pts != AV_NOPTS_VALUE && pkt_pts > expected_pts) {
+    gap_type = classify_gap(pkt_pts - expected_pts, elapsed, state->max_conceal);
+  } else if (expected_pts != AV_NOPTS_VALUE && pkt_pts < expected_pts - state->max_conceal) {
+    // Too far back to be a reordered packet
+    gap_type = GAP_DISCONTINUITY;
+  }
+
+  if (state->resumed) {
+    // expected_pts is where decoding stopped
+    state->resumed = false;
+    gap_type = GAP_DISCONTINUITY;
+  }
+
+  if (gap_type == GAP_DISCONTINUITY) {
+    // Nothing is synthesized across a jump. Start over on the new timeline.
+    state->total_discontinuities++;
+    send_gap_event(output, AUDIO_BUFFER_DISCONTINUITY, pkt_pts, pkt_pts - expected_pts);
+    opus_decoder_ctl(opus_decoder, OPUS_RESET_STATE);
+    packet_flags = PCM_OUTPUT_RING_FLAG_DISCONTINUITY;
+  } else if (gap_type == GAP_SILENCE) {
+    // Zeros cost nothing to make, and a single event is cheaper still
+    int64_t silence_samples = (pkt_pts - expected_pts) / pts_scale;
+    state->total_silence_samples += silence_samples;
+    send_gap_event(output, AUDIO_BUFFER_SILENCE, expected_pts, pkt_pts - expected_pts);
+
+    if (state->fill_silence) {
+      int64_t filled = 0;
+      while (filled < silence_samples) {
+        int count = (int)FFMIN(silence_samples - filled, OPUS_MAX_FRAME_SIZE);
+        if (silence_frame(output, count) < 0) {
+          fprintf(stderr, "audio_decode_thread: failed to allocate silence\n");
+          break;
+        }
+        set_frame_times(state, expected_pts + filled * pts_scale, AV_NOPTS_VALUE);
+        write_frame(state, count, expected_pts + filled * pts_scale, PCM_OUTPUT_RING_FLAG_SILENCE);
+        filled += count;
+      }
+    }
+  } else if (expected_pts != AV_NOPTS_VALUE && pkt_pts > expected_pts) {
+    // Calculate how many frames were missed
+    // PTS is at 48kHz, frame_size is at decode sample rate
+    int last_frame_size = state->last_frame_size;
+    int64_t pts_gap = pkt_pts - expected_pts;
+    int64_t pts_per_frame = last_frame_size * pts_scale;
+    int missing_frames = (int)(pts_gap / pts_per_frame);
+
+    if (missing_frames > 0) {
+      state->total_missing_frames += missing_frames;
+
+      // Decode missing frames using packet loss concealment
+      for (int i = 0; i < missing_frames; i++) {
+        int frame_size;
+        if (i == missing_frames - 1) {
+          // Last missing frame: use FEC from current packet if available
+          frame_size = decode_frame(opus_decoder, output, pkt->data, pkt->size, last_frame_size, 1);
+        } else {
+          // Earlier missing frames: use PLC (NULL packet)
+          frame_size = decode_frame(opus_decoder, output, NULL, 0, last_frame_size, 0);
+        }
+
+        if (frame_size < 0) {
+          fprintf(stderr, "opus_decode error during PLC: %s\n", opus_strerror(frame_size));
+          continue;
+        }
+
+        state->total_samples_decoded += frame_size;
+        // Send PLC/FEC decoded frame to Node.js callback
+        // PTS for recovered frames: interpolate from expected_pts
+        set_frame_times(state, expected_pts + (i * last_frame_size * pts_scale), AV_NOPTS_VALUE);
+        write_frame(state, frame_size, expected_pts + (i * last_frame_size * pts_scale),
+                    i == missing_frames - 1 ? PCM_OUTPUT_RING_FLAG_FEC : PCM_OUTPUT_RING_FLAG_PLC);
+      }
+    }
+  }
+
+  // Decode the actual packet
+  int frame_size = decode_frame(opus_decoder, output, pkt->data, pkt->size, OPUS_MAX_FRAME_SIZE, 0);
+
+  if (frame_size < 0) {
+    fprintf(stderr, "opus_decode error: %s\n", opus_strerror(frame_size));
+    packet_pool_release(&pkt);
+    return;
+  }
+
+  state->last_frame_size = frame_size;
+  state->total_samples_decoded += frame_size;
+  state->total_packets_decoded++;
+
+  // Update expected PTS for next packet
+  // frame_size is at decode sample rate, PTS is at 48kHz
+  state->expected_pts = pkt_pts + (frame_size * pts_scale);
+
+  // Send decoded frame to Node.js callback
+  set_frame_times(state, pkt_pts, packet_received_at(pkt));
+  write_frame(state, frame_size, pkt_pts, packet_flags);
+
+  packet_pool_release(&pkt);
+}
+
+// Decodes every packet in the jitter buffer whose playout time has come
+static void decode_due_packets(DecoderState *state, JitterBuffer *jitter_buffer, int64_t now) {
+  AVPacket *pkt;
+  while ((pkt = jitter_buffer_get(jitter_buffer, now)) != NULL) {
+    decode_packet(state, pkt);
+  }
 }
 
+// Emits one frame per frame duration on the local clock, whether or not a
+// packet is there for it. The sender's clock runs at a slightly different
+// rate, which shows up as the jitter buffer slowly filling or emptying. Once
+// in a while a frame is skipped or repeated to keep it at the playout delay.
+struct OutputClock {
+  bool started;
 
-static int ThreadMain(AVThreadMessageQueue *message_queue, uv_async_t *buffer_ready_async, uv_async_t *drain_async, const AudioDecodeThreadParams &thread_data) {
+  // When the next frame is due
+  int64_t next_tick;
+
+  // Sender pts of the next frame to play out
+  int64_t source_pts;
+
+  // pts of the next frame that is emitted. This counts continuously from the
+  // first packet, without the gaps and jumps of source_pts.
+  int64_t output_pts;
+
+  // Frames in a row that were concealed
+  int concealed_frames;
+
+  // Whether the last frame was silence
+  bool silent;
+
+  // Smoothed amount of audio waiting in the jitter buffer, in pts ticks
+  double level;
+  int64_t last_correction;
+
+  // Set when the clock restarts after decoding was paused, to flag the first
+  // frame
+  bool discontinuity;
+};
+
+// The level is smoothed over about 64 frames
+#define CLOCK_LEVEL_SMOOTHING (1.0 / 64)
+
+// Frames of drift that are tolerated before correcting
+#define CLOCK_DRIFT_TOLERANCE 2
+
+// Most one correction per this interval, so it's never audible as more than
+// an occasional glitch
+#define CLOCK_CORRECTION_INTERVAL (1 * MICROSECONDS)
+
+// If the thread falls this far behind, it skips ahead instead of catching up
+#define CLOCK_MAX_BACKLOG (200 * 1000)
+
+// Plays out one frame at clock->source_pts. Returns its duration in pts ticks.
+static int64_t clock_tick(DecoderState *state, JitterBuffer *jitter_buffer, OutputClock *clock, int64_t now) {
+  AudioOutput *output = &state->output;
+  const int pts_scale = state->pts_scale;
+  const int64_t frame_duration = (int64_t)state->last_frame_size * pts_scale;
+  const int64_t target = av_rescale(jitter_buffer_delay(jitter_buffer), OUTPUT_SAMPLE_RATE, MICROSECONDS);
+  const int64_t resync_window = av_rescale(jitter_buffer_delay(jitter_buffer) + DISCONTINUITY_TOLERANCE, OUTPUT_SAMPLE_RATE, MICROSECONDS);
+
+  int flags = clock->discontinuity ? PCM_OUTPUT_RING_FLAG_DISCONTINUITY : 0;
+  clock->discontinuity = false;
+
+  // Drop packets that missed their turn, and follow the sender if its
+  // timeline jumped
+  const AVPacket *head;
+  while ((head = jitter_buffer_peek(jitter_buffer)) != NULL) {
+    int64_t offset = head->pts - clock->source_pts;
+    if (offset < -resync_window || offset > resync_window) {
+      state->total_discontinuities++;
+      send_gap_event(output, AUDIO_BUFFER_DISCONTINUITY, clock->output_pts, offset);
+      opus_decoder_ctl(state->opus_decoder, OPUS_RESET_STATE);
+      clock->source_pts = head->pts;
+      clock->concealed_frames = 0;
+      flags = PCM_OUTPUT_RING_FLAG_DISCONTINUITY;
+      break;
+    }
+
+    if (offset >= 0) {
+      break;
+    }
+
+    if (clock->silent) {
+      // Speech is starting again after a pause. Rather than drop the first
+      // packets, line up with them, leaving room for the playout delay.
+      int64_t frames = (target + frame_duration - 1) / frame_duration;
+      clock->source_pts = head->pts - frames * frame_duration;
+      clock->level = (double)(jitter_buffer_end_pts(jitter_buffer) - clock->source_pts);
+      break;
+    }
+
+    jitter_buffer_drop_late(jitter_buffer);
+  }
+
+  // Correct for drift against the sender's clock. Pauses don't count.
+  if (head != NULL) {
+    int64_t level = jitter_buffer_end_pts(jitter_buffer) - clock->source_pts;
+    clock->level += (level - clock->level) * CLOCK_LEVEL_SMOOTHING;
+  }
+
+  int64_t tolerance = CLOCK_DRIFT_TOLERANCE * frame_duration;
+  bool can_correct = head != NULL && now - clock->last_correction >= CLOCK_CORRECTION_INTERVAL;
+
+  if (can_correct && clock->level > target + tolerance && head->pts == clock->source_pts) {
+    // The sender is ahead. Decode a frame without playing it out, so the
+    // decoder state stays continuous.
+    AVPacket *pkt = jitter_buffer_pop(jitter_buffer);
+    int frame_size = decode_frame(state->opus_decoder, output, pkt->data, pkt->size, OPUS_MAX_FRAME_SIZE, 0);
+    clock->source_pts += frame_size > 0 ? frame_size * pts_scale : pkt->duration;
+    clock->level -= frame_size > 0 ? frame_size * pts_scale : pkt->duration;
+    clock->last_correction = now;
+    packet_pool_release(&pkt);
+
+    head = jitter_buffer_peek(jitter_buffer);
+  }
+
+  bool repeat = can_correct && clock->level < target - tolerance;
+
+  int frame_size = -1;
+  int64_t received_at = AV_NOPTS_VALUE;
+  if (!repeat && head != NULL && head->pts == clock->source_pts) {
+    AVPacket *pkt = jitter_buffer_pop(jitter_buffer);
+    update_sender_clock(state, pkt);
+    received_at = packet_received_at(pkt);
+    frame_size = decode_frame(state->opus_decoder, output, pkt->data, pkt->size, OPUS_MAX_FRAME_SIZE, 0);
+    if (frame_size < 0) {
+      fprintf(stderr, "opus_decode error: %s\n", opus_strerror(frame_size));
+    } else {
+      state->last_frame_size = frame_size;
+      state->total_packets_decoded++;
+      clock->concealed_frames = 0;
+    }
+    if (frame_size < 0) {
+      received_at = AV_NOPTS_VALUE;
+    }
+    packet_pool_release(&pkt);
+  }
+
+  if (frame_size < 0 && (int64_t)(clock->concealed_frames + 1) * frame_duration <= state->max_conceal) {
+    // Recover the frame from the next packet's FEC data if it's there
+    if (!repeat && head != NULL && head->pts == clock->source_pts + frame_duration) {
+      frame_size = decode_frame(state->opus_decoder, output, head->data, head->size, state->last_frame_size, 1);
+      flags |= PCM_OUTPUT_RING_FLAG_FEC;
+    } else {
+      frame_size = decode_frame(state->opus_decoder, output, NULL, 0, state->last_frame_size, 0);
+      flags |= PCM_OUTPUT_RING_FLAG_PLC;
+    }
+    if (frame_size >= 0) {
+      clock->concealed_frames++;
+      state->total_missing_frames++;
+    }
+  }
+
+  if (frame_size < 0) {
+    // Nothing to conceal with, or the sender paused
+    frame_size = silence_frame(output, state->last_frame_size);
+    flags = (flags & PCM_OUTPUT_RING_FLAG_DISCONTINUITY) | PCM_OUTPUT_RING_FLAG_SILENCE;
+    if (frame_size < 0) {
+      fprintf(stderr, "audio_decode_thread: failed to allocate silence\n");
+      return frame_duration;
+    }
+    state->total_silence_samples += frame_size;
+    clock->silent = true;
+  } else {
+    state->total_samples_decoded += frame_size;
+    clock->silent = false;
+  }
+
+  set_frame_times(state, clock->source_pts, received_at);
+
+  if (repeat) {
+    // The sender is behind. Play this frame without moving through its
+    // timeline.
+    clock->last_correction = now;
+  } else {
+    clock->source_pts += frame_size * pts_scale;
+  }
+
+  write_frame(state, frame_size, clock->output_pts, flags);
+  clock->output_pts += frame_size * pts_scale;
+
+  // The packets that are drained at exit go through decode_packet(), which
+  // carries on from here
+  state->expected_pts = clock->source_pts;
+
+  return frame_size > 0 ? frame_size * pts_scale : frame_duration;
+}
+
+// Emits every frame that is due by now. The clock starts when the first
+// packet's playout time comes.
+static void run_output_clock(DecoderState *state, JitterBuffer *jitter_buffer, OutputClock *clock, int64_t now) {
+  if (!clock->started) {
+    int64_t due = jitter_buffer_next_due(jitter_buffer);
+    if (due == AV_NOPTS_VALUE || due > now) {
+      return;
+    }
+
+    const AVPacket *head = jitter_buffer_peek(jitter_buffer);
+    if (state->resumed) {
+      // The output timeline carries on from before the pause
+      state->resumed = false;
+      state->total_discontinuities++;
+      send_gap_event(&state->output, AUDIO_BUFFER_DISCONTINUITY, clock->output_pts, head->pts - state->expected_pts);
+      clock->discontinuity = true;
+    } else {
+      clock->output_pts = head->pts;
+    }
+    clock->started = true;
+    clock->next_tick = now;
+    clock->source_pts = head->pts;
+    clock->level = (double)(jitter_buffer_end_pts(jitter_buffer) - head->pts);
+    clock->last_correction = now;
+  }
+
+  if (now - clock->next_tick > CLOCK_MAX_BACKLOG) {
+    clock->next_tick = now;
+  }
+
+  while (clock->next_tick <= now) {
+    int64_t duration = clock_tick(state, jitter_buffer, clock, now);
+    clock->next_tick += av_rescale(duration, MICROSECONDS, OUTPUT_SAMPLE_RATE);
+  }
+}
+
+// Stops decoding. Audio that is waiting to be emitted is sent or dropped now,
+// so nothing is left over when decoding resumes.
+static void pause_decoder(DecoderState *state, JitterBuffer *jitter_buffer, OutputClock *clock) {
+  AudioOutput *output = &state->output;
+
+  if (output->vad != NULL) {
+    if (voice_activity_interrupt(output->vad)) {
+      send_speech_event(output, AUDIO_BUFFER_SPEECH_END, output->end_pts);
+    }
+    clear_pre_roll(output);
+  }
+  send_chunk(output);
+  for (int i = 0; i < state->sink_count; i++) {
+    send_chunk(&state->sinks[i]);
+  }
+
+  if (jitter_buffer != NULL) {
+    AVPacket *pkt;
+    while ((pkt = jitter_buffer_pop(jitter_buffer)) != NULL) {
+      packet_pool_release(&pkt);
+    }
+  }
+  clock->started = false;
+
+  state->paused = true;
+}
+
+// Starts decoding again. The Opus state from before the pause is stale, so it
+// starts over, and the next frame is marked as a discontinuity.
+static void resume_decoder(DecoderState *state) {
+  opus_decoder_ctl(state->opus_decoder, OPUS_RESET_STATE);
+  state->paused = false;
+  state->resumed = state->expected_pts != AV_NOPTS_VALUE;
+}
+
+// Takes ownership of a packet that arrived while paused. Only the sender's
+// clock is followed, so timestamps are right once decoding resumes.
+static void skip_packet(DecoderState *state, AVPacket *pkt) {
+  update_sender_clock(state, pkt);
+  state->last_packet_received_at = av_gettime_relative();
+  state->total_paused_packets++;
+  packet_pool_release(&pkt);
+}
+
+static inline bool is_paused(const AudioDecodeThreadParams &thread_data) {
+  return thread_data.control != NULL && __atomic_load_n(&thread_data.control[DECODER_CONTROL_PAUSED], __ATOMIC_SEQ_CST) != 0;
+}
+
+// Packets are relayed as they arrive, so this only has to cover the time that
+// a producer waits for the network
+#define RELAY_QUEUE_SIZE 64
+
+// Producer threads that send the received packets on without decoding them
+struct PacketRelays {
+  ProducerThreadData *producers[DECODER_MAX_RELAYS];
+  bool warned_queue_full[DECODER_MAX_RELAYS];
+  int count;
+
+  // pts of the last packet that was relayed
+  int64_t last_pts;
+};
+
+static void free_relay_params(const ProducerThreadParams &params) {
+  av_free(params.url);
+  av_free(params.ssrc);
+  av_free(params.payloadType);
+  av_free(params.cname);
+  av_free(params.cryptoSuite);
+  av_free(params.keyBase64);
+}
+
+// Starts a producer thread for each relay, which takes ownership of its
+// strings. If one fails, the strings of the rest are freed here.
+static int start_relays(PacketRelays *relays, const AudioDecodeThreadParams &thread_data) {
+  relays->last_pts = AV_NOPTS_VALUE;
+
+  for (int i = 0; i < thread_data.relayCount; i++) {
+    int ret = start_producer_thread_raw(thread_data.relays[i], RELAY_QUEUE_SIZE, &relays->producers[i]);
+    if (ret != 0) {
+      fprintf(stderr, "audio_decode_thread: failed to start relay [%d]\n", ret);
+      for (int j = i; j < thread_data.relayCount; j++) {
+        free_relay_params(thread_data.relays[j]);
+      }
+      return ret;
+    }
+    relays->count++;
+  }
+
+  return 0;
+}
+
+static void stop_relays(PacketRelays *relays) {
+  for (int i = 0; i < relays->count; i++) {
+    int ret = stop_producer_thread_raw(relays->producers[i]);
+    if (ret != 0) {
+      fprintf(stderr, "audio_decode_thread: relay thread returned error [%d]\n", ret);
+    }
+  }
+  relays->count = 0;
+}
+
+// Passes a reference to the packet to every relay. The producers rebase the
+// timestamps onto their own clock and take a step backwards for a new stream,
+// so packets that arrive out of order are left out. Far older ones are a
+// restart of the sender, and go through.
+static void relay_packet(PacketRelays *relays, const AVPacket *pkt) {
+  if (relays->count == 0) {
+    return;
+  }
+
+  int64_t tolerance = av_rescale(DISCONTINUITY_TOLERANCE, OUTPUT_SAMPLE_RATE, MICROSECONDS);
+  if (relays->last_pts != AV_NOPTS_VALUE && pkt->pts <= relays->last_pts && pkt->pts >= relays->last_pts - tolerance) {
+    return;
+  }
+  relays->last_pts = pkt->pts;
+
+  // The producers need the duration to order the packets they send
+  int duration = opus_packet_get_nb_samples(pkt->data, pkt->size, OUTPUT_SAMPLE_RATE);
+
+  for (int i = 0; i < relays->count; i++) {
+    AVPacket *copy = packet_pool_get();
+    if (copy == NULL || av_packet_ref(copy, pkt) < 0) {
+      fprintf(stderr, "audio_decode_thread: failed to copy packet for relay\n");
+      packet_pool_release(&copy);
+      return;
+    }
+
+    // opaque is the arrival time here, but the producer would take it for an
+    // audio level
+    copy->opaque = NULL;
+    if (duration > 0) {
+      copy->duration = duration;
+    }
+
+    int ret = post_packet_to_thread(relays->producers[i]->message_queue, &copy, AV_THREAD_MESSAGE_NONBLOCK);
+    if (ret == AVERROR(EAGAIN) && !relays->warned_queue_full[i]) {
+      relays->warned_queue_full[i] = true;
+      fprintf(stderr, "WARNING: relay queue full, dropping packets\n");
+    }
+  }
+}
+
+static int ThreadMain(AVThreadMessageQueue *message_queue, DispatchSource *buffer_ready_source, DispatchSource *drain_source, const AudioDecodeThreadParams &thread_data) {
   int thread_ret = 0;
   int demux_ret = 0;
 
   set_thread_name("audio_decode_thread");
 
-  const int opus_sample_rate = thread_data.sampleRate;
+  // Frames are decoded once, at the highest rate that any output needs. With
+  // only relays, nothing is decoded at all.
+  const bool main_output = thread_data.mainCallback || thread_data.outputRing.header != NULL;
+  const bool decode = main_output || thread_data.sinkCount > 0;
+
+  int opus_sample_rate = main_output ? decode_sample_rate_for(thread_data.sampleRate) : 8000;
+  for (int i = 0; i < thread_data.sinkCount; i++) {
+    opus_sample_rate = FFMAX(opus_sample_rate, decode_sample_rate_for(thread_data.sinks[i].sampleRate));
+  }
+
   const int opus_channels = thread_data.channels;
   const int opus_samples_per_frame = opus_sample_rate * OPUS_FRAME_DURATION_MS / 1000;
   const int pts_scale = OUTPUT_SAMPLE_RATE / opus_sample_rate;
@@ -62,41 +1221,130 @@ static int ThreadMain(AVThreadMessageQueue *message_queue, uv_async_t *buffer_re
   int64_t start_time_realtime = AV_NOPTS_VALUE;
   int64_t start_time_localtime = 0;
 
-  int64_t last_packet_realtime = AV_NOPTS_VALUE;
-  int64_t last_packet_received_at = 0;
-
   AVCodecParameters *codecpar = NULL;
   DemuxerThreadData *demuxer_thread = NULL;
 
+  // Only set if jitterMaxDelayMs is
+  JitterBuffer *jitter_buffer = NULL;
+
+  // Only used if clockedOutput is set
+  OutputClock clock = {};
+
+  PacketRelays relays = {};
+
   // Opus decoder state
-  OpusDecoder *opus_decoder = NULL;
-  int16_t *decoder_output = NULL;
-  int64_t expected_pts = AV_NOPTS_VALUE;
-  int64_t total_samples_decoded = 0;
-  int64_t total_packets_decoded = 0;
-  int64_t total_missing_frames = 0;
-  int last_frame_size = opus_samples_per_frame;
-
-  AVPacket *pkt_clone = av_packet_alloc();
-  if (pkt_clone == NULL) {
-    thread_ret = AVERROR(ENOMEM);
+  DecoderState state = {};
+  state.pts_scale = pts_scale;
+  state.max_conceal = (int64_t)thread_data.maxConcealMs * OUTPUT_SAMPLE_RATE / 1000;
+  state.fill_silence = thread_data.fillSilence;
+  state.expected_pts = AV_NOPTS_VALUE;
+  state.last_frame_size = opus_samples_per_frame;
+  state.sender_time_base = AV_NOPTS_VALUE;
+
+  AudioOutput &output = state.output;
+  output.callback = thread_data.mainCallback ? buffer_ready_source : NULL;
+  output.sink = -1;
+  output.control = thread_data.control;
+  output.ring = thread_data.outputRing.header != NULL ? &thread_data.outputRing : NULL;
+  output.reader_wakeup = drain_source;
+  output.channels = opus_channels;
+  output.use_float = thread_data.floatSamples;
+  output.sample_rate = thread_data.sampleRate;
+  output.pts_scale = pts_scale;
+  output.chunk_samples = thread_data.chunkMs > 0 && output.ring == NULL ? (int)lrint(thread_data.sampleRate * thread_data.chunkMs / 1000) : 0;
+  output.max_latency = thread_data.maxLatencyMs > 0 ? (int64_t)thread_data.maxLatencyMs * 1000 : 0;
+  output.gap_events = thread_data.gapEvents;
+  output.speech_events = thread_data.speechEvents;
+  output.vad_gate = thread_data.voiceActivity && thread_data.vadGate;
+  output.max_pre_roll = (int64_t)thread_data.vadPreRollMs * OUTPUT_SAMPLE_RATE / 1000;
+
+  // The relays are started first, so that they always own their strings
+  thread_ret = start_relays(&relays, thread_data);
+  if (thread_ret != 0) {
     goto cleanup_thread;
   }
 
-  // Allocate decoder output buffer
-  decoder_output = (int16_t *)av_malloc(OPUS_MAX_FRAME_SIZE * opus_channels * sizeof(int16_t));
-  if (decoder_output == NULL) {
-    thread_ret = AVERROR(ENOMEM);
+  // Allocate decoder output buffers
+  thread_ret = init_audio_output(&output, opus_sample_rate, opus_channels, thread_data.floatSamples);
+  if (thread_ret != 0) {
     goto cleanup_thread;
   }
 
-  thread_ret = start_rtp_demuxer(thread_data.sdpBase64, 10 * MICROSECONDS, message_queue, &demuxer_thread);
+  for (int i = 0; i < thread_data.sinkCount; i++) {
+    const DecoderSinkParams &sink_params = thread_data.sinks[i];
+    AudioOutput *sink = &state.sinks[i];
+    state.sink_count++;
+
+    sink->callback = buffer_ready_source;
+    sink->sink = i;
+    sink->control = thread_data.control;
+    sink->channels = sink_params.channels;
+    sink->use_float = sink_params.floatSamples;
+    sink->sample_rate = sink_params.sampleRate;
+    sink->pts_scale = pts_scale;
+    sink->chunk_samples = sink_params.chunkMs > 0 ? (int)lrint(sink_params.sampleRate * sink_params.chunkMs / 1000) : 0;
+    sink->max_latency = output.max_latency;
+
+    thread_ret = init_audio_output(sink, opus_sample_rate, opus_channels, thread_data.floatSamples);
+    if (thread_ret != 0) {
+      goto cleanup_thread;
+    }
+  }
+
+  if (thread_data.voiceActivity) {
+    output.vad = voice_activity_alloc(thread_data.vadThresholdDb, thread_data.vadHangoverMs);
+    if (output.vad == NULL) {
+      thread_ret = AVERROR(ENOMEM);
+      goto cleanup_thread;
+    }
+  }
+
+  if (thread_data.jitterMaxDelayMs > 0) {
+    jitter_buffer = jitter_buffer_alloc(thread_data.jitterMinDelayMs, thread_data.jitterMaxDelayMs, thread_data.jitterStats);
+    if (jitter_buffer == NULL) {
+      thread_ret = AVERROR(ENOMEM);
+      goto cleanup_thread;
+    }
+  }
+
+  thread_ret = start_rtp_demuxer(thread_data.sdpBase64, 10 * MICROSECONDS, jitter_buffer != NULL, message_queue, &demuxer_thread);
   if (thread_ret != 0) {
     goto cleanup_thread;
   }
 
   while (true) {
-    thread_ret = av_thread_message_queue_recv(message_queue, &thread_message, 0);
+    // Wake up for whichever comes first: a partial chunk that has waited long
+    // enough, or the next packet's playout time.
+    int64_t deadline = next_chunk_deadline(&state);
+    if (jitter_buffer != NULL) {
+      int64_t due = clock.started ? clock.next_tick : jitter_buffer_next_due(jitter_buffer);
+      if (deadline == AV_NOPTS_VALUE || (due != AV_NOPTS_VALUE && due < deadline)) {
+        deadline = due;
+      }
+    }
+
+    thread_ret = receive_message(message_queue, &thread_message, deadline);
+
+    if (thread_ret == AVERROR(EAGAIN)) {
+      // The clock keeps going while no packets arrive, so a pause has to be
+      // noticed here as well. Nothing is due until the next packet after it.
+      if (is_paused(thread_data) && !state.paused) {
+        pause_decoder(&state, jitter_buffer, &clock);
+      }
+      if (state.paused) {
+        continue;
+      }
+
+      int64_t now = av_gettime_relative();
+      if (thread_data.clockedOutput) {
+        run_output_clock(&state, jitter_buffer, &clock, now);
+      } else if (jitter_buffer != NULL) {
+        decode_due_packets(&state, jitter_buffer, now);
+      }
+
+      send_late_chunks(&state, now);
+      continue;
+    }
 
     if (thread_ret < 0) {
       // This error is expected when shutting down
@@ -112,9 +1360,9 @@ static int ThreadMain(AVThreadMessageQueue *message_queue, uv_async_t *buffer_re
       codecpar = thread_message.param.codecpar;
 
       // Create opus decoder when we receive codec parameters
-      if (opus_decoder == NULL) {
+      if (decode && state.opus_decoder == NULL) {
         int opus_err;
-        opus_decoder = opus_decoder_create(opus_sample_rate, opus_channels, &opus_err);
+        state.opus_decoder = opus_decoder_create(opus_sample_rate, opus_channels, &opus_err);
         if (opus_err != OPUS_OK) {
           fprintf(stderr, "Failed to create opus decoder: %s\n", opus_strerror(opus_err));
           thread_ret = ff_opus_error_to_averror(opus_err);
@@ -124,88 +1372,38 @@ static int ThreadMain(AVThreadMessageQueue *message_queue, uv_async_t *buffer_re
     } else if (thread_message.type == POST_PACKET) {
       AVPacket *pkt = thread_message.param.pkt;
 
-      // Skip if decoder not initialized yet
-      if (opus_decoder == NULL) {
-        av_packet_free(&pkt);
+      // Relays get every packet, even while decoding is paused
+      relay_packet(&relays, pkt);
+
+      // Skip if decoder not initialized yet, or not needed
+      if (state.opus_decoder == NULL) {
+        packet_pool_release(&pkt);
         continue;
       }
 
-      int64_t pkt_pts = pkt->pts;
-
-      // Detect gaps in PTS timestamps
-      if (expected_pts != AV_NOPTS_VALUE && pkt_pts > expected_pts) {
-        // Calculate how many frames were missed
-        // PTS is at 48kHz, frame_size is at decode sample rate
-        int64_t pts_gap = pkt_pts - expected_pts;
-        int64_t pts_per_frame = last_frame_size * pts_scale;
-        int missing_frames = (int)(pts_gap / pts_per_frame);
-
-        if (missing_frames > 0) {
-          total_missing_frames += missing_frames;
-
-          // Decode missing frames using packet loss concealment
-          for (int i = 0; i < missing_frames; i++) {
-            int frame_size;
-            if (i == missing_frames - 1) {
-              // Last missing frame: use FEC from current packet if available
-              frame_size = opus_decode(opus_decoder, pkt->data, pkt->size, decoder_output, last_frame_size, 1);
-            } else {
-              // Earlier missing frames: use PLC (NULL packet)
-              frame_size = opus_decode(opus_decoder, NULL, 0, decoder_output, last_frame_size, 0);
-            }
-
-            if (frame_size < 0) {
-              fprintf(stderr, "opus_decode error during PLC: %s\n", opus_strerror(frame_size));
-              continue;
-            }
-
-            total_samples_decoded += frame_size;
-            // Send PLC/FEC decoded frame to Node.js callback
-            if (buffer_ready_async != NULL) {
-              AudioBuffer audio_buffer;
-              audio_buffer.buf = (uint8_t *)av_malloc(frame_size * sizeof(int16_t));
-              if (audio_buffer.buf != NULL) {
-                memcpy(audio_buffer.buf, decoder_output, frame_size * sizeof(int16_t));
-                audio_buffer.len = frame_size * sizeof(int16_t);
-                // PTS for recovered frames: interpolate from expected_pts
-                audio_buffer.pts = expected_pts + (i * last_frame_size * pts_scale);
-                send_callback_for_many(buffer_ready_async, &audio_buffer);
-              }
-            }
-          }
-        }
+      bool paused = is_paused(thread_data);
+      if (paused && !state.paused) {
+        pause_decoder(&state, jitter_buffer, &clock);
+      } else if (!paused && state.paused) {
+        resume_decoder(&state);
       }
 
-      // Decode the actual packet
-      int frame_size = opus_decode(opus_decoder, pkt->data, pkt->size, decoder_output, OPUS_MAX_FRAME_SIZE, 0);
-
-      if (frame_size < 0) {
-        fprintf(stderr, "opus_decode error: %s\n", opus_strerror(frame_size));
-        av_packet_free(&pkt);
+      if (state.paused) {
+        skip_packet(&state, pkt);
         continue;
       }
 
-      last_frame_size = frame_size;
-      total_samples_decoded += frame_size;
-      total_packets_decoded++;
-
-      // Update expected PTS for next packet
-      // frame_size is at decode sample rate, PTS is at 48kHz
-      expected_pts = pkt_pts + (frame_size * pts_scale);
-
-      // Send decoded frame to Node.js callback
-      if (buffer_ready_async != NULL) {
-        AudioBuffer audio_buffer;
-        audio_buffer.buf = (uint8_t *)av_malloc(frame_size * sizeof(int16_t));
-        if (audio_buffer.buf != NULL) {
-          memcpy(audio_buffer.buf, decoder_output, frame_size * sizeof(int16_t));
-          audio_buffer.len = frame_size * sizeof(int16_t);
-          audio_buffer.pts = pkt_pts;
-          send_callback_for_many(buffer_ready_async, &audio_buffer);
-        }
+      if (thread_data.clockedOutput) {
+        int64_t now = av_gettime_relative();
+        jitter_buffer_put(jitter_buffer, pkt, now);
+        run_output_clock(&state, jitter_buffer, &clock, now);
+      } else if (jitter_buffer != NULL) {
+        int64_t now = av_gettime_relative();
+        jitter_buffer_put(jitter_buffer, pkt, now);
+        decode_due_packets(&state, jitter_buffer, now);
+      } else {
+        decode_packet(&state, pkt);
       }
-
-      av_packet_free(&pkt);
     } else if (thread_message.type == POST_START_TIME_REALTIME) {
       start_time_realtime = thread_message.param.start_time_realtime;
     } else if (thread_message.type == POST_START_TIME_LOCALTIME) {
@@ -214,32 +1412,58 @@ static int ThreadMain(AVThreadMessageQueue *message_queue, uv_async_t *buffer_re
   }
 
 cleanup_thread:
+  // Play out whatever is still waiting in the jitter buffer, unless the
+  // decoder never started
+  if (jitter_buffer != NULL && state.opus_decoder != NULL) {
+    decode_due_packets(&state, jitter_buffer, INT64_MAX);
+  }
+  jitter_buffer_free(&jitter_buffer);
+
   // Signal end of audio stream to Node.js callback
-  if (buffer_ready_async != NULL) {
-    finish_callback_for_many(buffer_ready_async);
+  if (buffer_ready_source != NULL) {
+    if (output.vad != NULL && voice_activity_interrupt(output.vad)) {
+      send_speech_event(&output, AUDIO_BUFFER_SPEECH_END, output.end_pts);
+    }
+    send_chunk(&output);
+    for (int i = 0; i < state.sink_count; i++) {
+      send_chunk(&state.sinks[i]);
+    }
+    finish_callback_for_many(buffer_ready_source);
+  }
+
+  if (output.ring != NULL) {
+    pcm_output_ring_end(output.ring);
+    wake_ring_reader(&output);
   }
 
   // Log decoding summary
-  if (total_packets_decoded > 0) {
-    double total_duration_sec = (double)total_samples_decoded / opus_sample_rate;
-    printf("Opus decode finished: %lld packets, %lld samples (%.2f sec), %lld missing frames recovered\n",
-           (long long)total_packets_decoded,
-           (long long)total_samples_decoded,
+  if (state.total_packets_decoded > 0) {
+    double total_duration_sec = (double)state.total_samples_decoded / opus_sample_rate;
+    printf("Opus decode finished: %lld packets, %lld samples (%.2f sec), %lld missing frames recovered, %.2f sec of silence, %lld discontinuities, %lld packets skipped while paused\n",
+           (long long)state.total_packets_decoded,
+           (long long)state.total_samples_decoded,
            total_duration_sec,
-           (long long)total_missing_frames);
+           (long long)state.total_missing_frames,
+           (double)state.total_silence_samples / opus_sample_rate,
+           (long long)state.total_discontinuities,
+           (long long)state.total_paused_packets);
   }
 
   avcodec_parameters_free(&codecpar);
-  av_packet_free(&pkt_clone);
-  av_free(decoder_output);
+  free_audio_output(&output);
+  for (int i = 0; i < state.sink_count; i++) {
+    free_audio_output(&state.sinks[i]);
+  }
 
-  if (opus_decoder != NULL) {
-    opus_decoder_destroy(opus_decoder);
+  if (state.opus_decoder != NULL) {
+    opus_decoder_destroy(state.opus_decoder);
   }
 
   av_thread_message_queue_set_err_send(message_queue, AVERROR_EOF);
 
   demux_ret = stop_rtp_demuxer(demuxer_thread);
+  stop_relays(&relays);
+
   if (demux_ret != 0) {
     return demux_ret;
   } else {
@@ -249,8 +1473,8 @@ cleanup_thread:
   // check_for_memory_leaks();
 }
 
-napi_status start_audio_decode_thread(napi_env env, const AudioDecodeThreadParams &params, napi_value abort_signal, napi_value on_audio_callback, napi_value *external, napi_value *promise) {
+napi_status start_audio_decode_thread(napi_env env, const AudioDecodeThreadParams &params, napi_value abort_signal, napi_value on_audio_callback, napi_value on_reader_wakeup, napi_value options, napi_value *external, napi_value *promise) {
   size_t stack_size = get_stack_size_for_thread("MUXER");
 
-  return start_thread_with_promise_result<AudioDecodeThreadParams>(env, ThreadMain, params, abort_signal, NULL, stack_size, DEFAULT_MESSAGE_QUEUE_SIZE, external, on_audio_callback, NULL, promise);
+  return start_thread_with_promise_result<AudioDecodeThreadParams>(env, ThreadMain, params, abort_signal, options, stack_size, DEFAULT_MESSAGE_QUEUE_SIZE, external, on_audio_callback, on_reader_wakeup, promise, params.batchCallbacks);
 }
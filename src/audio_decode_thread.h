@@ -2,19 +2,127 @@
 
 #include <node_api.h>
 
+#include "pcm_output_ring.h"
+#include "producer_thread.h"
+
+// Control block that is shared with JavaScript and accessed with Atomics on
+// both sides while the decoder runs. The layout must match src/index.ts:
+//
+//   int32 fields[4]
+#define DECODER_CONTROL_SIZE 16
+
+enum DecoderControlField {
+  // Non-zero while packets should be received but not decoded. Written by
+  // JavaScript.
+  DECODER_CONTROL_PAUSED = 0,
+
+  // Chunks that were dropped because the event loop didn't take them off the
+  // callback queue in time. Written by the decoder.
+  DECODER_CONTROL_DROPPED_CHUNKS = 1,
+};
+
+// A consumer can have extra outputs besides the main one. Sinks are fed from
+// the same decoded frames, converted to their own rate, channels and format,
+// and their audio goes to on_audio_callback with the sink's index. Relays get
+// the received Opus packets as they are, before decoding, and send them on to
+// another destination with a producer thread of their own.
+#define DECODER_MAX_SINKS 8
+#define DECODER_MAX_RELAYS 8
+
+struct DecoderSinkParams {
+  int32_t sampleRate;
+  int32_t channels;
+  bool floatSamples;
+  double chunkMs;
+};
+
 struct AudioDecodeThreadParams {
   char *sdpBase64;
 
-  // TODO: These are currently ignored by the decoder
-  int32_t sampleRate;   // Output sample rate (e.g., 24000 for OpenAI)
-  int32_t channels;     // Output channels (e.g., 1 for mono)
+  // Output sample rate (e.g., 24000 for OpenAI). Rates that Opus doesn't
+  // support natively are resampled from 48kHz.
+  int32_t sampleRate;
+  int32_t channels;     // Output channels, 1 or 2
+  bool floatSamples;    // 32-bit float samples instead of 16-bit integers
+
+  // Decoded frames are joined into chunks of this duration before they are
+  // sent to JavaScript. 0 sends each frame as it's decoded.
+  double chunkMs;
+
+  // How long a partially filled chunk can wait for more audio before it's sent
+  // anyway. 0 means no limit.
+  int32_t maxLatencyMs;
+
+  // Deliver every chunk that is ready in one callback, as an array
+  bool batchCallbacks;
+
+  // Send the main output's audio and events to on_audio_callback. When this is
+  // false, the callback only gets the audio of the sinks.
+  bool mainCallback;
+
+  // Gaps in the timestamps up to this long are treated as packet loss, and
+  // filled in with PLC and FEC. Longer gaps are either silence, if the
+  // timestamps kept pace with the wall clock, or a discontinuity.
+  int32_t maxConcealMs;
+
+  // Fill silences with zeros instead of leaving a gap in the timestamps
+  bool fillSilence;
+
+  // Send silence and discontinuity events to on_audio_callback
+  bool gapEvents;
+
+  // Reorder packets and hold them for a playout delay that adapts to the
+  // jitter, between these bounds. Disabled if jitterMaxDelayMs is 0.
+  int32_t jitterMinDelayMs;
+  int32_t jitterMaxDelayMs;
+
+  // Emit one frame per frame duration on the local clock, concealing or
+  // filling with silence when no packet is due. Requires the jitter buffer.
+  bool clockedOutput;
+
+  // Detect speech in the decoded audio. Frames are active if they are
+  // vadThresholdDb above the noise floor, and speech ends once none have been
+  // for vadHangoverMs.
+  bool voiceActivity;
+  int32_t vadThresholdDb;
+  int32_t vadHangoverMs;
+
+  // Only send audio to on_audio_callback while speech is in progress, starting
+  // with up to vadPreRollMs of audio from before it was detected
+  bool vadGate;
+  int32_t vadPreRollMs;
+
+  // Send speech start and end events to on_audio_callback
+  bool speechEvents;
+
+  // Where the jitter buffer reports its delay, laid out as described in
+  // jitter_buffer.h. Can be NULL.
+  int32_t *jitterStats;
+
+  // Laid out as described above. Can be NULL.
+  int32_t *control;
+
+  // Shared ring that decoded frames are written to, as well as or instead of
+  // being passed to on_audio_callback. header is NULL if it isn't used.
+  PcmOutputRing outputRing;
+
+  // Extra outputs, as described above. The decoder isn't created at all if
+  // there are only relays. The strings of each relay are owned by its
+  // producer thread once the decoder starts it.
+  DecoderSinkParams sinks[DECODER_MAX_SINKS];
+  int32_t sinkCount;
+
+  ProducerThreadParams relays[DECODER_MAX_RELAYS];
+  int32_t relayCount;
 };
 
 napi_status start_audio_decode_thread(
   napi_env env,
   const AudioDecodeThreadParams &params,
   napi_value abort_signal,
-  napi_value on_audio_callback,
+  napi_value on_audio_callback,     // Optional when outputRing is set
+  napi_value on_reader_wakeup,      // Called to Atomics.notify() a reader of outputRing
+  napi_value options,               // Kept alive while the thread runs, since it references outputRing
   napi_value *external,
   napi_value *promise
 );
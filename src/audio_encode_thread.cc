@@ -1,11 +1,15 @@
 #include <node_api.h>
 
 #include "audio_encode_thread.h"
+#include "audio_level.h"
+#include "clip_cache.h"
+#include "packet_pool.h"
 #include "producer_thread.h"
 #include "thread_messages.h"
 #include "node_errors.h"
 #include "util.h"
 #include "thread_with_promise_result.h"
+#include "time_stretch.h"
 
 extern "C" {
 #include <libavutil/time.h>
@@ -27,48 +31,538 @@ extern "C" {
 // is controlled by the encoder queue (queueDepth), not this.
 #define PRODUCER_QUEUE_SIZE 256
 
-// Copied from libavcodec/libopus.c
-static int ff_opus_error_to_averror(int err) {
-  switch (err) {
-    case OPUS_BAD_ARG:
-      return AVERROR(EINVAL);
-    case OPUS_BUFFER_TOO_SMALL:
-      return AVERROR_UNKNOWN;
-    case OPUS_INTERNAL_ERROR:
-      return AVERROR(EFAULT);
-    case OPUS_INVALID_PACKET:
-      return AVERROR_INVALIDDATA;
-    case OPUS_UNIMPLEMENTED:
-      return AVERROR(ENOSYS);
-    case OPUS_INVALID_STATE:
-      return AVERROR_UNKNOWN;
-    case OPUS_ALLOC_FAIL:
-      return AVERROR(ENOMEM);
-    default:
-      return AVERROR(EINVAL);
+// With mixer inputs, the encoder keeps only about 160ms ahead of the network,
+// so that audio written to one input is soon mixed with what the others are
+// playing.
+#define MIXER_PRODUCER_QUEUE_SIZE 8
+
+// Control messages are small and rare, and are drained before every frame
+#define CONTROL_QUEUE_SIZE 64
+
+struct EncoderState {
+  const AudioEncodeThreadParams *params;
+  int frame_size_input;
+
+  ProducerThreadData *producer_thread;
+  OpusEncoder *opus_encoder;
+
+  // Shared with the producer thread, which releases audio as it's sent
+  BufferedAudio buffered_audio;
+
+  // NULL unless catch-up mode is enabled
+  TimeStretch *time_stretch;
+
+  // NULL unless there are mixer inputs
+  Mixer *mixer;
+  bool catching_up;
+  int16_t stretched[MAX_FRAME_SIZE_INPUT];
+
+  int16_t mono_accum[MAX_FRAME_SIZE_INPUT];
+  int16_t stereo_frame[MAX_FRAME_SIZE_INPUT * CHANNELS];
+
+  // Opus is encoded straight into these, and they come back once the producer
+  // has sent the packet.
+  AVBufferPool *packet_buffers;
+  int accum_pos;
+  int64_t pts;
+
+  // Value of control->interrupt_count at the last ENCODER_INTERRUPT message
+  int32_t interrupts_handled;
+
+  // Set once the audio ahead of a pending interrupt has been dropped
+  bool interrupt_started;
+
+  int64_t total_samples_encoded;
+  int64_t total_frames_encoded;
+  int64_t total_packets_passed;
+};
+
+// Stops counting input samples that will never be sent
+static void release_samples(EncoderState *state, int count) {
+  buffered_audio_release(&state->buffered_audio, count * (FRAME_SIZE_OUTPUT / state->frame_size_input));
+}
+
+// Drops the packets that are waiting to be sent by the producer thread
+static void discard_producer_queue(EncoderState *state) {
+  if (state->producer_thread == NULL) {
+    return;
+  }
+
+  ThreadMessage thread_message;
+  while (av_thread_message_queue_recv(state->producer_thread->message_queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK) >= 0) {
+    if (thread_message.type == POST_PACKET) {
+      buffered_audio_release(&state->buffered_audio, thread_message.param.pkt->duration);
+    }
+    thread_message_free_func(&thread_message);
+  }
+}
+
+static void process_control_messages(EncoderState *state) {
+  ThreadMessage thread_message;
+
+  while (av_thread_message_queue_recv(state->params->control->queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK) >= 0) {
+    if (thread_message.type == CLEAR_PRODUCER_QUEUE) {
+      discard_producer_queue(state);
+    } else if (thread_message.type == SET_ENCODER_BITRATE) {
+      opus_encoder_ctl(state->opus_encoder, OPUS_SET_BITRATE(
+        thread_message.param.int_value > 0 ? thread_message.param.int_value : OPUS_AUTO));
+    } else if (thread_message.type == SET_ENCODER_FEC) {
+      opus_encoder_ctl(state->opus_encoder, OPUS_SET_INBAND_FEC(thread_message.param.int_value));
+    } else if (thread_message.type == SET_ENCODER_PACKET_LOSS_PERC) {
+      opus_encoder_ctl(state->opus_encoder, OPUS_SET_PACKET_LOSS_PERC(thread_message.param.int_value));
+    }
+
+    thread_message_free_func(&thread_message);
+  }
+}
+
+static bool interrupt_pending(EncoderState *state) {
+  return __atomic_load_n(&state->params->control->interrupt_count, __ATOMIC_SEQ_CST) != state->interrupts_handled;
+}
+
+// Called as soon as an interrupt is noticed. Everything that was encoded or
+// accumulated is dropped right away. PCM that is still in the message queue or
+// ring is dropped until the ENCODER_INTERRUPT message is reached.
+static void begin_interrupt(EncoderState *state) {
+  if (state->interrupt_started) {
+    return;
+  }
+  state->interrupt_started = true;
+
+  release_samples(state, state->accum_pos);
+  state->accum_pos = 0;
+
+  if (state->time_stretch != NULL) {
+    release_samples(state, time_stretch_pending(state->time_stretch));
+    time_stretch_reset(state->time_stretch);
+  }
+
+  discard_producer_queue(state);
+
+  opus_encoder_ctl(state->opus_encoder, OPUS_RESET_STATE);
+
+  // The producer rebases to the wall clock when the PTS goes backwards
+  state->pts = 0;
+}
+
+static void end_interrupt(EncoderState *state, int32_t interrupt_count) {
+  const PcmRingBuffer *ring = &state->params->pcmRing;
+
+  begin_interrupt(state);
+  state->interrupts_handled = interrupt_count;
+
+  if (ring->header != NULL) {
+    uint32_t limit = (uint32_t)__atomic_load_n(&state->params->control->interrupt_ring_write_index, __ATOMIC_SEQ_CST);
+    const int16_t *samples;
+    uint32_t count;
+    while ((count = pcm_ring_peek(ring, limit, &samples)) > 0) {
+      pcm_ring_consume(ring, count);
+      release_samples(state, count);
+    }
+    buffered_audio_notify_queue_room(&state->buffered_audio);
+  }
+
+  // There may be another interrupt behind this one
+  if (!interrupt_pending(state)) {
+    state->interrupt_started = false;
+  }
+}
+
+// Encodes the full frame in mono_accum and posts it to the producer thread
+static void encode_frame(EncoderState *state) {
+  const int frame_size_input = state->frame_size_input;
+
+  process_control_messages(state);
+
+  if (state->mixer != NULL) {
+    mixer_mix(state->mixer, state->mono_accum);
+  }
+
+  // Convert mono to stereo (duplicate each sample)
+  for (int i = 0; i < frame_size_input; i++) {
+    state->stereo_frame[i * 2] = state->mono_accum[i];      // Left
+    state->stereo_frame[i * 2 + 1] = state->mono_accum[i];  // Right
+  }
+
+  state->accum_pos = 0;
+
+  AVBufferRef *buf = av_buffer_pool_get(state->packet_buffers);
+  if (buf == NULL) {
+    fprintf(stderr, "audio_encode_thread: av_buffer_pool_get failed\n");
+    buffered_audio_release(&state->buffered_audio, FRAME_SIZE_OUTPUT);
+    return;
+  }
+
+  // Encode stereo frame (480 samples at 24kHz)
+  int encoded_len = opus_encode(state->opus_encoder, state->stereo_frame, frame_size_input, buf->data, MAX_OPUS_FRAME_SIZE);
+
+  if (encoded_len < 0) {
+    fprintf(stderr, "audio_encode_thread: opus_encode error: %s\n", opus_strerror(encoded_len));
+    av_buffer_unref(&buf);
+    buffered_audio_release(&state->buffered_audio, FRAME_SIZE_OUTPUT);
+    return;
+  }
+  memset(buf->data + encoded_len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+  // Create AVPacket - PTS is at 48kHz!
+  AVPacket *pkt = packet_pool_get();
+  if (pkt == NULL) {
+    fprintf(stderr, "audio_encode_thread: packet_pool_get failed\n");
+    av_buffer_unref(&buf);
+    buffered_audio_release(&state->buffered_audio, FRAME_SIZE_OUTPUT);
+    return;
+  }
+
+  pkt->buf = buf;
+  pkt->data = buf->data;
+  pkt->size = encoded_len;
+  pkt->pts = state->pts;
+  pkt->dts = state->pts;
+  pkt->duration = FRAME_SIZE_OUTPUT;  // 960 at 48kHz = 20ms
+
+  if (state->params->audioLevelExtensionId > 0) {
+    pkt->opaque = audio_level_to_opaque(compute_audio_level(state->mono_accum, frame_size_input));
+  }
+
+  // Post to producer thread (blocking — safe since we're on a dedicated pthread)
+  int post_ret = post_packet_to_thread(state->producer_thread->message_queue, &pkt, 0);
+  if (post_ret < 0) {
+    fprintf(stderr, "audio_encode_thread: post_packet_to_thread failed [%d]\n", post_ret);
+    buffered_audio_release(&state->buffered_audio, FRAME_SIZE_OUTPUT);
+  }
+
+  state->pts += FRAME_SIZE_OUTPUT;  // Increment at 48kHz rate
+  state->total_frames_encoded++;
+  state->total_samples_encoded += frame_size_input;
+}
+
+// Accumulates mono samples, encoding every time a frame is full
+static void encode_pcm(EncoderState *state, const int16_t *input, int remaining) {
+  while (remaining > 0) {
+    // The rest of this buffer was written before the interrupt
+    if (interrupt_pending(state)) {
+      begin_interrupt(state);
+      release_samples(state, remaining);
+      return;
+    }
+
+    // Copy mono samples to accumulator
+    int to_copy = remaining;
+    if (to_copy > state->frame_size_input - state->accum_pos) {
+      to_copy = state->frame_size_input - state->accum_pos;
+    }
+
+    memcpy(state->mono_accum + state->accum_pos, input, to_copy * sizeof(int16_t));
+    state->accum_pos += to_copy;
+    input += to_copy;
+    remaining -= to_copy;
+
+    // When we have a full frame, encode it
+    if (state->accum_pos >= state->frame_size_input) {
+      encode_frame(state);
+    }
+  }
+}
+
+// Returns the playback rate for the next samples. Catch-up starts when the
+// buffered audio goes above the threshold, and carries on until it is down to
+// the target.
+static double catch_up_rate(EncoderState *state) {
+  const AudioEncodeThreadParams *params = state->params;
+  int32_t buffered = buffered_audio_load(&state->buffered_audio);
+
+  if (state->catching_up) {
+    if (buffered <= params->catchUpTargetMs * BUFFERED_AUDIO_TICKS_PER_MS) {
+      state->catching_up = false;
+    }
+  } else if (buffered > params->catchUpThresholdMs * BUFFERED_AUDIO_TICKS_PER_MS) {
+    state->catching_up = true;
+  }
+
+  return state->catching_up ? params->catchUpRate : 1.0;
+}
+
+// Like encode_pcm, but time compresses the samples first when catching up
+static void feed_pcm(EncoderState *state, const int16_t *input, int remaining) {
+  TimeStretch *time_stretch = state->time_stretch;
+  if (time_stretch == NULL) {
+    encode_pcm(state, input, remaining);
+    return;
+  }
+
+  while (remaining > 0) {
+    if (interrupt_pending(state)) {
+      begin_interrupt(state);
+      release_samples(state, remaining);
+      return;
+    }
+
+    int pushed = time_stretch_push(time_stretch, input, remaining);
+    input += pushed;
+    remaining -= pushed;
+
+    // The samples that were cut out will never be sent
+    int dropped = 0;
+    int count = time_stretch_pull(time_stretch, catch_up_rate(state), state->stretched, MAX_FRAME_SIZE_INPUT, &dropped);
+    release_samples(state, dropped);
+
+    encode_pcm(state, state->stretched, count);
+
+    if (pushed == 0 && count == 0) {
+      fprintf(stderr, "audio_encode_thread: time stretch made no progress\n");
+      release_samples(state, remaining);
+      return;
+    }
+  }
+}
+
+// Writes out the samples that the time stretcher is holding on to
+static void flush_time_stretch(EncoderState *state) {
+  TimeStretch *time_stretch = state->time_stretch;
+  if (time_stretch == NULL) {
+    return;
+  }
+
+  int dropped = 0;
+  int count;
+  while ((count = time_stretch_pull(time_stretch, 1.0, state->stretched, MAX_FRAME_SIZE_INPUT, &dropped)) > 0) {
+    encode_pcm(state, state->stretched, count);
+  }
+
+  count = time_stretch_finish(time_stretch, state->stretched, &dropped);
+
+  // This is negative if the last window was padded with silence, which is
+  // sent like audio that was written.
+  release_samples(state, dropped);
+
+  encode_pcm(state, state->stretched, count);
+}
+
+// Encode any remaining accumulated PCM with zero-padding
+static void finish_pcm(EncoderState *state) {
+  flush_time_stretch(state);
+
+  if (state->accum_pos > 0) {
+    // The padding is sent too, so it's counted like audio that was written
+    int padding = state->frame_size_input - state->accum_pos;
+    buffered_audio_add(&state->buffered_audio, padding * FRAME_SIZE_OUTPUT / state->frame_size_input);
+
+    memset(state->mono_accum + state->accum_pos, 0, (state->frame_size_input - state->accum_pos) * sizeof(int16_t));
+    encode_frame(state);
+  }
+}
+
+// Returns true if a frame of the mixer inputs should be encoded on its own,
+// because there is no PCM from write() to mix them into
+static bool mixer_frame_due(EncoderState *state) {
+  return state->mixer != NULL && state->accum_pos == 0 && !interrupt_pending(state) && mixer_ready(state->mixer, false);
+}
+
+static void encode_mixer_frame(EncoderState *state) {
+  // The producer releases every packet it sends, so the frame is counted like
+  // audio that was written
+  buffered_audio_add(&state->buffered_audio, FRAME_SIZE_OUTPUT);
+
+  memset(state->mono_accum, 0, state->frame_size_input * sizeof(int16_t));
+  state->accum_pos = state->frame_size_input;
+  encode_frame(state);
+}
+
+// Encode any remaining accumulated PCM, then reset the PTS
+static void flush_encoder(EncoderState *state) {
+  finish_pcm(state);
+  state->pts = 0;
+}
+
+// Encodes at most one frame worth of samples from the shared ring, stopping at
+// `limit`. Samples are released back to the writer as soon as they have been
+// copied into the accumulator. Returns the number of samples read.
+static uint32_t encode_from_ring(EncoderState *state, uint32_t limit) {
+  const PcmRingBuffer *ring = &state->params->pcmRing;
+
+  // The ring is discarded when the ENCODER_INTERRUPT message is reached
+  if (interrupt_pending(state)) {
+    begin_interrupt(state);
+    return 0;
+  }
+
+  const int16_t *samples;
+  uint32_t count = pcm_ring_peek(ring, limit, &samples);
+
+  if (state->time_stretch != NULL) {
+    if (count > (uint32_t)state->frame_size_input) {
+      count = state->frame_size_input;
+    }
+
+    if (count > 0) {
+      // The samples are copied by the time stretcher, so they can only be
+      // consumed afterwards.
+      feed_pcm(state, samples, count);
+      pcm_ring_consume(ring, count);
+
+      if (pcm_ring_is_half_empty(ring)) {
+        buffered_audio_notify_queue_room(&state->buffered_audio);
+      }
+    }
+
+    return count;
+  }
+
+  if (count > (uint32_t)(state->frame_size_input - state->accum_pos)) {
+    count = state->frame_size_input - state->accum_pos;
+  }
+
+  if (count > 0) {
+    memcpy(state->mono_accum + state->accum_pos, samples, count * sizeof(int16_t));
+    state->accum_pos += count;
+    pcm_ring_consume(ring, count);
+
+    if (pcm_ring_is_half_empty(ring)) {
+      buffered_audio_notify_queue_room(&state->buffered_audio);
+    }
+
+    if (state->accum_pos >= state->frame_size_input) {
+      encode_frame(state);
+    }
+  }
+
+  return count;
+}
+
+static void encode_all_from_ring(EncoderState *state, uint32_t limit) {
+  while (encode_from_ring(state, limit) > 0) {
   }
 }
 
-static int ThreadMain(AVThreadMessageQueue *message_queue, uv_async_t *buffer_ready_async, uv_async_t *drain_async, const AudioEncodeThreadParams &params) {
+// Gets ready to pass on Opus packets that were written at ring_write_index.
+// Returns false if they were written before an interrupt, in which case they
+// are dropped.
+static bool start_opus_packets(EncoderState *state, int32_t ring_write_index, int64_t duration) {
+  if (interrupt_pending(state)) {
+    begin_interrupt(state);
+    buffered_audio_release(&state->buffered_audio, (int32_t)duration);
+    return false;
+  }
+
+  if (state->params->pcmRing.header != NULL) {
+    encode_all_from_ring(state, (uint32_t)ring_write_index);
+  }
+
+  // A packet can only start where a frame ends, so a partial frame of PCM is
+  // padded with silence.
+  finish_pcm(state);
+  return true;
+}
+
+// Posts a packet that points into buf, which it holds a new reference to.
+// audio_level is -1 if it isn't known.
+static void pass_opus_packet(EncoderState *state, AVBufferRef *buf, const uint8_t *data, int32_t size, int32_t duration, int audio_level) {
+  process_control_messages(state);
+
+  AVPacket *pkt = packet_pool_get();
+  if (pkt != NULL) {
+    pkt->buf = av_buffer_ref(buf);
+  }
+  if (pkt == NULL || pkt->buf == NULL) {
+    fprintf(stderr, "audio_encode_thread: out of memory for Opus packet\n");
+    packet_pool_release(&pkt);
+    buffered_audio_release(&state->buffered_audio, duration);
+    return;
+  }
+
+  pkt->data = (uint8_t *)data;
+  pkt->size = size;
+  pkt->pts = state->pts;
+  pkt->dts = state->pts;
+  pkt->duration = duration;
+
+  if (audio_level >= 0 && state->params->audioLevelExtensionId > 0) {
+    pkt->opaque = audio_level_to_opaque(audio_level);
+  }
+
+  int post_ret = post_packet_to_thread(state->producer_thread->message_queue, &pkt, 0);
+  if (post_ret < 0) {
+    fprintf(stderr, "audio_encode_thread: post_packet_to_thread failed [%d]\n", post_ret);
+    buffered_audio_release(&state->buffered_audio, duration);
+  }
+
+  state->pts += duration;
+  state->total_packets_passed++;
+}
+
+// Passes pre-encoded Opus on to the producer, on the same timeline as the
+// encoded PCM. The packets reference the message's buffer rather than being
+// copied again.
+static void post_opus_packets(EncoderState *state, AVBufferRef *buf) {
+  OpusPacketsHeader header;
+  memcpy(&header, buf->data, sizeof(header));
+
+  if (!start_opus_packets(state, header.ring_write_index, opus_packets_duration(buf))) {
+    return;
+  }
+
+  const uint8_t *src = buf->data + sizeof(header);
+  for (int32_t i = 0; i < header.count; i++) {
+    OpusPacketHeader packet_header;
+    memcpy(&packet_header, src, sizeof(packet_header));
+    src += sizeof(packet_header);
+
+    pass_opus_packet(state, buf, src, packet_header.size, packet_header.duration, -1);
+    src += FFALIGN(packet_header.size, 4);
+  }
+
+  // The next frame is encoded as if the listener had heard the previous one,
+  // which they didn't, so start from a clean state.
+  opus_encoder_ctl(state->opus_encoder, OPUS_RESET_STATE);
+}
+
+static void post_clip(EncoderState *state, AVBufferRef *buf) {
+  const ClipPlayback *playback = (const ClipPlayback *)buf->data;
+  const Clip *clip = clip_from_buffer(playback->clip);
+
+  if (!start_opus_packets(state, playback->ring_write_index, clip->duration)) {
+    return;
+  }
+
+  int64_t remaining = clip->duration;
+  for (int32_t i = 0; i < clip->count; i++) {
+    // A clip can be minutes of hold music, so it stops as soon as it's
+    // interrupted instead of at the end
+    if (interrupt_pending(state)) {
+      begin_interrupt(state);
+      buffered_audio_release(&state->buffered_audio, (int32_t)remaining);
+      return;
+    }
+
+    const ClipPacket *packet = &clip->packets[i];
+    pass_opus_packet(state, packet->buf, packet->data, packet->size, packet->duration, packet->audio_level);
+    remaining -= packet->duration;
+  }
+
+  // See post_opus_packets()
+  opus_encoder_ctl(state->opus_encoder, OPUS_RESET_STATE);
+}
+
+static int ThreadMain(AVThreadMessageQueue *message_queue, DispatchSource *buffer_ready_source, DispatchSource *drain_source, const AudioEncodeThreadParams &params) {
   set_thread_name("audio_encode_thread");
 
   const int input_sample_rate = params.sampleRate;
-  const int frame_size_input = input_sample_rate * 20 / 1000;  // 20ms frame
+  const bool use_ring = params.pcmRing.header != NULL;
 
   int ret = 0;
   ThreadMessage thread_message;
-  ProducerThreadData *producer_thread = NULL;
 
-  // Opus encoder state
-  OpusEncoder *opus_encoder = NULL;
-  int16_t mono_accum[MAX_FRAME_SIZE_INPUT];
-  int16_t stereo_frame[MAX_FRAME_SIZE_INPUT * CHANNELS];
-  uint8_t opus_data[MAX_OPUS_FRAME_SIZE];
-  int accum_pos = 0;
-  int64_t pts = 0;
+  EncoderState *state = new EncoderState();
+  state->params = &params;
+  state->frame_size_input = input_sample_rate * 20 / 1000;  // 20ms frame
+  state->buffered_audio = params.bufferedAudio;
+  state->buffered_audio.drain_source = drain_source;
 
-  int64_t total_samples_encoded = 0;
-  int64_t total_frames_encoded = 0;
+  state->packet_buffers = av_buffer_pool_init(MAX_OPUS_FRAME_SIZE + AV_INPUT_BUFFER_PADDING_SIZE, NULL);
+  if (state->packet_buffers == NULL) {
+    ret = AVERROR(ENOMEM);
+    goto cleanup;
+  }
 
   //
   // Start producer thread with RTP parameters
@@ -81,20 +575,44 @@ static int ThreadMain(AVThreadMessageQueue *message_queue, uv_async_t *buffer_re
     producer_params.cname = params.cname;
     producer_params.cryptoSuite = params.cryptoSuite;
     producer_params.keyBase64 = params.keyBase64;
+    producer_params.audioLevelExtensionId = params.audioLevelExtensionId;
+    producer_params.bufferedAudio = &state->buffered_audio;
 
-    ret = start_producer_thread_raw(producer_params, PRODUCER_QUEUE_SIZE, &producer_thread);
+    int producer_queue_size = params.mixerInputCount > 0 ? MIXER_PRODUCER_QUEUE_SIZE : PRODUCER_QUEUE_SIZE;
+    ret = start_producer_thread_raw(producer_params, producer_queue_size, &state->producer_thread);
     if (ret != 0) {
       fprintf(stderr, "audio_encode_thread: failed to start producer thread [%d]\n", ret);
       goto cleanup;
     }
   }
 
+  if (params.mixerInputCount > 0) {
+    EncoderControl *control = params.control;
+    for (int i = 0; i < control->mixer_input_count; i++) {
+      control->mixer_inputs[i].bufferedAudio.drain_source = drain_source;
+    }
+
+    ret = mixer_alloc(control->mixer_inputs, control->mixer_input_count, input_sample_rate, state->frame_size_input, &control->mixer_waiting, &state->mixer);
+    if (ret < 0) {
+      fprintf(stderr, "audio_encode_thread: failed to create mixer [%d]\n", ret);
+      goto cleanup;
+    }
+  }
+
+  if (params.catchUpThresholdMs > 0) {
+    state->time_stretch = time_stretch_alloc(input_sample_rate);
+    if (state->time_stretch == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto cleanup;
+    }
+  }
+
   //
   // 3. Create Opus encoder at specified sample rate
   //
   {
     int opus_err;
-    opus_encoder = opus_encoder_create(input_sample_rate, CHANNELS, OPUS_APPLICATION_VOIP, &opus_err);
+    state->opus_encoder = opus_encoder_create(input_sample_rate, CHANNELS, OPUS_APPLICATION_VOIP, &opus_err);
     if (opus_err != OPUS_OK) {
       fprintf(stderr, "audio_encode_thread: failed to create opus encoder: %s\n", opus_strerror(opus_err));
       ret = ff_opus_error_to_averror(opus_err);
@@ -102,13 +620,13 @@ static int ThreadMain(AVThreadMessageQueue *message_queue, uv_async_t *buffer_re
     }
 
     // Set bitrate
-    opus_encoder_ctl(opus_encoder, OPUS_SET_BITRATE(params.bitrate > 0 ? params.bitrate : 32000));
+    opus_encoder_ctl(state->opus_encoder, OPUS_SET_BITRATE(params.bitrate > 0 ? params.bitrate : 32000));
 
     // Set FEC
-    opus_encoder_ctl(opus_encoder, OPUS_SET_INBAND_FEC(params.enableFec ? 1 : 0));
+    opus_encoder_ctl(state->opus_encoder, OPUS_SET_INBAND_FEC(params.enableFec ? 1 : 0));
 
     // Set expected packet loss percentage
-    opus_encoder_ctl(opus_encoder, OPUS_SET_PACKET_LOSS_PERC(params.packetLossPercent));
+    opus_encoder_ctl(state->opus_encoder, OPUS_SET_PACKET_LOSS_PERC(params.packetLossPercent));
   }
 
   fprintf(stderr, "audio_encode_thread: started, bitrate=%d\n", params.bitrate);
@@ -117,179 +635,224 @@ static int ThreadMain(AVThreadMessageQueue *message_queue, uv_async_t *buffer_re
   // 4. Main loop - receive PCM, encode, post to producer
   //
   while (true) {
-    ret = av_thread_message_queue_recv(message_queue, &thread_message, 0);
-    if (ret < 0) {
-      if (ret == AVERROR_EOF) {
-        ret = 0;
-      }
-      goto cleanup;
-    }
+    process_control_messages(state);
 
-    if (drain_async != NULL) {
-      uv_async_send(drain_async);
+    if (interrupt_pending(state)) {
+      begin_interrupt(state);
     }
 
-    if (thread_message.type == POST_PCM_BUFFER) {
-      int16_t *input = (int16_t *)thread_message.param.buf->data;
-      int remaining = thread_message.param.buf->size / sizeof(int16_t);
-
-      while (remaining > 0) {
-        // Copy mono samples to accumulator
-        int to_copy = remaining;
-        if (to_copy > frame_size_input - accum_pos) {
-          to_copy = frame_size_input - accum_pos;
+    if (use_ring) {
+      // The write index must be read before polling the message queue. A flush
+      // is always posted before any samples that follow it are written, so if
+      // the poll comes back empty, every sample up to this index belongs to the
+      // current segment.
+      uint32_t write_index = pcm_ring_load_write_index(&params.pcmRing);
+
+      ret = av_thread_message_queue_recv(message_queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK);
+      if (ret == AVERROR(EAGAIN)) {
+        // Encode one frame at a time, so messages are still checked between frames
+        if (encode_from_ring(state, write_index) > 0) {
+          continue;
         }
 
-        memcpy(mono_accum + accum_pos, input, to_copy * sizeof(int16_t));
-        accum_pos += to_copy;
-        input += to_copy;
-        remaining -= to_copy;
-
-        // When we have a full frame, encode it
-        if (accum_pos >= frame_size_input) {
-          // Convert mono to stereo (duplicate each sample)
-          for (int i = 0; i < frame_size_input; i++) {
-            stereo_frame[i * 2] = mono_accum[i];      // Left
-            stereo_frame[i * 2 + 1] = mono_accum[i];  // Right
-          }
-
-          // Encode stereo frame (480 samples at 24kHz)
-          int encoded_len = opus_encode(opus_encoder, stereo_frame, frame_size_input, opus_data, MAX_OPUS_FRAME_SIZE);
+        if (mixer_frame_due(state)) {
+          encode_mixer_frame(state);
+          continue;
+        }
 
-          if (encoded_len < 0) {
-            fprintf(stderr, "audio_encode_thread: opus_encode error: %s\n", opus_strerror(encoded_len));
-            accum_pos = 0;
-            continue;
-          }
+        if (!pcm_ring_prepare_wait(&params.pcmRing)) {
+          continue;
+        }
 
-          // Create AVPacket - PTS is at 48kHz!
-          AVPacket *pkt = av_packet_alloc();
-          if (pkt == NULL) {
-            fprintf(stderr, "audio_encode_thread: av_packet_alloc failed\n");
-            accum_pos = 0;
-            continue;
-          }
+        if (state->mixer != NULL && !mixer_prepare_wait(state->mixer)) {
+          continue;
+        }
 
-          ret = av_new_packet(pkt, encoded_len);
-          if (ret != 0) {
-            av_packet_free(&pkt);
-            fprintf(stderr, "audio_encode_thread: av_packet_new failed\n");
-            accum_pos = 0;
-            continue;
-          }
+        ret = av_thread_message_queue_recv(message_queue, &thread_message, 0);
+      }
+    } else if (state->mixer != NULL) {
+      ret = av_thread_message_queue_recv(message_queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK);
+      if (ret == AVERROR(EAGAIN)) {
+        if (mixer_frame_due(state)) {
+          encode_mixer_frame(state);
+          continue;
+        }
 
-          memcpy(pkt->data, opus_data, encoded_len);
-          pkt->size = encoded_len;
-          pkt->pts = pts;
-          pkt->dts = pts;
-          pkt->duration = FRAME_SIZE_OUTPUT;  // 960 at 48kHz = 20ms
+        if (!mixer_prepare_wait(state->mixer)) {
+          continue;
+        }
 
-          // Post to producer thread (blocking — safe since we're on a dedicated pthread)
-          int post_ret = post_packet_to_thread(producer_thread->message_queue, pkt, 0);
-          if (post_ret < 0) {
-            fprintf(stderr, "audio_encode_thread: post_packet_to_thread failed [%d]\n", post_ret);
-          }
+        ret = av_thread_message_queue_recv(message_queue, &thread_message, 0);
+      }
+    } else {
+      ret = av_thread_message_queue_recv(message_queue, &thread_message, 0);
+    }
 
-          av_packet_free(&pkt);
+    if (ret < 0) {
+      if (ret == AVERROR_EOF) {
+        // end() was called. Finish whatever is left in the ring, unless the
+        // stream was aborted or interrupted.
+        if (use_ring && !pcm_ring_is_discarded(&params.pcmRing) && !interrupt_pending(state)) {
+          encode_all_from_ring(state, pcm_ring_load_write_index(&params.pcmRing));
+        }
 
-          pts += FRAME_SIZE_OUTPUT;  // Increment at 48kHz rate
-          accum_pos = 0;
-          total_frames_encoded++;
-          total_samples_encoded += frame_size_input;
+        // The inputs play out the audio that was written to them
+        if (state->mixer != NULL && !interrupt_pending(state)) {
+          finish_pcm(state);
+          while (mixer_ready(state->mixer, true)) {
+            encode_mixer_frame(state);
+          }
         }
+        ret = 0;
       }
+      goto cleanup;
+    }
+
+    if (!use_ring) {
+      buffered_audio_notify_queue_room(&state->buffered_audio);
+    }
+
+    if (thread_message.type == POST_PCM_BUFFER) {
+      feed_pcm(
+        state,
+        (int16_t *)thread_message.param.buf->data,
+        thread_message.param.buf->size / sizeof(int16_t)
+      );
 
       // Free the PCM buffer
       thread_message_free_func(&thread_message);
-    } else if (thread_message.type == FLUSH_OPUS_ENCODER) {
-      // Encode any remaining accumulated PCM with zero-padding
-      if (accum_pos > 0) {
-        // Zero-pad the rest of the frame
-        memset(mono_accum + accum_pos, 0, (frame_size_input - accum_pos) * sizeof(int16_t));
-
-        // Convert mono to stereo (duplicate each sample)
-        for (int i = 0; i < frame_size_input; i++) {
-          stereo_frame[i * 2] = mono_accum[i];
-          stereo_frame[i * 2 + 1] = mono_accum[i];
-        }
+    } else if (thread_message.type == POST_OPUS_PACKETS) {
+      post_opus_packets(state, thread_message.param.buf);
 
-        int encoded_len = opus_encode(opus_encoder, stereo_frame, frame_size_input, opus_data, MAX_OPUS_FRAME_SIZE);
-        if (encoded_len > 0) {
-          AVPacket *pkt = av_packet_alloc();
-          if (pkt != NULL && av_new_packet(pkt, encoded_len) == 0) {
-            memcpy(pkt->data, opus_data, encoded_len);
-            pkt->size = encoded_len;
-            pkt->pts = pts;
-            pkt->dts = pts;
-            pkt->duration = FRAME_SIZE_OUTPUT;
-
-            int post_ret = post_packet_to_thread(producer_thread->message_queue, pkt, 0);
-            if (post_ret < 0) {
-              fprintf(stderr, "audio_encode_thread: flush post_packet_to_thread failed [%d]\n", post_ret);
-            }
-          }
-          if (pkt != NULL) {
-            av_packet_free(&pkt);
-          }
+      // The packets that were sent hold their own references
+      thread_message_free_func(&thread_message);
+    } else if (thread_message.type == POST_CLIP) {
+      post_clip(state, thread_message.param.buf);
+      thread_message_free_func(&thread_message);
+    } else if (thread_message.type == ENCODER_WAKEUP) {
+      // Nothing to do. The ring and control queue are read at the top of the loop.
+    } else if (thread_message.type == ENCODER_INTERRUPT) {
+      end_interrupt(state, thread_message.param.int_value);
+    } else if (thread_message.type == FLUSH_OPUS_ENCODER) {
+      // A flush that was posted before an interrupt ends a segment that has
+      // already been discarded
+      if (!interrupt_pending(state)) {
+        if (use_ring) {
+          encode_all_from_ring(state, (uint32_t)thread_message.param.int_value);
         }
-
-        accum_pos = 0;
+        flush_encoder(state);
       }
-      pts = 0;
-    } else if (thread_message.type == CLEAR_PRODUCER_QUEUE) {
-      if (producer_thread != NULL) {
-        av_thread_message_flush(producer_thread->message_queue);
-      }
-    } else if (thread_message.type == SET_ENCODER_BITRATE) {
-      opus_encoder_ctl(opus_encoder, OPUS_SET_BITRATE(
-        thread_message.param.int_value > 0 ? thread_message.param.int_value : OPUS_AUTO));
-    } else if (thread_message.type == SET_ENCODER_FEC) {
-      opus_encoder_ctl(opus_encoder, OPUS_SET_INBAND_FEC(thread_message.param.int_value));
-    } else if (thread_message.type == SET_ENCODER_PACKET_LOSS_PERC) {
-      opus_encoder_ctl(opus_encoder, OPUS_SET_PACKET_LOSS_PERC(thread_message.param.int_value));
     } else {
       thread_message_free_func(&thread_message);
     }
   }
 
 cleanup:
-  fprintf(stderr, "audio_encode_thread: stopping, encoded %lld frames (%lld samples, %.2f sec)\n",
-          (long long)total_frames_encoded,
-          (long long)total_samples_encoded,
-          (double)total_samples_encoded / input_sample_rate);
-
-  if (producer_thread != NULL) {
-    int producer_ret = stop_producer_thread_raw(producer_thread);
+  fprintf(stderr, "audio_encode_thread: stopping, encoded %lld frames (%lld samples, %.2f sec), passed on %lld Opus packets\n",
+          (long long)state->total_frames_encoded,
+          (long long)state->total_samples_encoded,
+          (double)state->total_samples_encoded / input_sample_rate,
+          (long long)state->total_packets_passed);
+
+  if (state->producer_thread != NULL) {
+    int producer_ret = stop_producer_thread_raw(state->producer_thread);
     if (producer_ret != 0) {
       fprintf(stderr, "audio_encode_thread: producer thread returned error [%d]\n", producer_ret);
     }
   }
 
   // Cleanup resources
-  if (opus_encoder != NULL) {
-    opus_encoder_destroy(opus_encoder);
+  if (state->opus_encoder != NULL) {
+    opus_encoder_destroy(state->opus_encoder);
   }
 
+  time_stretch_free(&state->time_stretch);
+  mixer_free(&state->mixer);
+
+  // Buffers still held by packets keep the pool alive until they come back
+  av_buffer_pool_uninit(&state->packet_buffers);
+
+  delete state;
+
   return ret;
 }
 
+static void finalize_encoder_control(napi_env env, void *finalize_data, void *finalize_hint) {
+  EncoderControl *control = (EncoderControl *)finalize_data;
+  av_thread_message_queue_free(&control->queue);
+  for (int i = 0; i < control->mixer_input_count; i++) {
+    av_thread_message_queue_free(&control->mixer_inputs[i].queue);
+  }
+  delete control;
+}
+
 napi_status start_audio_encode_thread(
   napi_env env,
   const AudioEncodeThreadParams &params,
   napi_value abort_signal,
   napi_value on_drain_callback,
   unsigned int queue_depth,
+  napi_value options,
   napi_value *external,
+  napi_value *control_external,
   napi_value *promise
 ) {
   size_t stack_size = get_stack_size_for_thread("ENCODER");
+  napi_status status;
 
-  return start_thread_with_promise_result<AudioEncodeThreadParams>(
+  EncoderControl *control = new EncoderControl();
+
+  int ret = av_thread_message_queue_alloc(&control->queue, CONTROL_QUEUE_SIZE, sizeof(ThreadMessage));
+  if (ret != 0) {
+    delete control;
+    return throw_ffmpeg_error(env, ret);
+  }
+
+  av_thread_message_queue_set_free_func(control->queue, thread_message_free_func);
+
+  for (int i = 0; i < params.mixerInputCount; i++) {
+    MixerInputParams *input = &control->mixer_inputs[i];
+    *input = params.mixerInputs[i];
+
+    ret = av_thread_message_queue_alloc(&input->queue, input->queueDepth, sizeof(ThreadMessage));
+    if (ret != 0) {
+      finalize_encoder_control(env, control, NULL);
+      return throw_ffmpeg_error(env, ret);
+    }
+    av_thread_message_queue_set_free_func(input->queue, thread_message_free_func);
+    control->mixer_input_count++;
+  }
+
+  status = napi_create_external(env, control, finalize_encoder_control, NULL, control_external);
+  if (status != napi_ok) {
+    finalize_encoder_control(env, control, NULL);
+    return status;
+  }
+
+  // The thread holds on to this, which keeps the shared buffers in the options
+  // and the control queue alive until it exits.
+  napi_value js_input_value;
+  status = napi_create_object(env, &js_input_value);
+  if (status != napi_ok) return status;
+
+  status = napi_set_named_property(env, js_input_value, "options", options);
+  if (status != napi_ok) return status;
+
+  status = napi_set_named_property(env, js_input_value, "control", *control_external);
+  if (status != napi_ok) return status;
+
+  // Input sample rates always divide evenly into 48kHz ticks
+  control->ticks_per_sample = params.sampleRate > 0 ? OUTPUT_SAMPLE_RATE / params.sampleRate : 0;
+
+  AudioEncodeThreadParams thread_params = params;
+  thread_params.control = control;
+
+  status = start_thread_with_promise_result<AudioEncodeThreadParams>(
     env,
     ThreadMain,
-    params,
+    thread_params,
     abort_signal,
-    NULL,
+    js_input_value,
     stack_size,
     queue_depth,
     external,
@@ -297,4 +860,46 @@ napi_status start_audio_encode_thread(
     on_drain_callback,
     promise
   );
+  if (status != napi_ok) return status;
+
+  return napi_get_value_external(env, *external, (void **)&control->message_queue);
+}
+
+void wake_encoder(EncoderControl *control) {
+  post_encoder_wakeup_to_thread(control->message_queue);
+}
+
+int post_pcm_to_mixer_input(EncoderControl *control, int index, void **buffers, size_t *lengths, size_t count) {
+  int ret = post_pcm_buffers_to_thread(control->mixer_inputs[index].queue, buffers, lengths, count);
+  if (ret == 0 && mixer_take_waiting(&control->mixer_waiting)) {
+    wake_encoder(control);
+  }
+
+  return ret;
+}
+
+int64_t interrupt_encoder(EncoderControl *control, int32_t ring_write_index) {
+  __atomic_store_n(&control->interrupt_ring_write_index, ring_write_index, __ATOMIC_SEQ_CST);
+  int32_t interrupt_count = __atomic_add_fetch(&control->interrupt_count, 1, __ATOMIC_SEQ_CST);
+
+  // Remove the queued PCM right away, rather than have the encoder dequeue and
+  // drop each buffer. Anything posted after this is new audio.
+  int64_t discarded = 0;
+  ThreadMessage thread_message;
+  while (av_thread_message_queue_recv(control->message_queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK) >= 0) {
+    if (thread_message.type == POST_PCM_BUFFER) {
+      discarded += thread_message.param.buf->size / sizeof(int16_t) * control->ticks_per_sample;
+    } else if (thread_message.type == POST_OPUS_PACKETS) {
+      discarded += opus_packets_duration(thread_message.param.buf);
+    } else if (thread_message.type == POST_CLIP) {
+      discarded += clip_playback_duration(thread_message.param.buf);
+    }
+    thread_message_free_func(&thread_message);
+  }
+
+  // This also wakes up the encoder. It can only fail if end() has already been
+  // called, in which case the encoder stops discarding when it exits.
+  post_encoder_interrupt_to_thread(control->message_queue, interrupt_count);
+
+  return discarded;
 }
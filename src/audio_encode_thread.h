@@ -2,6 +2,44 @@
 
 #include <node_api.h>
 
+extern "C" {
+#include <libavutil/threadmessage.h>
+}
+
+#include "buffered_audio.h"
+#include "mixer.h"
+#include "pcm_ring_buffer.h"
+
+// Out of band control for an encoder session. Control messages skip ahead of
+// any PCM that is waiting in the encoder's message queue.
+struct EncoderControl {
+  // SET_ENCODER_* and CLEAR_PRODUCER_QUEUE messages. The encoder drains this
+  // before every frame.
+  AVThreadMessageQueue *queue;
+
+  // The encoder's PCM message queue, used to wake it up. Not owned.
+  AVThreadMessageQueue *message_queue;
+
+  // Incremented for each interrupt. The encoder checks this before every frame,
+  // and discards audio until it reaches the matching ENCODER_INTERRUPT message.
+  int32_t interrupt_count;
+
+  // Write index of the PCM ring at the most recent interrupt
+  int32_t interrupt_ring_write_index;
+
+  // Buffered audio ticks per input sample
+  int32_t ticks_per_sample;
+
+  // The mixer inputs from the params, with their queues, which are freed along
+  // with the control.
+  MixerInputParams mixer_inputs[MIXER_MAX_INPUTS];
+  int32_t mixer_input_count;
+
+  // Set while the encoder is blocked and an input has no full frame. See
+  // mixer_prepare_wait().
+  int32_t mixer_waiting;
+};
+
 struct AudioEncodeThreadParams {
   char *rtpUrl;       // "rtp://127.0.0.1:port" or "srtp://..."
   char *ssrc;
@@ -13,6 +51,30 @@ struct AudioEncodeThreadParams {
   int32_t bitrate;    // e.g., 32000 for speech
   bool enableFec;
   int32_t packetLossPercent;
+  int32_t audioLevelExtensionId; // RFC 6464 header extension id, or 0 to disable
+
+  // Shared ring that JS writes PCM into. header is NULL when PCM is posted
+  // through the message queue instead.
+  PcmRingBuffer pcmRing;
+
+  // Counter of audio that has been written but not sent yet. drain_source is
+  // filled in by the encoder thread.
+  BufferedAudio bufferedAudio;
+
+  // Catch-up mode. When more than catchUpThresholdMs of audio is buffered, the
+  // PCM is time compressed by catchUpRate until the buffered audio is back
+  // down to catchUpTargetMs. Disabled if catchUpThresholdMs is 0.
+  int32_t catchUpThresholdMs;
+  int32_t catchUpTargetMs;
+  double catchUpRate;
+
+  // Extra inputs that are mixed into each frame. Their queues are allocated by
+  // start_audio_encode_thread.
+  MixerInputParams mixerInputs[MIXER_MAX_INPUTS];
+  int32_t mixerInputCount;
+
+  // Set by start_audio_encode_thread
+  EncoderControl *control;
 };
 
 napi_status start_audio_encode_thread(
@@ -21,6 +83,22 @@ napi_status start_audio_encode_thread(
   napi_value abort_signal,
   napi_value on_drain_callback,  // Optional JS callback invoked when queue has room
   unsigned int queue_depth,       // Message queue depth
+  napi_value options,             // Kept alive while the thread runs, since it references the shared buffers in params
   napi_value *external,           // Returns message queue for posting PCM
+  napi_value *control_external,   // Returns the EncoderControl
   napi_value *promise
 );
+
+// Call after posting to control->queue, in case the encoder is blocked
+// waiting for PCM.
+void wake_encoder(EncoderControl *control);
+
+// Discards all audio that has been posted to the encoder so far, along with the
+// packets waiting in the producer queue. ring_write_index is the PCM ring's
+// write index, if there is one. Returns the buffered audio, in ticks, that was
+// removed from the message queue.
+int64_t interrupt_encoder(EncoderControl *control, int32_t ring_write_index);
+
+// Posts PCM to one of the encoder's mixer inputs, and wakes up the encoder if
+// it's waiting for one. Returns AVERROR(EAGAIN) if the input's queue is full.
+int post_pcm_to_mixer_input(EncoderControl *control, int index, void **buffers, size_t *lengths, size_t count);
@@ -0,0 +1,54 @@
+#include <math.h>
+#include <stdint.h>
+
+#include "audio_level.h"
+
+#define AUDIO_LEVEL_PRESENT 0x100
+#define AUDIO_LEVEL_VOICE_ACTIVITY 0x80
+
+int compute_audio_level(const int16_t *samples, int count) {
+  if (count <= 0) {
+    return AUDIO_LEVEL_SILENCE;
+  }
+
+  // A 20ms frame at 48kHz can't overflow the 64 bit accumulator
+  int64_t sum_of_squares = 0;
+  for (int i = 0; i < count; i++) {
+    int32_t sample = samples[i];
+    sum_of_squares += sample * sample;
+  }
+
+  if (sum_of_squares == 0) {
+    return AUDIO_LEVEL_SILENCE;
+  }
+
+  double mean_square = (double)sum_of_squares / count;
+  double dbov = 10.0 * log10(mean_square / (32768.0 * 32768.0));
+
+  int level = (int)lrint(-dbov);
+  if (level < 0) {
+    return 0;
+  } else if (level > AUDIO_LEVEL_SILENCE) {
+    return AUDIO_LEVEL_SILENCE;
+  } else {
+    return level;
+  }
+}
+
+void *audio_level_to_opaque(int level) {
+  intptr_t value = AUDIO_LEVEL_PRESENT | (level & 0x7F);
+  if (level < AUDIO_LEVEL_VOICE_THRESHOLD) {
+    value |= AUDIO_LEVEL_VOICE_ACTIVITY;
+  }
+  return (void *)value;
+}
+
+bool audio_level_from_opaque(void *opaque, uint8_t *extension_byte) {
+  intptr_t value = (intptr_t)opaque;
+  if (!(value & AUDIO_LEVEL_PRESENT)) {
+    return false;
+  }
+
+  *extension_byte = (uint8_t)(value & 0xFF);
+  return true;
+}
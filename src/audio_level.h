@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+// RFC 6464 client-to-mixer audio level, expressed in -dBov. 0 is a full scale
+// signal and 127 is digital silence.
+#define AUDIO_LEVEL_SILENCE 127
+
+// Frames louder than this level are flagged as containing voice activity.
+#define AUDIO_LEVEL_VOICE_THRESHOLD 50
+
+// Size of the one-byte header extension block we add to each RTP packet:
+// 4 bytes for the 0xBEDE profile header and 1 element padded to 4 bytes.
+#define AUDIO_LEVEL_EXTENSION_SIZE 8
+
+// Returns the RMS level of the samples in -dBov.
+int compute_audio_level(const int16_t *samples, int count);
+
+// The level travels from the encoder to the producer on AVPacket::opaque, along
+// with the packet itself. Packets with a NULL opaque (e.g. Opus that
+// didn't come from our encoder) are sent without the header extension.
+void *audio_level_to_opaque(int level);
+
+// Returns false if the packet doesn't carry a level. Otherwise, writes the
+// extension payload byte: V (1 bit) | level (7 bits).
+bool audio_level_from_opaque(void *opaque, uint8_t *extension_byte);
@@ -4,10 +4,10 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/threadmessage.h>
 #include <libavutil/error.h>
-#include <uv.h>
 }
 
 #include "buffer_ready_node_callback.h"
+#include "node_dispatcher.h"
 #include "node_errors.h"
 
 napi_status create_js_pts(napi_env env, int64_t value, napi_value *result) {
@@ -18,20 +18,89 @@ napi_status create_js_pts(napi_env env, int64_t value, napi_value *result) {
   }
 }
 
+// Converts microseconds to milliseconds, or AV_NOPTS_VALUE to null
+static napi_status create_js_time(napi_env env, int64_t value, napi_value *result) {
+  if (value == AV_NOPTS_VALUE) {
+    return napi_get_null(env, result);
+  } else {
+    return napi_create_double(env, value / 1000.0, result);
+  }
+}
+
 static void finalize_external_buffer(napi_env env, void* finalize_data, void* finalize_hint) {
-  av_free(finalize_data);
+  AVBufferRef *buf = (AVBufferRef *)finalize_hint;
+  av_buffer_unref(&buf);
+}
+
+static const char *event_type_name(AudioBufferType type) {
+  switch (type) {
+    case AUDIO_BUFFER_SILENCE:
+      return "silence";
+    case AUDIO_BUFFER_DISCONTINUITY:
+      return "discontinuity";
+    case AUDIO_BUFFER_SPEECH_START:
+      return "speechStart";
+    case AUDIO_BUFFER_SPEECH_END:
+      return "speechEnd";
+    default:
+      return "unknown";
+  }
+}
+
+// Gap events have a durationMs, speech events only a pts
+static napi_status create_js_event(napi_env env, AudioBuffer *buffer, napi_value *object) {
+  napi_status status;
+  napi_value js_type;
+  napi_value js_pts;
+  napi_value js_duration;
+
+  const char *type = event_type_name(buffer->type);
+  status = napi_create_string_utf8(env, type, NAPI_AUTO_LENGTH, &js_type);
+  if (status != napi_ok)
+    return status;
+
+  status = create_js_pts(env, buffer->pts, &js_pts);
+  if (status != napi_ok)
+    return status;
+
+  status = napi_create_double(env, buffer->duration_ms, &js_duration);
+  if (status != napi_ok)
+    return status;
+
+  status = napi_create_object(env, object);
+  if (status != napi_ok)
+    return status;
+
+  status = napi_set_named_property(env, *object, "type", js_type);
+  if (status != napi_ok)
+    return status;
+
+  status = napi_set_named_property(env, *object, "pts", js_pts);
+  if (status != napi_ok)
+    return status;
+
+  if (buffer->type == AUDIO_BUFFER_SPEECH_START || buffer->type == AUDIO_BUFFER_SPEECH_END) {
+    return napi_ok;
+  }
+
+  return napi_set_named_property(env, *object, "durationMs", js_duration);
 }
 
 napi_status create_js_result(napi_env env, AudioBuffer *buffer, napi_value *object) {
   napi_status status;
   napi_value js_buffer;
   napi_value js_pts;
+  napi_value js_sender_time;
+  napi_value js_received_at;
+
+  if (buffer->type != AUDIO_BUFFER_DATA) {
+    return create_js_event(env, buffer, object);
+  }
 
   // Convert into node Buffer object
-  status = napi_create_external_buffer(env, buffer->len, buffer->buf, finalize_external_buffer, NULL, &js_buffer);
+  status = napi_create_external_buffer(env, buffer->len, buffer->buf->data, finalize_external_buffer, buffer->buf, &js_buffer);
   if (status != napi_ok) {
-    av_free(buffer->buf);
-    buffer->buf = NULL;
+    av_buffer_unref(&buffer->buf);
     return status;
   }
 
@@ -39,6 +108,14 @@ napi_status create_js_result(napi_env env, AudioBuffer *buffer, napi_value *obje
   if (status != napi_ok)
     return status;
 
+  status = create_js_time(env, buffer->sender_time, &js_sender_time);
+  if (status != napi_ok)
+    return status;
+
+  status = create_js_time(env, buffer->received_at, &js_received_at);
+  if (status != napi_ok)
+    return status;
+
   status = napi_create_object(env, object);
   if (status != napi_ok)
     return status;
@@ -51,6 +128,25 @@ napi_status create_js_result(napi_env env, AudioBuffer *buffer, napi_value *obje
   if (status != napi_ok)
     return status;
 
+  status = napi_set_named_property(env, *object, "senderTime", js_sender_time);
+  if (status != napi_ok)
+    return status;
+
+  status = napi_set_named_property(env, *object, "receivedAt", js_received_at);
+  if (status != napi_ok)
+    return status;
+
+  if (buffer->sink >= 0) {
+    napi_value js_sink;
+    status = napi_create_int32(env, buffer->sink, &js_sink);
+    if (status != napi_ok)
+      return status;
+
+    status = napi_set_named_property(env, *object, "sink", js_sink);
+    if (status != napi_ok)
+      return status;
+  }
+
   return napi_ok;
 }
 
@@ -58,20 +154,50 @@ struct CallbackMany {
   napi_env env;
   int error;
   AVThreadMessageQueue *message_queue;
-  uv_async_t async;
+  DispatchSource source;
   napi_ref on_buffer_ready_callback;
+  bool batched;
+  bool warned_queue_full;
 };
 
-static void close_callback2(uv_handle_t *handle) {
-  CallbackMany *data = (CallbackMany *)handle->data;
+static void free_callback_for_many(DispatchSource *source) {
+  CallbackMany *data = (CallbackMany *)source->opaque;
   av_thread_message_queue_free(&data->message_queue);
   delete data;
 }
 
+static void call_buffer_ready_callback(CallbackMany *thread_data, napi_value argument) {
+  napi_env env = thread_data->env;
+  napi_status status;
+
+  napi_value callback_function;
+  status = napi_get_reference_value(env, thread_data->on_buffer_ready_callback, &callback_function);
+  if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+  size_t argc = 1;
+  napi_value argv[1] = { argument };
+  napi_value js_ret;
+  napi_value global;
+  status = napi_get_global(env, &global);
+  if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+  status = napi_call_function(env, global, callback_function, argc, argv, &js_ret);
+  if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+}
+
 void handle_all_messages_in_queue(CallbackMany *thread_data) {
   napi_env env = thread_data->env;
   napi_status status;
 
+  // Only used when batched
+  napi_value batch = NULL;
+  uint32_t batch_length = 0;
+
+  if (thread_data->batched) {
+    status = napi_create_array(env, &batch);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+  }
+
   while (true) {
     AudioBuffer audio_buffer;
     int ret = av_thread_message_queue_recv(thread_data->message_queue, &audio_buffer, AV_THREAD_MESSAGE_NONBLOCK);
@@ -80,7 +206,12 @@ void handle_all_messages_in_queue(CallbackMany *thread_data) {
       // queue is empty. exit while loop
       break;
     } else if (ret == AVERROR_EOF) {
-      // Thread is shutting down
+      // Thread is shutting down. Deliver what was collected first.
+      if (batch_length > 0) {
+        call_buffer_ready_callback(thread_data, batch);
+        batch_length = 0;
+      }
+
       if (thread_data->on_buffer_ready_callback != NULL) {
         status = napi_delete_reference(env, thread_data->on_buffer_ready_callback);
         if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
@@ -92,50 +223,34 @@ void handle_all_messages_in_queue(CallbackMany *thread_data) {
       fprintf(stderr, "av_thread_message_queue_recv failed with error [%d]", ret);
       break;
     } else {
-      napi_value callback_function;
-      status = napi_get_reference_value(env, thread_data->on_buffer_ready_callback, &callback_function);
-      if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
-
-      size_t argc = 1;
-      napi_value argv[1];
-      napi_value js_ret;
-      napi_value global;
-      status = napi_get_global(env, &global);
-      if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
-
-      status = create_js_result(env, &audio_buffer, &argv[0]);
+      napi_value js_result;
+      status = create_js_result(env, &audio_buffer, &js_result);
       if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
-      status = napi_call_function(env, global, callback_function, argc, argv, &js_ret);
-      if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+      if (thread_data->batched) {
+        status = napi_set_element(env, batch, batch_length++, js_result);
+        if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+      } else {
+        call_buffer_ready_callback(thread_data, js_result);
+      }
     }
   }
-}
-
-void async_callback_for_many(uv_async_t *async) {
-  CallbackMany *thread_data = (CallbackMany *)async->data;
 
-  napi_handle_scope scope;
-  napi_status status;
-  napi_env env = thread_data->env;
-
-  status = napi_open_handle_scope(env, &scope);
-  if (status != napi_ok) {
-    fprintf(stderr, "napi_open_handle_scope is fail status [%d]", status);
-    return;
+  if (batch_length > 0) {
+    call_buffer_ready_callback(thread_data, batch);
   }
+}
 
-  handle_all_messages_in_queue(thread_data);
-
-  status = napi_close_handle_scope(env, scope);
-  if (status != napi_ok) {
-    fprintf(stderr, "napi_close_handle_scope is fail status [%d]", status);
-  }
+// The dispatcher provides the handle scope
+static void dispatch_callback_for_many(DispatchSource *source) {
+  handle_all_messages_in_queue((CallbackMany *)source->opaque);
 }
 
-napi_status init_callback_for_many(napi_env env, napi_value on_buffer_ready_callback, uv_async_t **async) {
+napi_status init_callback_for_many(napi_env env, napi_value on_buffer_ready_callback, bool batched, DispatchSource **source) {
   CallbackMany *thread_data = new CallbackMany;
   thread_data->env = env;
+  thread_data->batched = batched;
+  thread_data->warned_queue_full = false;
 
   int ret;
   napi_status status;
@@ -143,12 +258,6 @@ napi_status init_callback_for_many(napi_env env, napi_value on_buffer_ready_call
   status = napi_create_reference(env, on_buffer_ready_callback, 1, &thread_data->on_buffer_ready_callback);
   if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
-  ret = uv_async_init(uv_default_loop(), &thread_data->async, async_callback_for_many);
-  if (ret != 0) {
-    napi_throw_error(env, NULL, "uv_async_init failed");
-    return napi_pending_exception;
-  }
-
   ret = av_thread_message_queue_alloc(&thread_data->message_queue, 1024, sizeof(AudioBuffer));
   if (ret < 0) {
     throw_ffmpeg_error(env, ret);
@@ -156,43 +265,53 @@ napi_status init_callback_for_many(napi_env env, napi_value on_buffer_ready_call
     return napi_pending_exception;
   }
 
-  thread_data->async.data = thread_data;
-  *async = &thread_data->async;
+  status = dispatch_source_init(env, &thread_data->source, dispatch_callback_for_many, thread_data);
+  if (status != napi_ok) {
+    av_thread_message_queue_free(&thread_data->message_queue);
+    delete thread_data;
+    return status;
+  }
+
+  *source = &thread_data->source;
 
   return napi_ok;
 }
 
-void cleanup_callback_for_many(uv_async_t *async) {
-  CallbackMany *thread_data = (CallbackMany *)async->data;
+void cleanup_callback_for_many(DispatchSource *source) {
+  CallbackMany *thread_data = (CallbackMany *)source->opaque;
   handle_all_messages_in_queue(thread_data);
-  uv_close((uv_handle_t *)&thread_data->async, close_callback2);
+  dispatch_source_release(source, free_callback_for_many);
 }
 
-int send_callback_for_many(uv_async_t *async, AudioBuffer *value) {
-  CallbackMany *thread_data = (CallbackMany *)async->data;
+int send_callback_for_many(DispatchSource *source, AudioBuffer *value) {
+  CallbackMany *thread_data = (CallbackMany *)source->opaque;
 
   int ret = av_thread_message_queue_send(thread_data->message_queue, value, AV_THREAD_MESSAGE_NONBLOCK);
   if (ret < 0) {
     if (ret == AVERROR(EAGAIN)) {
-      fprintf(stderr, "WARNING: message queue full while posting AudioBuffer to libav thread");
+      // The caller counts these. Warn once, rather than for every buffer while
+      // the event loop is blocked.
+      if (!thread_data->warned_queue_full) {
+        thread_data->warned_queue_full = true;
+        fprintf(stderr, "WARNING: message queue full while posting AudioBuffer to libav thread\n");
+      }
     }
 
-    av_free(value->buf);
-    value->buf = NULL;
+    av_buffer_unref(&value->buf);
     return ret;
   }
 
-  uv_async_send(&thread_data->async);
+  dispatcher_wake(source);
 
   return napi_ok;
 }
 
-int finish_callback_for_many(uv_async_t *async) {
-  CallbackMany *thread_data = (CallbackMany *)async->data;
+int finish_callback_for_many(DispatchSource *source) {
+  CallbackMany *thread_data = (CallbackMany *)source->opaque;
 
   av_thread_message_queue_set_err_recv(thread_data->message_queue, AVERROR_EOF);
 
-  uv_async_send(&thread_data->async);
+  dispatcher_wake(source);
 
   return napi_ok;
 }
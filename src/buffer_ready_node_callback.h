@@ -1,20 +1,58 @@
 #pragma once
 
 #include <node_api.h>
-#include <uv.h>
+
+extern "C" {
+#include <libavutil/buffer.h>
+}
+
+enum AudioBufferType {
+  AUDIO_BUFFER_DATA = 0,
+
+  // Events for gaps that weren't concealed. buf is NULL.
+  AUDIO_BUFFER_SILENCE,
+  AUDIO_BUFFER_DISCONTINUITY,
+
+  // Voice activity events. buf is NULL.
+  AUDIO_BUFFER_SPEECH_START,
+  AUDIO_BUFFER_SPEECH_END,
+};
 
 struct AudioBuffer {
-  // Pointer to PCM audio data (int16_t samples)
-  uint8_t *buf;
+  AudioBufferType type;
+
+  // PCM audio data (int16_t samples). This is usually a block from a pool, which
+  // it's returned to when the JavaScript Buffer is garbage collected or
+  // released.
+  AVBufferRef *buf;
   unsigned int len;
 
   // Presentation timestamp in samples (at source sample rate)
   int64_t pts;
+
+  // Length of a gap event
+  double duration_ms;
+
+  // Sender's wall clock time of the first sample, in microseconds since the
+  // Unix epoch, from RTCP sender reports. AV_NOPTS_VALUE if unknown.
+  int64_t sender_time;
+
+  // Monotonic time (av_gettime_relative) at which the packet that the first
+  // sample was decoded from arrived. AV_NOPTS_VALUE for concealed audio.
+  int64_t received_at;
+
+  // Index of the consumer's sink that the audio is for, or -1 for the main
+  // output
+  int32_t sink;
 };
 
-napi_status init_callback_for_many(napi_env env, napi_value on_buffer_ready_callback, uv_async_t **async);
+struct DispatchSource;
+
+// If batched is true, the callback is called once per wakeup with an array of
+// every buffer that is ready, instead of once for each buffer.
+napi_status init_callback_for_many(napi_env env, napi_value on_buffer_ready_callback, bool batched, DispatchSource **source);
 
-int send_callback_for_many(uv_async_t *async, AudioBuffer *value);
-int finish_callback_for_many(uv_async_t *async);
+int send_callback_for_many(DispatchSource *source, AudioBuffer *value);
+int finish_callback_for_many(DispatchSource *source);
 
-void cleanup_callback_for_many(uv_async_t *async);
+void cleanup_callback_for_many(DispatchSource *source);
@@ -0,0 +1,73 @@
+extern "C" {
+#include <libavutil/error.h>
+}
+
+#include "buffered_audio.h"
+
+// The fields are accessed by JavaScript with Atomics, which are sequentially
+// consistent.
+int buffered_audio_init(BufferedAudio *buffered_audio, void *data, size_t byte_length, int32_t low_water_mark_ms) {
+  if (data == NULL || ((uintptr_t)data & 3) != 0 || byte_length < BUFFERED_AUDIO_SIZE) {
+    return AVERROR(EINVAL);
+  }
+
+  buffered_audio->fields = (int32_t *)data;
+  if (low_water_mark_ms < 0 || low_water_mark_ms > INT32_MAX / BUFFERED_AUDIO_TICKS_PER_MS) {
+    buffered_audio->low_water_mark = INT32_MAX;
+  } else {
+    buffered_audio->low_water_mark = low_water_mark_ms * BUFFERED_AUDIO_TICKS_PER_MS;
+  }
+
+  return 0;
+}
+
+int32_t buffered_audio_load(const BufferedAudio *buffered_audio) {
+  if (buffered_audio->fields == NULL) {
+    return 0;
+  }
+
+  return __atomic_load_n(&buffered_audio->fields[BUFFERED_AUDIO_TICKS], __ATOMIC_SEQ_CST);
+}
+
+void buffered_audio_add(const BufferedAudio *buffered_audio, int32_t ticks) {
+  if (buffered_audio->fields == NULL) {
+    return;
+  }
+
+  __atomic_add_fetch(&buffered_audio->fields[BUFFERED_AUDIO_TICKS], ticks, __ATOMIC_SEQ_CST);
+}
+
+static void notify_drain(const BufferedAudio *buffered_audio, BufferedAudioDrainWaiting reason) {
+  if (buffered_audio->drain_source == NULL) {
+    return;
+  }
+
+  int32_t expected = reason;
+  if (__atomic_compare_exchange_n(&buffered_audio->fields[BUFFERED_AUDIO_DRAIN_WAITING], &expected, BUFFERED_AUDIO_NOT_WAITING, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    dispatcher_wake(buffered_audio->drain_source);
+  }
+}
+
+void buffered_audio_release(const BufferedAudio *buffered_audio, int32_t ticks) {
+  if (buffered_audio->fields == NULL) {
+    return;
+  }
+
+  int32_t buffered = __atomic_sub_fetch(&buffered_audio->fields[BUFFERED_AUDIO_TICKS], ticks, __ATOMIC_SEQ_CST);
+
+  // This is called for every packet, so keep the common case to plain loads
+  if (buffered <= buffered_audio->low_water_mark &&
+      __atomic_load_n(&buffered_audio->fields[BUFFERED_AUDIO_DRAIN_WAITING], __ATOMIC_SEQ_CST) == BUFFERED_AUDIO_WAITING_FOR_LOW_WATER_MARK) {
+    notify_drain(buffered_audio, BUFFERED_AUDIO_WAITING_FOR_LOW_WATER_MARK);
+  }
+}
+
+void buffered_audio_notify_queue_room(const BufferedAudio *buffered_audio) {
+  if (buffered_audio->fields == NULL) {
+    return;
+  }
+
+  if (__atomic_load_n(&buffered_audio->fields[BUFFERED_AUDIO_DRAIN_WAITING], __ATOMIC_SEQ_CST) == BUFFERED_AUDIO_WAITING_FOR_QUEUE) {
+    notify_drain(buffered_audio, BUFFERED_AUDIO_WAITING_FOR_QUEUE);
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "node_dispatcher.h"
+
+// Tracks how much audio has been written by JavaScript but not yet sent on the
+// network. The counter lives in a SharedArrayBuffer so that JavaScript can read
+// it and add to it without calling into the native module. The encoder and
+// producer threads subtract from it as audio leaves the pipeline.
+//
+// The layout must match the bufferedAudio array in src/index.ts:
+//
+//   int32 fields[4]
+#define BUFFERED_AUDIO_SIZE 16
+
+// Durations are counted in 48kHz ticks, the same units as the Opus RTP
+// timestamps, so that every supported input sample rate divides evenly.
+#define BUFFERED_AUDIO_TICKS_PER_MS 48
+
+enum BufferedAudioField {
+  BUFFERED_AUDIO_TICKS = 0,
+
+  // Set by JavaScript to one of the values below when a write was refused.
+  // Cleared by whichever thread sends the drain notification.
+  BUFFERED_AUDIO_DRAIN_WAITING = 1,
+};
+
+enum BufferedAudioDrainWaiting {
+  BUFFERED_AUDIO_NOT_WAITING = 0,
+
+  // The write would have gone above the high water mark. The producer thread
+  // calls onDrain once enough audio has been sent.
+  BUFFERED_AUDIO_WAITING_FOR_LOW_WATER_MARK = 1,
+
+  // The encoder's message queue or PCM ring was full. The encoder thread calls
+  // onDrain once it has made room.
+  BUFFERED_AUDIO_WAITING_FOR_QUEUE = 2,
+};
+
+struct BufferedAudio {
+  int32_t *fields;
+
+  // Ticks of buffered audio at which a writer waiting for the low water mark
+  // is notified.
+  int32_t low_water_mark;
+
+  DispatchSource *drain_source;
+};
+
+// Returns 0, or AVERROR(EINVAL) if byte_length is too small.
+int buffered_audio_init(BufferedAudio *buffered_audio, void *data, size_t byte_length, int32_t low_water_mark_ms);
+
+int32_t buffered_audio_load(const BufferedAudio *buffered_audio);
+
+void buffered_audio_add(const BufferedAudio *buffered_audio, int32_t ticks);
+
+// Subtracts audio that has left the pipeline, and notifies a waiting writer if
+// it crossed the low water mark.
+void buffered_audio_release(const BufferedAudio *buffered_audio, int32_t ticks);
+
+// Called by the encoder when it has made room in its queue. Notifies a writer
+// that is waiting for the queue.
+void buffered_audio_notify_queue_room(const BufferedAudio *buffered_audio);
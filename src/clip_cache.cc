@@ -0,0 +1,384 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/mem.h>
+#include <opus/opus.h>
+}
+
+#include "clip_cache.h"
+#include "audio_level.h"
+#include "node_errors.h"
+#include "ogg_parser.h"
+
+#define CHANNELS 2
+// 20ms frame at 48kHz
+#define FRAME_SIZE_OUTPUT 960
+#define MAX_OPUS_FRAME_SIZE 1275
+// Max 20ms frame at 48kHz input
+#define MAX_FRAME_SIZE_INPUT 960
+
+struct ClipLoad {
+  napi_async_work work;
+  napi_deferred deferred;
+  ClipLoadParams params;
+
+  // Set by execute_load()
+  AVBufferRef *clip;
+  int ret;
+};
+
+static void free_clip(void *opaque, uint8_t *data) {
+  Clip *clip = (Clip *)data;
+  for (int32_t i = 0; i < clip->count; i++) {
+    av_buffer_unref(&clip->packets[i].buf);
+  }
+  av_free(clip->packets);
+  av_free(clip);
+}
+
+static void unmap_file(void *opaque, uint8_t *data) {
+  munmap(data, (size_t)opaque);
+}
+
+// The pages of an Ogg file are read straight out of the mapping, so it stays
+// mapped for as long as the clip is loaded.
+static int map_file(const char *path, AVBufferRef **buf) {
+  struct stat st;
+  void *ptr = MAP_FAILED;
+  int ret = 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return AVERROR(errno);
+  }
+
+  if (fstat(fd, &st) < 0) {
+    ret = AVERROR(errno);
+    goto cleanup;
+  }
+
+  if (st.st_size == 0) {
+    ret = AVERROR_INVALIDDATA;
+    goto cleanup;
+  }
+
+  ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (ptr == MAP_FAILED) {
+    ret = AVERROR(errno);
+    goto cleanup;
+  }
+
+  *buf = av_buffer_create((uint8_t *)ptr, st.st_size, unmap_file, (void *)(size_t)st.st_size, AV_BUFFER_FLAG_READONLY);
+  if (*buf == NULL) {
+    munmap(ptr, st.st_size);
+    ret = AVERROR(ENOMEM);
+  }
+
+cleanup:
+  close(fd);
+  return ret;
+}
+
+// Takes ownership of *buf and sets it to NULL
+static int append_packet(Clip *clip, unsigned int *capacity, AVBufferRef **buf, const uint8_t *data, int32_t size, int32_t duration, int32_t audio_level) {
+  ClipPacket *packets = (ClipPacket *)av_fast_realloc(clip->packets, capacity, (clip->count + 1) * sizeof(ClipPacket));
+  if (packets == NULL) {
+    av_buffer_unref(buf);
+    return AVERROR(ENOMEM);
+  }
+  clip->packets = packets;
+
+  ClipPacket *packet = &packets[clip->count++];
+  packet->buf = *buf;
+  packet->data = data;
+  packet->size = size;
+  packet->duration = duration;
+  packet->audio_level = audio_level;
+  *buf = NULL;
+
+  clip->duration += duration;
+  return 0;
+}
+
+// The whole file is fed to the parser as one chunk, so the packets point into
+// it, except for the few that were spread over two pages.
+static int load_ogg(AVBufferRef **data, Clip *clip) {
+  unsigned int capacity = 0;
+  int ret = 0;
+
+  OggParser *parser = ogg_parser_alloc();
+  AVPacket *pkt = av_packet_alloc();
+  if (parser == NULL || pkt == NULL) {
+    ret = AVERROR(ENOMEM);
+    goto cleanup;
+  }
+
+  ogg_parser_feed(parser, data);
+
+  while ((ret = ogg_parser_read(parser, pkt)) != AVERROR(EAGAIN)) {
+    if (ret < 0) {
+      goto cleanup;
+    }
+    if (ret == OGG_PARSER_NEW_STREAM) {
+      continue;
+    }
+
+    // A packet can be trimmed away entirely by the end of the stream
+    if (pkt->duration > 0) {
+      ret = append_packet(clip, &capacity, &pkt->buf, pkt->data, pkt->size, (int32_t)pkt->duration, -1);
+      if (ret < 0) {
+        goto cleanup;
+      }
+    }
+    av_packet_unref(pkt);
+  }
+
+  ret = clip->count > 0 ? 0 : AVERROR_INVALIDDATA;
+
+cleanup:
+  av_packet_free(&pkt);
+  ogg_parser_free(&parser);
+  return ret;
+}
+
+// Encodes mono PCM the same way as the encoder thread, into one buffer that
+// all of the packets share. The last frame is padded with silence.
+static int load_pcm(const AVBufferRef *data, const ClipLoadParams *params, Clip *clip) {
+  const int frame_size = params->sampleRate / 50;
+  const size_t sample_count = data->size / sizeof(int16_t);
+  const size_t frame_count = frame_size > 0 ? (sample_count + frame_size - 1) / frame_size : 0;
+
+  int16_t mono[MAX_FRAME_SIZE_INPUT];
+  int16_t stereo[MAX_FRAME_SIZE_INPUT * CHANNELS];
+  unsigned int capacity = 0;
+  size_t used = 0;
+  int opus_err;
+  int ret = 0;
+
+  OpusEncoder *encoder = NULL;
+  AVBufferRef *payload = NULL;
+  int32_t *sizes = NULL;
+  int32_t *levels = NULL;
+
+  if (frame_count == 0 || frame_size > MAX_FRAME_SIZE_INPUT) {
+    return AVERROR(EINVAL);
+  }
+
+  encoder = opus_encoder_create(params->sampleRate, CHANNELS, OPUS_APPLICATION_VOIP, &opus_err);
+  if (opus_err != OPUS_OK) {
+    fprintf(stderr, "clip_cache: failed to create opus encoder: %s\n", opus_strerror(opus_err));
+    return ff_opus_error_to_averror(opus_err);
+  }
+  opus_encoder_ctl(encoder, OPUS_SET_BITRATE(params->bitrate > 0 ? params->bitrate : 32000));
+
+  // Shrunk to fit once everything has been encoded
+  payload = av_buffer_alloc(frame_count * MAX_OPUS_FRAME_SIZE + AV_INPUT_BUFFER_PADDING_SIZE);
+  sizes = (int32_t *)av_malloc_array(frame_count, sizeof(int32_t));
+  levels = (int32_t *)av_malloc_array(frame_count, sizeof(int32_t));
+  if (payload == NULL || sizes == NULL || levels == NULL) {
+    ret = AVERROR(ENOMEM);
+    goto cleanup;
+  }
+
+  for (size_t i = 0; i < frame_count; i++) {
+    size_t offset = i * frame_size;
+    size_t count = FFMIN((size_t)frame_size, sample_count - offset);
+
+    memcpy(mono, data->data + offset * sizeof(int16_t), count * sizeof(int16_t));
+    memset(mono + count, 0, (frame_size - count) * sizeof(int16_t));
+
+    for (int j = 0; j < frame_size; j++) {
+      stereo[j * 2] = mono[j];
+      stereo[j * 2 + 1] = mono[j];
+    }
+
+    int encoded_len = opus_encode(encoder, stereo, frame_size, payload->data + used, MAX_OPUS_FRAME_SIZE);
+    if (encoded_len < 0) {
+      fprintf(stderr, "clip_cache: opus_encode error: %s\n", opus_strerror(encoded_len));
+      ret = ff_opus_error_to_averror(encoded_len);
+      goto cleanup;
+    }
+
+    sizes[i] = encoded_len;
+    levels[i] = compute_audio_level(mono, frame_size);
+    used += encoded_len;
+  }
+
+  ret = av_buffer_realloc(&payload, used + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (ret < 0) {
+    goto cleanup;
+  }
+  memset(payload->data + used, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+  used = 0;
+  for (size_t i = 0; i < frame_count; i++) {
+    AVBufferRef *buf = av_buffer_ref(payload);
+    if (buf == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto cleanup;
+    }
+
+    ret = append_packet(clip, &capacity, &buf, payload->data + used, sizes[i], FRAME_SIZE_OUTPUT, levels[i]);
+    if (ret < 0) {
+      goto cleanup;
+    }
+    used += sizes[i];
+  }
+
+cleanup:
+  opus_encoder_destroy(encoder);
+  av_buffer_unref(&payload);
+  av_free(sizes);
+  av_free(levels);
+  return ret;
+}
+
+// Runs on the libuv thread pool, so it mustn't call into napi
+static void execute_load(napi_env env, void *data) {
+  ClipLoad *load = (ClipLoad *)data;
+  ClipLoadParams *params = &load->params;
+  int ret = 0;
+
+  Clip *clip = (Clip *)av_mallocz(sizeof(Clip));
+  if (clip == NULL) {
+    load->ret = AVERROR(ENOMEM);
+    return;
+  }
+
+  load->clip = av_buffer_create((uint8_t *)clip, sizeof(Clip), free_clip, NULL, AV_BUFFER_FLAG_READONLY);
+  if (load->clip == NULL) {
+    av_free(clip);
+    load->ret = AVERROR(ENOMEM);
+    return;
+  }
+
+  if (params->path != NULL) {
+    ret = map_file(params->path, &params->data);
+    if (ret < 0) {
+      fprintf(stderr, "clip_cache: failed to map %s: %s\n", params->path, av_err2str(ret));
+      goto cleanup;
+    }
+  }
+
+  if (params->format == CLIP_FORMAT_OGG) {
+    ret = load_ogg(&params->data, clip);
+  } else {
+    ret = load_pcm(params->data, params, clip);
+  }
+
+cleanup:
+  // PCM is no longer needed once it's encoded
+  av_buffer_unref(&params->data);
+
+  if (ret < 0) {
+    av_buffer_unref(&load->clip);
+  }
+  load->ret = ret;
+}
+
+static void finalize_clip(napi_env env, void *data, void *hint) {
+  AVBufferRef *clip = (AVBufferRef *)data;
+  av_buffer_unref(&clip);
+}
+
+// Takes ownership of *clip and sets it to NULL
+static napi_status create_clip_result(napi_env env, AVBufferRef **clip, napi_value *result) {
+  const Clip *loaded = clip_from_buffer(*clip);
+  napi_value value;
+  napi_status status;
+
+  status = napi_create_object(env, result);
+  if (status != napi_ok) return status;
+
+  status = napi_create_int64(env, loaded->duration, &value);
+  if (status != napi_ok) return status;
+  status = napi_set_named_property(env, *result, "durationSamples", value);
+  if (status != napi_ok) return status;
+
+  status = napi_create_int32(env, loaded->count, &value);
+  if (status != napi_ok) return status;
+  status = napi_set_named_property(env, *result, "packetCount", value);
+  if (status != napi_ok) return status;
+
+  status = napi_create_external(env, *clip, finalize_clip, NULL, &value);
+  if (status != napi_ok) return status;
+  *clip = NULL;
+
+  return napi_set_named_property(env, *result, "clip", value);
+}
+
+static void complete_load(napi_env env, napi_status status, void *data) {
+  ClipLoad *load = (ClipLoad *)data;
+  napi_value result = NULL;
+
+  napi_handle_scope scope;
+  status = napi_open_handle_scope(env, &scope);
+  if (status != napi_ok) {
+    fprintf(stderr, "napi_open_handle_scope is fail status [%d]", status);
+    goto cleanup;
+  }
+
+  if (load->ret >= 0) {
+    status = create_clip_result(env, &load->clip, &result);
+  }
+
+  if (load->ret >= 0 && status == napi_ok) {
+    napi_resolve_deferred(env, load->deferred, result);
+  } else {
+    napi_value error;
+    create_ffmpeg_error(env, load->ret < 0 ? load->ret : AVERROR(ENOMEM), &error);
+    napi_reject_deferred(env, load->deferred, error);
+  }
+
+  napi_close_handle_scope(env, scope);
+
+cleanup:
+  napi_delete_async_work(env, load->work);
+  av_buffer_unref(&load->clip);
+  av_free(load->params.path);
+  av_free(load);
+}
+
+napi_status load_clip(napi_env env, ClipLoadParams *params, napi_value *promise) {
+  napi_value resource_name;
+  napi_status status;
+
+  ClipLoad *load = (ClipLoad *)av_mallocz(sizeof(ClipLoad));
+  if (load == NULL) {
+    av_freep(&params->path);
+    av_buffer_unref(&params->data);
+    return napi_generic_failure;
+  }
+  load->params = *params;
+  params->path = NULL;
+  params->data = NULL;
+
+  status = napi_create_string_utf8(env, "loadClip", NAPI_AUTO_LENGTH, &resource_name);
+  if (status != napi_ok) goto fail;
+
+  status = napi_create_async_work(env, NULL, resource_name, execute_load, complete_load, load, &load->work);
+  if (status != napi_ok) goto fail;
+
+  status = napi_create_promise(env, &load->deferred, promise);
+  if (status != napi_ok) goto fail_work;
+
+  status = napi_queue_async_work(env, load->work);
+  if (status != napi_ok) goto fail_work;
+
+  return napi_ok;
+
+fail_work:
+  napi_delete_async_work(env, load->work);
+fail:
+  av_free(load->params.path);
+  av_buffer_unref(&load->params.data);
+  av_free(load);
+  return status;
+}
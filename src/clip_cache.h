@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <node_api.h>
+
+extern "C" {
+#include <libavutil/buffer.h>
+}
+
+// Clips of Opus, such as greetings or hold music, that are loaded once and then
+// played by any number of producers without being encoded again. A loaded clip
+// never changes, so the encoder threads share it without locking. Each packet
+// that is sent holds a reference to the clip's data, which is freed once the
+// clip has been unloaded and the last of its packets has been sent.
+struct ClipPacket {
+  // Points into data, which is the Ogg file itself unless the packet was
+  // spread over more than one page
+  AVBufferRef *buf;
+  const uint8_t *data;
+  int32_t size;
+
+  // At 48kHz
+  int32_t duration;
+
+  // In -dBov, or -1 if it isn't known, as for clips that were loaded from Ogg
+  int32_t audio_level;
+};
+
+struct Clip {
+  ClipPacket *packets;
+  int32_t count;
+
+  // At 48kHz
+  int64_t duration;
+};
+
+enum ClipFormat {
+  CLIP_FORMAT_OGG,
+
+  // Mono s16le, which is encoded with the same settings as produceRtp()
+  CLIP_FORMAT_PCM,
+};
+
+struct ClipLoadParams {
+  // Either a file to memory-map, or the data itself
+  char *path;
+  AVBufferRef *data;
+
+  ClipFormat format;
+
+  // Only for CLIP_FORMAT_PCM
+  int32_t sampleRate;
+  int32_t bitrate;
+};
+
+// Loads a clip on the libuv thread pool, taking ownership of params->path and
+// params->data. The promise resolves to { clip, durationSamples, packetCount },
+// where clip is an external that holds the AVBufferRef of the Clip.
+napi_status load_clip(napi_env env, ClipLoadParams *params, napi_value *promise);
+
+static inline const Clip *clip_from_buffer(const AVBufferRef *buf) {
+  return (const Clip *)buf->data;
+}
+
+// Layout of the buffer in a POST_CLIP message. Freeing the buffer releases
+// the reference to the clip.
+struct ClipPlayback {
+  AVBufferRef *clip;
+
+  // Same as OpusPacketsHeader::ring_write_index
+  int32_t ring_write_index;
+};
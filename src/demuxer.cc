@@ -13,6 +13,8 @@ extern "C" {
 
 #include "demuxer.h"
 #include "thread_messages.h"
+#include "ogg_parser.h"
+#include "packet_pool.h"
 #include "util.h"
 #include "thread_with_promise_result.h"
 
@@ -28,12 +30,20 @@ struct DemuxerThreadData {
   // Only valid for DEMUXER_MODE_FILE
   AVThreadMessageQueue *input_message_queue;
 
+  // Audio is added to this as it's posted to the producer, which releases it
+  // again as it's sent. fields is NULL if nothing is counted.
+  BufferedAudio buffered_audio;
+
   // Only valid for DEMUXER_MODE_RTP
   int should_tick;
   int64_t last_tick;
   int64_t tick_duration;
   char *sdpBase64;
-  int should_reset;
+
+  // Pass packets on even if they are out of order, for a jitter buffer
+  // downstream to reorder. FFmpeg's own reordering queue is disabled too, since
+  // it holds back every packet after a loss.
+  bool allow_reordering;
 };
 
 int stop_rtp_demuxer(DemuxerThreadData *thread_data) {
@@ -82,27 +92,6 @@ int interrupt_callback(void *opaque) {
 }
 
 
-// Take from ffmpeg oggparseopus.c. For more information, see https://www.rfc-editor.org/rfc/rfc6716#section-3
-static int opus_duration(uint8_t *src, int size)
-{
-    unsigned nb_frames  = 1;
-    unsigned toc        = src[0];
-    unsigned toc_config = toc >> 3;
-    unsigned toc_count  = toc & 3;
-    unsigned frame_size = toc_config < 12 ? FFMAX(480, 960 * (toc_config & 3)) :
-                          toc_config < 16 ? 480 << (toc_config & 1) :
-                                            120 << (toc_config & 3);
-    if (toc_count == 3) {
-        if (size<2)
-            return AVERROR_INVALIDDATA;
-        nb_frames = src[1] & 0x3F;
-    } else if (toc_count) {
-        nb_frames = 2;
-    }
-
-    return frame_size * nb_frames;
-}
-
 #define MAX_WARNING_COUNT 10
 
 int readAndWritePacket(DemuxerThreadData *thread_data, AVFormatContext *ifmt_ctx, int stream_idx, int64_t *pts_offset) {
@@ -117,14 +106,20 @@ int readAndWritePacket(DemuxerThreadData *thread_data, AVFormatContext *ifmt_ctx
 
   int64_t pts_correction = AV_NOPTS_VALUE;
 
-  AVPacket *pkt = av_packet_alloc();
-  if (pkt == NULL) {
-    ret = AVERROR(ENOMEM);
-    goto cleanup;
-  }
+  // Each packet that is posted moves to the decoder, so a new one is taken
+  // from the pool after that.
+  AVPacket *pkt = NULL;
 
   while (1) {
-    av_packet_unref(pkt);
+    if (pkt == NULL) {
+      pkt = packet_pool_get();
+      if (pkt == NULL) {
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+      }
+    } else {
+      av_packet_unref(pkt);
+    }
     ret = av_read_frame(ifmt_ctx, pkt);
 
     if (thread_data->should_tick) {
@@ -141,11 +136,6 @@ int readAndWritePacket(DemuxerThreadData *thread_data, AVFormatContext *ifmt_ctx
       goto cleanup;
     }
 
-    if (thread_data->should_reset) {
-      ret = 0;
-      goto cleanup;
-    }
-
     if (ret < 0) {
       if (ret == AVERROR_EXIT) {
         continue;
@@ -177,7 +167,7 @@ int readAndWritePacket(DemuxerThreadData *thread_data, AVFormatContext *ifmt_ctx
     // The RTP demuxer doesn't assign a duration to the packets, but the OGG muxer needs this to
     // pack ogg pages properly.
     if (pkt->duration == 0 && pkt->data != NULL) {
-      int found_duration = opus_duration(pkt->data, pkt->size);
+      int found_duration = opus_packet_duration(pkt->data, pkt->size);
       if (found_duration < 0) {
         // Malformed packet
         continue;
@@ -191,7 +181,9 @@ int readAndWritePacket(DemuxerThreadData *thread_data, AVFormatContext *ifmt_ctx
 
     // Sometimes packets come out of the demuxer out of order. This is rare, only 3 or 4 times a day in production.
     // We should drop these packets though, because the downstream muxer will choke on out of order packets.
-    if (prev_pts != AV_NOPTS_VALUE && pkt->pts < prev_pts) {
+    // A jitter buffer downstream puts them back in order instead.
+    bool out_of_order = prev_pts != AV_NOPTS_VALUE && pkt->pts < prev_pts;
+    if (out_of_order && !thread_data->allow_reordering) {
       if (warning_count < MAX_WARNING_COUNT) {
         warning_count++;
         fprintf(
@@ -208,7 +200,9 @@ int readAndWritePacket(DemuxerThreadData *thread_data, AVFormatContext *ifmt_ctx
 
       continue;
     }
-    prev_pts = pkt->pts;
+    if (!out_of_order) {
+      prev_pts = pkt->pts;
+    }
 
     // I'm pretty sure this never happens, because the rtp demuxer only calculates a pts, and then copies it to dts.
     if (pkt->pts != pkt->dts) {
@@ -235,14 +229,17 @@ int readAndWritePacket(DemuxerThreadData *thread_data, AVFormatContext *ifmt_ctx
     //fprintf(stderr, "XXX: adding pts_offset: %lld + %lld = %lld\n", pkt->pts, *pts_offset, pkt->pts + *pts_offset);
     pkt->pts += *pts_offset;
     pkt->dts += *pts_offset;
-    next_expected_pts = pkt->pts + pkt->duration;
+    if (!out_of_order) {
+      next_expected_pts = pkt->pts + pkt->duration;
+    }
 
-    // When demuxing from an file stream, we want to to block so that we can put back-pressure
-    // on the source. For RTP streams, we should just drop the packet if this happens.
-    // The message queue should be large enough that this never happens.
-    int flags = thread_data->mode == DEMUXER_MODE_RTP ? AV_THREAD_MESSAGE_NONBLOCK : 0;
+    // The decoder reports when each packet arrived. Nothing else uses opaque
+    // on the receive path, so the monotonic time is stashed there.
+    pkt->opaque = (void *)(intptr_t)av_gettime_relative();
 
-    ret = post_packet_to_thread(thread_data->output_message_queue, pkt, flags);
+    // For RTP streams, we should just drop the packet if the queue is full.
+    // The message queue should be large enough that this never happens.
+    ret = post_packet_to_thread(thread_data->output_message_queue, &pkt, AV_THREAD_MESSAGE_NONBLOCK);
 
     if (ret < 0) {
       if (ret == AVERROR(EAGAIN)) {
@@ -254,7 +251,7 @@ int readAndWritePacket(DemuxerThreadData *thread_data, AVFormatContext *ifmt_ctx
   }
 
 cleanup:
-  av_packet_free(&pkt);
+  packet_pool_release(&pkt);
 
   if ((ret == 0 || ret == AVERROR_EOF) && next_expected_pts != AV_NOPTS_VALUE) {
     //fprintf(stderr, "XXX: Adjusting pts_offset by [%d], +%lld (%lld -> %lld)\n", ret, next_expected_pts, *pts_offset, *pts_offset + next_expected_pts);
@@ -272,123 +269,14 @@ int post_file_buffer(DemuxerThreadData *thread_data, AVBufferRef *buffer_ref) {
   return ret;
 }
 
-static int read_packet(void *opaque, uint8_t *buf, int buf_size) {
-  DemuxerThreadData *thread_data = (DemuxerThreadData *)opaque;
-
-  ThreadMessage thread_message;
-
-  int ret;
-
-  //
-  // Read from the message queue
-  //
-  while (true) {
-    ret = av_thread_message_queue_recv(thread_data->input_message_queue, &thread_message, 0);
-    if (ret < 0) {
-      return ret;
-    }
-
-    // If the demuxer is already in the process of initializing, we should skip over any reset requests.
-    // Returning an empty buffer might cause the av_open_input() to return AVERROR_EOF.
-    if (thread_message.type == OGG_RESET_DEMUXER && thread_data->should_reset) {
-      thread_message_free_func(&thread_message);
-      continue;
-    }
-
-    break;
-  }
-
-  //
-  // Handle the message
-  //
-  if (thread_message.type == OGG_BUFFER) {
-    if (buf_size < 0 || thread_message.param.buf->size > (size_t)buf_size) {
-      fprintf(
-        stderr,
-        "read_packet called with insufficient buffer_size %d. Need at least %ld.\n",
-        buf_size,
-        thread_message.param.buf->size
-      );
-
-      ret = AVERROR_INVALIDDATA;
-    } else {
-      memcpy(buf, thread_message.param.buf->data, thread_message.param.buf->size);
-
-      ret = thread_message.param.buf->size;
-    }
-  } else if (thread_message.type == OGG_RESET_DEMUXER) {
-    thread_data->should_reset = true;
-    ret = 0;
-  } else {
-    fprintf(stderr, "Received unexpected message type %d\n", thread_message.type);
-    ret = AVERROR_INVALIDDATA;
-  }
-
-  thread_message_free_func(&thread_message);
-  return ret;
-}
-
-int openInputForFile(DemuxerThreadData *thread_data, AVFormatContext **ifmt_ctx) {
-  const AVInputFormat *input_format = av_find_input_format("ogg");
-  if (!input_format) {
-    avformat_free_context(*ifmt_ctx);
-    *ifmt_ctx = NULL;
-    fprintf(stderr, "Could not find Ogg demuxer.\n");
-    return AVERROR_DEMUXER_NOT_FOUND;
-  }
-
-  int ret;
-
-  // This buffer isn't used for anything, but it's required by the avio api
-  // It will be cleaned up by avio_close(), which is called by avformat_close_input()
-  const int MIN_BUFFER_SIZE = 1024 * 8;
-  unsigned char *avio_buffer = (unsigned char *)av_malloc(MIN_BUFFER_SIZE);
-  if (!avio_buffer) {
-    avformat_free_context(*ifmt_ctx);
-    *ifmt_ctx = NULL;
-    return AVERROR(ENOMEM);
-  }
-
-  AVIOContext *avio_ctx = avio_alloc_context(
-    avio_buffer,
-    MIN_BUFFER_SIZE,
-    0, // buffer is not writable
-    thread_data,
-    read_packet,
-    NULL, // write_packet
-    NULL // seek
-  );
-
-  if (!avio_ctx) {
-    av_freep(&avio_buffer);
-    avformat_free_context(*ifmt_ctx);
-    *ifmt_ctx = NULL;
-    fprintf(stderr, "Could not allocate AVIOContext.\n");
-    return AVERROR(ENOMEM);
-  }
-
-  (*ifmt_ctx)->pb = avio_ctx;
-  (*ifmt_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
-
-  ret = avformat_open_input(ifmt_ctx, NULL, input_format, NULL);
-  if (ret < 0) {
-    // If there is an error, the ifmt_ctx is cleaned up but not the avio_ctx.
-    av_freep(&avio_ctx->buffer);
-    av_freep(&avio_ctx);
-
-    if (ret != AVERROR_EOF) {
-      fprintf(stderr, "avformat_open_input fail error [%d] %s\n", ret, av_err2str(ret));
-    }
-  }
-
-  return ret;
-}
-
 int openInputForRtp(DemuxerThreadData *thread_data, AVFormatContext **ifmt_ctx) {
   int ret = 0;
 
   AVDictionary *options = NULL;
   ret = av_dict_set(&options, "listen_timeout", "-1", 0);
+  if (ret >= 0 && thread_data->allow_reordering) {
+    ret = av_dict_set(&options, "reorder_queue_size", "0", 0);
+  }
   if (ret < 0) {
     avformat_free_context(*ifmt_ctx);
     *ifmt_ctx = NULL;
@@ -428,12 +316,7 @@ int initInputFormatContext(DemuxerThreadData *thread_data, int *stream_idx, AVFo
   }
   (**ifmt_ctx).interrupt_callback.opaque = thread_data;
 
-  if (thread_data->mode == DEMUXER_MODE_RTP) {
-    ret = openInputForRtp(thread_data, ifmt_ctx);
-  } else {
-    ret = openInputForFile(thread_data, ifmt_ctx);
-  }
-
+  ret = openInputForRtp(thread_data, ifmt_ctx);
   if (ret < 0) {
     return ret;
   }
@@ -454,23 +337,6 @@ int initInputFormatContext(DemuxerThreadData *thread_data, int *stream_idx, AVFo
   return 0;
 }
 
-void custom_io_close_input(AVFormatContext **ifmt_ctx) {
-  if (ifmt_ctx != NULL && *ifmt_ctx != NULL) {
-    // The "File" version of the demuxer uses a custom IOContext.
-    if ((*ifmt_ctx)->flags & AVFMT_FLAG_CUSTOM_IO) {
-      if ((*ifmt_ctx)->pb != NULL) {
-        av_freep(&((*ifmt_ctx)->pb->buffer));
-        av_freep(&((*ifmt_ctx)->pb));
-      } else {
-        fprintf(stderr, "WARNING: custom_io_close_input pb is NULL\n");
-      }
-    }
-
-    avformat_close_input(ifmt_ctx);
-  }
-}
-
-
 static int ThreadMain(DemuxerThreadData *thread_data) {
   set_thread_name("demuxer");
 
@@ -478,17 +344,12 @@ static int ThreadMain(DemuxerThreadData *thread_data) {
   int stream_idx = -1;
   int64_t pts_offset = 0;
 
-  // Setting this flag to true will cause the read_packet function to ignore any
-  // reset requests that are received while the demuxer is initializing.
-  thread_data->should_reset = true;
-
   AVFormatContext *ifmt_ctx = NULL;
 
   ret = initInputFormatContext(thread_data, &stream_idx, &ifmt_ctx);
   if (ret != 0) {
     goto cleanup;
   }
-  thread_data->should_reset = false;
 
   ret = post_codec_parameters_to_thread(
     thread_data->output_message_queue,
@@ -498,41 +359,126 @@ static int ThreadMain(DemuxerThreadData *thread_data) {
     goto cleanup;
   }
 
+  // receive AVpackets
+  ret = readAndWritePacket(thread_data, ifmt_ctx, stream_idx, &pts_offset);
+
+cleanup:
+
+  avformat_close_input(&ifmt_ctx);
+
+  av_thread_message_queue_set_err_recv(thread_data->output_message_queue, AVERROR_EOF);
+
+  //check_for_memory_leaks();
+
+  if (ret == AVERROR_EOF) {
+    return 0;
+  } else {
+    return ret;
+  }
+}
+
+// Ogg is parsed here rather than by avformat, so that each chunk is read in
+// place, and a reset only has to clear the parser's state instead of opening a
+// new demuxer.
+static int ThreadMainOgg(DemuxerThreadData *thread_data) {
+  set_thread_name("demuxer");
+
+  int ret = 0;
+  ThreadMessage thread_message;
+
+  // The timeline carries on from one stream to the next across resets
+  int64_t pts_offset = 0;
+  int64_t next_expected_pts = AV_NOPTS_VALUE;
+
+  // Each packet that is posted moves to the producer, so a new one is taken
+  // from the pool after that.
+  AVPacket *pkt = NULL;
+
+  AVCodecParameters *codecpar = avcodec_parameters_alloc();
+  OggParser *parser = ogg_parser_alloc();
+  if (codecpar == NULL || parser == NULL) {
+    ret = AVERROR(ENOMEM);
+    goto cleanup;
+  }
+
   while (true) {
-    if (thread_data->shutdown) {
-      break;
+    ret = av_thread_message_queue_recv(thread_data->input_message_queue, &thread_message, 0);
+    if (ret < 0) {
+      goto cleanup;
     }
 
-    // receive AVpackets
-    ret = readAndWritePacket(thread_data, ifmt_ctx, stream_idx, &pts_offset);
-    if (ret < 0) {
+    // A writer may be waiting for room in the queue
+    buffered_audio_notify_queue_room(&thread_data->buffered_audio);
+
+    if (thread_message.type == OGG_RESET_DEMUXER) {
+      thread_message_free_func(&thread_message);
+
+      if (next_expected_pts != AV_NOPTS_VALUE) {
+        pts_offset = next_expected_pts;
+      }
+      ogg_parser_reset(parser);
+      continue;
+    }
+
+    if (thread_message.type != OGG_BUFFER) {
+      fprintf(stderr, "Received unexpected message type %d\n", thread_message.type);
+      thread_message_free_func(&thread_message);
+      ret = AVERROR_INVALIDDATA;
       goto cleanup;
     }
 
-    if (thread_data->should_reset) {
-      custom_io_close_input(&ifmt_ctx);
-      ret = initInputFormatContext(thread_data, &stream_idx, &ifmt_ctx);
-      if (ret != 0) {
+    ogg_parser_feed(parser, &thread_message.param.buf);
+    thread_message_free_func(&thread_message);
+
+    while (true) {
+      if (pkt == NULL) {
+        pkt = packet_pool_get();
+        if (pkt == NULL) {
+          ret = AVERROR(ENOMEM);
+          goto cleanup;
+        }
+      }
+
+      ret = ogg_parser_read(parser, pkt);
+      if (ret == AVERROR(EAGAIN)) {
+        break;
+      }
+      if (ret < 0) {
         goto cleanup;
       }
 
-      // Note, this flag should remain true for the duration of the initInputFormatContext so
-      // that it will ignore any reset requests that are received while the demuxer is initializing.
-      thread_data->should_reset = false;
-    }
-  }
+      if (ret == OGG_PARSER_NEW_STREAM) {
+        ret = ogg_parser_codec_parameters(parser, codecpar);
+        if (ret >= 0) {
+          ret = post_codec_parameters_to_thread(thread_data->output_message_queue, codecpar);
+        }
+        if (ret < 0) {
+          goto cleanup;
+        }
+        continue;
+      }
 
-cleanup:
+      pkt->pts += pts_offset;
+      pkt->dts += pts_offset;
+      next_expected_pts = pkt->pts + pkt->duration;
 
-  if (ifmt_ctx != NULL) {
-    custom_io_close_input(&ifmt_ctx);
-  }
+      // Counted before it's posted, so that the producer can't release it first
+      int32_t duration = (int32_t)pkt->duration;
+      buffered_audio_add(&thread_data->buffered_audio, duration);
 
-  if (thread_data->mode == DEMUXER_MODE_RTP) {
-    av_thread_message_queue_set_err_recv(thread_data->output_message_queue, AVERROR_EOF);
+      // Blocks while the queue is full, which puts back-pressure on the source
+      ret = post_packet_to_thread(thread_data->output_message_queue, &pkt, 0);
+      if (ret < 0) {
+        buffered_audio_release(&thread_data->buffered_audio, duration);
+        goto cleanup;
+      }
+    }
   }
 
-  //check_for_memory_leaks();
+cleanup:
+  packet_pool_release(&pkt);
+  ogg_parser_free(&parser);
+  avcodec_parameters_free(&codecpar);
 
   if (ret == AVERROR_EOF) {
     return 0;
@@ -541,10 +487,11 @@ cleanup:
   }
 }
 
-int ThreadMainFile(AVThreadMessageQueue *message_queue, uv_async_t *buffer_ready_async, uv_async_t *drain_async, const DemuxerThreadData &params) {
+int ThreadMainFile(AVThreadMessageQueue *message_queue, DispatchSource *buffer_ready_source, DispatchSource *drain_source, const DemuxerThreadData &params) {
   DemuxerThreadData params2(params);
   params2.input_message_queue = message_queue;
-  return ThreadMain(&params2);
+  params2.buffered_audio.drain_source = drain_source;
+  return ThreadMainOgg(&params2);
 }
 
 void *ThreadMainRtp(void *opaque) {
@@ -554,7 +501,7 @@ void *ThreadMainRtp(void *opaque) {
 }
 
 
-int start_rtp_demuxer(char *sdp_base_64, int64_t tick_duration, AVThreadMessageQueue *output_message_queue, DemuxerThreadData **thread_data) {
+int start_rtp_demuxer(char *sdp_base_64, int64_t tick_duration, bool allow_reordering, AVThreadMessageQueue *output_message_queue, DemuxerThreadData **thread_data) {
   int ret;
 
   pthread_attr_t attr;
@@ -580,8 +527,8 @@ int start_rtp_demuxer(char *sdp_base_64, int64_t tick_duration, AVThreadMessageQ
   (*thread_data)->mode = DEMUXER_MODE_RTP;
   (*thread_data)->shutdown = 0;
   (*thread_data)->should_tick = 0;
-  (*thread_data)->should_reset = 0;
   (*thread_data)->last_tick = av_gettime_relative();
+  (*thread_data)->allow_reordering = allow_reordering;
 
   ret = pthread_create(&(*thread_data)->thread, &attr, ThreadMainRtp, (void *)*thread_data);
   if (ret != 0) {
@@ -598,24 +545,46 @@ int start_rtp_demuxer(char *sdp_base_64, int64_t tick_duration, AVThreadMessageQ
 // I've noticed when testing with long TTS responses that the message queue would fill up and generate warnings.
 #define FILE_DEMUXER_MESSAGE_QUEUE_SIZE 2048
 
-napi_status start_file_demuxer(napi_env env, napi_value js_output_message_queue, napi_value abort_signal, napi_value *external, napi_value *promise) {
+napi_status start_file_demuxer(
+    napi_env env,
+    napi_value js_output_message_queue,
+    napi_value abort_signal,
+    const BufferedAudio &buffered_audio,
+    napi_value js_options,
+    napi_value on_drain_callback,
+    napi_value *external,
+    napi_value *promise) {
   AVThreadMessageQueue *output_message_queue;
   napi_status status = napi_get_value_external(env, js_output_message_queue, (void **)&output_message_queue);
   if (status != napi_ok) {
     return status;
   }
 
-  DemuxerThreadData thread_data;
+  // Holds on to the producer's queue, and to the options, which own the
+  // bufferedAudio array
+  napi_value js_input;
+  status = napi_create_array_with_length(env, 2, &js_input);
+  if (status != napi_ok) {
+    return status;
+  }
+
+  status = napi_set_element(env, js_input, 0, js_output_message_queue);
+  if (status != napi_ok) {
+    return status;
+  }
+
+  if (js_options != NULL) {
+    status = napi_set_element(env, js_input, 1, js_options);
+    if (status != napi_ok) {
+      return status;
+    }
+  }
+
+  DemuxerThreadData thread_data = {};
   thread_data.output_message_queue = output_message_queue;
+  thread_data.buffered_audio = buffered_audio;
   thread_data.mode = DEMUXER_MODE_FILE;
 
-  // Unused in file demuxer
-  thread_data.sdpBase64 = NULL;
-  thread_data.shutdown = 0;
-  thread_data.should_tick = 0;
-  thread_data.should_reset = 0;
-  thread_data.last_tick = av_gettime_relative();
-
   size_t stack_size = get_stack_size_for_thread("DEMUXER");
 
   return start_thread_with_promise_result(
@@ -623,12 +592,12 @@ napi_status start_file_demuxer(napi_env env, napi_value js_output_message_queue,
     ThreadMainFile,
     thread_data,
     abort_signal,
-    js_output_message_queue,
+    js_input,
     stack_size,
     FILE_DEMUXER_MESSAGE_QUEUE_SIZE,
     external,
     NULL,
-    NULL,
+    on_drain_callback,
     promise
   );
 }
@@ -2,6 +2,8 @@
 
 #include <node_api.h>
 
+#include "buffered_audio.h"
+
 extern "C" {
 #include <libavutil/threadmessage.h>
 #include <libavformat/avformat.h>
@@ -9,7 +11,19 @@ extern "C" {
 
 struct DemuxerThreadData;
 
-int start_rtp_demuxer(char *sdp_base_64, int64_t tick_duration, AVThreadMessageQueue *output_message_queue, DemuxerThreadData **thread_data);
-napi_status start_file_demuxer(napi_env env, napi_value js_output_message_queue, napi_value abort_signal, napi_value *external, napi_value *promise);
+int start_rtp_demuxer(char *sdp_base_64, int64_t tick_duration, bool allow_reordering, AVThreadMessageQueue *output_message_queue, DemuxerThreadData **thread_data);
+// Demuxes Ogg Opus that is posted in chunks of any size, and passes the packets
+// to js_output_message_queue. buffered_audio.fields can be NULL, and
+// on_drain_callback and js_options can be NULL.
+napi_status start_file_demuxer(
+  napi_env env,
+  napi_value js_output_message_queue,
+  napi_value abort_signal,
+  const BufferedAudio &buffered_audio,
+  napi_value js_options,
+  napi_value on_drain_callback,
+  napi_value *external,
+  napi_value *promise
+);
 int post_file_buffer(DemuxerThreadData *thread_data, AVBufferRef *buffer_ref);
 int stop_rtp_demuxer(DemuxerThreadData *output_message_queue);
\ No newline at end of file
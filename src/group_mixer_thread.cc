@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <string.h>
+#include <node_api.h>
+
+#include "audio_level.h"
+#include "buffer_ready_node_callback.h"
+#include "group_mixer_thread.h"
+#include "mixer.h"
+#include "thread_messages.h"
+#include "thread_with_promise_result.h"
+#include "util.h"
+
+extern "C" {
+  #include "libavutil/time.h"
+  #include <libavutil/audio_fifo.h>
+  #include <libavutil/common.h>
+  #include <libavutil/mem.h>
+}
+
+// The pts of the mixed frames are at 48kHz, like those from consumeRtp()
+#define OUTPUT_SAMPLE_RATE 48000
+#define FRAME_DURATION_MS 20
+#define FRAME_DURATION (FRAME_DURATION_MS * 1000)
+
+// Max 20ms frame at 192kHz
+#define MAX_FRAME_SIZE 3840
+
+// Each decoder runs on a clock of its own, so a frame or two can build up
+// before the mixer takes them. Beyond this, the oldest audio is dropped so
+// that a source can't fall further and further behind the others.
+#define MAX_BACKLOG_FRAMES 5
+
+// If the thread falls this far behind its clock, e.g. because the machine was
+// suspended, it starts again from now instead of catching up
+#define MAX_CLOCK_LAG (200 * 1000)
+
+struct GroupMixerSource {
+  const PcmOutputRing *ring;
+  int32_t *fields;
+
+  // Audio taken from the ring, which doesn't have to come in 20ms frames
+  AVAudioFifo *fifo;
+
+  // Value of GROUP_MIXER_SOURCE_GENERATION when the ring was last emptied
+  int32_t generation;
+
+  // The source's part of the current frame
+  int16_t *frame;
+  int level;
+};
+
+struct GroupMixerState {
+  GroupMixerSource sources[GROUP_MIXER_MAX_SOURCES];
+  int count;
+  int frame_size;
+  int loudest;
+
+  DispatchSource *callback;
+  AVBufferPool *pool;
+  int64_t pts;
+
+  int32_t mix[MAX_FRAME_SIZE];
+  int16_t frames[GROUP_MIXER_MAX_SOURCES][MAX_FRAME_SIZE];
+};
+
+static inline int32_t load_field(const GroupMixerSource *source, GroupMixerSourceField field) {
+  return __atomic_load_n(&source->fields[field], __ATOMIC_SEQ_CST);
+}
+
+static inline void store_field(const GroupMixerSource *source, GroupMixerSourceField field, int32_t value) {
+  __atomic_store_n(&source->fields[field], value, __ATOMIC_SEQ_CST);
+}
+
+// Moves every frame that is waiting in the ring into the fifo. When the ring
+// has been given to another decoder, the audio of the previous one is dropped.
+static void take_from_ring(GroupMixerState *state, GroupMixerSource *source) {
+  int32_t generation = load_field(source, GROUP_MIXER_SOURCE_GENERATION);
+  bool stale = generation != source->generation;
+  if (stale) {
+    source->generation = generation;
+    av_audio_fifo_reset(source->fifo);
+  }
+
+  const int16_t *samples;
+  uint32_t count;
+  while (pcm_output_ring_peek(source->ring, &samples, &count)) {
+    if (!stale && count > 0 && av_audio_fifo_write(source->fifo, (void **)&samples, count) < 0) {
+      fprintf(stderr, "group_mixer_thread: out of memory for %u samples\n", count);
+    }
+    pcm_output_ring_consume(source->ring);
+  }
+
+  int excess = av_audio_fifo_size(source->fifo) - MAX_BACKLOG_FRAMES * state->frame_size;
+  if (excess > 0) {
+    av_audio_fifo_drain(source->fifo, excess);
+  }
+}
+
+// Adds samples * gain to the mix. 32 sources at the highest gain can't
+// overflow the accumulator.
+static void accumulate(int32_t *mix, const int16_t *samples, int count, int32_t gain) {
+  for (int i = 0; i < count; i++) {
+    mix[i] += (samples[i] * gain) >> MIXER_GAIN_SHIFT;
+  }
+}
+
+// Mixes the next frame of every source. Returns false, without sending
+// anything, if none of them had any audio.
+static bool mix_frame(GroupMixerState *state) {
+  const int frame_size = state->frame_size;
+  int order[GROUP_MIXER_MAX_SOURCES];
+  int audible = 0;
+  bool any_audio = false;
+
+  for (int i = 0; i < state->count; i++) {
+    GroupMixerSource *source = &state->sources[i];
+    take_from_ring(state, source);
+
+    void *frame = source->frame;
+    int count = av_audio_fifo_read(source->fifo, &frame, frame_size);
+    if (count < 0) {
+      count = 0;
+    }
+    memset(source->frame + count, 0, (frame_size - count) * sizeof(int16_t));
+
+    source->level = count > 0 ? compute_audio_level(source->frame, frame_size) : AUDIO_LEVEL_SILENCE;
+    store_field(source, GROUP_MIXER_SOURCE_LEVEL, source->level);
+    store_field(source, GROUP_MIXER_SOURCE_MIXED, 0);
+
+    any_audio = any_audio || count > 0;
+    if (source->level < AUDIO_LEVEL_SILENCE) {
+      order[audible++] = i;
+    }
+  }
+
+  if (!any_audio) {
+    return false;
+  }
+
+  // Loudest first, i.e. the lowest level in -dBov. There are few enough
+  // sources for an insertion sort.
+  for (int i = 1; i < audible; i++) {
+    int index = order[i];
+    int j = i;
+    for (; j > 0 && state->sources[order[j - 1]].level > state->sources[index].level; j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = index;
+  }
+
+  int mixed = state->loudest > 0 && state->loudest < audible ? state->loudest : audible;
+
+  memset(state->mix, 0, frame_size * sizeof(int32_t));
+  for (int i = 0; i < mixed; i++) {
+    GroupMixerSource *source = &state->sources[order[i]];
+    int32_t gain = FFMIN(FFMAX(load_field(source, GROUP_MIXER_SOURCE_GAIN), 0), MIXER_MAX_GAIN);
+    accumulate(state->mix, source->frame, frame_size, gain);
+
+    store_field(source, GROUP_MIXER_SOURCE_MIXED, 1);
+    __atomic_add_fetch(&source->fields[GROUP_MIXER_SOURCE_MIXED_FRAMES], 1, __ATOMIC_SEQ_CST);
+  }
+
+  AVBufferRef *buf = av_buffer_pool_get(state->pool);
+  if (buf == NULL) {
+    fprintf(stderr, "group_mixer_thread: failed to allocate frame\n");
+    return false;
+  }
+
+  int16_t *output = (int16_t *)buf->data;
+  for (int i = 0; i < frame_size; i++) {
+    output[i] = (int16_t)FFMIN(FFMAX(state->mix[i], INT16_MIN), INT16_MAX);
+  }
+
+  AudioBuffer audio_buffer;
+  audio_buffer.type = AUDIO_BUFFER_DATA;
+  audio_buffer.buf = buf;
+  audio_buffer.len = frame_size * sizeof(int16_t);
+  audio_buffer.pts = state->pts;
+  audio_buffer.duration_ms = 0;
+  audio_buffer.sender_time = AV_NOPTS_VALUE;
+  audio_buffer.received_at = AV_NOPTS_VALUE;
+  audio_buffer.sink = -1;
+
+  // The callback takes ownership of the buffer even if it fails. The queue
+  // only fills up if the event loop is blocked.
+  send_callback_for_many(state->callback, &audio_buffer);
+  return true;
+}
+
+static int ThreadMain(AVThreadMessageQueue *message_queue, DispatchSource *buffer_ready_source, DispatchSource *drain_source, const GroupMixerThreadParams &params) {
+  int ret = 0;
+  ThreadMessage thread_message;
+  int64_t next_tick;
+
+  set_thread_name("group_mixer_thread");
+
+  GroupMixerState *state = (GroupMixerState *)av_mallocz(sizeof(GroupMixerState));
+  if (state == NULL) {
+    ret = AVERROR(ENOMEM);
+    goto cleanup;
+  }
+
+  state->frame_size = params.sampleRate * FRAME_DURATION_MS / 1000;
+  state->loudest = params.loudest;
+  state->callback = buffer_ready_source;
+
+  state->pool = av_buffer_pool_init(state->frame_size * sizeof(int16_t), NULL);
+  if (state->pool == NULL) {
+    ret = AVERROR(ENOMEM);
+    goto cleanup;
+  }
+
+  for (int i = 0; i < params.sourceCount; i++) {
+    GroupMixerSource *source = &state->sources[i];
+    source->ring = &params.rings[i];
+    source->fields = params.sources + i * (GROUP_MIXER_SOURCE_SIZE / sizeof(int32_t));
+    source->generation = load_field(source, GROUP_MIXER_SOURCE_GENERATION);
+    source->frame = state->frames[i];
+    state->count++;
+
+    source->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_S16, 1, state->frame_size * MAX_BACKLOG_FRAMES);
+    if (source->fifo == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto cleanup;
+    }
+  }
+
+  next_tick = av_gettime_relative() + FRAME_DURATION;
+
+  while (true) {
+    ret = av_thread_message_queue_recv(message_queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK);
+    if (ret == AVERROR(EAGAIN)) {
+      int64_t now = av_gettime_relative();
+      if (now < next_tick) {
+        av_usleep(next_tick - now);
+        continue;
+      }
+
+      if (now - next_tick > MAX_CLOCK_LAG) {
+        int64_t skipped = (now - next_tick) / FRAME_DURATION;
+        state->pts += skipped * OUTPUT_SAMPLE_RATE * FRAME_DURATION_MS / 1000;
+        next_tick += skipped * FRAME_DURATION;
+      }
+
+      mix_frame(state);
+      state->pts += OUTPUT_SAMPLE_RATE * FRAME_DURATION_MS / 1000;
+      next_tick += FRAME_DURATION;
+      continue;
+    }
+
+    if (ret < 0) {
+      // This error is expected when shutting down
+      if (ret == AVERROR_EOF) {
+        ret = 0;
+      }
+      break;
+    }
+
+    // Nothing is posted to the mixer, except to end it
+    thread_message_free_func(&thread_message);
+  }
+
+cleanup:
+  if (buffer_ready_source != NULL) {
+    finish_callback_for_many(buffer_ready_source);
+  }
+
+  if (state != NULL) {
+    for (int i = 0; i < state->count; i++) {
+      av_audio_fifo_free(state->sources[i].fifo);
+    }
+
+    // Frames still held by JavaScript keep the pool alive until they come back
+    av_buffer_pool_uninit(&state->pool);
+    av_free(state);
+  }
+
+  return ret;
+}
+
+napi_status start_group_mixer_thread(napi_env env, const GroupMixerThreadParams &params, napi_value abort_signal, napi_value on_audio_callback, napi_value options, napi_value *external, napi_value *promise) {
+  size_t stack_size = get_stack_size_for_thread("MIXER");
+
+  return start_thread_with_promise_result<GroupMixerThreadParams>(env, ThreadMain, params, abort_signal, options, stack_size, DEFAULT_MESSAGE_QUEUE_SIZE, external, on_audio_callback, NULL, promise);
+}
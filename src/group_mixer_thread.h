@@ -0,0 +1,62 @@
+#pragma once
+
+#include <node_api.h>
+
+#include "pcm_output_ring.h"
+
+// Mixes the decoded audio of many RTP streams, e.g. the participants of a
+// conference, into one PCM stream. Each participant has a decoder thread with
+// clocked output that writes into one of the mixer's rings. The mixer takes a
+// frame from every ring on its own 20ms clock, and sends a single mixed frame
+// to JavaScript.
+#define GROUP_MIXER_MAX_SOURCES 32
+
+// Every source has 8 fields in an Int32Array over a SharedArrayBuffer. The
+// layout must match consumeRtpGroup() in src/index.ts:
+//
+//   int32 sources[source_count][8]
+#define GROUP_MIXER_SOURCE_SIZE 32
+
+enum GroupMixerSourceField {
+  // Gain in 1/MIXER_GAIN_ONE steps. Written by JavaScript.
+  GROUP_MIXER_SOURCE_GAIN = 0,
+
+  // Incremented by JavaScript when the ring is handed to another decoder, so
+  // that the mixer drops what is left of the previous one's audio
+  GROUP_MIXER_SOURCE_GENERATION = 1,
+
+  // Level of the source's last frame in -dBov, from 0 to AUDIO_LEVEL_SILENCE.
+  // Written by the mixer.
+  GROUP_MIXER_SOURCE_LEVEL = 2,
+
+  // Non-zero if the last frame was mixed in, i.e. the source wasn't silent
+  // and was among the loudest. Written by the mixer.
+  GROUP_MIXER_SOURCE_MIXED = 3,
+
+  // Frames of the source that have been mixed in. Written by the mixer.
+  GROUP_MIXER_SOURCE_MIXED_FRAMES = 4,
+};
+
+struct GroupMixerThreadParams {
+  // Output sample rate, which is also the rate of the rings
+  int32_t sampleRate;
+
+  // Only the loudest sources are mixed into each frame. 0 mixes all of them.
+  int32_t loudest;
+
+  PcmOutputRing rings[GROUP_MIXER_MAX_SOURCES];
+  int32_t sourceCount;
+
+  // Laid out as described above
+  int32_t *sources;
+};
+
+napi_status start_group_mixer_thread(
+  napi_env env,
+  const GroupMixerThreadParams &params,
+  napi_value abort_signal,
+  napi_value on_audio_callback,
+  napi_value options,               // Kept alive while the thread runs, since it references the rings
+  napi_value *external,
+  napi_value *promise
+);
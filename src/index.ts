@@ -6,6 +6,10 @@ import { randomBytes, getRandomValues } from "crypto";
 // https://github.com/versatica/mediasoup/blob/v3/node/src/rtpParametersTypes.ts
 import { RtpParameters } from "./rtpParametersTypes";
 
+// RFC 6464 audio level header extension. mediasoup uses this for active speaker
+// detection, and to drop silent streams without decoding them.
+const AUDIO_LEVEL_URI = "urn:ietf:params:rtp-hdrext:ssrc-audio-level";
+
 export type SrtpParameters = {
   cryptoSuite: string;
   keyBase64: string;
@@ -22,15 +26,40 @@ type ProduceOptions = {
 
   onError?: (error: Error) => void;
 
-  // Called when the encoder's message queue has room after write() returned false.
-  // Use this to implement backpressure: stop writing when write() returns false,
-  // resume when onDrain fires.
+  // Called once there is room again after write() returned false. Use this to
+  // implement backpressure: stop writing when write() returns false, resume
+  // when onDrain fires.
   onDrain?: () => void;
 
   // Depth of the encoder's message queue. When the queue is full, write() returns
   // false. Smaller values surface backpressure sooner. Defaults to 8192.
   queueDepth?: number;
 
+  // Limits how much audio can be buffered ahead of the network, in milliseconds.
+  // write() returns false if the data would take the buffered audio above
+  // highWaterMarkMs, and onDrain is called when it falls to lowWaterMarkMs.
+  // lowWaterMarkMs defaults to half of highWaterMarkMs. By default, there is no
+  // limit other than queueDepth.
+  highWaterMarkMs?: number;
+  lowWaterMarkMs?: number;
+
+  // When set, write() and writev() copy PCM into a ring buffer that is shared
+  // with the encoder thread, instead of posting a message for each chunk. This
+  // is the size of the ring in milliseconds, rounded up to a power of two
+  // samples. write() returns false when the ring is full, and onDrain is called
+  // once half of it is free again. queueDepth doesn't apply in this mode.
+  ringBufferMs?: number;
+
+  // When more than thresholdMs of audio is buffered, the encoder speeds up the
+  // speech by `rate` without changing its pitch, until the buffered audio is
+  // back down to targetMs. targetMs defaults to half of thresholdMs, and rate
+  // defaults to 1.15 and can be at most 2.
+  catchUp?: {
+    thresholdMs: number;
+    targetMs?: number;
+    rate?: number;
+  };
+
   // Use this to enable encryption. This is the result of the createSrtpParameters function.
   srtpParameters?: SrtpParameters;
 
@@ -42,6 +71,47 @@ type ProduceOptions = {
     enableFec?: boolean;
     packetLossPercent?: number;
   };
+
+  // Extra PCM inputs, such as background music under text-to-speech, that are
+  // mixed into the audio on the encoder thread. Write to them with
+  // input(name). At most 8.
+  inputs?: Record<string, MixerInputOptions>;
+};
+
+export type MixerInputOptions = {
+  // Sample rate of the mono s16le PCM written to this input. Unlike the main
+  // input, any rate is allowed, and it's resampled before it's mixed.
+  sampleRate: number;
+
+  // Volume of the input, from 0 to 8. Defaults to 1.
+  gain?: number;
+
+  // Same as for the main input, but for this input alone. bufferedMs() counts
+  // the audio that the mixer hasn't taken yet.
+  onDrain?: () => void;
+  highWaterMarkMs?: number;
+  lowWaterMarkMs?: number;
+
+  // Depth of the input's message queue. Defaults to 1024.
+  queueDepth?: number;
+};
+
+type MixerInput = {
+  // Queues up PCM data to be mixed in. Returns false like write() does.
+  write: (data: Buffer) => boolean;
+  writev: (buffers: Buffer[]) => boolean;
+
+  // Takes effect from the next frame, e.g. to duck music while speech plays
+  setGain: (gain: number) => void;
+
+  // While paused, the input is left out of the mix and its audio stays queued
+  pause: () => void;
+  resume: () => void;
+
+  // Discards the audio that hasn't been mixed yet
+  clear: () => void;
+
+  bufferedMs: () => number;
 };
 
 type ProduceReturn = {
@@ -50,10 +120,43 @@ type ProduceReturn = {
   // for the onDrain callback and retry.
   write: (data: Buffer) => boolean;
 
+  // Same as write(), but queues several chunks with a single call into the
+  // native module. Either all of the chunks are accepted, or none of them are.
+  writev: (buffers: Buffer[]) => boolean;
+
+  // Queues a packet that is already Opus encoded, such as a cached prompt. It
+  // is sent as it is, in order with the PCM written before and after it.
+  // durationSamples is at 48kHz, and defaults to the duration given by the
+  // packet's TOC byte. Returns false like write() does.
+  writeOpus: (packet: Buffer, durationSamples?: number) => boolean;
+
+  // Same as writeOpus(), but queues several packets with a single call into
+  // the native module.
+  writevOpus: (packets: Buffer[], durationSamples?: number[]) => boolean;
+
+  // Queues a clip from loadClip(), in order with the PCM written before and
+  // after it. The clip's packets are shared, so nothing is encoded or copied.
+  // Throws if no clip was loaded with this id. Returns false like write() does.
+  playClip: (id: string) => boolean;
+
+  // Milliseconds of audio that have been written but not sent on the network
+  // yet. This is a single atomic load, so it's cheap to call often.
+  bufferedMs: () => number;
+
+  // Returns one of the inputs that were given in options.inputs. Throws if
+  // there is no input with this name.
+  input: (name: string) => MixerInput;
+
   // Signal the end of a contiguous audio segment. Flushes any partial frame
   // and resets timing so the next write() starts a fresh segment.
   endSegment: () => void;
 
+  // Immediately discards all audio that hasn't been sent yet, including the
+  // PCM waiting to be encoded and the packets waiting in the producer queue.
+  // Use this for barge-in. Anything written after this starts a new segment.
+  // The inputs are left alone, so use clear() on them as well if needed.
+  interrupt: () => void;
+
   // Called when you are done sending data. The thread will shutdown when it's
   // finished sending any queued data.
   end: () => void;
@@ -69,31 +172,702 @@ type ProduceReturn = {
   setPacketLossPercent: (percent: number) => void;
 };
 
+export type AudioData = {
+  buffer: Buffer;
+  pts: number | null;
+
+  // When the sender captured the first sample, in milliseconds since the Unix
+  // epoch on the sender's clock. Mapped from the pts with the RTCP sender
+  // reports, and null until the first one arrives.
+  senderTime: number | null;
+
+  // When the packet holding the first sample arrived, in milliseconds on the
+  // monotonic clock that process.hrtime() uses. null for audio that was
+  // concealed or filled in rather than received.
+  receivedAt: number | null;
+};
+
+// A gap in the timestamps that was too long to conceal. "silence" is a pause
+// by the sender, e.g. DTX or the time between segments, and pts is where it
+// starts. "discontinuity" is a jump in the timeline, and pts is the first
+// timestamp on the new one. durationMs is how far the timestamps moved, which
+// is negative if they went backwards.
+type AudioGap = {
+  type: "silence" | "discontinuity";
+  pts: number;
+  durationMs: number;
+};
+
+// Speech found by voice activity detection. For "speechStart", pts is the
+// frame in which speech was detected, and any pre-roll follows the event. For
+// "speechEnd", it's the first frame after the hangover.
+type SpeechEvent = {
+  type: "speechStart" | "speechEnd";
+  pts: number;
+};
+
+// An extra decoded output of consumeRtp(). Every sink is fed from the same
+// Opus decoder as the main output, so it only costs the conversion to its own
+// rate, channels and format. The options mean the same as for consumeRtp().
+export type SinkOptions = {
+  sampleRate: number;
+  channels?: 1 | 2;
+  sampleFormat?: "s16" | "f32";
+  chunkMs?: number;
+  onAudioData: (data: AudioData) => void;
+};
+
+// Sends the received Opus on to another destination without decoding it,
+// with the SSRC and payload type of rtpParameters, and encrypted with
+// srtpParameters if they are given.
+export type RelayOptions = {
+  ipAddress: string;
+  rtpPort: number;
+  rtpParameters: RtpParameters;
+  srtpParameters?: SrtpParameters;
+};
+
 type ConsumeOptions = {
   sdp: string;
-  onAudioData: (data: { buffer: Buffer; pts: number | null }) => void;
+
+  // Called with each chunk of decoded audio. One of this, onAudioBatch,
+  // stream, outputRingMs, sinks or relays must be given.
+  onAudioData?: (data: AudioData) => void;
+
+  // Called once per wakeup of the event loop with every chunk that is ready.
+  // This saves a call into JavaScript per chunk.
+  onAudioBatch?: (data: AudioData[]) => void;
+
+  // Delivers the audio through a ReadableStream, returned as stream, instead of
+  // a callback. Read it with for await, and the buffer only fills up when the
+  // reader falls behind.
+  stream?: AudioStreamOptions;
+
+  // Called, in order with the audio, for each gap that wasn't concealed.
+  // Requires onAudioData, onAudioBatch or stream.
+  onGap?: (gap: AudioGap) => void;
+
+  // Called, in order with the audio, when speech starts and ends. Turns on
+  // voiceActivity with its default settings unless it's given. Requires
+  // onAudioData, onAudioBatch or stream.
+  onSpeech?: (event: SpeechEvent) => void;
+
   onError?: (error: Error) => void;
 
-  // Sample rate that the audio data will be decoded to.
-  // Must be one of 8000, 12000, 16000, 24000, 48000
+  // Sample rate that the audio data will be decoded to. Opus decodes to 8000,
+  // 12000, 16000, 24000 and 48000 directly. Other rates, e.g. 22050 or 44100,
+  // are resampled from 48000 on the decoder thread.
   sampleRate: number;
 
+  // Number of interleaved channels to decode to. Defaults to 1.
+  channels?: 1 | 2;
+
+  // "s16" for 16-bit signed integer samples (the default), or "f32" for 32-bit
+  // float samples.
+  sampleFormat?: "s16" | "f32";
+
+  // Joins decoded frames into chunks of this many milliseconds, e.g. 100, or 32
+  // for 512 samples at 16kHz. A chunk that is interrupted by a gap in the
+  // timestamps is sent early. By default, each 20ms frame is sent separately.
+  chunkMs?: number;
+
+  // Sends a partially filled chunk once its first sample has waited this long,
+  // so audio isn't held back when the stream pauses. By default, chunks are
+  // only sent when they are full.
+  maxLatencyMs?: number;
+
+  // Gaps up to this long are treated as packet loss, and filled in with PLC and
+  // FEC. Longer gaps are silence if the timestamps kept pace with the wall
+  // clock, and discontinuities otherwise. Defaults to 100.
+  maxConcealMs?: number;
+
+  // Fill silences with zeros. By default nothing is sent for them, and the
+  // next chunk's pts shows how long they were.
+  fillSilence?: boolean;
+
+  // Holds packets for a playout delay so that ones which arrive late or out
+  // of order can still be decoded, instead of being concealed. The delay
+  // adapts to the measured jitter, between minDelayMs (default 20) and
+  // maxDelayMs (default 200, at most 1000). Off by default.
+  jitterBuffer?: { minDelayMs?: number; maxDelayMs?: number };
+
+  // Emits exactly one frame per frame duration on a local clock, filling in
+  // with PLC or silence when no packet is due, so the audio arrives at a
+  // steady cadence even while the sender pauses. pts then counts continuously
+  // on the output timeline. Uses the jitter buffer, with its default settings
+  // unless jitterBuffer is given.
+  clockedOutput?: boolean;
+
+  // Detects speech on the decoder thread. A frame is active when it's
+  // thresholdDb (default 12) above the background noise, and speech ends once
+  // no frame has been for hangoverMs (default 300). With gate, audio is only
+  // passed to onAudioData or onAudioBatch during speech, starting with up to
+  // preRollMs (default 200, at most 1000) from before it was detected. Frames
+  // in the output ring are flagged with PCM_FRAME_SPEECH instead of gated.
+  voiceActivity?: {
+    thresholdDb?: number;
+    hangoverMs?: number;
+    gate?: boolean;
+    preRollMs?: number;
+  };
+
+  // When set, decoded frames are written into a SharedArrayBuffer ring of this
+  // many milliseconds, which is returned as outputRing. Read it with
+  // PcmRingReader, on this thread or in a worker. Frames are dropped if the
+  // reader falls behind. onAudioData is optional in this mode, and chunkMs is
+  // ignored. Only "s16" samples are supported.
+  outputRingMs?: number;
+
+  // Extra decoded outputs, e.g. 16kHz for speech recognition next to 48kHz
+  // for recording, which share the main output's decoder. They get every
+  // frame, without gap or speech events, and voiceActivity doesn't gate
+  // them. At most 8.
+  sinks?: SinkOptions[];
+
+  // Forwards the received packets to other destinations as they arrive,
+  // without decoding them. Packets that arrive out of order are left out. At
+  // most 8.
+  relays?: RelayOptions[];
+
   signal: AbortSignal;
 };
 
+type AudioStreamOptions = {
+  // How much audio the stream holds for a reader that falls behind. Defaults
+  // to 1000.
+  bufferMs?: number;
+
+  // What happens to audio that arrives while the buffer is full:
+  // - "dropOldest" (the default) discards the oldest chunks to make room, so
+  //   the reader skips ahead to recent audio.
+  // - "dropNewest" discards the chunk that arrived, so the reader hears
+  //   everything up to the point it fell behind.
+  // - "coalesce" joins everything that is buffered into one chunk of the most
+  //   recent bufferMs, so the reader catches up in a single read. Its pts is
+  //   that of its first sample, and gaps between the joined chunks are lost.
+  overflow?: "dropOldest" | "dropNewest" | "coalesce";
+};
+
 type ConsumeReturn = {
   done: () => Promise<void>;
+
+  // Set if stream was given. It closes after the last chunk once the
+  // consumer is done, or errors if the consumer fails. Cancelling it stops
+  // the consumer like aborting the signal does, and done() resolves.
+  stream?: ReadableStream<AudioData>;
+
+  // How much audio was lost on its way to JavaScript, and why
+  deliveryStats: () => DeliveryStats;
+
+  // Set if outputRingMs was given. Pass this to a PcmRingReader.
+  outputRing?: SharedArrayBuffer;
+
+  // Returns a buffer that was passed to onAudioData or onAudioBatch to the
+  // decoder's pool right away, instead of when it's garbage collected. The
+  // buffer is empty afterwards, so don't keep any references to it.
+  release: (buffer: Buffer) => void;
+
+  // Current playout delay of the jitter buffer, and how many packets it put
+  // back in order or dropped for arriving too late. Zeros if jitterBuffer
+  // wasn't given.
+  jitterStats: () => JitterStats;
+
+  // Stops decoding, without closing the socket. Packets are still received, so
+  // the sender is followed, but none are decoded or delivered. Takes effect
+  // with the next packet, and any partial chunk is sent first.
+  pause: () => void;
+
+  // Decoding starts again with the next packet. The first audio after a pause
+  // is preceded by a "discontinuity" gap, and flagged PCM_FRAME_DISCONTINUITY
+  // in the output ring.
+  resume: () => void;
 };
 
-export function produceRtp(options: ProduceOptions): ProduceReturn {
-  const { rtpParameters, srtpParameters, signal } = options;
+type DeliveryStats = {
+  // Chunks the decoder thread dropped because the event loop was blocked for
+  // too long to take them
+  droppedChunks: number;
+
+  // Audio waiting in the stream's buffer, and how many chunks the overflow
+  // policy dropped or joined. Zero if stream wasn't given.
+  bufferedMs: number;
+  overflowedChunks: number;
+};
+
+type JitterStats = {
+  delayMs: number;
+  latePackets: number;
+  reorderedPackets: number;
+};
+
+// Must match the layout in src/pcm_ring_buffer.h
+const PCM_RING_HEADER_SIZE = 32;
+const PCM_RING_WRITE_INDEX = 0;
+const PCM_RING_READ_INDEX = 1;
+const PCM_RING_CONSUMER_WAITING = 2;
+const PCM_RING_DISCARD = 3;
+
+// Must match the layout in src/buffered_audio.h
+const BUFFERED_AUDIO_SIZE = 16;
+const BUFFERED_AUDIO_TICKS = 0;
+const BUFFERED_AUDIO_DRAIN_WAITING = 1;
+const BUFFERED_AUDIO_NOT_WAITING = 0;
+const BUFFERED_AUDIO_WAITING_FOR_LOW_WATER_MARK = 1;
+const BUFFERED_AUDIO_WAITING_FOR_QUEUE = 2;
+const BUFFERED_AUDIO_TICKS_PER_MS = 48;
+
+// Must match the layout in src/mixer.h
+const MIXER_MAX_INPUTS = 8;
+const MIXER_INPUT_SIZE = 32;
+const MIXER_INPUT_GAIN = 2;
+const MIXER_INPUT_PAUSED = 3;
+const MIXER_INPUT_CLEAR_COUNT = 4;
+const MIXER_GAIN_ONE = 4096;
+const MIXER_MAX_GAIN = 8;
+
+// Must match the layout in src/jitter_buffer.h
+const JITTER_BUFFER_STATS_SIZE = 16;
+const JITTER_BUFFER_DELAY_MS = 0;
+const JITTER_BUFFER_LATE_PACKETS = 1;
+const JITTER_BUFFER_REORDERED_PACKETS = 2;
+
+// Must match the layout in src/audio_decode_thread.h
+const DECODER_CONTROL_SIZE = 16;
+const DECODER_CONTROL_PAUSED = 0;
+const DECODER_CONTROL_DROPPED_CHUNKS = 1;
+
+// Must match the layout in src/pcm_output_ring.h
+const PCM_OUTPUT_RING_HEADER_SIZE = 64;
+const PCM_OUTPUT_RING_FRAME_SIZE = 16;
+const PCM_OUTPUT_RING_WRITE_INDEX = 0;
+const PCM_OUTPUT_RING_READ_INDEX = 1;
+const PCM_OUTPUT_RING_SAMPLE_READ_INDEX = 3;
+const PCM_OUTPUT_RING_READER_WAITING = 4;
+const PCM_OUTPUT_RING_DROPPED_FRAMES = 5;
+const PCM_OUTPUT_RING_ENDED = 6;
+const PCM_OUTPUT_RING_FRAME_CAPACITY = 7;
+const PCM_OUTPUT_RING_SAMPLE_CAPACITY = 8;
+
+// Flags of a PcmFrame
+export const PCM_FRAME_PLC = 1; // Packet loss concealment
+export const PCM_FRAME_FEC = 2; // Recovered from forward error correction
+export const PCM_FRAME_DISCONTINUITY = 4; // First frame after a timeline jump
+export const PCM_FRAME_SILENCE = 8; // Zeros from fillSilence
+export const PCM_FRAME_SPEECH = 16; // Voice activity detection found speech
+
+function nextPowerOfTwo(value: number, minimum: number): number {
+  let result = minimum;
+  while (result < value) {
+    result *= 2;
+  }
+  return result;
+}
+
+function createPcmOutputRing(
+  sampleRate: number,
+  durationMs: number,
+): SharedArrayBuffer {
+  const sampleCapacity = nextPowerOfTwo(
+    Math.ceil((sampleRate * durationMs) / 1000),
+    1024,
+  );
+  // Opus frames are at least 2.5ms long
+  const frameCapacity = nextPowerOfTwo(Math.ceil(durationMs / 2.5), 16);
+
+  const sab = new SharedArrayBuffer(
+    PCM_OUTPUT_RING_HEADER_SIZE +
+      frameCapacity * (PCM_OUTPUT_RING_FRAME_SIZE + 8) +
+      sampleCapacity * 2,
+  );
+  const header = new Int32Array(sab, 0, PCM_OUTPUT_RING_HEADER_SIZE / 4);
+  header[PCM_OUTPUT_RING_FRAME_CAPACITY] = frameCapacity;
+  header[PCM_OUTPUT_RING_SAMPLE_CAPACITY] = sampleCapacity;
+
+  return sab;
+}
+
+export type PcmFrame = {
+  // A view into the ring. It's only valid until the next call to read().
+  samples: Int16Array;
+  pts: number | null;
+  flags: number;
+};
+
+// Reading side of the ring that consumeRtp() decodes into when outputRingMs is
+// set. The SharedArrayBuffer can be posted to a worker thread, which creates
+// its own reader. There must only be one reader per ring.
+export class PcmRingReader {
+  private readonly header: Int32Array;
+  private readonly frames: Int32Array;
+  private readonly pts: Float64Array;
+  private readonly samples: Int16Array;
+  private readonly frameCapacity: number;
+  private readonly sampleCapacity: number;
+
+  // Index of the next frame to read, and the end of the samples of the frame
+  // that was last returned, until it's released.
+  private readIndex: number;
+  private lastFrameEnd: number | null = null;
+
+  constructor(ring: SharedArrayBuffer) {
+    this.header = new Int32Array(ring, 0, PCM_OUTPUT_RING_HEADER_SIZE / 4);
+    this.frameCapacity = this.header[PCM_OUTPUT_RING_FRAME_CAPACITY];
+    this.sampleCapacity = this.header[PCM_OUTPUT_RING_SAMPLE_CAPACITY];
+
+    const ptsOffset =
+      PCM_OUTPUT_RING_HEADER_SIZE +
+      this.frameCapacity * PCM_OUTPUT_RING_FRAME_SIZE;
+    const samplesOffset = ptsOffset + this.frameCapacity * 8;
+
+    this.frames = new Int32Array(
+      ring,
+      PCM_OUTPUT_RING_HEADER_SIZE,
+      (this.frameCapacity * PCM_OUTPUT_RING_FRAME_SIZE) / 4,
+    );
+    this.pts = new Float64Array(ring, ptsOffset, this.frameCapacity);
+    this.samples = new Int16Array(ring, samplesOffset, this.sampleCapacity);
+    this.readIndex = Atomics.load(this.header, PCM_OUTPUT_RING_READ_INDEX);
+  }
+
+  // Returns the next frame, or null if there isn't one yet. This hands the
+  // previous frame's space back to the decoder.
+  read(): PcmFrame | null {
+    this.releaseLastFrame();
+
+    if (!this.available()) {
+      return null;
+    }
+
+    const slot = this.readIndex & (this.frameCapacity - 1);
+    const start = this.frames[slot * 4];
+    const count = this.frames[slot * 4 + 1];
+    const flags = this.frames[slot * 4 + 2];
+    const pts = this.pts[slot];
+
+    this.lastFrameEnd = (start + count) | 0;
+
+    const offset = start & (this.sampleCapacity - 1);
+    return {
+      samples: this.samples.subarray(offset, offset + count),
+      pts: pts < 0 ? null : pts,
+      flags,
+    };
+  }
+
+  // Blocks until a frame can be read, the stream ends, or timeoutMs passes.
+  // Returns true if a frame can be read. Only worker threads can block.
+  wait(timeoutMs: number = Infinity): boolean {
+    if (this.available()) {
+      return true;
+    }
+
+    Atomics.store(this.header, PCM_OUTPUT_RING_READER_WAITING, 1);
+
+    // Check again, in case the decoder wrote before it could see the flag
+    if (!this.available() && !this.isEnded()) {
+      Atomics.wait(this.header, PCM_OUTPUT_RING_READER_WAITING, 1, timeoutMs);
+    }
+
+    Atomics.store(this.header, PCM_OUTPUT_RING_READER_WAITING, 0);
+
+    return this.available();
+  }
+
+  // True once the decoder has exited and every frame has been read
+  get ended(): boolean {
+    return this.isEnded() && !this.available();
+  }
+
+  // Number of frames that were dropped because the reader fell behind
+  get droppedFrames(): number {
+    return Atomics.load(this.header, PCM_OUTPUT_RING_DROPPED_FRAMES);
+  }
+
+  private available(): boolean {
+    // Skip the frame that was returned last but hasn't been released yet
+    const next =
+      this.lastFrameEnd === null ? this.readIndex : (this.readIndex + 1) | 0;
+    return Atomics.load(this.header, PCM_OUTPUT_RING_WRITE_INDEX) !== next;
+  }
+
+  private isEnded(): boolean {
+    return Atomics.load(this.header, PCM_OUTPUT_RING_ENDED) !== 0;
+  }
+
+  private releaseLastFrame() {
+    if (this.lastFrameEnd === null) {
+      return;
+    }
+
+    Atomics.store(
+      this.header,
+      PCM_OUTPUT_RING_SAMPLE_READ_INDEX,
+      this.lastFrameEnd,
+    );
+    this.readIndex = (this.readIndex + 1) | 0;
+    Atomics.store(this.header, PCM_OUTPUT_RING_READ_INDEX, this.readIndex);
+    this.lastFrameEnd = null;
+  }
+}
+
+// Writing side of the PCM ring that is shared with the encoder thread. Indexes
+// count samples and wrap around at 2^32.
+class PcmRingWriter {
+  // Passed to the native module. This covers the header and the samples.
+  readonly array: Int16Array;
+
+  private readonly header: Int32Array;
+  private readonly bytes: Uint8Array;
+  private readonly capacity: number;
+
+  constructor(minimumSamples: number) {
+    let capacity = 1024;
+    while (capacity < minimumSamples) {
+      capacity *= 2;
+    }
+
+    // A SharedArrayBuffer can't be detached or moved by the garbage collector,
+    // so the encoder thread can keep reading from it while JavaScript runs.
+    const sab = new SharedArrayBuffer(PCM_RING_HEADER_SIZE + capacity * 2);
+    this.array = new Int16Array(sab);
+    this.header = new Int32Array(sab, 0, PCM_RING_HEADER_SIZE / 4);
+    this.bytes = new Uint8Array(sab, PCM_RING_HEADER_SIZE);
+    this.capacity = capacity;
+  }
+
+  writeIndex(): number {
+    return Atomics.load(this.header, PCM_RING_WRITE_INDEX);
+  }
+
+  // Copies all of the buffers into the ring, or none of them if they don't fit.
+  write(buffers: Buffer[]): boolean {
+    let count = 0;
+    for (const buffer of buffers) {
+      count += buffer.byteLength >> 1;
+    }
+
+    if (count > this.capacity) {
+      throw new Error("PCM data is larger than the ring buffer");
+    }
+
+    if (count > this.free()) {
+      return false;
+    }
+
+    const writeIndex = this.writeIndex();
+    let offset = (writeIndex & (this.capacity - 1)) * 2;
+
+    for (const buffer of buffers) {
+      const length = buffer.byteLength & ~1;
+      const first = Math.min(length, this.bytes.byteLength - offset);
+
+      this.bytes.set(buffer.subarray(0, first), offset);
+      this.bytes.set(buffer.subarray(first, length), 0);
+
+      offset = (offset + length) % this.bytes.byteLength;
+    }
+
+    Atomics.store(this.header, PCM_RING_WRITE_INDEX, (writeIndex + count) | 0);
+
+    return true;
+  }
+
+  // Returns true if the encoder thread is blocked on its message queue and
+  // needs to be sent a wakeup message.
+  takeConsumerWaiting(): boolean {
+    return (
+      Atomics.compareExchange(this.header, PCM_RING_CONSUMER_WAITING, 1, 0) ===
+      1
+    );
+  }
+
+  // Tells the encoder to exit without encoding the rest of the ring
+  discard() {
+    Atomics.store(this.header, PCM_RING_DISCARD, 1);
+  }
+
+  private free(): number {
+    const used =
+      (this.writeIndex() - Atomics.load(this.header, PCM_RING_READ_INDEX)) >>>
+      0;
+    return this.capacity - used;
+  }
+}
+
+type ProduceOggOptions = {
+  ipAddress: string;
+  rtpParameters: RtpParameters;
+  rtpPort: number;
+  rtcpPort: number;
+
+  onError?: (error: Error) => void;
+
+  // Called once there is room again after write() returned false
+  onDrain?: () => void;
+
+  // Limits how much audio can be buffered ahead of the network, in
+  // milliseconds. The duration of the Ogg data isn't known until it has been
+  // demuxed, so write() returns false once the buffered audio is already above
+  // highWaterMarkMs, and onDrain is called when it falls to lowWaterMarkMs.
+  // lowWaterMarkMs defaults to half of highWaterMarkMs. By default, there is no
+  // limit other than the demuxer's queue of 2048 chunks.
+  highWaterMarkMs?: number;
+  lowWaterMarkMs?: number;
+
+  // Use this to enable encryption. This is the result of the createSrtpParameters function.
+  srtpParameters?: SrtpParameters;
+
+  // If this signal is raised, the threads will shutdown immediately.
+  signal?: AbortSignal;
+};
+
+type ProduceOggReturn = {
+  // Queues up Ogg Opus data to be sent, in chunks of any size. Returns true if
+  // the data was accepted, false if it was dropped. When false is returned,
+  // wait for the onDrain callback and retry.
+  write: (data: Buffer) => boolean;
+
+  // Starts a new Ogg stream, for example the next response from a TTS vendor.
+  // Data written after this must begin with the Ogg headers. The RTP timeline
+  // continues from the previous stream.
+  reset: () => void;
+
+  // Milliseconds of demuxed audio that hasn't been sent on the network yet
+  bufferedMs: () => number;
+
+  // Called when you are done sending data. The threads will shutdown when
+  // they're finished sending any queued data.
+  end: () => void;
+
+  // Await this to wait until everything has been sent, or the signal was
+  // aborted, or an error was raised.
+  done: () => Promise<void>;
+};
+
+// An Opus packet holds at most 120ms
+const MAX_OPUS_PACKET_DURATION = 5760;
+
+// Returns the duration of an Opus packet at 48kHz, from its TOC byte. See
+// https://www.rfc-editor.org/rfc/rfc6716#section-3.1
+function opusPacketDuration(packet: Buffer): number {
+  if (packet.byteLength === 0) {
+    throw new Error("Opus packet is empty");
+  }
+
+  const toc = packet[0];
+  const config = toc >> 3;
+  const frameSize =
+    config < 12
+      ? Math.max(480, 960 * (config & 3))
+      : config < 16
+        ? 480 << (config & 1)
+        : 120 << (config & 3);
+
+  let frameCount;
+  switch (toc & 3) {
+    case 0:
+      frameCount = 1;
+      break;
+    case 1:
+    case 2:
+      frameCount = 2;
+      break;
+    default:
+      if (packet.byteLength < 2) {
+        throw new Error("Opus packet is missing its frame count");
+      }
+      frameCount = packet[1] & 0x3f;
+  }
+
+  const duration = frameSize * frameCount;
+  if (duration === 0 || duration > MAX_OPUS_PACKET_DURATION) {
+    throw new Error(`Opus packet has an invalid duration of ${duration}`);
+  }
+  return duration;
+}
+
+export type LoadClipOptions = {
+  // Sample rate of the PCM. The source is read as mono s16le PCM when this is
+  // given, like produceRtp() takes, and as Ogg Opus otherwise.
+  sampleRate?: number;
+
+  // Only for PCM. Defaults to the same bitrate as produceRtp().
+  opus?: {
+    bitrate?: number;
+  };
+};
+
+export type ClipInfo = {
+  id: string;
+  durationMs: number;
+  packetCount: number;
+};
+
+type LoadedClip = {
+  clip: unknown;
+  durationSamples: number;
+};
+
+const clips = new Map<string, LoadedClip>();
+
+// Loads a clip, such as a greeting or hold music, so that any producer can
+// play it with playClip() without encoding it again. source is either the
+// data, or the path of a file that is memory-mapped. Loading a clip with an id
+// that is already taken replaces it, but producers that are playing the old
+// clip finish it.
+export async function loadClip(
+  id: string,
+  source: Buffer | string,
+  options?: LoadClipOptions,
+): Promise<ClipInfo> {
+  const pcm = options?.sampleRate != null;
+  const loaded = await native.loadClip({
+    format: pcm ? "pcm" : "ogg",
+    path: typeof source === "string" ? source : null,
+    data: typeof source === "string" ? null : source,
+    sampleRate: options?.sampleRate ?? 0,
+    bitrate: options?.opus?.bitrate ?? 0,
+  });
+
+  clips.set(id, {
+    clip: loaded.clip,
+    durationSamples: loaded.durationSamples,
+  });
+
+  return {
+    id,
+    durationMs: loaded.durationSamples / 48,
+    packetCount: loaded.packetCount,
+  };
+}
+
+// The memory is freed once no producer is still playing the clip
+export function unloadClip(id: string): boolean {
+  return clips.delete(id);
+}
+
+type RtpOutput = {
+  url: string;
+  ssrc: number | undefined;
+  payloadType: number;
+  cname: string;
+  audioLevelExtensionId: number;
+};
+
+function rtpOutput(options: {
+  ipAddress: string;
+  rtpParameters: RtpParameters;
+  rtpPort: number;
+  srtpParameters?: SrtpParameters;
+}): RtpOutput {
+  const { rtpParameters } = options;
 
   const host = options.ipAddress.includes(":")
     ? `[${options.ipAddress}]`
     : options.ipAddress;
 
   const protocol = options.srtpParameters ? "srtp://" : "rtp://";
-  const rtpUrl = `${protocol}${host}:${options.rtpPort}`;
+  const url = `${protocol}${host}:${options.rtpPort}`;
 
   // TODO: We could probably support disabling rtcp
   if (rtpParameters.rtcp == null) {
@@ -120,82 +894,598 @@ export function produceRtp(options: ProduceOptions): ProduceReturn {
 
   const ssrc = rtpParameters.encodings[0].ssrc;
 
-  const { promise, external } = native.startAudioEncodeThread(signal, {
-    rtpUrl,
-    ssrc: String(ssrc),
-    payloadType: String(payloadType),
-    cname: cname,
+  const audioLevelExtension = rtpParameters.headerExtensions?.find(
+    (ext) => ext.uri === AUDIO_LEVEL_URI,
+  );
+
+  // Only the one-byte header format is supported, which limits ids to 1-14
+  if (
+    audioLevelExtension &&
+    (audioLevelExtension.id < 1 || audioLevelExtension.id > 14)
+  ) {
+    throw new Error("audio level header extension id must be between 1 and 14");
+  }
+
+  return {
+    url,
+    ssrc,
+    payloadType,
+    cname,
+    audioLevelExtensionId: audioLevelExtension?.id ?? 0,
+  };
+}
+
+function resolveLowWaterMarkMs(options: {
+  highWaterMarkMs?: number;
+  lowWaterMarkMs?: number;
+}): number {
+  const lowWaterMarkMs =
+    options.lowWaterMarkMs ??
+    (options.highWaterMarkMs != null ? options.highWaterMarkMs / 2 : -1);
+
+  if (
+    options.highWaterMarkMs != null &&
+    lowWaterMarkMs > options.highWaterMarkMs
+  ) {
+    throw new Error("lowWaterMarkMs must not be greater than highWaterMarkMs");
+  }
+
+  return lowWaterMarkMs;
+}
+
+function mixerGain(gain: number): number {
+  if (!(gain >= 0 && gain <= MIXER_MAX_GAIN)) {
+    throw new Error(`gain must be between 0 and ${MIXER_MAX_GAIN}`);
+  }
+  return Math.round(gain * MIXER_GAIN_ONE);
+}
+
+// Where a write is counted, and who is told once it would be accepted again
+type BackpressureTarget = {
+  bufferedAudio: Int32Array;
+  highWaterMark: number;
+  onDrain?: () => void;
+
+  // Set when a write was refused, until onDrain is called for it
+  pendingDrain: boolean;
+};
+
+function backpressureTarget(
+  options: {
+    highWaterMarkMs?: number;
+    onDrain?: () => void;
+  },
+  size = BUFFERED_AUDIO_SIZE,
+): BackpressureTarget {
+  return {
+    bufferedAudio: new Int32Array(new SharedArrayBuffer(size)),
+    highWaterMark:
+      options.highWaterMarkMs != null
+        ? options.highWaterMarkMs * BUFFERED_AUDIO_TICKS_PER_MS
+        : Infinity,
+    onDrain: options.onDrain,
+    pendingDrain: false,
+  };
+}
+
+export function produceRtp(options: ProduceOptions): ProduceReturn {
+  const { srtpParameters, signal } = options;
+  const output = rtpOutput(options);
+
+  const pcmRing = options.ringBufferMs
+    ? new PcmRingWriter(
+        Math.ceil((options.sampleRate * options.ringBufferMs) / 1000),
+      )
+    : null;
+
+  if (options.catchUp) {
+    const { thresholdMs, targetMs, rate } = options.catchUp;
+    if (!(thresholdMs > 0)) {
+      throw new Error("catchUp.thresholdMs must be greater than 0");
+    }
+    if (targetMs != null && !(targetMs >= 0 && targetMs < thresholdMs)) {
+      throw new Error(
+        "catchUp.targetMs must be at least 0 and less than thresholdMs",
+      );
+    }
+    if (rate != null && !(rate >= 1 && rate <= 2)) {
+      throw new Error("catchUp.rate must be between 1 and 2");
+    }
+  }
+
+  const lowWaterMark = resolveLowWaterMarkMs(options);
+
+  // Input sample rates always divide evenly into 48kHz ticks
+  const ticksPerSample = 48000 / options.sampleRate;
+
+  const main = backpressureTarget(options);
+  const { bufferedAudio } = main;
+
+  const inputNames = Object.keys(options.inputs ?? {});
+  if (inputNames.length > MIXER_MAX_INPUTS) {
+    throw new Error(`At most ${MIXER_MAX_INPUTS} inputs can be mixed`);
+  }
+
+  const inputs = inputNames.map((name) => {
+    const inputOptions = options.inputs![name];
+    // The input's fields follow its buffered audio counter
+    const target = backpressureTarget(inputOptions, MIXER_INPUT_SIZE);
+    Atomics.store(
+      target.bufferedAudio,
+      MIXER_INPUT_GAIN,
+      mixerGain(inputOptions.gain ?? 1),
+    );
+    return {
+      name,
+      target,
+      sampleRate: inputOptions.sampleRate,
+      lowWaterMarkMs: Math.floor(resolveLowWaterMarkMs(inputOptions)),
+      queueDepth: inputOptions.queueDepth ?? 0,
+    };
+  });
+
+  // The encoder has a single onDrain callback, so with inputs it's passed on
+  // to each writer that was refused and is no longer waiting.
+  const targets = [main, ...inputs.map((input) => input.target)];
+  function dispatchDrain() {
+    for (const target of targets) {
+      if (
+        target.pendingDrain &&
+        Atomics.load(target.bufferedAudio, BUFFERED_AUDIO_DRAIN_WAITING) ===
+          BUFFERED_AUDIO_NOT_WAITING
+      ) {
+        target.pendingDrain = false;
+        target.onDrain?.();
+      }
+    }
+  }
+
+  if (pcmRing && signal) {
+    // This must run before the native abort handler ends the thread
+    signal.addEventListener("abort", () => pcmRing.discard(), { once: true });
+  }
+
+  const { promise, external, control } = native.startAudioEncodeThread(signal, {
+    rtpUrl: output.url,
+    ssrc: String(output.ssrc),
+    payloadType: String(output.payloadType),
+    cname: output.cname,
     sampleRate: options.sampleRate,
     bitrate: options.opus?.bitrate ?? 0,
     enableFec: options.opus?.enableFec ?? false,
     packetLossPercent: options.opus?.packetLossPercent ?? 0,
     cryptoSuite: srtpParameters?.cryptoSuite,
     keyBase64: srtpParameters?.keyBase64,
+    audioLevelExtensionId: output.audioLevelExtensionId,
+    onDrain: inputs.length > 0 ? dispatchDrain : options.onDrain,
+    queueDepth: options.queueDepth ?? 0,
+    pcmRing: pcmRing?.array,
+    bufferedAudio,
+    lowWaterMarkMs: Math.floor(lowWaterMark),
+    catchUpThresholdMs: Math.ceil(options.catchUp?.thresholdMs ?? 0),
+    catchUpTargetMs: Math.floor(
+      options.catchUp?.targetMs ?? (options.catchUp?.thresholdMs ?? 0) / 2,
+    ),
+    catchUpRate: options.catchUp?.rate ?? 1.15,
+    mixerInputs: inputs.map((input) => ({
+      sampleRate: input.sampleRate,
+      bufferedAudio: input.target.bufferedAudio,
+      lowWaterMarkMs: input.lowWaterMarkMs,
+      queueDepth: input.queueDepth,
+    })),
+  });
+
+  if (options.onError) {
+    promise.catch((error: any) => {
+      options.onError!(error);
+    });
+  }
+
+  function end() {
+    native.postEndOfFile(external);
+  }
+
+  function done(): Promise<void> {
+    return promise;
+  }
+
+  if (signal) {
+    function listener() {
+      interrupt();
+    }
+
+    signal.addEventListener("abort", listener, { once: true });
+
+    promise.then(
+      () => {
+        signal.removeEventListener("abort", listener);
+      },
+      () => {
+        /* Ignoring error. Just don't want a danging promise */
+      },
+    );
+  }
+
+  function writeToRing(ring: PcmRingWriter, buffers: Buffer[]): boolean {
+    if (!ring.write(buffers)) {
+      return false;
+    }
+
+    if (ring.takeConsumerWaiting()) {
+      native.postPcmRingWakeup(external);
+    }
+
+    return true;
+  }
+
+  function post(buffers: Buffer[]): boolean {
+    if (pcmRing) {
+      return writeToRing(pcmRing, buffers);
+    } else if (buffers.length === 1) {
+      return native.postPcmToEncoder(external, buffers[0]);
+    } else {
+      return native.postPcmBuffersToEncoder(external, buffers);
+    }
+  }
+
+  // Opus packets skip the ring, and are put in order with the PCM in it by
+  // its write index.
+  function postOpus(packets: Buffer[], durations: number[]): boolean {
+    return native.postOpusPacketsToEncoder(
+      external,
+      packets,
+      durations,
+      pcmRing ? pcmRing.writeIndex() : 0,
+    );
+  }
+
+  // Returns BUFFERED_AUDIO_NOT_WAITING if send() posted the audio, otherwise
+  // the reason why it wasn't.
+  function tryPost(
+    target: BackpressureTarget,
+    send: () => boolean,
+    ticks: number,
+  ): number {
+    const { bufferedAudio } = target;
+
+    // The audio is counted before it's posted, so that the producer thread
+    // can't release it before it was added.
+    const buffered =
+      Atomics.add(bufferedAudio, BUFFERED_AUDIO_TICKS, ticks) + ticks;
+
+    let result = BUFFERED_AUDIO_NOT_WAITING;
+    // Audio that is longer than the high water mark on its own is taken once
+    // nothing else is buffered, or it could never be written
+    if (buffered > target.highWaterMark && buffered > ticks) {
+      result = BUFFERED_AUDIO_WAITING_FOR_LOW_WATER_MARK;
+    } else if (!send()) {
+      result = BUFFERED_AUDIO_WAITING_FOR_QUEUE;
+    }
+
+    if (result !== BUFFERED_AUDIO_NOT_WAITING) {
+      Atomics.sub(bufferedAudio, BUFFERED_AUDIO_TICKS, ticks);
+    }
+
+    return result;
+  }
+
+  function writeWithBackpressure(
+    target: BackpressureTarget,
+    send: () => boolean,
+    ticks: number,
+  ): boolean {
+    const { bufferedAudio } = target;
+    const reason = tryPost(target, send, ticks);
+    if (reason === BUFFERED_AUDIO_NOT_WAITING) {
+      return true;
+    }
+
+    target.pendingDrain = true;
+    Atomics.store(bufferedAudio, BUFFERED_AUDIO_DRAIN_WAITING, reason);
+
+    // The pipeline may have drained before it could see the flag, in which
+    // case nothing would ever call onDrain.
+    if (tryPost(target, send, ticks) === BUFFERED_AUDIO_NOT_WAITING) {
+      Atomics.compareExchange(
+        bufferedAudio,
+        BUFFERED_AUDIO_DRAIN_WAITING,
+        reason,
+        BUFFERED_AUDIO_NOT_WAITING,
+      );
+      target.pendingDrain = false;
+      return true;
+    }
+
+    return false;
+  }
+
+  function writev(buffers: Buffer[]): boolean {
+    let samples = 0;
+    for (const buffer of buffers) {
+      samples += buffer.byteLength >> 1;
+    }
+
+    return writeWithBackpressure(
+      main,
+      () => post(buffers),
+      samples * ticksPerSample,
+    );
+  }
+
+  function write(buffer: Buffer): boolean {
+    return writev([buffer]);
+  }
+
+  function writevOpus(packets: Buffer[], durationSamples?: number[]): boolean {
+    // Buffered audio ticks are at 48kHz, like the durations
+    let ticks = 0;
+    const durations = packets.map((packet, i) => {
+      const tocDuration = opusPacketDuration(packet);
+      const duration = durationSamples?.[i] ?? tocDuration;
+      if (!Number.isInteger(duration) || duration <= 0) {
+        throw new Error("durationSamples must be a positive integer");
+      }
+      ticks += duration;
+      return duration;
+    });
+
+    if (packets.length === 0) {
+      return true;
+    }
+
+    return writeWithBackpressure(
+      main,
+      () => postOpus(packets, durations),
+      ticks,
+    );
+  }
+
+  function writeOpus(packet: Buffer, durationSamples?: number): boolean {
+    return writevOpus(
+      [packet],
+      durationSamples != null ? [durationSamples] : undefined,
+    );
+  }
+
+  function playClip(id: string): boolean {
+    const loaded = clips.get(id);
+    if (!loaded) {
+      throw new Error(`No clip was loaded with the id ${id}`);
+    }
+
+    // Buffered audio ticks are at 48kHz, like the clip's duration
+    return writeWithBackpressure(
+      main,
+      () =>
+        native.postClipToEncoder(
+          external,
+          loaded.clip,
+          pcmRing ? pcmRing.writeIndex() : 0,
+        ),
+      loaded.durationSamples,
+    );
+  }
+
+  function bufferedMs(): number {
+    return (
+      Atomics.load(bufferedAudio, BUFFERED_AUDIO_TICKS) /
+      BUFFERED_AUDIO_TICKS_PER_MS
+    );
+  }
+
+  const mixerInputs = new Map(
+    inputs.map((input, index): [string, MixerInput] => {
+      const { target, sampleRate } = input;
+      const fields = target.bufferedAudio;
+
+      function writev(buffers: Buffer[]): boolean {
+        let bytes = 0;
+        for (const buffer of buffers) {
+          bytes += buffer.byteLength;
+        }
+
+        // Rounded down like the mixer does, as the rate may not divide 48kHz
+        const ticks = Math.floor(((bytes >> 1) * 48000) / sampleRate);
+        return writeWithBackpressure(
+          target,
+          () => native.postPcmToMixerInput(control, index, buffers),
+          ticks,
+        );
+      }
+
+      function clear() {
+        const discardedTicks = native.clearMixerInput(control, index);
+        Atomics.sub(fields, BUFFERED_AUDIO_TICKS, discardedTicks);
+      }
+
+      return [
+        input.name,
+        {
+          write: (data) => writev([data]),
+          writev,
+          setGain: (gain) =>
+            Atomics.store(fields, MIXER_INPUT_GAIN, mixerGain(gain)),
+          pause: () => Atomics.store(fields, MIXER_INPUT_PAUSED, 1),
+          resume: () => {
+            Atomics.store(fields, MIXER_INPUT_PAUSED, 0);
+            native.postMixerWakeup(control);
+          },
+          clear,
+          bufferedMs: () =>
+            Atomics.load(fields, BUFFERED_AUDIO_TICKS) /
+            BUFFERED_AUDIO_TICKS_PER_MS,
+        },
+      ];
+    }),
+  );
+
+  function input(name: string): MixerInput {
+    const mixerInput = mixerInputs.get(name);
+    if (!mixerInput) {
+      throw new Error(`No input was given with the name ${name}`);
+    }
+    return mixerInput;
+  }
+
+  function interrupt() {
+    const discardedTicks = native.postInterrupt(
+      control,
+      pcmRing ? pcmRing.writeIndex() : 0,
+    );
+
+    // The encoder releases everything else that it discards
+    Atomics.sub(bufferedAudio, BUFFERED_AUDIO_TICKS, discardedTicks);
+  }
+
+  function setBitrate(bitrate: number | null) {
+    native.postSetBitrate(control, bitrate ?? 0);
+  }
+
+  function setEnableFec(enableFec: boolean) {
+    native.postSetEnableFec(control, enableFec);
+  }
+
+  function setPacketLossPercent(percent: number) {
+    native.postSetPacketLossPercent(control, percent);
+  }
+
+  function endSegment() {
+    if (pcmRing) {
+      native.postFlushEncoder(external, pcmRing.writeIndex());
+    } else {
+      native.postFlushEncoder(external);
+    }
+  }
+
+  return {
+    end,
+    done,
+    write,
+    writev,
+    writeOpus,
+    writevOpus,
+    playClip,
+    bufferedMs,
+    input,
+    endSegment,
+    interrupt,
+    setBitrate,
+    setEnableFec,
+    setPacketLossPercent,
+  };
+}
+
+// Sends Ogg Opus, such as the output of a TTS vendor, over RTP without decoding
+// and re-encoding it. The demuxer thread takes the Opus packets out of the Ogg
+// pages, and the producer thread sends them in real-time.
+export function produceRtpFromOgg(options: ProduceOggOptions): ProduceOggReturn {
+  const { srtpParameters, signal } = options;
+  const output = rtpOutput(options);
+
+  const lowWaterMark = resolveLowWaterMarkMs(options);
+  const highWaterMark =
+    options.highWaterMarkMs != null
+      ? options.highWaterMarkMs * BUFFERED_AUDIO_TICKS_PER_MS
+      : Infinity;
+
+  // The demuxer adds packets as it passes them on, and the producer releases
+  // them as they're sent.
+  const bufferedAudio = new Int32Array(
+    new SharedArrayBuffer(BUFFERED_AUDIO_SIZE),
+  );
+
+  const producerOptions = {
+    url: output.url,
+    ssrc: String(output.ssrc),
+    payloadType: String(output.payloadType),
+    cname: output.cname,
+    cryptoSuite: srtpParameters?.cryptoSuite,
+    keyBase64: srtpParameters?.keyBase64,
+    bufferedAudio,
+    lowWaterMarkMs: Math.floor(lowWaterMark),
+    onDrain: options.onDrain,
+  };
+
+  const producer = native.startProducerJob(signal, producerOptions);
+
+  // The demuxer notifies onDrain when it makes room in its queue
+  const demuxer = native.startDemuxerJob(producer.external, signal, {
+    bufferedAudio,
     onDrain: options.onDrain,
-    queueDepth: options.queueDepth ?? 0,
   });
 
+  // The producer keeps going until everything the demuxer passed on has been
+  // sent
+  const promise = demuxer.promise.then(
+    () => {
+      native.postEndOfFile(producer.external);
+      return producer.muxer_promise;
+    },
+    (error: unknown) => {
+      native.postEndOfFile(producer.external);
+      throw error;
+    },
+  );
+
   if (options.onError) {
     promise.catch((error: any) => {
       options.onError!(error);
     });
   }
 
-  function end() {
-    native.postEndOfFile(external);
-  }
-
-  function done(): Promise<void> {
-    return promise;
+  function tryPost(data: Buffer): number {
+    if (Atomics.load(bufferedAudio, BUFFERED_AUDIO_TICKS) > highWaterMark) {
+      return BUFFERED_AUDIO_WAITING_FOR_LOW_WATER_MARK;
+    } else if (!native.postOggBuffer(demuxer.external, data)) {
+      return BUFFERED_AUDIO_WAITING_FOR_QUEUE;
+    } else {
+      return BUFFERED_AUDIO_NOT_WAITING;
+    }
   }
 
-  if (signal) {
-    function listener() {
-      native.clearMessageQueue(external);
-      native.postClearProducerQueue(external);
+  function write(data: Buffer): boolean {
+    const reason = tryPost(data);
+    if (reason === BUFFERED_AUDIO_NOT_WAITING) {
+      return true;
     }
 
-    signal.addEventListener("abort", listener, { once: true });
-
-    promise.then(
-      () => {
-        signal.removeEventListener("abort", listener);
-      },
-      () => {
-        /* Ignoring error. Just don't want a danging promise */
-      },
-    );
-  }
+    Atomics.store(bufferedAudio, BUFFERED_AUDIO_DRAIN_WAITING, reason);
+
+    // The pipeline may have drained before it could see the flag, in which
+    // case nothing would ever call onDrain.
+    if (tryPost(data) === BUFFERED_AUDIO_NOT_WAITING) {
+      Atomics.compareExchange(
+        bufferedAudio,
+        BUFFERED_AUDIO_DRAIN_WAITING,
+        reason,
+        BUFFERED_AUDIO_NOT_WAITING,
+      );
+      return true;
+    }
 
-  function write(buffer: Buffer): boolean {
-    return native.postPcmToEncoder(external, buffer);
+    return false;
   }
 
-  function setBitrate(bitrate: number | null) {
-    native.postSetBitrate(external, bitrate ?? 0);
+  function reset() {
+    native.postDemuxerReset(demuxer.external);
   }
 
-  function setEnableFec(enableFec: boolean) {
-    native.postSetEnableFec(external, enableFec);
+  function bufferedMs(): number {
+    return (
+      Atomics.load(bufferedAudio, BUFFERED_AUDIO_TICKS) /
+      BUFFERED_AUDIO_TICKS_PER_MS
+    );
   }
 
-  function setPacketLossPercent(percent: number) {
-    native.postSetPacketLossPercent(external, percent);
+  function end() {
+    native.postEndOfFile(demuxer.external);
   }
 
-  function endSegment() {
-    native.postFlushEncoder(external);
+  function done(): Promise<void> {
+    return promise;
   }
 
-  return {
-    end,
-    done,
-    write,
-    endSegment,
-    setBitrate,
-    setEnableFec,
-    setPacketLossPercent,
-  };
+  return { write, reset, bufferedMs, end, done };
 }
 
 export function createSrtpParameters(): SrtpParameters {
@@ -228,7 +1518,16 @@ export function createRtpParameters(): RtpParameters {
         rtcpFeedback: [],
       },
     ],
-    headerExtensions: [],
+    headerExtensions: [
+      {
+        // mediasoup's preferred id for this extension
+        uri: AUDIO_LEVEL_URI,
+        id: 10,
+        parameters: {
+          vad: "on",
+        },
+      },
+    ],
     encodings: [{ ssrc }],
     rtcp: {
       cname,
@@ -345,13 +1644,155 @@ function sdpParameters(parameters: Record<string, unknown>): string {
 }
 
 export function consumeRtp(options: ConsumeOptions): ConsumeReturn {
+  const hasCallback =
+    options.onAudioData != null ||
+    options.onAudioBatch != null ||
+    options.stream != null;
+
+  const sinks = options.sinks ?? [];
+  const relays = options.relays ?? [];
+
+  if (
+    !hasCallback &&
+    !options.outputRingMs &&
+    sinks.length === 0 &&
+    relays.length === 0
+  ) {
+    throw new Error(
+      "either onAudioData, onAudioBatch, stream, outputRingMs, sinks or " +
+        "relays is required",
+    );
+  }
+
+  for (const sink of sinks) {
+    if (sink.chunkMs != null && !(sink.chunkMs > 0)) {
+      throw new Error("chunkMs must be greater than 0");
+    }
+  }
+
+  if (options.stream && (options.onAudioData || options.onAudioBatch)) {
+    throw new Error("stream can't be used with onAudioData or onAudioBatch");
+  }
+
+  if (options.onGap && !hasCallback) {
+    throw new Error("onGap requires onAudioData, onAudioBatch or stream");
+  }
+
+  if (options.onSpeech && !hasCallback) {
+    throw new Error("onSpeech requires onAudioData, onAudioBatch or stream");
+  }
+
+  if (options.outputRingMs && options.sampleFormat === "f32") {
+    throw new Error('outputRingMs only supports sampleFormat "s16"');
+  }
+
+  const outputRing = options.outputRingMs
+    ? createPcmOutputRing(options.sampleRate, options.outputRingMs)
+    : undefined;
+  const outputRingHeader = outputRing
+    ? new Int32Array(outputRing, 0, PCM_OUTPUT_RING_HEADER_SIZE / 4)
+    : undefined;
+
+  if (options.chunkMs != null && !(options.chunkMs > 0)) {
+    throw new Error("chunkMs must be greater than 0");
+  }
+
+  const jitterBuffer =
+    options.jitterBuffer || options.clockedOutput
+      ? {
+          minDelayMs: Math.ceil(options.jitterBuffer?.minDelayMs ?? 20),
+          maxDelayMs: Math.ceil(options.jitterBuffer?.maxDelayMs ?? 200),
+        }
+      : undefined;
+  const voiceActivity =
+    options.voiceActivity ?? (options.onSpeech ? {} : undefined);
+
+  const jitterStatsArray = new Int32Array(
+    new SharedArrayBuffer(JITTER_BUFFER_STATS_SIZE),
+  );
+
+  const control = new Int32Array(new SharedArrayBuffer(DECODER_CONTROL_SIZE));
+
+  // Cancelling the stream stops the decoder, the same as aborting the signal
+  const streamController = options.stream ? new AbortController() : undefined;
+  function forwardAbort() {
+    streamController!.abort();
+  }
+  if (streamController) {
+    if (options.signal.aborted) {
+      streamController.abort();
+    } else {
+      options.signal.addEventListener("abort", forwardAbort, { once: true });
+    }
+  }
+
+  const audioStream = options.stream
+    ? new AudioStream(
+        options.stream,
+        options,
+        (buffer) => release(buffer),
+        () => streamController!.abort(),
+      )
+    : undefined;
+
+  const mainCallback = audioCallback(
+    audioStream
+      ? { ...options, onAudioData: (data) => audioStream.push(data) }
+      : options,
+  );
+
   const { promise } = native.startAudioDecodeThread(
     dataUrl(options.sdp),
-    options.onAudioData,
-    options.signal,
+    sinks.length > 0
+      ? sinkCallback(sinks, mainCallback, options.onAudioBatch != null)
+      : mainCallback,
+    streamController?.signal ?? options.signal,
     {
       sampleRate: options.sampleRate,
-      channels: 1,
+      channels: options.channels ?? 1,
+      floatSamples: options.sampleFormat === "f32",
+      chunkMs: options.chunkMs ?? 0,
+      maxLatencyMs: Math.ceil(options.maxLatencyMs ?? 0),
+      batchCallbacks: options.onAudioBatch != null && !audioStream,
+      mainCallback: hasCallback,
+      maxConcealMs: Math.ceil(options.maxConcealMs ?? 100),
+      fillSilence: options.fillSilence ?? false,
+      gapEvents: options.onGap != null,
+      jitterMinDelayMs: jitterBuffer?.minDelayMs ?? 0,
+      jitterMaxDelayMs: jitterBuffer?.maxDelayMs ?? 0,
+      jitterStats: jitterStatsArray,
+      control,
+      clockedOutput: options.clockedOutput ?? false,
+      voiceActivity: voiceActivity != null,
+      vadThresholdDb: Math.round(voiceActivity?.thresholdDb ?? 12),
+      vadHangoverMs: Math.ceil(voiceActivity?.hangoverMs ?? 300),
+      vadGate: voiceActivity?.gate ?? false,
+      vadPreRollMs: Math.ceil(voiceActivity?.preRollMs ?? 200),
+      speechEvents: options.onSpeech != null,
+      outputRing: outputRing && new Uint8Array(outputRing),
+      // Native threads can't wake up Atomics.wait(), so they ask this thread
+      // to do it.
+      onReaderWakeup: outputRingHeader
+        ? () =>
+            Atomics.notify(outputRingHeader, PCM_OUTPUT_RING_READER_WAITING)
+        : undefined,
+      sinks: sinks.map((sink) => ({
+        sampleRate: sink.sampleRate,
+        channels: sink.channels ?? 1,
+        floatSamples: sink.sampleFormat === "f32",
+        chunkMs: sink.chunkMs ?? 0,
+      })),
+      relays: relays.map((relay) => {
+        const output = rtpOutput(relay);
+        return {
+          url: output.url,
+          ssrc: String(output.ssrc),
+          payloadType: String(output.payloadType),
+          cname: output.cname,
+          cryptoSuite: relay.srtpParameters?.cryptoSuite,
+          keyBase64: relay.srtpParameters?.keyBase64,
+        };
+      }),
     },
   );
 
@@ -361,11 +1802,568 @@ export function consumeRtp(options: ConsumeOptions): ConsumeReturn {
     });
   }
 
+  if (audioStream) {
+    promise.then(
+      () => {
+        options.signal.removeEventListener("abort", forwardAbort);
+        audioStream.close();
+      },
+      (error: any) => {
+        options.signal.removeEventListener("abort", forwardAbort);
+        audioStream.error(error);
+      },
+    );
+  }
+
   function done() {
     return promise;
   }
 
-  return { done };
+  function release(buffer: Buffer) {
+    native.releaseAudioBuffer(buffer);
+  }
+
+  function jitterStats(): JitterStats {
+    return {
+      delayMs: Atomics.load(jitterStatsArray, JITTER_BUFFER_DELAY_MS),
+      latePackets: Atomics.load(jitterStatsArray, JITTER_BUFFER_LATE_PACKETS),
+      reorderedPackets: Atomics.load(
+        jitterStatsArray,
+        JITTER_BUFFER_REORDERED_PACKETS,
+      ),
+    };
+  }
+
+  function pause() {
+    Atomics.store(control, DECODER_CONTROL_PAUSED, 1);
+  }
+
+  function resume() {
+    Atomics.store(control, DECODER_CONTROL_PAUSED, 0);
+  }
+
+  function deliveryStats(): DeliveryStats {
+    return {
+      droppedChunks: Atomics.load(control, DECODER_CONTROL_DROPPED_CHUNKS),
+      bufferedMs: audioStream ? audioStream.bufferedMs : 0,
+      overflowedChunks: audioStream ? audioStream.overflowedChunks : 0,
+    };
+  }
+
+  return {
+    done,
+    release,
+    jitterStats,
+    deliveryStats,
+    pause,
+    resume,
+    outputRing,
+    stream: audioStream?.stream,
+  };
+}
+
+// Must match the layout in src/group_mixer_thread.h
+const GROUP_MIXER_MAX_SOURCES = 32;
+const GROUP_MIXER_SOURCE_SIZE = 32;
+const GROUP_MIXER_SOURCE_GAIN = 0;
+const GROUP_MIXER_SOURCE_GENERATION = 1;
+const GROUP_MIXER_SOURCE_LEVEL = 2;
+const GROUP_MIXER_SOURCE_MIXED = 3;
+const GROUP_MIXER_SOURCE_MIXED_FRAMES = 4;
+const GROUP_MIXER_FRAME_MS = 20;
+
+// Each participant's decoder runs a clock of its own, and the mixer takes a
+// frame every 20ms, so only a few frames are ever in the ring
+const GROUP_RING_MS = 500;
+
+type ConsumeGroupOptions = {
+  // Sample rate of the mixed audio, which every participant is decoded to
+  sampleRate: number;
+
+  // Called with each 20ms frame of mixed audio. Frames are only sent while
+  // some participant has audio, and the pts shows how long the gaps were.
+  onAudioData: (data: AudioData) => void;
+
+  onError?: (error: Error) => void;
+
+  // Most participants at a time. Defaults to 8, and can be at most 32.
+  maxParticipants?: number;
+
+  // Only the loudest participants, by the energy of each frame, are mixed in.
+  // By default, everyone who isn't silent is.
+  loudest?: number;
+
+  // The jitter buffer of each participant, as for consumeRtp()
+  jitterBuffer?: { minDelayMs?: number; maxDelayMs?: number };
+
+  signal: AbortSignal;
+};
+
+export type ParticipantOptions = {
+  // Describes the participant's RTP stream, as for consumeRtp()
+  sdp: string;
+
+  // Volume of the participant, from 0 to 8. Defaults to 1.
+  gain?: number;
+};
+
+export type ParticipantActivity = {
+  id: string;
+
+  // Level of the participant's last frame in -dBov, from 0 for full scale to
+  // 127 for silence
+  level: number;
+
+  // Whether the last frame was mixed in
+  mixed: boolean;
+
+  // How much of the participant's audio has been mixed in
+  mixedMs: number;
+};
+
+type ConsumeGroupReturn = {
+  // Starts decoding a participant. Throws if the id is taken or the group is
+  // full.
+  add: (id: string, options: ParticipantOptions) => void;
+
+  // Stops decoding a participant. Resolves once its place can be taken by
+  // someone else.
+  remove: (id: string) => Promise<void>;
+
+  // Takes effect from the next frame
+  setGain: (id: string, gain: number) => void;
+
+  // Cheap enough to call every frame, e.g. to show who is speaking
+  activity: () => ParticipantActivity[];
+
+  // Same as for consumeRtp()
+  release: (buffer: Buffer) => void;
+
+  // Resolves once the signal was aborted and every thread has exited
+  done: () => Promise<void>;
+};
+
+type GroupParticipant = {
+  slot: number;
+  controller: AbortController;
+  done: Promise<void>;
+};
+
+// Decodes many RTP streams, such as the participants of a conference, and
+// mixes them on a native thread into a single stream of PCM. Each participant
+// has its own decoder with clockedOutput, which writes into a ring that the
+// mixer reads, so JavaScript is called once per frame however many people are
+// talking.
+export function consumeRtpGroup(
+  options: ConsumeGroupOptions,
+): ConsumeGroupReturn {
+  const { sampleRate, signal } = options;
+
+  const maxParticipants = options.maxParticipants ?? 8;
+  if (!(maxParticipants >= 1 && maxParticipants <= GROUP_MIXER_MAX_SOURCES)) {
+    throw new Error(
+      `maxParticipants must be between 1 and ${GROUP_MIXER_MAX_SOURCES}`,
+    );
+  }
+  if (options.loudest != null && !(options.loudest >= 1)) {
+    throw new Error("loudest must be at least 1");
+  }
+
+  const minDelayMs = Math.ceil(options.jitterBuffer?.minDelayMs ?? 20);
+  const maxDelayMs = Math.ceil(options.jitterBuffer?.maxDelayMs ?? 200);
+
+  // The rings stay with the group, and are handed from one participant to the
+  // next, so that the mixer never has to be told about them
+  const rings = Array.from({ length: maxParticipants }, () =>
+    createPcmOutputRing(sampleRate, GROUP_RING_MS),
+  );
+  const sources = new Int32Array(
+    new SharedArrayBuffer(maxParticipants * GROUP_MIXER_SOURCE_SIZE),
+  );
+  const freeSlots = rings.map((_, slot) => maxParticipants - 1 - slot);
+  const participants = new Map<string, GroupParticipant>();
+
+  function field(slot: number, index: number): number {
+    return (slot * GROUP_MIXER_SOURCE_SIZE) / 4 + index;
+  }
+
+  const { promise } = native.startGroupMixerThread(
+    options.onAudioData,
+    signal,
+    {
+      sampleRate,
+      loudest: options.loudest ?? 0,
+      rings: rings.map((ring) => new Uint8Array(ring)),
+      sources,
+    },
+  );
+
+  if (options.onError) {
+    promise.catch((error: any) => {
+      options.onError!(error);
+    });
+  }
+
+  signal.addEventListener(
+    "abort",
+    () => {
+      for (const participant of participants.values()) {
+        participant.controller.abort();
+      }
+    },
+    { once: true },
+  );
+
+  function add(id: string, participantOptions: ParticipantOptions) {
+    if (signal.aborted) {
+      throw new Error("The group has been aborted");
+    }
+    if (participants.has(id)) {
+      throw new Error(`A participant with the id ${id} was already added`);
+    }
+
+    const gain = mixerGain(participantOptions.gain ?? 1);
+    const slot = freeSlots.pop();
+    if (slot === undefined) {
+      throw new Error("The group is full");
+    }
+
+    Atomics.store(sources, field(slot, GROUP_MIXER_SOURCE_GAIN), gain);
+    Atomics.store(sources, field(slot, GROUP_MIXER_SOURCE_LEVEL), 127);
+    Atomics.store(sources, field(slot, GROUP_MIXER_SOURCE_MIXED), 0);
+    Atomics.store(sources, field(slot, GROUP_MIXER_SOURCE_MIXED_FRAMES), 0);
+
+    const controller = new AbortController();
+    const decoder = native.startAudioDecodeThread(
+      dataUrl(participantOptions.sdp),
+      undefined,
+      controller.signal,
+      {
+        sampleRate,
+        channels: 1,
+        maxConcealMs: 100,
+        jitterMinDelayMs: minDelayMs,
+        jitterMaxDelayMs: maxDelayMs,
+        clockedOutput: true,
+        outputRing: new Uint8Array(rings[slot]),
+      },
+    );
+
+    const participant: GroupParticipant = {
+      slot,
+      controller,
+      done: decoder.promise
+        .catch((error: any) => {
+          options.onError?.(error);
+        })
+        .then(() => {
+          // The mixer drops whatever the decoder left in the ring
+          Atomics.add(sources, field(slot, GROUP_MIXER_SOURCE_GENERATION), 1);
+          if (participants.get(id) === participant) {
+            participants.delete(id);
+          }
+          freeSlots.push(slot);
+        }),
+    };
+    participants.set(id, participant);
+  }
+
+  function remove(id: string): Promise<void> {
+    const participant = participants.get(id);
+    if (!participant) {
+      return Promise.resolve();
+    }
+
+    participant.controller.abort();
+    return participant.done;
+  }
+
+  function setGain(id: string, gain: number) {
+    const participant = participants.get(id);
+    if (!participant) {
+      throw new Error(`No participant with the id ${id}`);
+    }
+
+    Atomics.store(
+      sources,
+      field(participant.slot, GROUP_MIXER_SOURCE_GAIN),
+      mixerGain(gain),
+    );
+  }
+
+  function activity(): ParticipantActivity[] {
+    return Array.from(participants, ([id, { slot }]) => ({
+      id,
+      level: Atomics.load(sources, field(slot, GROUP_MIXER_SOURCE_LEVEL)),
+      mixed:
+        Atomics.load(sources, field(slot, GROUP_MIXER_SOURCE_MIXED)) !== 0,
+      mixedMs:
+        Atomics.load(sources, field(slot, GROUP_MIXER_SOURCE_MIXED_FRAMES)) *
+        GROUP_MIXER_FRAME_MS,
+    }));
+  }
+
+  function release(buffer: Buffer) {
+    native.releaseAudioBuffer(buffer);
+  }
+
+  async function done() {
+    await promise;
+    await Promise.all(
+      Array.from(participants.values(), (participant) => participant.done),
+    );
+  }
+
+  return { add, remove, setGain, activity, release, done };
+}
+
+// Bounded buffer between the decoder's callbacks and a ReadableStream. Chunks
+// are only handed to the stream when its reader asks for one, so the stream's
+// own queue stays empty and the overflow policy decides what is kept.
+class AudioStream {
+  readonly stream: ReadableStream<AudioData>;
+  overflowedChunks = 0;
+
+  private readonly chunks: AudioData[] = [];
+  private bufferedBytes = 0;
+  private readonly capacity: number;
+  private readonly overflow: "dropOldest" | "dropNewest" | "coalesce";
+  private controller!: ReadableStreamDefaultController<AudioData>;
+  private pulling = false;
+  private closed = false;
+
+  // Bytes per sample, for all channels
+  private readonly sampleSize: number;
+  private readonly bytesPerMs: number;
+  private readonly release: (buffer: Buffer) => void;
+
+  constructor(
+    options: AudioStreamOptions,
+    consumeOptions: ConsumeOptions,
+    release: (buffer: Buffer) => void,
+    onCancel: () => void,
+  ) {
+    this.release = release;
+    this.sampleSize =
+      (consumeOptions.channels ?? 1) *
+      (consumeOptions.sampleFormat === "f32" ? 4 : 2);
+    this.bytesPerMs = (consumeOptions.sampleRate * this.sampleSize) / 1000;
+
+    const bufferMs = options.bufferMs ?? 1000;
+    if (!(bufferMs > 0)) {
+      throw new Error("stream.bufferMs must be greater than 0");
+    }
+    this.capacity = Math.ceil(bufferMs * this.bytesPerMs);
+    this.overflow = options.overflow ?? "dropOldest";
+
+    this.stream = new ReadableStream<AudioData>(
+      {
+        start: (controller) => {
+          this.controller = controller;
+        },
+        pull: () => {
+          this.pulling = true;
+          this.flush();
+        },
+        cancel: () => {
+          this.closed = true;
+          this.clear();
+          onCancel();
+        },
+      },
+      { highWaterMark: 0 },
+    );
+  }
+
+  get bufferedMs(): number {
+    return this.bufferedBytes / this.bytesPerMs;
+  }
+
+  push(data: AudioData) {
+    if (this.closed) {
+      this.release(data.buffer);
+      return;
+    }
+
+    if (this.pulling && this.chunks.length === 0) {
+      this.pulling = false;
+      this.controller.enqueue(data);
+      return;
+    }
+
+    const length = data.buffer.byteLength;
+    if (this.bufferedBytes + length > this.capacity) {
+      if (this.overflow === "dropNewest") {
+        this.overflowedChunks++;
+        this.release(data.buffer);
+        return;
+      }
+
+      this.chunks.push(data);
+      this.bufferedBytes += length;
+
+      if (this.overflow === "coalesce") {
+        this.coalesce();
+      } else {
+        while (this.bufferedBytes > this.capacity && this.chunks.length > 1) {
+          const oldest = this.chunks.shift()!;
+          this.bufferedBytes -= oldest.buffer.byteLength;
+          this.overflowedChunks++;
+          this.release(oldest.buffer);
+        }
+      }
+      return;
+    }
+
+    this.chunks.push(data);
+    this.bufferedBytes += length;
+  }
+
+  close() {
+    this.closed = true;
+    this.flush();
+  }
+
+  error(error: any) {
+    this.closed = true;
+    this.clear();
+    this.controller.error(error);
+  }
+
+  private flush() {
+    if (this.pulling && this.chunks.length > 0) {
+      const data = this.chunks.shift()!;
+      this.bufferedBytes -= data.buffer.byteLength;
+      this.pulling = false;
+      this.controller.enqueue(data);
+    }
+
+    if (this.closed && this.chunks.length === 0) {
+      try {
+        this.controller.close();
+      } catch {
+        // Already closed or cancelled
+      }
+    }
+  }
+
+  private clear() {
+    for (const { buffer } of this.chunks) {
+      this.release(buffer);
+    }
+    this.chunks.length = 0;
+    this.bufferedBytes = 0;
+  }
+
+  // Joins every buffered chunk into one that holds the most recent audio that
+  // fits in the buffer
+  private coalesce() {
+    const keep = this.capacity - (this.capacity % this.sampleSize);
+    const skip = this.bufferedBytes - keep;
+    const first = this.chunks[0];
+
+    // Copied out before the decoder's buffers go back to its pool
+    const buffer = Buffer.allocUnsafe(keep);
+    let offset = -skip;
+    for (const chunk of this.chunks) {
+      const length = chunk.buffer.byteLength;
+      if (offset + length > 0) {
+        chunk.buffer.copy(buffer, Math.max(offset, 0), Math.max(-offset, 0));
+      }
+      offset += length;
+      this.release(chunk.buffer);
+    }
+
+    const skippedMs = skip / this.bytesPerMs;
+    this.overflowedChunks += this.chunks.length - 1;
+    this.chunks.length = 0;
+    this.chunks.push({
+      buffer,
+      pts: first.pts === null ? null : first.pts + Math.round(skippedMs * 48),
+      senderTime:
+        first.senderTime === null ? null : first.senderTime + skippedMs,
+      receivedAt: first.receivedAt,
+    });
+    this.bufferedBytes = keep;
+  }
+}
+
+// Gap and speech events come through the same callback as the audio, so that
+// they stay in order with it. This splits them out again.
+function audioCallback(options: ConsumeOptions) {
+  const { onAudioData, onAudioBatch, onGap, onSpeech } = options;
+  if (!onGap && !onSpeech) {
+    return onAudioBatch ?? onAudioData;
+  }
+
+  function onEvent(event: AudioGap | SpeechEvent) {
+    if (event.type === "speechStart" || event.type === "speechEnd") {
+      onSpeech?.(event);
+    } else {
+      onGap?.(event);
+    }
+  }
+
+  if (onAudioBatch) {
+    return (items: (AudioData | AudioGap | SpeechEvent)[]) => {
+      let start = 0;
+      for (let i = 0; i < items.length; i++) {
+        const item = items[i];
+        if ("type" in item) {
+          if (i > start) {
+            onAudioBatch(items.slice(start, i) as AudioData[]);
+          }
+          onEvent(item);
+          start = i + 1;
+        }
+      }
+      if (start < items.length) {
+        onAudioBatch(
+          (start === 0 ? items : items.slice(start)) as AudioData[],
+        );
+      }
+    };
+  }
+
+  return (item: AudioData | AudioGap | SpeechEvent) => {
+    if ("type" in item) {
+      onEvent(item);
+    } else {
+      onAudioData!(item);
+    }
+  };
+}
+
+// Passes the audio of each sink to its onAudioData, and everything else to
+// the main output's callback. With batched, the main callback takes arrays.
+function sinkCallback(
+  sinks: SinkOptions[],
+  main: ((item: any) => void) | undefined,
+  batched: boolean,
+) {
+  if (!batched) {
+    return (item: any) => {
+      if (item.sink != null) {
+        sinks[item.sink].onAudioData(item);
+      } else {
+        main?.(item);
+      }
+    };
+  }
+
+  return (items: any[]) => {
+    const mainItems = [];
+    for (const item of items) {
+      if (item.sink != null) {
+        sinks[item.sink].onAudioData(item);
+      } else {
+        mainItems.push(item);
+      }
+    }
+    if (mainItems.length > 0) {
+      main?.(mainItems);
+    }
+  };
 }
 
 function dataUrl(input: string) {
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+}
+
+#include "jitter_buffer.h"
+#include "packet_pool.h"
+#include "time_util.h"
+
+// Opus RTP timestamps are always at 48kHz
+#define PTS_RATE 48000
+
+// More than a second of 10ms packets, which is more than max_delay allows
+#define JITTER_BUFFER_CAPACITY 128
+
+// The peak lateness decays by 1/256 per packet, which halves it in about 3.5
+// seconds of 20ms packets. Increases in jitter are followed right away.
+#define PEAK_DECAY_SHIFT 8
+
+struct JitterBufferEntry {
+  AVPacket *pkt;
+
+  // Incremented when the timestamps jump backwards, so that packets from the
+  // new timeline sort after everything that is left from the old one.
+  int epoch;
+};
+
+struct JitterBuffer {
+  JitterBufferEntry entries[JITTER_BUFFER_CAPACITY];
+  int count;
+  int epoch;
+
+  // Microseconds
+  int64_t min_delay;
+  int64_t max_delay;
+  int64_t delay;
+  int64_t peak_lateness;
+
+  // Maps a pts to the time that the packet would have arrived with the least
+  // network delay seen so far.
+  int64_t base_time;
+  int64_t base_pts;
+
+  // pts that follows the last packet that was released, or AV_NOPTS_VALUE
+  int64_t next_pts;
+
+  int32_t *stats;
+};
+
+static inline void store_stat(JitterBuffer *jitter_buffer, JitterBufferStatsField field, int32_t value) {
+  if (jitter_buffer->stats != NULL) {
+    __atomic_store_n(&jitter_buffer->stats[field], value, __ATOMIC_SEQ_CST);
+  }
+}
+
+static inline void increment_stat(JitterBuffer *jitter_buffer, JitterBufferStatsField field) {
+  if (jitter_buffer->stats != NULL) {
+    __atomic_add_fetch(&jitter_buffer->stats[field], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static int64_t arrival_time(const JitterBuffer *jitter_buffer, int64_t pts) {
+  return jitter_buffer->base_time + av_rescale(pts - jitter_buffer->base_pts, MICROSECONDS, PTS_RATE);
+}
+
+static void anchor(JitterBuffer *jitter_buffer, int64_t now, int64_t pts) {
+  jitter_buffer->base_time = now;
+  jitter_buffer->base_pts = pts;
+}
+
+JitterBuffer *jitter_buffer_alloc(int min_delay_ms, int max_delay_ms, int32_t *stats) {
+  JitterBuffer *jitter_buffer = (JitterBuffer *)av_mallocz(sizeof(JitterBuffer));
+  if (jitter_buffer == NULL) {
+    return NULL;
+  }
+
+  jitter_buffer->min_delay = (int64_t)min_delay_ms * 1000;
+  jitter_buffer->max_delay = (int64_t)max_delay_ms * 1000;
+  jitter_buffer->delay = jitter_buffer->min_delay;
+  jitter_buffer->base_time = AV_NOPTS_VALUE;
+  jitter_buffer->next_pts = AV_NOPTS_VALUE;
+  jitter_buffer->stats = stats;
+
+  store_stat(jitter_buffer, JITTER_BUFFER_DELAY_MS, min_delay_ms);
+
+  return jitter_buffer;
+}
+
+void jitter_buffer_free(JitterBuffer **jitter_buffer) {
+  if (*jitter_buffer == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < (*jitter_buffer)->count; i++) {
+    packet_pool_release(&(*jitter_buffer)->entries[i].pkt);
+  }
+
+  av_freep(jitter_buffer);
+}
+
+// Adapts the delay to the worst lateness seen recently
+static void update_delay(JitterBuffer *jitter_buffer, int64_t lateness) {
+  int64_t peak = jitter_buffer->peak_lateness - (jitter_buffer->peak_lateness >> PEAK_DECAY_SHIFT);
+  jitter_buffer->peak_lateness = lateness > peak ? lateness : peak;
+
+  int64_t delay = FFMIN(FFMAX(jitter_buffer->peak_lateness, jitter_buffer->min_delay), jitter_buffer->max_delay);
+  if (delay / 1000 != jitter_buffer->delay / 1000) {
+    store_stat(jitter_buffer, JITTER_BUFFER_DELAY_MS, (int32_t)(delay / 1000));
+  }
+  jitter_buffer->delay = delay;
+}
+
+void jitter_buffer_put(JitterBuffer *jitter_buffer, AVPacket *pkt, int64_t now) {
+  int64_t pts = pkt->pts;
+
+  if (jitter_buffer->base_time == AV_NOPTS_VALUE) {
+    anchor(jitter_buffer, now, pts);
+  }
+
+  if (jitter_buffer->next_pts != AV_NOPTS_VALUE && pts < jitter_buffer->next_pts) {
+    int64_t max_delay_pts = av_rescale(jitter_buffer->max_delay, PTS_RATE, MICROSECONDS);
+    if (pts >= jitter_buffer->next_pts - max_delay_pts) {
+      // Its playout time has passed, and it has already been concealed
+      increment_stat(jitter_buffer, JITTER_BUFFER_LATE_PACKETS);
+      packet_pool_release(&pkt);
+      return;
+    }
+
+    // Too far back to be late, so the timeline was reset
+    jitter_buffer->epoch++;
+    jitter_buffer->next_pts = AV_NOPTS_VALUE;
+    anchor(jitter_buffer, now, pts);
+  }
+
+  int64_t lateness = now - arrival_time(jitter_buffer, pts);
+  if (lateness < 0 || lateness > jitter_buffer->max_delay * 2) {
+    // Either this packet took the quickest path yet, or the timestamps stood
+    // still while the sender paused. Either way, measure from here.
+    anchor(jitter_buffer, now, pts);
+    lateness = 0;
+  }
+  update_delay(jitter_buffer, lateness);
+
+  if (jitter_buffer->count == JITTER_BUFFER_CAPACITY) {
+    fprintf(stderr, "WARNING: jitter buffer full, dropping packet pts=%lld\n", (long long)pts);
+    packet_pool_release(&pkt);
+    return;
+  }
+
+  // Packets almost always arrive in order, so search from the end
+  int i = jitter_buffer->count;
+  while (i > 0) {
+    const JitterBufferEntry *previous = &jitter_buffer->entries[i - 1];
+    if (previous->epoch < jitter_buffer->epoch || previous->pkt->pts < pts) {
+      break;
+    }
+    if (previous->pkt->pts == pts) {
+      // Duplicate
+      packet_pool_release(&pkt);
+      return;
+    }
+    i--;
+  }
+
+  if (i < jitter_buffer->count) {
+    increment_stat(jitter_buffer, JITTER_BUFFER_REORDERED_PACKETS);
+    memmove(&jitter_buffer->entries[i + 1], &jitter_buffer->entries[i], (jitter_buffer->count - i) * sizeof(JitterBufferEntry));
+  }
+
+  jitter_buffer->entries[i].pkt = pkt;
+  jitter_buffer->entries[i].epoch = jitter_buffer->epoch;
+  jitter_buffer->count++;
+}
+
+int64_t jitter_buffer_next_due(const JitterBuffer *jitter_buffer) {
+  if (jitter_buffer->count == 0) {
+    return AV_NOPTS_VALUE;
+  }
+
+  const JitterBufferEntry *head = &jitter_buffer->entries[0];
+  if (head->epoch < jitter_buffer->epoch) {
+    // Left over from before the timeline was reset
+    return 0;
+  }
+
+  return arrival_time(jitter_buffer, head->pkt->pts) + jitter_buffer->delay;
+}
+
+AVPacket *jitter_buffer_get(JitterBuffer *jitter_buffer, int64_t now) {
+  int64_t due = jitter_buffer_next_due(jitter_buffer);
+  if (due == AV_NOPTS_VALUE || due > now) {
+    return NULL;
+  }
+
+  return jitter_buffer_pop(jitter_buffer);
+}
+
+const AVPacket *jitter_buffer_peek(const JitterBuffer *jitter_buffer) {
+  return jitter_buffer->count > 0 ? jitter_buffer->entries[0].pkt : NULL;
+}
+
+AVPacket *jitter_buffer_pop(JitterBuffer *jitter_buffer) {
+  if (jitter_buffer->count == 0) {
+    return NULL;
+  }
+
+  JitterBufferEntry head = jitter_buffer->entries[0];
+  jitter_buffer->count--;
+  memmove(&jitter_buffer->entries[0], &jitter_buffer->entries[1], jitter_buffer->count * sizeof(JitterBufferEntry));
+
+  if (head.epoch == jitter_buffer->epoch) {
+    jitter_buffer->next_pts = head.pkt->pts + head.pkt->duration;
+  }
+
+  return head.pkt;
+}
+
+void jitter_buffer_drop_late(JitterBuffer *jitter_buffer) {
+  AVPacket *pkt = jitter_buffer_pop(jitter_buffer);
+  if (pkt != NULL) {
+    increment_stat(jitter_buffer, JITTER_BUFFER_LATE_PACKETS);
+    packet_pool_release(&pkt);
+  }
+}
+
+int64_t jitter_buffer_end_pts(const JitterBuffer *jitter_buffer) {
+  if (jitter_buffer->count == 0) {
+    return AV_NOPTS_VALUE;
+  }
+
+  const AVPacket *newest = jitter_buffer->entries[jitter_buffer->count - 1].pkt;
+  return newest->pts + newest->duration;
+}
+
+int64_t jitter_buffer_delay(const JitterBuffer *jitter_buffer) {
+  return jitter_buffer->delay;
+}
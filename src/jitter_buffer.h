@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// Receive side jitter buffer between the RTP demuxer and the Opus decoder. It
+// puts packets back in timestamp order and holds each one until its playout
+// time, so that packets which arrive late or out of order can still be decoded
+// instead of being concealed. The playout delay adapts to the measured jitter,
+// between a minimum and a maximum.
+//
+// Packets are ordered by their RTP timestamp rather than the sequence number,
+// since the FFmpeg RTP demuxer doesn't expose sequence numbers. Opus
+// timestamps always increase by the duration of each packet, so this is the
+// same order.
+//
+// The stats live in a SharedArrayBuffer so JavaScript can read them without
+// calling into the native module. The layout must match jitterStats in
+// src/index.ts:
+//
+//   int32 fields[4]
+#define JITTER_BUFFER_STATS_SIZE 16
+
+enum JitterBufferStatsField {
+  // Current playout delay
+  JITTER_BUFFER_DELAY_MS = 0,
+
+  // Packets that arrived after their playout time and were dropped
+  JITTER_BUFFER_LATE_PACKETS = 1,
+
+  // Packets that arrived out of order and were put back in place
+  JITTER_BUFFER_REORDERED_PACKETS = 2,
+};
+
+struct JitterBuffer;
+
+// stats can be NULL. Returns NULL if out of memory.
+JitterBuffer *jitter_buffer_alloc(int min_delay_ms, int max_delay_ms, int32_t *stats);
+
+void jitter_buffer_free(JitterBuffer **jitter_buffer);
+
+// Takes ownership of pkt, and releases it to the packet pool. Times are from av_gettime_relative().
+void jitter_buffer_put(JitterBuffer *jitter_buffer, AVPacket *pkt, int64_t now);
+
+// Returns the next packet if its playout time has come, or NULL. Pass
+// INT64_MAX as now to drain the buffer.
+AVPacket *jitter_buffer_get(JitterBuffer *jitter_buffer, int64_t now);
+
+// Returns when the next packet is due, or AV_NOPTS_VALUE if the buffer is
+// empty.
+int64_t jitter_buffer_next_due(const JitterBuffer *jitter_buffer);
+
+// Functions for a caller that runs its own playout clock instead of using
+// jitter_buffer_get().
+
+// Returns the packet with the lowest pts without removing it, or NULL
+const AVPacket *jitter_buffer_peek(const JitterBuffer *jitter_buffer);
+
+// Removes and returns the packet with the lowest pts, or NULL
+AVPacket *jitter_buffer_pop(JitterBuffer *jitter_buffer);
+
+// Drops the packet with the lowest pts and counts it as late
+void jitter_buffer_drop_late(JitterBuffer *jitter_buffer);
+
+// Returns the pts that follows the newest packet, or AV_NOPTS_VALUE if the
+// buffer is empty
+int64_t jitter_buffer_end_pts(const JitterBuffer *jitter_buffer);
+
+// Returns the current playout delay in microseconds
+int64_t jitter_buffer_delay(const JitterBuffer *jitter_buffer);
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libswresample/swresample.h>
+}
+
+#include "mixer.h"
+#include "thread_messages.h"
+
+// Max 20ms frame at 48kHz
+#define MAX_FRAME_SIZE 960
+
+struct MixerInput {
+  const MixerInputParams *params;
+
+  // Audio that has been taken from the queue, at the mixer's sample rate
+  AVAudioFifo *fifo;
+
+  // NULL if the input is at the mixer's sample rate
+  SwrContext *swr;
+  int16_t *resampled;
+  unsigned int resampled_size;
+
+  // Value of MIXER_INPUT_CLEAR_COUNT when the fifo was last emptied
+  int32_t clear_count;
+};
+
+struct Mixer {
+  MixerInput inputs[MIXER_MAX_INPUTS];
+  int count;
+  int frame_size;
+  int32_t *waiting;
+  int16_t samples[MAX_FRAME_SIZE];
+};
+
+static inline int32_t load_field(const MixerInput *input, MixerInputField field) {
+  return __atomic_load_n(&input->params->bufferedAudio.fields[field], __ATOMIC_SEQ_CST);
+}
+
+static bool is_paused(const MixerInput *input) {
+  return load_field(input, MIXER_INPUT_PAUSED) != 0;
+}
+
+int mixer_alloc(const MixerInputParams *inputs, int count, int sample_rate, int frame_size, int32_t *waiting, Mixer **mixer) {
+  if (count > MIXER_MAX_INPUTS || frame_size > MAX_FRAME_SIZE) {
+    return AVERROR(EINVAL);
+  }
+
+  Mixer *m = (Mixer *)av_mallocz(sizeof(Mixer));
+  if (m == NULL) {
+    return AVERROR(ENOMEM);
+  }
+  m->frame_size = frame_size;
+  m->waiting = waiting;
+
+  int ret = 0;
+  for (int i = 0; i < count; i++) {
+    MixerInput *input = &m->inputs[i];
+    input->params = &inputs[i];
+    m->count++;
+
+    input->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_S16, 1, frame_size * 2);
+    if (input->fifo == NULL) {
+      ret = AVERROR(ENOMEM);
+      goto fail;
+    }
+
+    if (inputs[i].sampleRate != sample_rate) {
+      AVChannelLayout mono = AV_CHANNEL_LAYOUT_MONO;
+      ret = swr_alloc_set_opts2(&input->swr,
+                                &mono, AV_SAMPLE_FMT_S16, sample_rate,
+                                &mono, AV_SAMPLE_FMT_S16, inputs[i].sampleRate,
+                                0, NULL);
+      if (ret < 0) {
+        goto fail;
+      }
+
+      ret = swr_init(input->swr);
+      if (ret < 0) {
+        goto fail;
+      }
+    }
+  }
+
+  *mixer = m;
+  return 0;
+
+fail:
+  mixer_free(&m);
+  return ret;
+}
+
+void mixer_free(Mixer **mixer) {
+  if (*mixer == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < (*mixer)->count; i++) {
+    MixerInput *input = &(*mixer)->inputs[i];
+    av_audio_fifo_free(input->fifo);
+    swr_free(&input->swr);
+    av_free(input->resampled);
+  }
+
+  av_freep(mixer);
+}
+
+// Drops what was taken from the queue before the input was cleared. The queue
+// itself was emptied by mixer_clear_input(), before it bumped the count.
+static void check_cleared(MixerInput *input) {
+  int32_t clear_count = load_field(input, MIXER_INPUT_CLEAR_COUNT);
+  if (clear_count == input->clear_count) {
+    return;
+  }
+  input->clear_count = clear_count;
+
+  av_audio_fifo_reset(input->fifo);
+  if (input->swr != NULL) {
+    // Forgets the samples that it was holding on to
+    swr_init(input->swr);
+  }
+}
+
+// Moves one buffer from the queue into the fifo. Returns false if the queue is
+// empty.
+static bool take_buffer(MixerInput *input) {
+  const MixerInputParams *params = input->params;
+  ThreadMessage thread_message;
+
+  if (av_thread_message_queue_recv(params->queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK) < 0) {
+    return false;
+  }
+
+  if (thread_message.type != POST_PCM_BUFFER) {
+    thread_message_free_func(&thread_message);
+    return true;
+  }
+
+  const int16_t *samples = (const int16_t *)thread_message.param.buf->data;
+  int count = thread_message.param.buf->size / sizeof(int16_t);
+
+  buffered_audio_release(&params->bufferedAudio, mixer_input_ticks(count, params->sampleRate));
+  buffered_audio_notify_queue_room(&params->bufferedAudio);
+
+  if (input->swr != NULL) {
+    int max_output = swr_get_out_samples(input->swr, count);
+    av_fast_malloc(&input->resampled, &input->resampled_size, max_output * sizeof(int16_t));
+    if (input->resampled == NULL) {
+      fprintf(stderr, "mixer: out of memory for resampling\n");
+      thread_message_free_func(&thread_message);
+      return true;
+    }
+
+    uint8_t *output = (uint8_t *)input->resampled;
+    count = swr_convert(input->swr, &output, max_output, (const uint8_t **)&samples, count);
+    if (count < 0) {
+      fprintf(stderr, "mixer: swr_convert failed [%d]\n", count);
+      count = 0;
+    }
+    samples = input->resampled;
+  }
+
+  if (count > 0 && av_audio_fifo_write(input->fifo, (void **)&samples, count) < 0) {
+    fprintf(stderr, "mixer: out of memory for %d samples\n", count);
+  }
+
+  thread_message_free_func(&thread_message);
+  return true;
+}
+
+// Takes buffers from the queue until the fifo holds a full frame. Returns the
+// number of samples in the fifo. The clear count is checked after every
+// buffer, so a buffer that was taken while the input was being cleared is
+// never mixed.
+static int fill(Mixer *mixer, MixerInput *input) {
+  check_cleared(input);
+
+  while (av_audio_fifo_size(input->fifo) < mixer->frame_size && take_buffer(input)) {
+    check_cleared(input);
+  }
+
+  return av_audio_fifo_size(input->fifo);
+}
+
+bool mixer_ready(Mixer *mixer, bool partial) {
+  for (int i = 0; i < mixer->count; i++) {
+    MixerInput *input = &mixer->inputs[i];
+    if (is_paused(input)) {
+      continue;
+    }
+
+    int available = fill(mixer, input);
+    if (available >= mixer->frame_size || (partial && available > 0)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Adds input * gain to output with saturation. This is kept to plain int32
+// arithmetic on arrays, so that the compiler vectorizes it into saturating
+// adds.
+static void mix_samples(int16_t *output, const int16_t *input, int count, int32_t gain) {
+  for (int i = 0; i < count; i++) {
+    int32_t sample = output[i] + ((input[i] * gain) >> MIXER_GAIN_SHIFT);
+    output[i] = (int16_t)FFMIN(FFMAX(sample, INT16_MIN), INT16_MAX);
+  }
+}
+
+void mixer_mix(Mixer *mixer, int16_t *frame) {
+  for (int i = 0; i < mixer->count; i++) {
+    MixerInput *input = &mixer->inputs[i];
+    if (is_paused(input)) {
+      continue;
+    }
+
+    fill(mixer, input);
+
+    void *samples = mixer->samples;
+    int count = av_audio_fifo_read(input->fifo, &samples, mixer->frame_size);
+    if (count <= 0) {
+      continue;
+    }
+
+    int32_t gain = FFMIN(FFMAX(load_field(input, MIXER_INPUT_GAIN), 0), MIXER_MAX_GAIN);
+    mix_samples(frame, mixer->samples, count, gain);
+  }
+}
+
+bool mixer_prepare_wait(Mixer *mixer) {
+  __atomic_store_n(mixer->waiting, 1, __ATOMIC_SEQ_CST);
+
+  if (!mixer_ready(mixer, false)) {
+    return true;
+  }
+
+  // An input was written to after we last looked. If the writer already
+  // cleared the flag, a wakeup message is on its way and it's safe to block.
+  int32_t expected = 1;
+  return !__atomic_compare_exchange_n(mixer->waiting, &expected, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+bool mixer_take_waiting(int32_t *waiting) {
+  return __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+int64_t mixer_clear_input(const MixerInputParams *input) {
+  int64_t discarded = 0;
+  ThreadMessage thread_message;
+
+  while (av_thread_message_queue_recv(input->queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK) >= 0) {
+    if (thread_message.type == POST_PCM_BUFFER) {
+      discarded += mixer_input_ticks(thread_message.param.buf->size / sizeof(int16_t), input->sampleRate);
+    }
+    thread_message_free_func(&thread_message);
+  }
+
+  // Bumped once the queue is empty, so that the mixer also drops what it took
+  // from the queue while it was being emptied. Nothing newer can have been
+  // queued yet, since JavaScript is still in this call.
+  __atomic_add_fetch(&input->bufferedAudio.fields[MIXER_INPUT_CLEAR_COUNT], 1, __ATOMIC_SEQ_CST);
+
+  return discarded;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavutil/threadmessage.h>
+}
+
+#include "buffered_audio.h"
+
+// Extra PCM inputs of an encoder, such as background music under
+// text-to-speech, that are mixed into each frame just before it's encoded.
+// Each input has its own message queue, sample rate, gain and buffered audio
+// counter, so one input that is written far ahead doesn't hold up another.
+//
+// Frames are still driven by the PCM from write(). When that has nothing
+// waiting, the encoder encodes a frame of the inputs alone as soon as one of
+// them has a full frame, so background audio carries on between replies.
+#define MIXER_MAX_INPUTS 8
+
+// Each input has an Int32Array in a SharedArrayBuffer, which starts with the
+// fields of its BufferedAudio. The layout must match MixerInput in
+// src/index.ts:
+//
+//   int32 fields[8]
+#define MIXER_INPUT_SIZE 32
+
+enum MixerInputField {
+  // Gain in 1/MIXER_GAIN_ONE steps, from 0 to MIXER_MAX_GAIN
+  MIXER_INPUT_GAIN = 2,
+
+  // Non-zero while the input is paused. Its audio stays queued.
+  MIXER_INPUT_PAUSED = 3,
+
+  // Incremented when the input is cleared, after its queue has been emptied,
+  // so that the mixer drops the audio that it has already taken from the queue
+  MIXER_INPUT_CLEAR_COUNT = 4,
+};
+
+#define MIXER_GAIN_SHIFT 12
+#define MIXER_GAIN_ONE (1 << MIXER_GAIN_SHIFT)
+
+// Keeps the product of a sample and the gain within 32 bits
+#define MIXER_MAX_GAIN (8 * MIXER_GAIN_ONE)
+
+struct MixerInputParams {
+  int32_t sampleRate;
+
+  // Counts the audio in the queue. fields points into the input's Int32Array.
+  BufferedAudio bufferedAudio;
+
+  // POST_PCM_BUFFER messages from JavaScript, with queueDepth slots
+  AVThreadMessageQueue *queue;
+  int32_t queueDepth;
+};
+
+struct Mixer;
+
+// inputs must outlive the mixer. waiting is set while the encoder is blocked
+// and needs to be woken up when an input is written to. Returns 0, or a
+// negative error code if an input's sample rate can't be converted.
+int mixer_alloc(const MixerInputParams *inputs, int count, int sample_rate, int frame_size, int32_t *waiting, Mixer **mixer);
+
+void mixer_free(Mixer **mixer);
+
+// Returns true if an input that isn't paused has a full frame of audio, or any
+// audio at all when partial is true. Takes audio from the input queues as
+// needed.
+bool mixer_ready(Mixer *mixer, bool partial);
+
+// Adds the next frame of every input that isn't paused to frame, with
+// saturation. An input that doesn't have a full frame adds what it has.
+void mixer_mix(Mixer *mixer, int16_t *frame);
+
+// Call before the encoder blocks on its message queue. Returns false if an
+// input already has a full frame, in which case it mustn't block.
+bool mixer_prepare_wait(Mixer *mixer);
+
+// Called by JavaScript after posting to an input's queue. Returns true if the
+// encoder is blocked and needs to be woken up.
+bool mixer_take_waiting(int32_t *waiting);
+
+// Called by JavaScript. Drops the audio in an input's queue, and tells the
+// mixer to drop what it has taken from it. Returns the ticks of buffered
+// audio that were removed from the queue.
+int64_t mixer_clear_input(const MixerInputParams *input);
+
+// Ticks of buffered audio for a buffer of samples at sample_rate. Input sample
+// rates don't have to divide 48kHz, so this is rounded down.
+static inline int32_t mixer_input_ticks(int64_t samples, int32_t sample_rate) {
+  return (int32_t)(samples * 48000 / sample_rate);
+}
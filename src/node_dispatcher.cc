@@ -0,0 +1,136 @@
+#include <stdio.h>
+
+#include <node_api.h>
+#include <uv.h>
+
+#include "node_dispatcher.h"
+
+struct Dispatcher {
+  napi_env env;
+  uv_async_t async;
+  bool initialized;
+
+  // Sources that are not released yet, which keep the loop alive
+  int live_sources;
+
+  // Multiple producer, single consumer stack of queued sources. Producers push
+  // with compare and swap, and the main thread takes the whole stack at once,
+  // so there's no ABA problem.
+  DispatchSource *head;
+};
+
+static Dispatcher dispatcher;
+
+static void report_exception(napi_env env) {
+  bool is_pending;
+  if (napi_is_exception_pending(env, &is_pending) != napi_ok || !is_pending) {
+    return;
+  }
+
+  // Other sources still have to be dispatched, which can't be done with an
+  // exception pending. Report it the way an exception in any other callback
+  // from the event loop would be.
+  napi_value exception;
+  if (napi_get_and_clear_last_exception(env, &exception) == napi_ok) {
+    napi_fatal_exception(env, exception);
+  }
+}
+
+static void dispatcher_async_callback(uv_async_t *async) {
+  DispatchSource *list = __atomic_exchange_n(&dispatcher.head, (DispatchSource *)NULL, __ATOMIC_ACQUIRE);
+  if (list == NULL) {
+    return;
+  }
+
+  // The stack is newest first
+  DispatchSource *ordered = NULL;
+  while (list != NULL) {
+    DispatchSource *next = list->next;
+    list->next = ordered;
+    ordered = list;
+    list = next;
+  }
+
+  napi_env env = dispatcher.env;
+  napi_handle_scope scope;
+  napi_status status = napi_open_handle_scope(env, &scope);
+  if (status != napi_ok) {
+    fprintf(stderr, "napi_open_handle_scope is fail status [%d]", status);
+    return;
+  }
+
+  while (ordered != NULL) {
+    // Dispatching may release and free this source, or ones after it
+    DispatchSource *source = ordered;
+    ordered = source->next;
+    source->next = NULL;
+
+    if (source->released) {
+      source->free_source(source);
+      continue;
+    }
+
+    // Cleared first, so that a wakeup during the dispatch queues it again
+    __atomic_store_n(&source->queued, 0, __ATOMIC_SEQ_CST);
+    source->dispatch(source);
+    report_exception(env);
+  }
+
+  status = napi_close_handle_scope(env, scope);
+  if (status != napi_ok) {
+    fprintf(stderr, "napi_close_handle_scope is fail status [%d]", status);
+  }
+}
+
+napi_status dispatch_source_init(napi_env env, DispatchSource *source, void (*dispatch)(DispatchSource *source), void *opaque) {
+  if (!dispatcher.initialized) {
+    int ret = uv_async_init(uv_default_loop(), &dispatcher.async, dispatcher_async_callback);
+    if (ret != 0) {
+      napi_throw_error(env, NULL, "uv_async_init failed");
+      return napi_pending_exception;
+    }
+    uv_unref((uv_handle_t *)&dispatcher.async);
+    dispatcher.env = env;
+    dispatcher.initialized = true;
+  }
+
+  source->dispatch = dispatch;
+  source->opaque = opaque;
+  source->next = NULL;
+  source->queued = 0;
+  source->released = false;
+  source->free_source = NULL;
+
+  if (dispatcher.live_sources++ == 0) {
+    uv_ref((uv_handle_t *)&dispatcher.async);
+  }
+
+  return napi_ok;
+}
+
+void dispatcher_wake(DispatchSource *source) {
+  if (__atomic_exchange_n(&source->queued, 1, __ATOMIC_SEQ_CST) == 0) {
+    DispatchSource *head = __atomic_load_n(&dispatcher.head, __ATOMIC_RELAXED);
+    do {
+      source->next = head;
+    } while (!__atomic_compare_exchange_n(&dispatcher.head, &head, source, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+  // libuv coalesces these, so the loop wakes up once for everything that was
+  // queued since the last time
+  uv_async_send(&dispatcher.async);
+}
+
+void dispatch_source_release(DispatchSource *source, void (*free_source)(DispatchSource *source)) {
+  source->released = true;
+  source->free_source = free_source;
+
+  if (--dispatcher.live_sources == 0) {
+    uv_unref((uv_handle_t *)&dispatcher.async);
+  }
+
+  // A queued source is still on the dispatcher's list
+  if (__atomic_load_n(&source->queued, __ATOMIC_SEQ_CST) == 0) {
+    free_source(source);
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <node_api.h>
+
+// Wakes up the event loop on behalf of every native thread with one shared
+// uv_async_t, instead of a handle per session. libuv checks every async handle
+// on each wakeup, so with thousands of sessions a handle each costs more than
+// the callbacks themselves.
+//
+// A thread calls dispatcher_wake() to ask for a source's dispatch function to
+// be called on the main thread. Sources that are woken up again before that
+// are only queued once. Each wakeup of the loop dispatches every queued source
+// in the order they were first woken up, within a single handle scope.
+struct DispatchSource {
+  // Called on the main thread
+  void (*dispatch)(DispatchSource *source);
+  void *opaque;
+
+  // Owned by the dispatcher
+  DispatchSource *next;
+  int queued;
+  bool released;
+  void (*free_source)(DispatchSource *source);
+};
+
+// Main thread only. Starts the dispatcher on first use. The dispatcher only
+// keeps the loop alive while there are sources that haven't been released.
+napi_status dispatch_source_init(napi_env env, DispatchSource *source, void (*dispatch)(DispatchSource *source), void *opaque);
+
+// Thread safe
+void dispatcher_wake(DispatchSource *source);
+
+// Main thread only, once nothing will wake the source up again. free_source is
+// called right away, or after the source's pending dispatch has been skipped.
+void dispatch_source_release(DispatchSource *source, void (*free_source)(DispatchSource *source));
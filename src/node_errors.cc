@@ -1,5 +1,9 @@
 #include "node_errors.h"
 
+extern "C" {
+#include <opus/opus.h>
+}
+
 
 napi_status create_ffmpeg_error(napi_env env, int errnum, napi_value *result) {
   napi_status status;
@@ -32,3 +36,25 @@ napi_status throw_ffmpeg_error(napi_env env, int errnum) {
     return napi_ok;
   }
 }
+
+// Copied from libavcodec/libopus.c
+int ff_opus_error_to_averror(int err) {
+  switch (err) {
+    case OPUS_BAD_ARG:
+      return AVERROR(EINVAL);
+    case OPUS_BUFFER_TOO_SMALL:
+      return AVERROR_UNKNOWN;
+    case OPUS_INTERNAL_ERROR:
+      return AVERROR(EFAULT);
+    case OPUS_INVALID_PACKET:
+      return AVERROR_INVALIDDATA;
+    case OPUS_UNIMPLEMENTED:
+      return AVERROR(ENOSYS);
+    case OPUS_INVALID_STATE:
+      return AVERROR_UNKNOWN;
+    case OPUS_ALLOC_FAIL:
+      return AVERROR(ENOMEM);
+    default:
+      return AVERROR(EINVAL);
+  }
+}
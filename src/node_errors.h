@@ -49,3 +49,6 @@ av_always_inline char *av_err2str(int errnum) {
 
 napi_status create_ffmpeg_error(napi_env env, int errnum, napi_value *result);
 napi_status throw_ffmpeg_error(napi_env env, int errnum);
+
+// Converts an error code returned by libopus to an AVERROR
+int ff_opus_error_to_averror(int err);
@@ -0,0 +1,671 @@
+#include <stdio.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/crc.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mem.h>
+}
+
+#include "ogg_parser.h"
+
+// Opus always runs at 48kHz, whatever the OpusHead says the input rate was
+#define OPUS_SAMPLE_RATE 48000
+
+#define OGG_HEADER_SIZE 27
+#define OGG_MAX_SEGMENTS 255
+#define OGG_MAX_PAGE_SIZE (OGG_HEADER_SIZE + OGG_MAX_SEGMENTS + OGG_MAX_SEGMENTS * 255)
+
+#define OGG_FLAG_CONTINUED 0x01
+#define OGG_FLAG_BOS 0x02
+#define OGG_FLAG_EOS 0x04
+
+// The fixed part of the OpusHead, and the largest channel mapping table
+#define OPUS_HEAD_MIN_SIZE 19
+#define OPUS_HEAD_MAX_SIZE (OPUS_HEAD_MIN_SIZE + 2 + 255)
+
+// An Opus packet is at most 120ms, so a packet that grows past this over many
+// pages is garbage.
+#define MAX_PARTIAL_PACKET_SIZE (1 << 20)
+
+#define MAX_WARNING_COUNT 10
+
+enum OggStreamState {
+  // Waiting for the first page of an Opus stream
+  OGG_STREAM_NONE,
+  OGG_STREAM_HEAD,
+  OGG_STREAM_TAGS,
+  OGG_STREAM_AUDIO,
+};
+
+// A whole packet on the current page
+struct OggPacketSpan {
+  const uint8_t *data;
+  int size;
+
+  // AVERROR_INVALIDDATA if the TOC is malformed
+  int duration;
+};
+
+struct OggParser {
+  // Chunk that is being parsed, and how far into it
+  AVBufferRef *input;
+  size_t input_offset;
+
+  // A page that straddles two chunks is copied into a buffer from the pool, so
+  // the packets on it can reference it like a chunk.
+  AVBufferPool *page_pool;
+  AVBufferRef *carry;
+  size_t carry_size;
+
+  // Page that packets are being taken from. It references either a chunk or a
+  // carry buffer.
+  AVBufferRef *page;
+  OggPacketSpan packets[OGG_MAX_SEGMENTS];
+  int packet_count;
+  int packet_index;
+  bool end_of_stream;
+
+  // When the first packet on the page continued from the previous page, both
+  // parts are copied into this.
+  AVBufferRef *joined;
+
+  // Start of the packet that continues on the next page
+  uint8_t *partial;
+  unsigned int partial_capacity;
+  int partial_size;
+
+  OggStreamState state;
+  uint32_t serial;
+  uint32_t sequence;
+  uint8_t head[OPUS_HEAD_MAX_SIZE];
+  int head_size;
+
+  // Granule position of the next packet, which counts samples from the start
+  // of the stream, including the pre-skip. AV_NOPTS_VALUE until a page with a
+  // granule position has been seen.
+  int64_t position;
+
+  // Granule position of the first packet in the stream
+  int64_t start_position;
+
+  // pts of the first packet in the stream, and of the packet after the last
+  // one that was read.
+  int64_t stream_pts;
+  int64_t next_pts;
+
+  int warning_count;
+};
+
+int opus_packet_duration(const uint8_t *data, int size) {
+  if (size < 1) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  // Taken from ffmpeg oggparseopus.c
+  unsigned nb_frames  = 1;
+  unsigned toc        = data[0];
+  unsigned toc_config = toc >> 3;
+  unsigned toc_count  = toc & 3;
+  unsigned frame_size = toc_config < 12 ? FFMAX(480, 960 * (toc_config & 3)) :
+                        toc_config < 16 ? 480 << (toc_config & 1) :
+                                          120 << (toc_config & 3);
+  if (toc_count == 3) {
+    if (size < 2) {
+      return AVERROR_INVALIDDATA;
+    }
+    nb_frames = data[1] & 0x3F;
+  } else if (toc_count) {
+    nb_frames = 2;
+  }
+
+  return frame_size * nb_frames;
+}
+
+static void warn(OggParser *parser, const char *message) {
+  if (parser->warning_count < MAX_WARNING_COUNT) {
+    parser->warning_count++;
+    fprintf(stderr, "WARNING: ogg parser %s\n", message);
+  }
+}
+
+OggParser *ogg_parser_alloc(void) {
+  OggParser *parser = (OggParser *)av_mallocz(sizeof(OggParser));
+  if (parser == NULL) {
+    return NULL;
+  }
+
+  parser->page_pool = av_buffer_pool_init(OGG_MAX_PAGE_SIZE + AV_INPUT_BUFFER_PADDING_SIZE, NULL);
+  if (parser->page_pool == NULL) {
+    av_freep(&parser);
+    return NULL;
+  }
+
+  ogg_parser_reset(parser);
+
+  return parser;
+}
+
+void ogg_parser_free(OggParser **parser) {
+  if (*parser == NULL) {
+    return;
+  }
+
+  ogg_parser_reset(*parser);
+  av_buffer_unref(&(*parser)->carry);
+  av_buffer_pool_uninit(&(*parser)->page_pool);
+  av_freep(&(*parser)->partial);
+  av_freep(parser);
+}
+
+void ogg_parser_reset(OggParser *parser) {
+  av_buffer_unref(&parser->input);
+  parser->input_offset = 0;
+
+  // The carry buffer is kept for the next stream
+  parser->carry_size = 0;
+
+  av_buffer_unref(&parser->page);
+  av_buffer_unref(&parser->joined);
+  parser->packet_count = 0;
+  parser->packet_index = 0;
+  parser->end_of_stream = false;
+
+  parser->partial_size = 0;
+
+  parser->state = OGG_STREAM_NONE;
+  parser->head_size = 0;
+  parser->position = AV_NOPTS_VALUE;
+  parser->start_position = AV_NOPTS_VALUE;
+  parser->stream_pts = 0;
+  parser->next_pts = 0;
+}
+
+void ogg_parser_feed(OggParser *parser, AVBufferRef **buf) {
+  av_buffer_unref(&parser->input);
+  parser->input = *buf;
+  parser->input_offset = 0;
+  *buf = NULL;
+}
+
+// Returns the offset of the first place a page could start: a capture pattern,
+// or the start of one that is cut off by the end of the data.
+static size_t find_capture_pattern(const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (memcmp(data + i, "OggS", FFMIN(4, size - i)) == 0) {
+      return i;
+    }
+  }
+  return size;
+}
+
+// Returns the size of the page that data starts with, or 0 if the header and
+// segment table aren't all there yet.
+static size_t get_page_size(const uint8_t *data, size_t size) {
+  if (size < OGG_HEADER_SIZE || size < (size_t)OGG_HEADER_SIZE + data[26]) {
+    return 0;
+  }
+
+  size_t page_size = OGG_HEADER_SIZE + data[26];
+  for (int i = 0; i < data[26]; i++) {
+    page_size += data[OGG_HEADER_SIZE + i];
+  }
+  return page_size;
+}
+
+static bool check_page(const uint8_t *data, size_t size) {
+  static const uint8_t zeros[4] = { 0 };
+
+  if (data[4] != 0) {
+    // Unknown version
+    return false;
+  }
+
+  // The checksum is calculated with the checksum field set to zero
+  const AVCRC *table = av_crc_get_table(AV_CRC_32_IEEE);
+  uint32_t crc = av_crc(table, 0, data, 22);
+  crc = av_crc(table, crc, zeros, 4);
+  crc = av_crc(table, crc, data + 26, size - 26);
+
+  // The table is for a big-endian CRC, so the result comes out byte swapped,
+  // like the little-endian field read as big-endian.
+  return crc == AV_RB32(data + 22);
+}
+
+// Copies up to size bytes of the chunk to the carry buffer. Returns false if the
+// chunk runs out first.
+static bool carry_input(OggParser *parser, size_t size) {
+  if (parser->input == NULL) {
+    return size == 0;
+  }
+
+  size_t available = (size_t)parser->input->size - parser->input_offset;
+  size_t copied = FFMIN(size, available);
+
+  memcpy(parser->carry->data + parser->carry_size, parser->input->data + parser->input_offset, copied);
+  parser->carry_size += copied;
+  parser->input_offset += copied;
+
+  if (parser->input_offset == (size_t)parser->input->size) {
+    av_buffer_unref(&parser->input);
+  }
+
+  return copied == size;
+}
+
+// Finds the next whole page with a valid checksum, and sets parser->page to
+// reference it. Returns 0, AVERROR(EAGAIN), or AVERROR(ENOMEM).
+static int next_page(OggParser *parser, const uint8_t **page_data, size_t *page_size) {
+  while (true) {
+    if (parser->carry_size > 0) {
+      uint8_t *carry = parser->carry->data;
+
+      size_t skip = find_capture_pattern(carry, parser->carry_size);
+      if (skip > 0) {
+        warn(parser, "skipped data between pages");
+        memmove(carry, carry + skip, parser->carry_size - skip);
+        parser->carry_size -= skip;
+        continue;
+      }
+
+      size_t size = get_page_size(carry, parser->carry_size);
+      size_t needed = size;
+      if (needed == 0) {
+        needed = parser->carry_size < OGG_HEADER_SIZE ? OGG_HEADER_SIZE : OGG_HEADER_SIZE + carry[26];
+      }
+
+      if (parser->carry_size < needed) {
+        if (!carry_input(parser, needed - parser->carry_size)) {
+          return AVERROR(EAGAIN);
+        }
+        continue;
+      }
+
+      if (!check_page(carry, size)) {
+        // The rest of the chunk is still searched, but not what was carried
+        warn(parser, "dropped a page with a bad checksum");
+        parser->carry_size = 0;
+        continue;
+      }
+
+      parser->page = parser->carry;
+      parser->carry = NULL;
+      parser->carry_size = 0;
+
+      *page_data = parser->page->data;
+      *page_size = size;
+      return 0;
+    }
+
+    if (parser->input == NULL) {
+      return AVERROR(EAGAIN);
+    }
+
+    const uint8_t *data = parser->input->data + parser->input_offset;
+    size_t available = (size_t)parser->input->size - parser->input_offset;
+
+    size_t skip = find_capture_pattern(data, available);
+    if (skip > 0) {
+      warn(parser, "skipped data between pages");
+      data += skip;
+      available -= skip;
+      parser->input_offset += skip;
+    }
+
+    if (available == 0) {
+      av_buffer_unref(&parser->input);
+      return AVERROR(EAGAIN);
+    }
+
+    size_t size = get_page_size(data, available);
+    if (size == 0 || size > available) {
+      // The page carries on in the next chunk
+      if (parser->carry == NULL) {
+        parser->carry = av_buffer_pool_get(parser->page_pool);
+        if (parser->carry == NULL) {
+          return AVERROR(ENOMEM);
+        }
+      }
+      carry_input(parser, available);
+      continue;
+    }
+
+    if (!check_page(data, size)) {
+      warn(parser, "dropped a page with a bad checksum");
+      parser->input_offset += 4;
+      continue;
+    }
+
+    parser->page = av_buffer_ref(parser->input);
+    if (parser->page == NULL) {
+      return AVERROR(ENOMEM);
+    }
+    parser->input_offset += size;
+
+    *page_data = data;
+    *page_size = size;
+    return 0;
+  }
+}
+
+static int append_partial(OggParser *parser, const uint8_t *data, int size) {
+  if (parser->partial_size + size > MAX_PARTIAL_PACKET_SIZE) {
+    warn(parser, "dropped a packet that is too large");
+    parser->partial_size = 0;
+    return 0;
+  }
+
+  uint8_t *partial = (uint8_t *)av_fast_realloc(parser->partial, &parser->partial_capacity, parser->partial_size + size);
+  if (partial == NULL) {
+    return AVERROR(ENOMEM);
+  }
+  parser->partial = partial;
+
+  memcpy(parser->partial + parser->partial_size, data, size);
+  parser->partial_size += size;
+  return 0;
+}
+
+// Copies the start of a packet from the previous page, and the rest of it from
+// this one, into parser->joined.
+static int join_partial(OggParser *parser, const uint8_t *data, int size, OggPacketSpan *span) {
+  int joined_size = parser->partial_size + size;
+
+  parser->joined = av_buffer_alloc(joined_size + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (parser->joined == NULL) {
+    return AVERROR(ENOMEM);
+  }
+
+  memcpy(parser->joined->data, parser->partial, parser->partial_size);
+  memcpy(parser->joined->data + parser->partial_size, data, size);
+  memset(parser->joined->data + joined_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+  parser->partial_size = 0;
+
+  span->data = parser->joined->data;
+  span->size = joined_size;
+  return 0;
+}
+
+// Matches the granule position of the page against the durations of the
+// packets that end on it.
+static void apply_granule_position(OggParser *parser, int64_t granule) {
+  int64_t total = 0;
+  for (int i = 0; i < parser->packet_count; i++) {
+    if (parser->packets[i].duration > 0) {
+      total += parser->packets[i].duration;
+    }
+  }
+
+  int64_t start = granule - total;
+
+  if (parser->position == AV_NOPTS_VALUE || start > parser->position) {
+    if (parser->position != AV_NOPTS_VALUE) {
+      warn(parser, "found a gap in the granule positions");
+    }
+    parser->position = start;
+  } else if (start < parser->position) {
+    if (!parser->end_of_stream) {
+      // Timestamps never go backwards, so the durations win
+      warn(parser, "found packets that are longer than the granule positions allow");
+      return;
+    }
+
+    // End trimming: the last page can cut the last packets short
+    int64_t trim = parser->position - start;
+    for (int i = parser->packet_count - 1; i >= 0 && trim > 0; i--) {
+      OggPacketSpan *span = &parser->packets[i];
+      if (span->duration > 0) {
+        int64_t cut = FFMIN(trim, (int64_t)span->duration);
+        span->duration -= (int)cut;
+        trim -= cut;
+      }
+    }
+  }
+}
+
+// Splits the page into packets, or skips it if it belongs to another stream
+static int split_page(OggParser *parser, const uint8_t *data, size_t size) {
+  int ret;
+
+  if (size < OGG_HEADER_SIZE || size < (size_t)OGG_HEADER_SIZE + data[26]) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  int flags = data[5];
+  int64_t granule = (int64_t)AV_RL64(data + 6);
+  uint32_t serial = AV_RL32(data + 14);
+  uint32_t sequence = AV_RL32(data + 18);
+  int segment_count = data[26];
+  const uint8_t *lacing = data + OGG_HEADER_SIZE;
+  const uint8_t *body = lacing + segment_count;
+
+  // Every packet below is read from the body, so the segment table has to
+  // fit within the page
+  size_t body_size = 0;
+  for (int i = 0; i < segment_count; i++) {
+    body_size += lacing[i];
+  }
+  if (body_size > size - OGG_HEADER_SIZE - segment_count) {
+    return AVERROR_INVALIDDATA;
+  }
+
+  if (flags & OGG_FLAG_BOS) {
+    if (parser->state != OGG_STREAM_NONE) {
+      // Another logical stream is multiplexed with this one
+      return 0;
+    }
+
+    parser->state = OGG_STREAM_HEAD;
+    parser->serial = serial;
+    parser->partial_size = 0;
+  } else if (parser->state == OGG_STREAM_NONE || serial != parser->serial) {
+    return 0;
+  } else if (sequence != parser->sequence + 1) {
+    warn(parser, "lost a page");
+    parser->partial_size = 0;
+    parser->position = AV_NOPTS_VALUE;
+  }
+  parser->sequence = sequence;
+  parser->end_of_stream = (flags & OGG_FLAG_EOS) != 0;
+
+  int segment = 0;
+  size_t offset = 0;
+
+  if (!(flags & OGG_FLAG_CONTINUED)) {
+    if (parser->partial_size > 0) {
+      warn(parser, "dropped a packet that didn't continue on the next page");
+      parser->partial_size = 0;
+    }
+  } else if (parser->partial_size == 0) {
+    // The start of this packet was lost
+    while (segment < segment_count) {
+      int length = lacing[segment++];
+      offset += length;
+      if (length < 255) {
+        break;
+      }
+    }
+  }
+
+  // A lacing value below 255 ends a packet
+  int packet_size = 0;
+  size_t packet_offset = offset;
+  for (; segment < segment_count; segment++) {
+    int length = lacing[segment];
+    packet_size += length;
+    offset += length;
+    if (length == 255) {
+      continue;
+    }
+
+    OggPacketSpan span = { body + packet_offset, packet_size, 0 };
+    if (parser->partial_size > 0) {
+      ret = join_partial(parser, span.data, span.size, &span);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+
+    if (span.size > 0) {
+      span.duration = opus_packet_duration(span.data, span.size);
+      parser->packets[parser->packet_count++] = span;
+    }
+
+    packet_size = 0;
+    packet_offset = offset;
+  }
+
+  if (packet_size > 0) {
+    ret = append_partial(parser, body + packet_offset, packet_size);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  // Header pages have a granule position of 0, and -1 means that no packet
+  // ends on this page.
+  if (parser->state == OGG_STREAM_AUDIO && granule != -1) {
+    apply_granule_position(parser, granule);
+  }
+
+  return 0;
+}
+
+static bool read_head(OggParser *parser, const OggPacketSpan *span) {
+  if (span->size < OPUS_HEAD_MIN_SIZE || span->size > OPUS_HEAD_MAX_SIZE || memcmp(span->data, "OpusHead", 8) != 0) {
+    return false;
+  }
+
+  // Only the major version is checked, as the spec says
+  if ((span->data[8] & 0xF0) != 0 || span->data[9] == 0) {
+    return false;
+  }
+
+  memcpy(parser->head, span->data, span->size);
+  parser->head_size = span->size;
+  return true;
+}
+
+static int output_packet(OggParser *parser, const OggPacketSpan *span, AVBufferRef *buf, AVPacket *pkt) {
+  pkt->buf = av_buffer_ref(buf);
+  if (pkt->buf == NULL) {
+    return AVERROR(ENOMEM);
+  }
+
+  pkt->data = (uint8_t *)span->data;
+  pkt->size = span->size;
+
+  if (parser->position == AV_NOPTS_VALUE) {
+    // No granule position yet, so carry on from the last packet
+    parser->position = parser->start_position == AV_NOPTS_VALUE
+      ? 0
+      : parser->start_position + parser->next_pts - parser->stream_pts;
+  }
+  if (parser->start_position == AV_NOPTS_VALUE) {
+    parser->start_position = parser->position;
+  }
+
+  pkt->pts = parser->stream_pts + parser->position - parser->start_position;
+  pkt->dts = pkt->pts;
+  pkt->duration = span->duration;
+
+  parser->position += span->duration;
+  parser->next_pts = pkt->pts + span->duration;
+
+  return 0;
+}
+
+int ogg_parser_read(OggParser *parser, AVPacket *pkt) {
+  int ret;
+
+  while (true) {
+    while (parser->packet_index < parser->packet_count) {
+      const OggPacketSpan *span = &parser->packets[parser->packet_index];
+      AVBufferRef *buf = parser->packet_index == 0 && parser->joined != NULL ? parser->joined : parser->page;
+      parser->packet_index++;
+
+      switch (parser->state) {
+        case OGG_STREAM_NONE:
+          break;
+
+        case OGG_STREAM_HEAD:
+          if (!read_head(parser, span)) {
+            // Some other codec, so wait for another stream
+            warn(parser, "skipped a stream that isn't Opus");
+            parser->state = OGG_STREAM_NONE;
+            break;
+          }
+
+          parser->state = OGG_STREAM_TAGS;
+          parser->position = AV_NOPTS_VALUE;
+          parser->start_position = AV_NOPTS_VALUE;
+          parser->stream_pts = parser->next_pts;
+          return OGG_PARSER_NEW_STREAM;
+
+        case OGG_STREAM_TAGS:
+          if (span->size < 8 || memcmp(span->data, "OpusTags", 8) != 0) {
+            warn(parser, "expected OpusTags");
+          }
+          parser->state = OGG_STREAM_AUDIO;
+          break;
+
+        case OGG_STREAM_AUDIO:
+          if (span->duration <= 0) {
+            // Malformed, or trimmed away entirely
+            break;
+          }
+          return output_packet(parser, span, buf, pkt);
+      }
+    }
+
+    if (parser->end_of_stream) {
+      // A chained stream may follow
+      parser->state = OGG_STREAM_NONE;
+      parser->end_of_stream = false;
+    }
+
+    av_buffer_unref(&parser->page);
+    av_buffer_unref(&parser->joined);
+    parser->packet_count = 0;
+    parser->packet_index = 0;
+
+    const uint8_t *data;
+    size_t size;
+    ret = next_page(parser, &data, &size);
+    if (ret < 0) {
+      return ret;
+    }
+
+    ret = split_page(parser, data, size);
+    if (ret < 0) {
+      return ret;
+    }
+  }
+}
+
+int ogg_parser_codec_parameters(const OggParser *parser, AVCodecParameters *codecpar) {
+  if (parser->head_size == 0) {
+    return AVERROR(EINVAL);
+  }
+
+  uint8_t *extradata = (uint8_t *)av_mallocz(parser->head_size + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (extradata == NULL) {
+    return AVERROR(ENOMEM);
+  }
+  memcpy(extradata, parser->head, parser->head_size);
+
+  av_freep(&codecpar->extradata);
+  codecpar->extradata = extradata;
+  codecpar->extradata_size = parser->head_size;
+
+  codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+  codecpar->codec_id = AV_CODEC_ID_OPUS;
+  codecpar->sample_rate = OPUS_SAMPLE_RATE;
+  codecpar->initial_padding = AV_RL16(parser->head + 10);
+
+  av_channel_layout_uninit(&codecpar->ch_layout);
+  av_channel_layout_default(&codecpar->ch_layout, parser->head[9]);
+
+  return 0;
+}
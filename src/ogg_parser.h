@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// Incremental parser for Ogg Opus (RFC 3533 and RFC 7845) that arrives in
+// chunks of any size. A page that lies within one chunk is parsed in place,
+// and its packets reference the chunk instead of being copied. Only a page that
+// straddles two chunks, or a packet that straddles two pages, is copied.
+//
+// The first Opus stream in the data is followed, and pages from any other
+// logical stream are skipped. Once it has ended, another Opus stream can
+// follow, as in a chained Ogg file, and its timestamps carry on from the first.
+struct OggParser;
+
+// Returned by ogg_parser_read() when the OpusHead of a new stream has been read
+#define OGG_PARSER_NEW_STREAM 1
+
+// Returns NULL if out of memory
+OggParser *ogg_parser_alloc(void);
+
+void ogg_parser_free(OggParser **parser);
+
+// Drops any partly parsed data, so the next chunk must begin a new Ogg stream.
+// Timestamps start from 0 again. This doesn't allocate or free anything.
+void ogg_parser_reset(OggParser *parser);
+
+// Takes ownership of *buf and sets it to NULL. Call this only after
+// ogg_parser_read() has returned AVERROR(EAGAIN), since it replaces any data
+// that is left from the previous chunk.
+void ogg_parser_feed(OggParser *parser, AVBufferRef **buf);
+
+// Reads the next Opus packet into pkt, which must be blank. pts counts 48kHz
+// samples from the start of the stream, and duration is cut short by the end
+// trimming of the last page. Returns 0, OGG_PARSER_NEW_STREAM without touching
+// pkt, AVERROR(EAGAIN) if it needs another chunk, or a negative error code.
+int ogg_parser_read(OggParser *parser, AVPacket *pkt);
+
+// Fills in codecpar from the OpusHead of the current stream. Returns 0, or a
+// negative error code.
+int ogg_parser_codec_parameters(const OggParser *parser, AVCodecParameters *codecpar);
+
+// Returns the duration of an Opus packet in 48kHz samples, from its TOC byte,
+// or AVERROR_INVALIDDATA. See https://www.rfc-editor.org/rfc/rfc6716#section-3
+int opus_packet_duration(const uint8_t *data, int size);
@@ -0,0 +1,49 @@
+#include <pthread.h>
+
+#include "packet_pool.h"
+
+// About 1.7MB of structs. Packets beyond this are freed as usual.
+#define PACKET_POOL_CAPACITY 16384
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static AVPacket *free_packets[PACKET_POOL_CAPACITY];
+static int free_count = 0;
+
+AVPacket *packet_pool_get(void) {
+  AVPacket *pkt = NULL;
+
+  pthread_mutex_lock(&pool_mutex);
+  if (free_count > 0) {
+    pkt = free_packets[--free_count];
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  if (pkt == NULL) {
+    pkt = av_packet_alloc();
+  }
+
+  return pkt;
+}
+
+void packet_pool_release(AVPacket **pkt) {
+  if (*pkt == NULL) {
+    return;
+  }
+
+  // Returns the payload to its own pool, outside of the lock
+  av_packet_unref(*pkt);
+
+  bool pooled = false;
+  pthread_mutex_lock(&pool_mutex);
+  if (free_count < PACKET_POOL_CAPACITY) {
+    free_packets[free_count++] = *pkt;
+    pooled = true;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  if (pooled) {
+    *pkt = NULL;
+  } else {
+    av_packet_free(pkt);
+  }
+}
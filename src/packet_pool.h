@@ -0,0 +1,18 @@
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// Recycles the AVPacket structs that are posted between threads, so that
+// sending a packet doesn't allocate one and receiving it doesn't free it. A
+// packet is usually taken on one thread and released on another, so the free
+// list is shared by the whole process. Payloads aren't pooled here; they come
+// from whatever the packet's buf came from, such as an AVBufferPool.
+
+// Returns a blank packet, or NULL if out of memory
+AVPacket *packet_pool_get(void);
+
+// Unreferences the packet, puts it back in the pool and sets *pkt to NULL.
+// Does nothing if *pkt is NULL.
+void packet_pool_release(AVPacket **pkt);
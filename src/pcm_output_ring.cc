@@ -0,0 +1,126 @@
+#include <string.h>
+
+extern "C" {
+#include <libavutil/error.h>
+}
+
+#include "pcm_output_ring.h"
+
+// The header fields are accessed by JavaScript with Atomics, so every access
+// here must be atomic too. The frame entries and samples are plain memory, and
+// are published by the store to the write index.
+static inline uint32_t load_field(const PcmOutputRing *ring, PcmOutputRingHeaderField field) {
+  return (uint32_t)__atomic_load_n(&ring->header[field], __ATOMIC_SEQ_CST);
+}
+
+static inline void store_field(const PcmOutputRing *ring, PcmOutputRingHeaderField field, uint32_t value) {
+  __atomic_store_n(&ring->header[field], (int32_t)value, __ATOMIC_SEQ_CST);
+}
+
+static inline bool is_power_of_two(uint32_t value) {
+  return value != 0 && (value & (value - 1)) == 0;
+}
+
+int pcm_output_ring_init(PcmOutputRing *ring, void *data, size_t byte_length) {
+  // The pts array needs 8 byte alignment
+  if (data == NULL || ((uintptr_t)data & 7) != 0 || byte_length < PCM_OUTPUT_RING_HEADER_SIZE) {
+    return AVERROR(EINVAL);
+  }
+
+  int32_t *header = (int32_t *)data;
+  uint32_t frame_capacity = (uint32_t)__atomic_load_n(&header[PCM_OUTPUT_RING_FRAME_CAPACITY], __ATOMIC_SEQ_CST);
+  uint32_t sample_capacity = (uint32_t)__atomic_load_n(&header[PCM_OUTPUT_RING_SAMPLE_CAPACITY], __ATOMIC_SEQ_CST);
+
+  if (!is_power_of_two(frame_capacity) || frame_capacity > (1 << 20) ||
+      !is_power_of_two(sample_capacity) || sample_capacity > (1 << 28)) {
+    return AVERROR(EINVAL);
+  }
+
+  size_t frames_offset = PCM_OUTPUT_RING_HEADER_SIZE;
+  size_t pts_offset = frames_offset + (size_t)frame_capacity * PCM_OUTPUT_RING_FRAME_SIZE;
+  size_t samples_offset = pts_offset + (size_t)frame_capacity * sizeof(double);
+  if (samples_offset + (size_t)sample_capacity * sizeof(int16_t) > byte_length) {
+    return AVERROR(EINVAL);
+  }
+
+  ring->header = header;
+  ring->frames = (int32_t *)((uint8_t *)data + frames_offset);
+  ring->pts = (double *)((uint8_t *)data + pts_offset);
+  ring->samples = (int16_t *)((uint8_t *)data + samples_offset);
+  ring->frame_capacity = frame_capacity;
+  ring->sample_capacity = sample_capacity;
+
+  return 0;
+}
+
+bool pcm_output_ring_write(const PcmOutputRing *ring, const int16_t *samples, uint32_t count, int64_t pts, int32_t flags) {
+  // Only this thread writes the write indexes, so they can't change under us
+  uint32_t write_index = load_field(ring, PCM_OUTPUT_RING_WRITE_INDEX);
+  uint32_t sample_write_index = load_field(ring, PCM_OUTPUT_RING_SAMPLE_WRITE_INDEX);
+
+  uint32_t read_index = load_field(ring, PCM_OUTPUT_RING_READ_INDEX);
+  uint32_t sample_read_index = load_field(ring, PCM_OUTPUT_RING_SAMPLE_READ_INDEX);
+
+  // Skip to the start of the ring rather than split the frame
+  uint32_t start = sample_write_index;
+  uint32_t offset = start & (ring->sample_capacity - 1);
+  if (offset + count > ring->sample_capacity) {
+    start += ring->sample_capacity - offset;
+    offset = 0;
+  }
+
+  if (write_index - read_index >= ring->frame_capacity ||
+      count > ring->sample_capacity ||
+      start + count - sample_read_index > ring->sample_capacity) {
+    __atomic_add_fetch(&ring->header[PCM_OUTPUT_RING_DROPPED_FRAMES], 1, __ATOMIC_SEQ_CST);
+    return false;
+  }
+
+  memcpy(ring->samples + offset, samples, count * sizeof(int16_t));
+
+  uint32_t slot = write_index & (ring->frame_capacity - 1);
+  int32_t *frame = ring->frames + slot * (PCM_OUTPUT_RING_FRAME_SIZE / sizeof(int32_t));
+  frame[0] = (int32_t)start;
+  frame[1] = (int32_t)count;
+  frame[2] = flags;
+  frame[3] = 0;
+  ring->pts[slot] = pts >= 0 ? (double)pts : -1.0;
+
+  store_field(ring, PCM_OUTPUT_RING_SAMPLE_WRITE_INDEX, start + count);
+  store_field(ring, PCM_OUTPUT_RING_WRITE_INDEX, write_index + 1);
+
+  return true;
+}
+
+void pcm_output_ring_end(const PcmOutputRing *ring) {
+  store_field(ring, PCM_OUTPUT_RING_ENDED, 1);
+}
+
+bool pcm_output_ring_take_reader_waiting(const PcmOutputRing *ring) {
+  if (load_field(ring, PCM_OUTPUT_RING_READER_WAITING) == 0) {
+    return false;
+  }
+
+  int32_t expected = 1;
+  return __atomic_compare_exchange_n(&ring->header[PCM_OUTPUT_RING_READER_WAITING], &expected, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+bool pcm_output_ring_peek(const PcmOutputRing *ring, const int16_t **samples, uint32_t *count) {
+  uint32_t read_index = load_field(ring, PCM_OUTPUT_RING_READ_INDEX);
+  if (load_field(ring, PCM_OUTPUT_RING_WRITE_INDEX) == read_index) {
+    return false;
+  }
+
+  const int32_t *frame = ring->frames + (read_index & (ring->frame_capacity - 1)) * (PCM_OUTPUT_RING_FRAME_SIZE / sizeof(int32_t));
+  *samples = ring->samples + ((uint32_t)frame[0] & (ring->sample_capacity - 1));
+  *count = (uint32_t)frame[1];
+  return true;
+}
+
+void pcm_output_ring_consume(const PcmOutputRing *ring) {
+  uint32_t read_index = load_field(ring, PCM_OUTPUT_RING_READ_INDEX);
+  const int32_t *frame = ring->frames + (read_index & (ring->frame_capacity - 1)) * (PCM_OUTPUT_RING_FRAME_SIZE / sizeof(int32_t));
+
+  store_field(ring, PCM_OUTPUT_RING_SAMPLE_READ_INDEX, (uint32_t)frame[0] + (uint32_t)frame[1]);
+  store_field(ring, PCM_OUTPUT_RING_READ_INDEX, read_index + 1);
+}
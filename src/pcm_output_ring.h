@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Single producer, single consumer ring of decoded frames living in a
+// SharedArrayBuffer. The decoder thread writes each frame's samples and
+// metadata and advances the write index. JavaScript, possibly in a worker
+// thread, or another native thread reads frames in place and advances the read
+// index. Frames never wrap around the end of the sample ring, so each one can
+// be read as a single view.
+//
+// The layout must match PcmRingReader in src/index.ts:
+//
+//   int32   header[16]
+//   int32   frames[frame_capacity][4]   (sample_start, sample_count, flags, 0)
+//   float64 pts[frame_capacity]         (-1 if unknown)
+//   int16   samples[sample_capacity]
+//
+// Both capacities are powers of two. Frame indexes count frames, and sample
+// indexes count samples. Both are allowed to wrap around at 2^32.
+#define PCM_OUTPUT_RING_HEADER_SIZE 64
+#define PCM_OUTPUT_RING_FRAME_SIZE 16
+
+enum PcmOutputRingHeaderField {
+  PCM_OUTPUT_RING_WRITE_INDEX = 0,
+  PCM_OUTPUT_RING_READ_INDEX = 1,
+
+  // Where the next frame's samples go, and the end of the samples of the last
+  // frame that was read.
+  PCM_OUTPUT_RING_SAMPLE_WRITE_INDEX = 2,
+  PCM_OUTPUT_RING_SAMPLE_READ_INDEX = 3,
+
+  // Set by the reader before it calls Atomics.wait(). The decoder clears it and
+  // asks the main thread to call Atomics.notify(), since native code can't wake
+  // up Atomics.wait() itself.
+  PCM_OUTPUT_RING_READER_WAITING = 4,
+
+  // Frames that were dropped because the reader fell behind
+  PCM_OUTPUT_RING_DROPPED_FRAMES = 5,
+
+  // Set once the decoder has exited
+  PCM_OUTPUT_RING_ENDED = 6,
+
+  // Written by JavaScript when the ring is created
+  PCM_OUTPUT_RING_FRAME_CAPACITY = 7,
+  PCM_OUTPUT_RING_SAMPLE_CAPACITY = 8,
+};
+
+// Frame flags
+#define PCM_OUTPUT_RING_FLAG_PLC 1  // Packet loss concealment
+#define PCM_OUTPUT_RING_FLAG_FEC 2  // Recovered from forward error correction
+#define PCM_OUTPUT_RING_FLAG_DISCONTINUITY 4  // First frame after a jump in the timeline
+#define PCM_OUTPUT_RING_FLAG_SILENCE 8  // Zeros filling in for a pause by the sender
+#define PCM_OUTPUT_RING_FLAG_SPEECH 16  // Voice activity detection found speech
+
+struct PcmOutputRing {
+  int32_t *header;
+  int32_t *frames;
+  double *pts;
+  int16_t *samples;
+  uint32_t frame_capacity;
+  uint32_t sample_capacity;
+};
+
+// Returns 0, or AVERROR(EINVAL) if the header doesn't describe a ring that
+// fits in byte_length.
+int pcm_output_ring_init(PcmOutputRing *ring, void *data, size_t byte_length);
+
+// Copies a frame into the ring. Returns false, and counts the frame as
+// dropped, if the reader hasn't made room for it.
+bool pcm_output_ring_write(const PcmOutputRing *ring, const int16_t *samples, uint32_t count, int64_t pts, int32_t flags);
+
+// Marks the end of the stream
+void pcm_output_ring_end(const PcmOutputRing *ring);
+
+// Returns true if the reader is blocked in Atomics.wait() and should be woken
+// up. Only returns true once per wait.
+bool pcm_output_ring_take_reader_waiting(const PcmOutputRing *ring);
+
+// For a reader on another native thread, such as the group mixer, instead of
+// JavaScript. Points samples at the next frame and returns true, or returns
+// false if there isn't one yet.
+bool pcm_output_ring_peek(const PcmOutputRing *ring, const int16_t **samples, uint32_t *count);
+
+// Hands the frame from pcm_output_ring_peek() back to the writer
+void pcm_output_ring_consume(const PcmOutputRing *ring);
@@ -0,0 +1,82 @@
+extern "C" {
+#include <libavutil/error.h>
+}
+
+#include "pcm_ring_buffer.h"
+
+// The header fields are accessed by JavaScript with Atomics, so every access
+// here must be atomic too. Atomics are sequentially consistent.
+static inline uint32_t load_field(const PcmRingBuffer *ring, PcmRingHeaderField field) {
+  return (uint32_t)__atomic_load_n(&ring->header[field], __ATOMIC_SEQ_CST);
+}
+
+static inline void store_field(const PcmRingBuffer *ring, PcmRingHeaderField field, uint32_t value) {
+  __atomic_store_n(&ring->header[field], (int32_t)value, __ATOMIC_SEQ_CST);
+}
+
+static inline bool compare_exchange_field(const PcmRingBuffer *ring, PcmRingHeaderField field, int32_t expected, int32_t desired) {
+  return __atomic_compare_exchange_n(&ring->header[field], &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+int pcm_ring_init(PcmRingBuffer *ring, void *data, size_t byte_length) {
+  if (data == NULL || ((uintptr_t)data & 3) != 0 || byte_length <= PCM_RING_HEADER_SIZE) {
+    return AVERROR(EINVAL);
+  }
+
+  size_t capacity = (byte_length - PCM_RING_HEADER_SIZE) / sizeof(int16_t);
+  if (capacity > UINT32_MAX / 2 || (capacity & (capacity - 1)) != 0) {
+    return AVERROR(EINVAL);
+  }
+
+  ring->header = (int32_t *)data;
+  ring->samples = (int16_t *)((uint8_t *)data + PCM_RING_HEADER_SIZE);
+  ring->capacity = (uint32_t)capacity;
+
+  return 0;
+}
+
+uint32_t pcm_ring_load_write_index(const PcmRingBuffer *ring) {
+  return load_field(ring, PCM_RING_WRITE_INDEX);
+}
+
+uint32_t pcm_ring_peek(const PcmRingBuffer *ring, uint32_t limit, const int16_t **samples) {
+  // Only the encoder thread writes the read index, so this doesn't race.
+  uint32_t read_index = load_field(ring, PCM_RING_READ_INDEX);
+  uint32_t available = limit - read_index;
+  if (available > ring->capacity) {
+    // The writer never gets more than capacity ahead. This can only happen
+    // if the limit is stale.
+    return 0;
+  }
+
+  uint32_t offset = read_index & (ring->capacity - 1);
+  uint32_t contiguous = ring->capacity - offset;
+
+  *samples = ring->samples + offset;
+  return available < contiguous ? available : contiguous;
+}
+
+void pcm_ring_consume(const PcmRingBuffer *ring, uint32_t count) {
+  store_field(ring, PCM_RING_READ_INDEX, load_field(ring, PCM_RING_READ_INDEX) + count);
+}
+
+bool pcm_ring_prepare_wait(const PcmRingBuffer *ring) {
+  store_field(ring, PCM_RING_CONSUMER_WAITING, 1);
+
+  if (load_field(ring, PCM_RING_WRITE_INDEX) == load_field(ring, PCM_RING_READ_INDEX)) {
+    return true;
+  }
+
+  // Samples were written after we last looked. If the writer already cleared
+  // the flag, a wakeup message is on its way and it's safe to block.
+  return !compare_exchange_field(ring, PCM_RING_CONSUMER_WAITING, 1, 0);
+}
+
+bool pcm_ring_is_half_empty(const PcmRingBuffer *ring) {
+  uint32_t used = load_field(ring, PCM_RING_WRITE_INDEX) - load_field(ring, PCM_RING_READ_INDEX);
+  return used <= ring->capacity / 2;
+}
+
+bool pcm_ring_is_discarded(const PcmRingBuffer *ring) {
+  return load_field(ring, PCM_RING_DISCARD) != 0;
+}
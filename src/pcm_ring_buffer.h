@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Single producer, single consumer ring of 16-bit PCM samples living in a
+// SharedArrayBuffer. JavaScript writes samples and advances the write index,
+// the encoder thread reads them in place and advances the read index. Both
+// indexes count samples and are allowed to wrap around at 2^32.
+//
+// The layout must match PcmRingWriter in src/index.ts:
+//
+//   int32 header[8]
+//   int16 samples[capacity]   (capacity is a power of two)
+#define PCM_RING_HEADER_SIZE 32
+
+enum PcmRingHeaderField {
+  PCM_RING_WRITE_INDEX = 0,
+  PCM_RING_READ_INDEX = 1,
+
+  // Set by the encoder before it blocks on its message queue. The writer clears
+  // it and posts an ENCODER_WAKEUP message.
+  PCM_RING_CONSUMER_WAITING = 2,
+
+  // Set when the stream is aborted, so the encoder doesn't drain the ring
+  // before exiting.
+  PCM_RING_DISCARD = 3,
+};
+
+struct PcmRingBuffer {
+  int32_t *header;
+  int16_t *samples;
+  uint32_t capacity;
+};
+
+// Returns 0, or AVERROR(EINVAL) if byte_length doesn't describe a valid ring.
+int pcm_ring_init(PcmRingBuffer *ring, void *data, size_t byte_length);
+
+uint32_t pcm_ring_load_write_index(const PcmRingBuffer *ring);
+
+// Returns the number of contiguous samples that can be read before reaching
+// `limit` (a write index snapshot), and points `samples` at the first one.
+uint32_t pcm_ring_peek(const PcmRingBuffer *ring, uint32_t limit, const int16_t **samples);
+
+void pcm_ring_consume(const PcmRingBuffer *ring, uint32_t count);
+
+// Marks the encoder as waiting. Returns false if samples arrived in the
+// meantime and the encoder should keep reading instead of blocking.
+bool pcm_ring_prepare_wait(const PcmRingBuffer *ring);
+
+// Returns true if at least half of the ring is free.
+bool pcm_ring_is_half_empty(const PcmRingBuffer *ring);
+
+bool pcm_ring_is_discarded(const PcmRingBuffer *ring);
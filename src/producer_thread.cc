@@ -10,6 +10,7 @@ extern "C" {
 }
 
 #include "util.h"
+#include "audio_level.h"
 #include "producer_thread.h"
 #include "thread_with_promise_result.h"
 #include "time_util.h"
@@ -21,12 +22,126 @@ extern "C" {
 // Setting it to 1/10 of a second seems to work well.
 #define MAX_FUTURE (OPUS_SAMPLE_RATE / 10)
 
+#define RTP_HEADER_SIZE 12
+
+// Copied from libavformat/rtp.h
+#define RTP_PT_IS_RTCP(x) (((x) >= 192 && (x) <= 195) || ((x) >= 200 && (x) <= 210))
+
+// The ffmpeg RTP muxer can't write header extensions, so when the audio level
+// extension is enabled, the muxer writes into a custom AVIOContext. Each
+// complete RTP packet is rewritten to include the extension and then passed to
+// the real rtp:// or srtp:// AVIOContext, which takes care of the encryption.
+struct AudioLevelWriter {
+  AVIOContext *net_pb;
+  uint8_t extension_id;
+
+  // opaque of the packet currently being passed to av_write_frame
+  void *packet_opaque;
+
+  uint8_t packet[RTP_HEADER_SIZE + 15 * 4 + AUDIO_LEVEL_EXTENSION_SIZE + 2048];
+};
+
+#if !defined(FF_API_AVIO_WRITE_NONCONST) || FF_API_AVIO_WRITE_NONCONST
+static int write_rtp_packet(void *opaque, uint8_t *buf, int buf_size) {
+#else
+static int write_rtp_packet(void *opaque, const uint8_t *buf, int buf_size) {
+#endif
+  AudioLevelWriter *writer = (AudioLevelWriter *)opaque;
+
+  uint8_t extension_byte;
+  int header_size = RTP_HEADER_SIZE + (buf_size > 0 ? (buf[0] & 0x0F) * 4 : 0);
+
+  bool add_extension = buf_size >= header_size &&
+                       !RTP_PT_IS_RTCP(buf[1]) &&
+                       !(buf[0] & 0x10) &&
+                       (size_t)buf_size + AUDIO_LEVEL_EXTENSION_SIZE <= sizeof(writer->packet) &&
+                       audio_level_from_opaque(writer->packet_opaque, &extension_byte);
+
+  if (add_extension) {
+    uint8_t *dst = writer->packet;
+
+    memcpy(dst, buf, header_size);
+    dst[0] |= 0x10;  // X bit
+    dst += header_size;
+
+    // RFC 8285 one-byte header: 0xBEDE profile, length in 32 bit words
+    *dst++ = 0xBE;
+    *dst++ = 0xDE;
+    *dst++ = 0x00;
+    *dst++ = 0x01;
+
+    // ID (4 bits) | L (4 bits, length - 1), followed by the data and padding
+    *dst++ = (writer->extension_id << 4) | 0;
+    *dst++ = extension_byte;
+    *dst++ = 0;
+    *dst++ = 0;
+
+    memcpy(dst, buf + header_size, buf_size - header_size);
+
+    avio_write(writer->net_pb, writer->packet, buf_size + AUDIO_LEVEL_EXTENSION_SIZE);
+  } else {
+    // RTCP packets are routed to the RTCP port by the rtp/srtp protocols
+    avio_write(writer->net_pb, buf, buf_size);
+  }
+
+  avio_flush(writer->net_pb);
+
+  if (writer->net_pb->error < 0) {
+    return writer->net_pb->error;
+  }
+
+  return buf_size;
+}
+
+static int open_audio_level_writer(AVFormatContext *output_ctx, const char *url, AVDictionary **options, AudioLevelWriter *writer) {
+  int ret = avio_open2(&writer->net_pb, url, AVIO_FLAG_WRITE, NULL, options);
+  if (ret < 0) {
+    return ret;
+  }
+
+  // Leave room for the extension, so that the rewritten packets still fit in
+  // the packet size of the network protocol.
+  int max_packet_size = writer->net_pb->max_packet_size - AUDIO_LEVEL_EXTENSION_SIZE;
+  if (max_packet_size <= RTP_HEADER_SIZE || max_packet_size > (int)sizeof(writer->packet) - AUDIO_LEVEL_EXTENSION_SIZE) {
+    max_packet_size = sizeof(writer->packet) - AUDIO_LEVEL_EXTENSION_SIZE;
+  }
+
+  unsigned char *avio_buffer = (unsigned char *)av_malloc(max_packet_size);
+  if (avio_buffer == NULL) {
+    avio_closep(&writer->net_pb);
+    return AVERROR(ENOMEM);
+  }
+
+  output_ctx->pb = avio_alloc_context(avio_buffer, max_packet_size, 1, writer, NULL, write_rtp_packet, NULL);
+  if (output_ctx->pb == NULL) {
+    av_free(avio_buffer);
+    avio_closep(&writer->net_pb);
+    return AVERROR(ENOMEM);
+  }
+
+  // The RTP muxer uses this to decide how much payload fits in a packet.
+  output_ctx->pb->max_packet_size = max_packet_size;
+
+  return 0;
+}
+
+static void close_audio_level_writer(AVFormatContext *output_ctx, AudioLevelWriter *writer) {
+  if (output_ctx->pb != NULL) {
+    avio_flush(output_ctx->pb);
+    av_freep(&output_ctx->pb->buffer);
+    avio_context_free(&output_ctx->pb);
+  }
+
+  avio_closep(&writer->net_pb);
+}
+
 static int ThreadMain(AVThreadMessageQueue *message_queue, const ProducerThreadParams &params) {
   AVFormatContext *output_ctx = NULL;
   AVStream *out_stream = NULL;
   const AVCodec *codec = NULL;
   ThreadMessage thread_message;
   AVDictionary *options = NULL;
+  AudioLevelWriter *audio_level_writer = NULL;
 
   // Copy to a non-const point because it's easier to track when it's freed
   char *url = params.url;
@@ -80,7 +195,14 @@ static int ThreadMain(AVThreadMessageQueue *message_queue, const ProducerThreadP
   out_stream->codecpar->extradata = NULL;
   out_stream->codecpar->extradata_size = 0;
 
-  ret = avio_open2(&output_ctx->pb, url, AVIO_FLAG_WRITE, NULL, &options);
+  if (params.audioLevelExtensionId > 0) {
+    audio_level_writer = new AudioLevelWriter();
+    audio_level_writer->extension_id = params.audioLevelExtensionId;
+
+    ret = open_audio_level_writer(output_ctx, url, &options, audio_level_writer);
+  } else {
+    ret = avio_open2(&output_ctx->pb, url, AVIO_FLAG_WRITE, NULL, &options);
+  }
   if (ret < 0) {
     fprintf(stderr, "avio_open2 failed [%d]\n", ret);
     goto cleanup;
@@ -152,18 +274,29 @@ static int ThreadMain(AVThreadMessageQueue *message_queue, const ProducerThreadP
       // muxer to stop, so we must avoid this.
       if (next_expected_pts != AV_NOPTS_VALUE && pkt->pts < next_expected_pts) {
         fprintf(stderr, "WARNING: dropping packet with pts < next_expected_pts. %lld <= %lld\n", pkt->pts, next_expected_pts);
+        if (params.bufferedAudio != NULL) {
+          buffered_audio_release(params.bufferedAudio, pkt->duration);
+        }
         thread_message_free_func(&thread_message);
         continue;
       }
 
       next_expected_pts = pkt->pts + pkt->duration;
 
+      if (audio_level_writer != NULL) {
+        audio_level_writer->packet_opaque = pkt->opaque;
+      }
+
       ret = av_write_frame(output_ctx, pkt);
       if (ret < 0) {
         fprintf(stderr, "av_write_frame failed [%d]\n", ret);
         thread_message_free_func(&thread_message);
         goto cleanup;
       }
+
+      if (params.bufferedAudio != NULL) {
+        buffered_audio_release(params.bufferedAudio, pkt->duration);
+      }
     }
 
     thread_message_free_func(&thread_message);
@@ -176,11 +309,17 @@ cleanup:
   av_freep(&url);
 
   if (output_ctx != NULL) {
-    avio_closep(&output_ctx->pb);
+    if (audio_level_writer != NULL) {
+      close_audio_level_writer(output_ctx, audio_level_writer);
+    } else {
+      avio_closep(&output_ctx->pb);
+    }
     avformat_free_context(output_ctx);
     output_ctx = NULL;
   }
 
+  delete audio_level_writer;
+
   return ret;
 }
 
@@ -188,14 +327,23 @@ cleanup:
 // to handle the backpressure.
 #define PRODUCER_MESSAGE_QUEUE_SIZE 8192
 
-static int ThreadMainWithPromise(AVThreadMessageQueue *message_queue, uv_async_t *buffer_ready_async, uv_async_t *drain_async, const ProducerThreadParams &params) {
-    return ThreadMain(message_queue, params);
+static int ThreadMainWithPromise(AVThreadMessageQueue *message_queue, DispatchSource *buffer_ready_source, DispatchSource *drain_source, const ProducerThreadParams &params) {
+    if (params.jobBufferedAudio.fields == NULL) {
+      return ThreadMain(message_queue, params);
+    }
+
+    BufferedAudio buffered_audio = params.jobBufferedAudio;
+    buffered_audio.drain_source = drain_source;
+
+    ProducerThreadParams job_params = params;
+    job_params.bufferedAudio = &buffered_audio;
+    return ThreadMain(message_queue, job_params);
 }
 
-napi_status start_producer_thread(napi_env env, ProducerThreadParams &params, napi_value abort_signal, napi_value *external, napi_value *promise) {
+napi_status start_producer_thread(napi_env env, ProducerThreadParams &params, napi_value abort_signal, napi_value js_options, napi_value on_drain_callback, napi_value *external, napi_value *promise) {
   size_t stack_size = get_stack_size_for_thread("PRODUCER");
 
-  napi_status status = start_thread_with_promise_result<ProducerThreadParams>(env, ThreadMainWithPromise, params, abort_signal, NULL, stack_size, PRODUCER_MESSAGE_QUEUE_SIZE, external, NULL, NULL, promise);
+  napi_status status = start_thread_with_promise_result<ProducerThreadParams>(env, ThreadMainWithPromise, params, abort_signal, js_options, stack_size, PRODUCER_MESSAGE_QUEUE_SIZE, external, NULL, on_drain_callback, promise);
 
   if (status != napi_ok) {
     av_freep(&params.url);
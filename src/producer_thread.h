@@ -3,6 +3,8 @@
 #include <pthread.h>
 #include <node_api.h>
 
+#include "buffered_audio.h"
+
 extern "C" {
 #include <libavutil/threadmessage.h>
 }
@@ -14,13 +16,28 @@ struct ProducerThreadParams {
   char *keyBase64;
   char *ssrc;
   char *payloadType;
+
+  // RTP header extension id for the RFC 6464 audio level, or 0 to disable it.
+  int32_t audioLevelExtensionId;
+
+  // Audio is released from this as it's sent. NULL when the producer isn't
+  // owned by an encoder.
+  const BufferedAudio *bufferedAudio;
+
+  // Counter for a producer started from JavaScript, which notifies the drain
+  // callback. fields is NULL if there is none.
+  BufferedAudio jobBufferedAudio;
 };
 
-// NAPI-based API for use from Node.js
+// NAPI-based API for use from Node.js. on_drain_callback can be NULL.
+// js_options is held until the thread exits, since it owns the
+// jobBufferedAudio array.
 napi_status start_producer_thread(
   napi_env env,
   ProducerThreadParams &params,
   napi_value abort_signal,
+  napi_value js_options,
+  napi_value on_drain_callback,
   napi_value *external,
   napi_value *promise
 );
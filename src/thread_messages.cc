@@ -3,22 +3,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include "thread_messages.h"
+#include "packet_pool.h"
+#include "clip_cache.h"
 
-int post_packet_to_thread(AVThreadMessageQueue *message_queue, AVPacket *pkt, int flags) {
-  AVPacket *clone = av_packet_clone(pkt);
-
+int post_packet_to_thread(AVThreadMessageQueue *message_queue, AVPacket **pkt, int flags) {
   ThreadMessage thread_message = {
     .type = POST_PACKET,
     .param = {
-      .pkt = clone
+      .pkt = *pkt
     },
     .async = NULL
   };
+  *pkt = NULL;
 
   int ret = av_thread_message_queue_send(message_queue, &thread_message, flags);
 
   if (ret != 0) {
-    av_packet_free(&clone);
+    packet_pool_release(&thread_message.param.pkt);
   }
 
   return ret;
@@ -94,6 +95,184 @@ int post_pcm_buffer_to_thread(AVThreadMessageQueue *message_queue, void *buffer,
   return ret;
 }
 
+// Posts several PCM buffers as one message, so they only cost a single allocation
+// and a single queue slot.
+int post_pcm_buffers_to_thread(AVThreadMessageQueue *message_queue, void **buffers, size_t *buffer_lengths, size_t count) {
+  size_t total_length = 0;
+  for (size_t i = 0; i < count; i++) {
+    total_length += buffer_lengths[i];
+  }
+
+  if (total_length == 0) {
+    return 0;
+  }
+
+  AVBufferRef *buffer_ref = av_buffer_alloc(total_length);
+  if (buffer_ref == NULL) {
+    return AVERROR(ENOMEM);
+  }
+
+  uint8_t *dst = buffer_ref->data;
+  for (size_t i = 0; i < count; i++) {
+    memcpy(dst, buffers[i], buffer_lengths[i]);
+    dst += buffer_lengths[i];
+  }
+
+  ThreadMessage thread_message = {
+    .type = POST_PCM_BUFFER,
+    .param = {
+      .buf = buffer_ref
+    },
+    .async = NULL
+  };
+
+  int ret = av_thread_message_queue_send(message_queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK);
+
+  if (ret != 0) {
+    av_buffer_unref(&buffer_ref);
+  }
+
+  return ret;
+}
+
+// Copies the packets into one buffer, so they take a single allocation and a
+// single queue slot like post_pcm_buffers_to_thread(). The encoder sends them
+// straight out of it.
+int post_opus_packets_to_thread(AVThreadMessageQueue *message_queue, void **packets, size_t *packet_sizes, int32_t *durations, size_t count, int32_t ring_write_index) {
+  if (count == 0) {
+    return 0;
+  }
+
+  size_t total_length = sizeof(OpusPacketsHeader);
+  for (size_t i = 0; i < count; i++) {
+    total_length += sizeof(OpusPacketHeader) + FFALIGN(packet_sizes[i], 4);
+  }
+
+  // The last packet needs the padding that FFmpeg expects after packet data
+  AVBufferRef *buffer_ref = av_buffer_alloc(total_length + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (buffer_ref == NULL) {
+    return AVERROR(ENOMEM);
+  }
+  memset(buffer_ref->data, 0, buffer_ref->size);
+
+  OpusPacketsHeader header = { ring_write_index, (int32_t)count };
+  memcpy(buffer_ref->data, &header, sizeof(header));
+
+  uint8_t *dst = buffer_ref->data + sizeof(header);
+  for (size_t i = 0; i < count; i++) {
+    OpusPacketHeader packet_header = { (int32_t)packet_sizes[i], durations[i] };
+    memcpy(dst, &packet_header, sizeof(packet_header));
+    dst += sizeof(packet_header);
+
+    memcpy(dst, packets[i], packet_sizes[i]);
+    dst += FFALIGN(packet_sizes[i], 4);
+  }
+
+  ThreadMessage thread_message = {
+    .type = POST_OPUS_PACKETS,
+    .param = {
+      .buf = buffer_ref
+    },
+    .async = NULL
+  };
+
+  int ret = av_thread_message_queue_send(message_queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK);
+
+  if (ret != 0) {
+    av_buffer_unref(&buffer_ref);
+  }
+
+  return ret;
+}
+
+int64_t opus_packets_duration(const AVBufferRef *buf) {
+  OpusPacketsHeader header;
+  memcpy(&header, buf->data, sizeof(header));
+
+  int64_t duration = 0;
+  const uint8_t *src = buf->data + sizeof(header);
+  for (int32_t i = 0; i < header.count; i++) {
+    OpusPacketHeader packet_header;
+    memcpy(&packet_header, src, sizeof(packet_header));
+    duration += packet_header.duration;
+    src += sizeof(packet_header) + FFALIGN(packet_header.size, 4);
+  }
+
+  return duration;
+}
+
+static void free_clip_playback(void *opaque, uint8_t *data) {
+  ClipPlayback *playback = (ClipPlayback *)data;
+  av_buffer_unref(&playback->clip);
+  av_free(playback);
+}
+
+// The clip itself isn't copied. The message only holds a reference to it.
+int post_clip_to_thread(AVThreadMessageQueue *message_queue, AVBufferRef *clip, int32_t ring_write_index) {
+  ClipPlayback *playback = (ClipPlayback *)av_mallocz(sizeof(ClipPlayback));
+  if (playback == NULL) {
+    return AVERROR(ENOMEM);
+  }
+
+  playback->clip = av_buffer_ref(clip);
+  playback->ring_write_index = ring_write_index;
+  if (playback->clip == NULL) {
+    av_free(playback);
+    return AVERROR(ENOMEM);
+  }
+
+  AVBufferRef *buffer_ref = av_buffer_create((uint8_t *)playback, sizeof(ClipPlayback), free_clip_playback, NULL, 0);
+  if (buffer_ref == NULL) {
+    free_clip_playback(NULL, (uint8_t *)playback);
+    return AVERROR(ENOMEM);
+  }
+
+  ThreadMessage thread_message = {
+    .type = POST_CLIP,
+    .param = {
+      .buf = buffer_ref
+    },
+    .async = NULL
+  };
+
+  int ret = av_thread_message_queue_send(message_queue, &thread_message, AV_THREAD_MESSAGE_NONBLOCK);
+
+  if (ret != 0) {
+    av_buffer_unref(&buffer_ref);
+  }
+
+  return ret;
+}
+
+int64_t clip_playback_duration(const AVBufferRef *buf) {
+  const ClipPlayback *playback = (const ClipPlayback *)buf->data;
+  return clip_from_buffer(playback->clip)->duration;
+}
+
+int post_encoder_wakeup_to_thread(AVThreadMessageQueue *mq) {
+  ThreadMessage thread_message = {
+    .type = ENCODER_WAKEUP,
+    .param = {
+      .pkt = NULL
+    },
+    .async = NULL
+  };
+
+  return av_thread_message_queue_send(mq, &thread_message, AV_THREAD_MESSAGE_NONBLOCK);
+}
+
+int post_encoder_interrupt_to_thread(AVThreadMessageQueue *mq, int32_t interrupt_count) {
+  ThreadMessage thread_message = {
+    .type = ENCODER_INTERRUPT,
+    .param = {
+      .int_value = interrupt_count
+    },
+    .async = NULL
+  };
+
+  return av_thread_message_queue_send(mq, &thread_message, AV_THREAD_MESSAGE_NONBLOCK);
+}
+
 int post_set_bitrate_to_thread(AVThreadMessageQueue *mq, int32_t bitrate) {
   ThreadMessage thread_message = {
     .type = SET_ENCODER_BITRATE,
@@ -118,11 +297,11 @@ int post_set_fec_to_thread(AVThreadMessageQueue *mq, bool enable) {
   return av_thread_message_queue_send(mq, &thread_message, AV_THREAD_MESSAGE_NONBLOCK);
 }
 
-int post_flush_encoder_to_thread(AVThreadMessageQueue *mq) {
+int post_flush_encoder_to_thread(AVThreadMessageQueue *mq, int32_t ring_write_index) {
   ThreadMessage thread_message = {
     .type = FLUSH_OPUS_ENCODER,
     .param = {
-      .pkt = NULL
+      .int_value = ring_write_index
     },
     .async = NULL
   };
@@ -159,8 +338,8 @@ void thread_message_free_func(void *opaque) {
   if (thread_message->type == POST_CODEC_PARAMETERS) {
     avcodec_parameters_free(&thread_message->param.codecpar);
   } else if (thread_message->type == POST_PACKET) {
-    av_packet_free(&thread_message->param.pkt);
-  } else if (thread_message->type == OGG_BUFFER || thread_message->type == POST_PCM_BUFFER) {
+    packet_pool_release(&thread_message->param.pkt);
+  } else if (thread_message->type == OGG_BUFFER || thread_message->type == POST_PCM_BUFFER || thread_message->type == POST_OPUS_PACKETS || thread_message->type == POST_CLIP) {
     av_buffer_unref(&thread_message->param.buf);
   }
 }
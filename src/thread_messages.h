@@ -18,7 +18,12 @@ enum ThreadMessageType {
   // Used for streaming PCM buffers for encoding
   POST_PCM_BUFFER,
 
-  // Runtime encoder config changes
+  // Wakes up an encoder that is blocked on its message queue, because samples
+  // arrived in its shared PCM ring or a control message was posted
+  ENCODER_WAKEUP,
+
+  // Runtime encoder config changes. These are sent on the encoder's control
+  // queue.
   SET_ENCODER_BITRATE,
   SET_ENCODER_FEC,
   SET_ENCODER_PACKET_LOSS_PERC,
@@ -26,8 +31,20 @@ enum ThreadMessageType {
   // Flush remaining PCM in the encoder accumulator, then reset PTS
   FLUSH_OPUS_ENCODER,
 
-  // Drain the producer thread's packet queue
+  // Drain the producer thread's packet queue. Sent on the control queue.
   CLEAR_PRODUCER_QUEUE,
+
+  // Marks the position of an interrupt in the encoder's PCM queue. Everything
+  // before it is discarded.
+  ENCODER_INTERRUPT,
+
+  // Opus packets for the encoder to pass on to the producer as they are, in
+  // order with the PCM around them. See OpusPacketsHeader.
+  POST_OPUS_PACKETS,
+
+  // A clip from the clip cache, to be passed on like POST_OPUS_PACKETS. See
+  // ClipPlayback.
+  POST_CLIP,
 };
 
 union ThreadMessageParameter {
@@ -45,7 +62,26 @@ struct ThreadMessage {
   uv_async_t *async;
 };
 
-int post_packet_to_thread(AVThreadMessageQueue *message_queue, AVPacket *pkt, int flags);
+// Layout of the buffer in a POST_OPUS_PACKETS message. The header is followed
+// by count packets, each one an OpusPacketHeader and size bytes of Opus, padded
+// to a multiple of 4 bytes.
+struct OpusPacketsHeader {
+  // Write index of the encoder's PCM ring when the packets were written, so
+  // the samples before them are encoded first. 0 if there is no ring.
+  int32_t ring_write_index;
+  int32_t count;
+};
+
+struct OpusPacketHeader {
+  int32_t size;
+
+  // At 48kHz
+  int32_t duration;
+};
+
+// Takes ownership of *pkt, which should come from packet_pool_get(), and sets
+// it to NULL. The packet goes back to the pool if it can't be posted.
+int post_packet_to_thread(AVThreadMessageQueue *message_queue, AVPacket **pkt, int flags);
 int post_start_time_to_thread(AVThreadMessageQueue *message_queue, int64_t start_time_realtime);
 int post_start_time_local_to_thread(AVThreadMessageQueue *message_queue, int64_t start_time_localtime);
 int post_codec_parameters_to_thread(AVThreadMessageQueue *message_queue, AVCodecParameters *codecpar);
@@ -53,10 +89,22 @@ int post_tick_to_thread(AVThreadMessageQueue *message_queue);
 int post_ogg_buffer_to_thread(AVThreadMessageQueue *message_queue, void *buffer, size_t buffer_length);
 int post_ogg_reset_demuxer_to_thread(AVThreadMessageQueue *message_queue);
 int post_pcm_buffer_to_thread(AVThreadMessageQueue *message_queue, void *buffer, size_t buffer_length);
+int post_pcm_buffers_to_thread(AVThreadMessageQueue *message_queue, void **buffers, size_t *buffer_lengths, size_t count);
+int post_opus_packets_to_thread(AVThreadMessageQueue *message_queue, void **packets, size_t *packet_sizes, int32_t *durations, size_t count, int32_t ring_write_index);
+// Returns the total duration of the packets in a POST_OPUS_PACKETS buffer
+int64_t opus_packets_duration(const AVBufferRef *buf);
+// Adds a reference to clip, which is the buffer of a Clip
+int post_clip_to_thread(AVThreadMessageQueue *message_queue, AVBufferRef *clip, int32_t ring_write_index);
+// Returns the duration of the clip in a POST_CLIP buffer
+int64_t clip_playback_duration(const AVBufferRef *buf);
+int post_encoder_wakeup_to_thread(AVThreadMessageQueue *mq);
+int post_encoder_interrupt_to_thread(AVThreadMessageQueue *mq, int32_t interrupt_count);
 int post_set_bitrate_to_thread(AVThreadMessageQueue *mq, int32_t bitrate);
 int post_set_fec_to_thread(AVThreadMessageQueue *mq, bool enable);
 int post_set_packet_loss_perc_to_thread(AVThreadMessageQueue *mq, int32_t percent);
-int post_flush_encoder_to_thread(AVThreadMessageQueue *mq);
+// ring_write_index is the write index of the shared PCM ring at the time of the
+// flush. It's ignored when the encoder isn't reading from a ring.
+int post_flush_encoder_to_thread(AVThreadMessageQueue *mq, int32_t ring_write_index);
 int post_clear_producer_queue_to_thread(AVThreadMessageQueue *mq);
 
 
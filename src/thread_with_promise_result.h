@@ -5,35 +5,28 @@
 #include "thread_messages.h"
 #include "node_errors.h"
 #include "buffer_ready_node_callback.h"
+#include "node_dispatcher.h"
 
 struct DrainCallback {
   napi_env env;
   napi_ref callback_ref;
+  DispatchSource source;
 };
 
-static void drain_async_callback(uv_async_t *async) {
-  DrainCallback *data = (DrainCallback *)async->data;
-  napi_handle_scope scope;
-  napi_status status = napi_open_handle_scope(data->env, &scope);
-  if (status != napi_ok) {
-    fprintf(stderr, "drain_async_callback: napi_open_handle_scope failed [%d]\n", status);
-    return;
-  }
+// The dispatcher provides the handle scope
+static void drain_dispatch(DispatchSource *source) {
+  DrainCallback *data = (DrainCallback *)source->opaque;
 
   napi_value callback, global, result;
   napi_get_reference_value(data->env, data->callback_ref, &callback);
   napi_get_global(data->env, &global);
   napi_call_function(data->env, global, callback, 0, NULL, &result);
-
-  napi_close_handle_scope(data->env, scope);
 }
 
-static void drain_close_callback(uv_handle_t *handle) {
-  DrainCallback *data = (DrainCallback *)handle->data;
+static void drain_free(DispatchSource *source) {
+  DrainCallback *data = (DrainCallback *)source->opaque;
   napi_delete_reference(data->env, data->callback_ref);
-  uv_async_t *async = (uv_async_t *)handle;
   delete data;
-  delete async;
 }
 
 template<class THREAD_PARAMS>
@@ -53,15 +46,15 @@ class ThreadData {
   THREAD_PARAMS params;
   pthread_t thread;
 
-  uv_async_t thread_finished_async;
-  uv_async_t *buffer_ready_async;
-  uv_async_t *drain_async;
+  DispatchSource thread_finished_source;
+  DispatchSource *buffer_ready_source;
+  DispatchSource *drain_source;
 
   napi_env env;
   napi_deferred deferred;
   int thread_ret;
 
-  int (*thread_main)(AVThreadMessageQueue *message_queue, uv_async_t *buffer_ready_async, uv_async_t *drain_async, const THREAD_PARAMS &params);
+  int (*thread_main)(AVThreadMessageQueue *message_queue, DispatchSource *buffer_ready_source, DispatchSource *drain_source, const THREAD_PARAMS &params);
 
   ~ThreadData() {
     napi_delete_reference(env, message_queue_ref);
@@ -177,34 +170,35 @@ static napi_status add_abort_event_listener(napi_env env, napi_value signal, nap
 }
 
 template<class THREAD_PARAMS>
-static void close_callback(uv_handle_t *handle) {
-  uv_async_t *async = (uv_async_t*)handle;
-  ThreadData<THREAD_PARAMS> *thread_data = (ThreadData<THREAD_PARAMS> *)async->data;
+static void free_thread_data(DispatchSource *source) {
+  ThreadData<THREAD_PARAMS> *thread_data = (ThreadData<THREAD_PARAMS> *)source->opaque;
   delete thread_data;
 }
 
+// Releases the callbacks that the thread used
 template<class THREAD_PARAMS>
-static void async_callback(uv_async_t *async) {
-  ThreadData<THREAD_PARAMS> *thread_data = (ThreadData<THREAD_PARAMS> *)async->data;
-
-  napi_env env = thread_data->env;
-  int status;
-
-  napi_handle_scope scope;
-  status = napi_open_handle_scope(env, &scope);
-  if (status != napi_ok) {
-    fprintf(stderr, "napi_open_handle_scope is fail status [%d]", status);
-    return;
+static void release_thread_callbacks(ThreadData<THREAD_PARAMS> *thread_data) {
+  if (thread_data->buffer_ready_source != NULL) {
+    cleanup_callback_for_many(thread_data->buffer_ready_source);
+    thread_data->buffer_ready_source = NULL;
   }
 
-  if (thread_data->buffer_ready_async != NULL) {
-    cleanup_callback_for_many(thread_data->buffer_ready_async);
+  if (thread_data->drain_source != NULL) {
+    dispatch_source_release(thread_data->drain_source, drain_free);
+    thread_data->drain_source = NULL;
   }
+}
 
-  if (thread_data->drain_async != NULL) {
-    uv_close((uv_handle_t *)thread_data->drain_async, drain_close_callback);
-    thread_data->drain_async = NULL;
-  }
+// Runs on the main thread once the thread has exited. The dispatcher provides
+// the handle scope.
+template<class THREAD_PARAMS>
+static void thread_finished_dispatch(DispatchSource *source) {
+  ThreadData<THREAD_PARAMS> *thread_data = (ThreadData<THREAD_PARAMS> *)source->opaque;
+
+  napi_env env = thread_data->env;
+  int status;
+
+  release_thread_callbacks(thread_data);
 
   napi_value js_value;
   status = napi_create_int32(env, thread_data->thread_ret, &js_value);
@@ -222,25 +216,20 @@ static void async_callback(uv_async_t *async) {
   }
 
 cleanup:
-  status = napi_close_handle_scope(env, scope);
-  if (status != napi_ok) {
-    fprintf(stderr, "napi_close_handle_scope is fail status [%d]", status);
-  }
-
-  uv_close((uv_handle_t *)async, close_callback<THREAD_PARAMS>);
+  dispatch_source_release(source, free_thread_data<THREAD_PARAMS>);
 }
 
 template<class THREAD_PARAMS>
 void *ThreadMain(void *opaque) {
   ThreadData<THREAD_PARAMS>* thread_data = (ThreadData<THREAD_PARAMS>*)opaque;
 
-  int ret = thread_data->thread_main(thread_data->message_queue, thread_data->buffer_ready_async, thread_data->drain_async, thread_data->params);
+  int ret = thread_data->thread_main(thread_data->message_queue, thread_data->buffer_ready_source, thread_data->drain_source, thread_data->params);
   thread_data->thread_ret = ret;
 
   av_thread_message_queue_set_err_send(thread_data->message_queue, AVERROR_EOF);
   av_thread_message_queue_set_err_recv(thread_data->message_queue, AVERROR_EOF);
 
-  uv_async_send(&thread_data->thread_finished_async);
+  dispatcher_wake(&thread_data->thread_finished_source);
 
   return 0;
 }
@@ -255,7 +244,7 @@ static void finalize(napi_env env, void* finalize_data, void* finalize_hint) {
 template<class THREAD_PARAMS>
 napi_status start_thread_with_promise_result(
     napi_env env,
-    int (*thread_main)(AVThreadMessageQueue *message_queue, uv_async_t *buffer_ready_async, uv_async_t *drain_async, const THREAD_PARAMS &params),
+    int (*thread_main)(AVThreadMessageQueue *message_queue, DispatchSource *buffer_ready_source, DispatchSource *drain_source, const THREAD_PARAMS &params),
     const THREAD_PARAMS &params,
     napi_value abort_signal,
     napi_value js_input_value,
@@ -264,7 +253,8 @@ napi_status start_thread_with_promise_result(
     napi_value *external,
     napi_value on_buffer_ready_callback,
     napi_value on_drain_callback,
-    napi_value *promise) {
+    napi_value *promise,
+    bool batch_buffers = false) {
 
   napi_status status;
   int ret;
@@ -274,13 +264,6 @@ napi_status start_thread_with_promise_result(
   thread_data->env = env;
   thread_data->thread_main = thread_main;
 
-  ret = uv_async_init(uv_default_loop(), &thread_data->thread_finished_async, async_callback<THREAD_PARAMS>);
-  if (ret != 0) {
-    delete thread_data;
-    return napi_throw_error(env, NULL, "uv_async_init failed");
-  }
-  thread_data->thread_finished_async.data = (void*)thread_data;
-
   status = napi_create_promise(env, &thread_data->deferred, promise);
   if (status != napi_ok) {
     delete thread_data;
@@ -324,39 +307,46 @@ napi_status start_thread_with_promise_result(
     return status;
   }
 
+  thread_data->drain_source = NULL;
+
   if (on_buffer_ready_callback == NULL) {
-    thread_data->buffer_ready_async = NULL;
+    thread_data->buffer_ready_source = NULL;
   } else {
-    status = init_callback_for_many(env, on_buffer_ready_callback, &thread_data->buffer_ready_async);
+    status = init_callback_for_many(env, on_buffer_ready_callback, batch_buffers, &thread_data->buffer_ready_source);
     if (status != napi_ok) {
       delete thread_data;
       return status;
     }
   }
 
-  if (on_drain_callback == NULL) {
-    thread_data->drain_async = NULL;
-  } else {
+  if (on_drain_callback != NULL) {
     DrainCallback *drain_data = new DrainCallback();
     drain_data->env = env;
 
     status = napi_create_reference(env, on_drain_callback, 1, &drain_data->callback_ref);
     if (status != napi_ok) {
       delete drain_data;
+      release_thread_callbacks(thread_data);
       delete thread_data;
       return status;
     }
 
-    thread_data->drain_async = new uv_async_t();
-    ret = uv_async_init(uv_default_loop(), thread_data->drain_async, drain_async_callback);
-    if (ret != 0) {
+    status = dispatch_source_init(env, &drain_data->source, drain_dispatch, drain_data);
+    if (status != napi_ok) {
       napi_delete_reference(env, drain_data->callback_ref);
       delete drain_data;
-      delete thread_data->drain_async;
+      release_thread_callbacks(thread_data);
       delete thread_data;
-      return napi_throw_error(env, NULL, "uv_async_init failed for drain");
+      return status;
     }
-    thread_data->drain_async->data = drain_data;
+    thread_data->drain_source = &drain_data->source;
+  }
+
+  status = dispatch_source_init(env, &thread_data->thread_finished_source, thread_finished_dispatch<THREAD_PARAMS>, thread_data);
+  if (status != napi_ok) {
+    release_thread_callbacks(thread_data);
+    delete thread_data;
+    return status;
   }
 
   //
@@ -366,7 +356,8 @@ napi_status start_thread_with_promise_result(
   pthread_attr_t attr;
   ret = pthread_attr_init(&attr);
   if (ret != 0) {
-    delete thread_data;
+    release_thread_callbacks(thread_data);
+    dispatch_source_release(&thread_data->thread_finished_source, free_thread_data<THREAD_PARAMS>);
     fprintf(stderr, "pthread_attr_init fail error num [%d]\n", ret);
     return napi_throw_error(env, NULL, "pthread_attr_init failed");
   }
@@ -380,7 +371,8 @@ napi_status start_thread_with_promise_result(
 
   ret = pthread_create(&thread_data->thread, &attr, ThreadMain<THREAD_PARAMS>, (void *)thread_data);
   if (ret != 0) {
-    delete thread_data;
+    release_thread_callbacks(thread_data);
+    dispatch_source_release(&thread_data->thread_finished_source, free_thread_data<THREAD_PARAMS>);
     fprintf(stderr, "pthread_create fail error num [%d]\n", ret);
     return napi_throw_error(env, NULL, "pthread_create failed");
   }
@@ -0,0 +1,290 @@
+#include <math.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/mem.h>
+}
+
+#include "time_stretch.h"
+
+struct TimeStretch {
+  // Half of the window length, which is also the amount of output produced by
+  // each overlap-add step. 10ms.
+  int half_window;
+
+  // How far the window can move to line up with the previous one
+  int tolerance;
+
+  // Rising half of a Hann window. The falling half is 1 - rising.
+  float *rising;
+
+  int16_t *input;
+  int input_length;
+  int input_capacity;
+
+  // Start of the last window, or -1 if no window is in progress and samples
+  // are passing straight through.
+  int window_start;
+
+  // Where the last window would have started without the tolerance. This
+  // advances by exactly half_window * rate each step, so the windows don't
+  // drift back towards the natural continuation.
+  double nominal_start;
+
+  // The falling half of the last window, to be added to the next one
+  float *overlap;
+};
+
+TimeStretch *time_stretch_alloc(int sample_rate) {
+  TimeStretch *time_stretch = new TimeStretch();
+
+  time_stretch->half_window = sample_rate / 100;
+  time_stretch->tolerance = time_stretch->half_window / 2;
+  time_stretch->window_start = -1;
+
+  // Room for a window at the furthest position the fastest rate can reach, and
+  // some more to push into.
+  time_stretch->input_capacity = time_stretch->half_window * 16;
+
+  time_stretch->rising = (float *)av_malloc_array(time_stretch->half_window, sizeof(float));
+  time_stretch->overlap = (float *)av_malloc_array(time_stretch->half_window, sizeof(float));
+  time_stretch->input = (int16_t *)av_malloc_array(time_stretch->input_capacity, sizeof(int16_t));
+
+  if (time_stretch->rising == NULL || time_stretch->overlap == NULL || time_stretch->input == NULL) {
+    time_stretch_free(&time_stretch);
+    return NULL;
+  }
+
+  for (int i = 0; i < time_stretch->half_window; i++) {
+    time_stretch->rising[i] = 0.5f - 0.5f * cosf((float)M_PI * i / time_stretch->half_window);
+  }
+
+  return time_stretch;
+}
+
+void time_stretch_free(TimeStretch **time_stretch) {
+  if (*time_stretch == NULL) {
+    return;
+  }
+
+  av_freep(&(*time_stretch)->rising);
+  av_freep(&(*time_stretch)->overlap);
+  av_freep(&(*time_stretch)->input);
+
+  delete *time_stretch;
+  *time_stretch = NULL;
+}
+
+static int16_t clip_int16(float value) {
+  int rounded = (int)lrintf(value);
+  if (rounded > INT16_MAX) {
+    return INT16_MAX;
+  } else if (rounded < INT16_MIN) {
+    return INT16_MIN;
+  }
+  return (int16_t)rounded;
+}
+
+// Removes input that no window will look at again
+static void compact_input(TimeStretch *time_stretch, int keep_from) {
+  if (keep_from <= 0) {
+    return;
+  }
+
+  time_stretch->input_length -= keep_from;
+  memmove(time_stretch->input, time_stretch->input + keep_from, time_stretch->input_length * sizeof(int16_t));
+
+  if (time_stretch->window_start >= 0) {
+    time_stretch->window_start -= keep_from;
+    time_stretch->nominal_start -= keep_from;
+  }
+}
+
+int time_stretch_push(TimeStretch *time_stretch, const int16_t *samples, int count) {
+  if (time_stretch->window_start >= 0) {
+    // The next search can reach back to tolerance before the nominal start
+    int keep_from = (int)(time_stretch->nominal_start + time_stretch->half_window) - time_stretch->tolerance;
+    if (keep_from > time_stretch->window_start) {
+      keep_from = time_stretch->window_start;
+    }
+    compact_input(time_stretch, keep_from);
+  }
+
+  int space = time_stretch->input_capacity - time_stretch->input_length;
+  if (count > space) {
+    count = space;
+  }
+
+  memcpy(time_stretch->input + time_stretch->input_length, samples, count * sizeof(int16_t));
+  time_stretch->input_length += count;
+
+  return count;
+}
+
+static int64_t cross_correlation(const int16_t *a, const int16_t *b, int count) {
+  int64_t sum = 0;
+  for (int i = 0; i < count; i++) {
+    sum += (int32_t)a[i] * b[i];
+  }
+  return sum;
+}
+
+// Returns the window start in [center - tolerance, center + tolerance] that
+// best continues the waveform at `natural`. A coarse search is refined around
+// its best result.
+static int find_best_window(const TimeStretch *time_stretch, int center, int natural) {
+  const int16_t *target = time_stretch->input + natural;
+  const int length = time_stretch->half_window;
+
+  int best = center;
+  int64_t best_score = INT64_MIN;
+
+  for (int offset = -time_stretch->tolerance; offset <= time_stretch->tolerance; offset += 4) {
+    int64_t score = cross_correlation(time_stretch->input + center + offset, target, length);
+    if (score > best_score) {
+      best_score = score;
+      best = center + offset;
+    }
+  }
+
+  int coarse = best;
+  for (int offset = -3; offset <= 3; offset++) {
+    int candidate = coarse + offset;
+    if (offset == 0 || candidate < center - time_stretch->tolerance || candidate > center + time_stretch->tolerance) {
+      continue;
+    }
+
+    int64_t score = cross_correlation(time_stretch->input + candidate, target, length);
+    if (score > best_score) {
+      best_score = score;
+      best = candidate;
+    }
+  }
+
+  return best;
+}
+
+// Stores the falling half of the window that starts at `start`
+static void save_overlap(TimeStretch *time_stretch, int start) {
+  const int16_t *second_half = time_stretch->input + start + time_stretch->half_window;
+  for (int i = 0; i < time_stretch->half_window; i++) {
+    time_stretch->overlap[i] = second_half[i] * (1.0f - time_stretch->rising[i]);
+  }
+}
+
+// Writes the saved overlap added to the rising half of the window at `start`
+static void write_overlap_add(const TimeStretch *time_stretch, int start, int16_t *out) {
+  const int16_t *first_half = time_stretch->input + start;
+  for (int i = 0; i < time_stretch->half_window; i++) {
+    out[i] = clip_int16(time_stretch->overlap[i] + first_half[i] * time_stretch->rising[i]);
+  }
+}
+
+int time_stretch_pull(TimeStretch *time_stretch, double rate, int16_t *out, int max_count, int *dropped) {
+  const int half_window = time_stretch->half_window;
+  int written = 0;
+
+  while (true) {
+    if (time_stretch->window_start < 0) {
+      if (rate <= 1.0) {
+        // Pass through
+        int count = time_stretch->input_length;
+        if (count > max_count - written) {
+          count = max_count - written;
+        }
+
+        memcpy(out + written, time_stretch->input, count * sizeof(int16_t));
+        written += count;
+        compact_input(time_stretch, count);
+        return written;
+      }
+
+      // Start the first window. Its rising half is written as is.
+      if (time_stretch->input_length < 2 * half_window || max_count - written < half_window) {
+        return written;
+      }
+
+      memcpy(out + written, time_stretch->input, half_window * sizeof(int16_t));
+      written += half_window;
+      save_overlap(time_stretch, 0);
+      time_stretch->window_start = 0;
+      time_stretch->nominal_start = 0;
+      continue;
+    }
+
+    if (max_count - written < half_window) {
+      return written;
+    }
+
+    // The input that would naturally follow the last window
+    int natural = time_stretch->window_start + half_window;
+
+    if (rate <= 1.0) {
+      // Finish the last window against its natural continuation, which
+      // crossfades back to the unmodified input.
+      if (time_stretch->input_length < natural + half_window) {
+        return written;
+      }
+
+      write_overlap_add(time_stretch, natural, out + written);
+      written += half_window;
+      compact_input(time_stretch, natural + half_window);
+      time_stretch->window_start = -1;
+      continue;
+    }
+
+    double nominal_start = time_stretch->nominal_start + half_window * rate;
+    int center = (int)lrint(nominal_start);
+    if (center - time_stretch->tolerance < 0) {
+      // Only possible if the rate dropped sharply. Catch up with the window.
+      center = time_stretch->tolerance;
+    }
+    if (time_stretch->input_length < center + time_stretch->tolerance + 2 * half_window) {
+      return written;
+    }
+
+    int start = find_best_window(time_stretch, center, natural);
+    time_stretch->nominal_start = nominal_start;
+
+    write_overlap_add(time_stretch, start, out + written);
+    written += half_window;
+    save_overlap(time_stretch, start);
+
+    *dropped += start - natural;
+    time_stretch->window_start = start;
+  }
+}
+
+int time_stretch_finish(TimeStretch *time_stretch, int16_t *out, int *dropped) {
+  if (time_stretch->window_start < 0) {
+    // Pass through mode never holds on to samples
+    return 0;
+  }
+
+  // The natural continuation of the last window is incomplete, so pad it with
+  // silence.
+  int natural = time_stretch->window_start + time_stretch->half_window;
+  int available = time_stretch->input_length - natural;
+
+  for (int i = 0; i < time_stretch->half_window; i++) {
+    float next = i < available ? time_stretch->input[natural + i] * time_stretch->rising[i] : 0.0f;
+    out[i] = clip_int16(time_stretch->overlap[i] + next);
+  }
+
+  *dropped += available - time_stretch->half_window;
+  time_stretch_reset(time_stretch);
+
+  return time_stretch->half_window;
+}
+
+int time_stretch_pending(const TimeStretch *time_stretch) {
+  if (time_stretch->window_start < 0) {
+    return time_stretch->input_length;
+  }
+  return time_stretch->input_length - (time_stretch->window_start + time_stretch->half_window);
+}
+
+void time_stretch_reset(TimeStretch *time_stretch) {
+  time_stretch->input_length = 0;
+  time_stretch->window_start = -1;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+// WSOLA (waveform similarity overlap-add) time compression for mono 16-bit
+// PCM. This shortens speech without changing its pitch, by overlapping
+// windows taken from the input at a faster rate than they are written to the
+// output. Each window is shifted by up to half a window to line up with the
+// waveform of the previous one, which hides the seams.
+//
+// Samples are pushed in and pulled out. While the rate is 1.0 and no window is
+// in progress, samples pass straight through.
+struct TimeStretch;
+
+TimeStretch *time_stretch_alloc(int sample_rate);
+void time_stretch_free(TimeStretch **time_stretch);
+
+// Copies as many samples as will fit into the input buffer, and returns how
+// many were copied.
+int time_stretch_push(TimeStretch *time_stretch, const int16_t *samples, int count);
+
+// Writes up to max_count samples of output, played back at `rate` times normal
+// speed. Returns the number of samples written. dropped is increased by the
+// number of input samples that were cut out of the output, which is negative
+// if the output was stretched.
+int time_stretch_pull(TimeStretch *time_stretch, double rate, int16_t *out, int max_count, int *dropped);
+
+// Writes out everything that is left, for the end of a segment. This should be
+// called after time_stretch_pull() with a rate of 1.0 has written all that it
+// can. out must have room for 10ms of audio.
+int time_stretch_finish(TimeStretch *time_stretch, int16_t *out, int *dropped);
+
+// Returns the number of input samples that were pushed but haven't been fully
+// written to the output yet.
+int time_stretch_pending(const TimeStretch *time_stretch);
+
+// Discards everything that was pushed.
+void time_stretch_reset(TimeStretch *time_stretch);
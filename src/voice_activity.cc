@@ -0,0 +1,152 @@
+#include <math.h>
+
+extern "C" {
+#include <libavutil/mem.h>
+}
+
+#include "time_util.h"
+#include "voice_activity.h"
+
+// Frames quieter than this are never speech, however quiet the background is
+#define MIN_SPEECH_DB -55.0
+
+// Where the noise floor starts, before it has seen any audio
+#define INITIAL_NOISE_FLOOR_DB -60.0
+
+// Active audio needed before speech starts, so that clicks and pops don't
+// count. The pre-roll recovers what is skipped.
+#define ONSET_DURATION (30 * 1000)
+
+// Fraction of sign changes between consecutive samples. Voiced speech is well
+// below this, white noise is near 0.5.
+#define NOISE_ZERO_CROSSING_RATE 0.35
+
+// Frames with a high zero crossing rate still count if they are this much
+// louder than the threshold, since fricatives like "s" look like noise too.
+#define LOUD_NOISE_MARGIN_DB 10.0
+
+// Time constants of the noise floor. It falls quickly to follow quiet
+// backgrounds, and rises slowly so that speech doesn't become the floor.
+#define NOISE_FLOOR_FALL_TIME (100 * 1000)
+#define NOISE_FLOOR_RISE_TIME (5 * MICROSECONDS)
+
+struct VoiceActivityDetector {
+  double threshold_db;
+  double noise_floor_db;
+
+  // Microseconds
+  int64_t hangover;
+  int64_t active_run;
+  int64_t inactive_run;
+
+  bool speaking;
+};
+
+VoiceActivityDetector *voice_activity_alloc(int threshold_db, int hangover_ms) {
+  VoiceActivityDetector *vad = (VoiceActivityDetector *)av_mallocz(sizeof(VoiceActivityDetector));
+  if (vad == NULL) {
+    return NULL;
+  }
+
+  vad->threshold_db = threshold_db;
+  vad->noise_floor_db = INITIAL_NOISE_FLOOR_DB;
+  vad->hangover = (int64_t)hangover_ms * 1000;
+
+  return vad;
+}
+
+void voice_activity_free(VoiceActivityDetector **vad) {
+  av_freep(vad);
+}
+
+// Mean square of all channels relative to full scale, and the zero crossing
+// rate of the first channel
+static void measure(const void *samples, int count, int channels, bool is_float, double *energy_db, double *zero_crossing_rate) {
+  int total = count * channels;
+  double sum_of_squares = 0;
+  int crossings = 0;
+
+  if (is_float) {
+    const float *data = (const float *)samples;
+    for (int i = 0; i < total; i++) {
+      sum_of_squares += (double)data[i] * data[i];
+    }
+    for (int i = channels; i < total; i += channels) {
+      crossings += (data[i] < 0) != (data[i - channels] < 0);
+    }
+  } else {
+    const int16_t *data = (const int16_t *)samples;
+    int64_t sum = 0;
+    for (int i = 0; i < total; i++) {
+      int32_t sample = data[i];
+      sum += sample * sample;
+    }
+    sum_of_squares = (double)sum / (32768.0 * 32768.0);
+    for (int i = channels; i < total; i += channels) {
+      crossings += (data[i] < 0) != (data[i - channels] < 0);
+    }
+  }
+
+  double mean_square = sum_of_squares / total;
+  *energy_db = mean_square > 1e-12 ? 10.0 * log10(mean_square) : -120.0;
+  *zero_crossing_rate = count > 1 ? (double)crossings / (count - 1) : 0;
+}
+
+static void update_noise_floor(VoiceActivityDetector *vad, double energy_db, int64_t duration) {
+  int64_t time_constant = energy_db < vad->noise_floor_db ? NOISE_FLOOR_FALL_TIME : NOISE_FLOOR_RISE_TIME;
+  double alpha = 1.0 - exp(-(double)duration / time_constant);
+  vad->noise_floor_db += (energy_db - vad->noise_floor_db) * alpha;
+}
+
+VoiceActivityEvent voice_activity_process(VoiceActivityDetector *vad, const void *samples, int count, int channels, bool is_float, int sample_rate) {
+  if (count <= 0) {
+    return VOICE_ACTIVITY_NONE;
+  }
+
+  int64_t duration = (int64_t)count * MICROSECONDS / sample_rate;
+
+  double energy_db, zero_crossing_rate;
+  measure(samples, count, channels, is_float, &energy_db, &zero_crossing_rate);
+
+  double threshold_db = fmax(vad->noise_floor_db + vad->threshold_db, MIN_SPEECH_DB);
+  bool active = energy_db > threshold_db &&
+                (zero_crossing_rate < NOISE_ZERO_CROSSING_RATE || energy_db > threshold_db + LOUD_NOISE_MARGIN_DB);
+
+  // Speech only ever pulls the floor up at the slow rate, and the pauses
+  // between words pull it back down. A background that gets louder and stays
+  // that way still becomes the floor after a few seconds, so it can't hold
+  // speech open forever.
+  update_noise_floor(vad, energy_db, duration);
+
+  if (active) {
+    vad->active_run += duration;
+    vad->inactive_run = 0;
+  } else {
+    vad->active_run = 0;
+    vad->inactive_run += duration;
+  }
+
+  if (!vad->speaking && vad->active_run >= ONSET_DURATION) {
+    vad->speaking = true;
+    return VOICE_ACTIVITY_START;
+  }
+
+  if (vad->speaking && vad->inactive_run > vad->hangover) {
+    vad->speaking = false;
+    return VOICE_ACTIVITY_END;
+  }
+
+  return VOICE_ACTIVITY_NONE;
+}
+
+bool voice_activity_speaking(const VoiceActivityDetector *vad) {
+  return vad->speaking;
+}
+
+bool voice_activity_interrupt(VoiceActivityDetector *vad) {
+  bool was_speaking = vad->speaking;
+  vad->speaking = false;
+  vad->active_run = 0;
+  vad->inactive_run = 0;
+  return was_speaking;
+}
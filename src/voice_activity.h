@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+// Voice activity detector that runs on decoded frames. Each frame is active if
+// its energy stands out from an adaptive estimate of the background noise, and
+// it doesn't look like broadband noise, i.e. it isn't both quiet and full of
+// zero crossings. Speech starts after a short run of active frames, and ends
+// once no frame has been active for the hangover time.
+//
+// This is deliberately cheap: a couple of multiply-adds per sample, so it can
+// run on every frame of every stream without showing up next to the decoder.
+
+enum VoiceActivityEvent {
+  VOICE_ACTIVITY_NONE,
+  VOICE_ACTIVITY_START,
+  VOICE_ACTIVITY_END,
+};
+
+struct VoiceActivityDetector;
+
+// threshold_db is how far above the noise floor a frame must be to count as
+// active. Returns NULL if out of memory.
+VoiceActivityDetector *voice_activity_alloc(int threshold_db, int hangover_ms);
+
+void voice_activity_free(VoiceActivityDetector **vad);
+
+// Classifies a frame of `count` samples per channel of interleaved int16, or
+// float if is_float is set. Returns whether speech started or ended with it.
+VoiceActivityEvent voice_activity_process(VoiceActivityDetector *vad, const void *samples, int count, int channels, bool is_float, int sample_rate);
+
+// Whether the last frame was part of speech, including the hangover
+bool voice_activity_speaking(const VoiceActivityDetector *vad);
+
+// Ends speech without waiting for the hangover, e.g. when the stream pauses.
+// Returns true if speech was in progress. The noise floor is kept.
+bool voice_activity_interrupt(VoiceActivityDetector *vad);
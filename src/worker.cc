@@ -19,10 +19,17 @@ extern "C" {
 #include "node_errors.h"
 #include "thread_messages.h"
 #include "audio_decode_thread.h"
+#include "jitter_buffer.h"
 #include "audio_encode_thread.h"
 #include "thread_with_promise_result.h"
+#include "clip_cache.h"
+#include "group_mixer_thread.h"
 #define SDP_MAX_SIZE 2046
 
+// An Opus packet holds at most 120ms, in up to 48 frames of at most 1275 bytes
+#define MAX_OPUS_PACKET_DURATION 5760
+#define MAX_OPUS_PACKET_SIZE (48 * 1275)
+
 namespace hilokal {
 
   napi_status is_nullish(napi_env env, napi_value value, bool *result) {
@@ -176,20 +183,287 @@ namespace hilokal {
     return status;
   }
 
+  // Sets value to NULL if the option isn't a function
+  napi_status get_option_function(napi_env env, napi_value options, const char *key, napi_value *value) {
+    napi_status status;
+    napi_value prop_value;
+    napi_valuetype prop_type;
+
+    *value = NULL;
+
+    status = napi_get_named_property(env, options, key, &prop_value);
+    if (status != napi_ok) {
+      return status;
+    }
+
+    status = napi_typeof(env, prop_value, &prop_type);
+    if (status != napi_ok) {
+      return status;
+    }
+
+    if (prop_type == napi_function) {
+      *value = prop_value;
+    }
+
+    return status;
+  }
+
+  // Extracts the optional bufferedAudio option, which is an Int32Array over a
+  // SharedArrayBuffer, laid out as described in buffered_audio.h. Leaves
+  // buffered_audio->fields NULL if it's missing.
+  napi_status get_option_buffered_audio(napi_env env, napi_value options, BufferedAudio *buffered_audio) {
+    napi_value prop_value;
+    bool is_typedarray = false;
+    napi_get_named_property(env, options, "bufferedAudio", &prop_value);
+    napi_is_typedarray(env, prop_value, &is_typedarray);
+    if (!is_typedarray) {
+      return napi_ok;
+    }
+
+    int32_t low_water_mark_ms = -1;
+    get_option_int32(env, options, "lowWaterMarkMs", &low_water_mark_ms);
+
+    napi_typedarray_type type;
+    size_t length;
+    void *data;
+    napi_status status = napi_get_typedarray_info(env, prop_value, &type, &length, &data, NULL, NULL);
+    if (status != napi_ok) {
+      GET_AND_THROW_LAST_ERROR(env);
+      return status;
+    }
+
+    if (type != napi_int32_array || buffered_audio_init(buffered_audio, data, length * sizeof(int32_t), low_water_mark_ms) != 0) {
+      napi_throw_error(env, NULL, "bufferedAudio must be an Int32Array of at least 4 elements");
+      return napi_invalid_arg;
+    }
+
+    return napi_ok;
+  }
+
+  // Extracts the optional mixerInputs option, an array of { sampleRate,
+  // bufferedAudio, lowWaterMarkMs, queueDepth }. Each bufferedAudio is an
+  // Int32Array laid out as described in mixer.h.
+  napi_status get_option_mixer_inputs(napi_env env, napi_value options, AudioEncodeThreadParams *params) {
+    napi_value inputs;
+    bool is_array = false;
+    napi_get_named_property(env, options, "mixerInputs", &inputs);
+    napi_is_array(env, inputs, &is_array);
+    if (!is_array) {
+      return napi_ok;
+    }
+
+    uint32_t count;
+    napi_status status = napi_get_array_length(env, inputs, &count);
+    if (status != napi_ok) {
+      GET_AND_THROW_LAST_ERROR(env);
+      return status;
+    }
+
+    if (count > MIXER_MAX_INPUTS) {
+      napi_throw_range_error(env, NULL, "Too many mixer inputs");
+      return napi_invalid_arg;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      MixerInputParams *input = &params->mixerInputs[i];
+      napi_value element;
+      status = napi_get_element(env, inputs, i, &element);
+      if (status != napi_ok) {
+        GET_AND_THROW_LAST_ERROR(env);
+        return status;
+      }
+
+      status = get_option_int32(env, element, "sampleRate", &input->sampleRate);
+      if (status != napi_ok || input->sampleRate < 8000 || input->sampleRate > 192000) {
+        napi_throw_range_error(env, NULL, "Mixer input sampleRate must be between 8000 and 192000");
+        return napi_invalid_arg;
+      }
+
+      status = get_option_int32(env, element, "queueDepth", &input->queueDepth);
+      if (status != napi_ok || input->queueDepth <= 0) {
+        input->queueDepth = 1024;
+      }
+
+      status = get_option_buffered_audio(env, element, &input->bufferedAudio);
+      if (status != napi_ok) {
+        return status;
+      }
+
+      napi_value fields;
+      size_t length = 0;
+      napi_get_named_property(env, element, "bufferedAudio", &fields);
+      if (input->bufferedAudio.fields == NULL ||
+          napi_get_typedarray_info(env, fields, NULL, &length, NULL, NULL, NULL) != napi_ok ||
+          length * sizeof(int32_t) < MIXER_INPUT_SIZE) {
+        napi_throw_error(env, NULL, "Mixer input bufferedAudio must be an Int32Array of at least 8 elements");
+        return napi_invalid_arg;
+      }
+    }
+
+    params->mixerInputCount = count;
+    return napi_ok;
+  }
+
+  // Extracts the optional sinks option of the decoder, an array of {
+  // sampleRate, channels, floatSamples, chunkMs }
+  napi_status get_option_decoder_sinks(napi_env env, napi_value options, AudioDecodeThreadParams *params) {
+    napi_value sinks;
+    bool is_array = false;
+    napi_get_named_property(env, options, "sinks", &sinks);
+    napi_is_array(env, sinks, &is_array);
+    if (!is_array) {
+      return napi_ok;
+    }
+
+    uint32_t count;
+    napi_status status = napi_get_array_length(env, sinks, &count);
+    if (status != napi_ok) {
+      GET_AND_THROW_LAST_ERROR(env);
+      return status;
+    }
+
+    if (count > DECODER_MAX_SINKS) {
+      napi_throw_range_error(env, NULL, "Too many sinks");
+      return napi_invalid_arg;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      DecoderSinkParams *sink = &params->sinks[i];
+      napi_value element;
+      status = napi_get_element(env, sinks, i, &element);
+      if (status != napi_ok) {
+        GET_AND_THROW_LAST_ERROR(env);
+        return status;
+      }
+
+      status = get_option_int32(env, element, "sampleRate", &sink->sampleRate);
+      if (status != napi_ok || sink->sampleRate < 8000 || sink->sampleRate > 192000) {
+        napi_throw_range_error(env, NULL, "Sink sampleRate must be between 8000 and 192000");
+        return napi_invalid_arg;
+      }
+
+      if (get_option_int32(env, element, "channels", &sink->channels) != napi_ok) {
+        sink->channels = 1;
+      }
+      if (sink->channels != 1 && sink->channels != 2) {
+        napi_throw_range_error(env, NULL, "Sink channels must be 1 or 2");
+        return napi_invalid_arg;
+      }
+
+      if (get_option_bool(env, element, "floatSamples", &sink->floatSamples) != napi_ok) {
+        sink->floatSamples = false;
+      }
+      if (get_option_double(env, element, "chunkMs", &sink->chunkMs) != napi_ok) {
+        sink->chunkMs = 0;
+      }
+    }
+
+    params->sinkCount = count;
+    return napi_ok;
+  }
+
+  void free_decoder_relays(AudioDecodeThreadParams *params) {
+    for (int i = 0; i < params->relayCount; i++) {
+      ProducerThreadParams *relay = &params->relays[i];
+      av_freep(&relay->url);
+      av_freep(&relay->ssrc);
+      av_freep(&relay->payloadType);
+      av_freep(&relay->cname);
+      av_freep(&relay->cryptoSuite);
+      av_freep(&relay->keyBase64);
+    }
+    params->relayCount = 0;
+  }
+
+  // Extracts the optional relays option of the decoder, an array of { url,
+  // ssrc, payloadType, cname, cryptoSuite, keyBase64 }. On failure, the caller
+  // frees the strings with free_decoder_relays().
+  napi_status get_option_decoder_relays(napi_env env, napi_value options, AudioDecodeThreadParams *params) {
+    napi_value relays;
+    bool is_array = false;
+    napi_get_named_property(env, options, "relays", &relays);
+    napi_is_array(env, relays, &is_array);
+    if (!is_array) {
+      return napi_ok;
+    }
+
+    uint32_t count;
+    napi_status status = napi_get_array_length(env, relays, &count);
+    if (status != napi_ok) {
+      GET_AND_THROW_LAST_ERROR(env);
+      return status;
+    }
+
+    if (count > DECODER_MAX_RELAYS) {
+      napi_throw_range_error(env, NULL, "Too many relays");
+      return napi_invalid_arg;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      ProducerThreadParams *relay = &params->relays[i];
+      napi_value element;
+      status = napi_get_element(env, relays, i, &element);
+      if (status != napi_ok) {
+        GET_AND_THROW_LAST_ERROR(env);
+        return status;
+      }
+
+      // Counted first, so that the strings are freed if one of them fails
+      params->relayCount++;
+
+      const char *keys[] = { "url", "ssrc", "payloadType", "cname", "cryptoSuite", "keyBase64" };
+      char **values[] = { &relay->url, &relay->ssrc, &relay->payloadType, &relay->cname, &relay->cryptoSuite, &relay->keyBase64 };
+      for (size_t j = 0; j < sizeof(keys) / sizeof(keys[0]); j++) {
+        status = get_option_string(env, element, keys[j], values[j]);
+        if (status != napi_ok) {
+          GET_AND_THROW_LAST_ERROR(env);
+          return status;
+        }
+      }
+
+      if (relay->url == NULL) {
+        napi_throw_error(env, NULL, "Relay url is required");
+        return napi_invalid_arg;
+      }
+    }
+
+    return napi_ok;
+  }
+
   napi_value startDemuxerJob(napi_env env, napi_callback_info cbinfo) {
-    size_t argsLength = 2;
-    napi_value args[2];
+    size_t argsLength = 3;
+    napi_value args[3];
     napi_value ret;
     napi_status status = napi_ok;
 
     status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
+    // The options are optional
+    napi_value options = NULL;
+    BufferedAudio buffered_audio = {};
+    napi_value on_drain_callback = NULL;
+    if (argsLength > 2) {
+      napi_valuetype options_type;
+      status = napi_typeof(env, args[2], &options_type);
+      if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+      if (options_type == napi_object) {
+        options = args[2];
+
+        status = get_option_buffered_audio(env, options, &buffered_audio);
+        if (status != napi_ok) return NULL;
+
+        status = get_option_function(env, options, "onDrain", &on_drain_callback);
+        if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+      }
+    }
+
     napi_value abort_signal = args[1];
     napi_value external;
     napi_value promise;
 
-    status = start_file_demuxer(env, args[0], abort_signal, &external, &promise);
+    status = start_file_demuxer(env, args[0], abort_signal, buffered_audio, options, on_drain_callback, &external, &promise);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
     status = napi_create_object(env, &ret);
@@ -233,6 +507,16 @@ namespace hilokal {
     status = get_option_string(env, args[1], "ssrc", &params.ssrc);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
+    napi_value on_drain_callback = NULL;
+    if (status == napi_ok) {
+      status = get_option_buffered_audio(env, args[1], &params.jobBufferedAudio);
+    }
+
+    if (status == napi_ok) {
+      status = get_option_function(env, args[1], "onDrain", &on_drain_callback);
+      if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+    }
+
     if (status != napi_ok) {
       av_freep(&params.url);
       av_freep(&params.cname);
@@ -247,7 +531,7 @@ namespace hilokal {
     napi_value external;
     napi_value muxer_promise;
 
-    status = start_producer_thread(env, params, abort_signal, &external, &muxer_promise);
+    status = start_producer_thread(env, params, abort_signal, args[1], on_drain_callback, &external, &muxer_promise);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
     status = napi_create_object(env, &ret);
@@ -317,7 +601,7 @@ namespace hilokal {
 
     napi_valuetype valuetype1;
     napi_typeof(env, args[1], &valuetype1);
-    if (valuetype1 != napi_function) {
+    if (valuetype1 != napi_function && valuetype1 != napi_undefined) {
       fprintf(stderr, "[TYPE ERROR] Expects a function as second argument. type [%d]\n", valuetype1);
     }
 
@@ -336,16 +620,314 @@ namespace hilokal {
     status = get_option_int32(env, args[3], "channels", &params.channels);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
+    if (status == napi_ok) {
+      if (get_option_bool(env, args[3], "floatSamples", &params.floatSamples) != napi_ok) {
+        params.floatSamples = false;
+      }
+
+      if (params.sampleRate < 8000 || params.sampleRate > 192000) {
+        napi_throw_range_error(env, NULL, "sampleRate must be between 8000 and 192000");
+        status = napi_invalid_arg;
+      } else if (params.channels != 1 && params.channels != 2) {
+        napi_throw_range_error(env, NULL, "channels must be 1 or 2");
+        status = napi_invalid_arg;
+      }
+    }
+
+    // Extract optional chunking settings
+    if (status == napi_ok) {
+      if (get_option_double(env, args[3], "chunkMs", &params.chunkMs) != napi_ok) {
+        params.chunkMs = 0;
+      }
+      if (get_option_int32(env, args[3], "maxLatencyMs", &params.maxLatencyMs) != napi_ok) {
+        params.maxLatencyMs = 0;
+      }
+      if (get_option_bool(env, args[3], "batchCallbacks", &params.batchCallbacks) != napi_ok) {
+        params.batchCallbacks = false;
+      }
+      if (get_option_bool(env, args[3], "mainCallback", &params.mainCallback) != napi_ok) {
+        params.mainCallback = true;
+      }
+    }
+
+    // Extract optional gap handling settings
+    if (status == napi_ok) {
+      if (get_option_int32(env, args[3], "maxConcealMs", &params.maxConcealMs) != napi_ok) {
+        params.maxConcealMs = 100;
+      }
+      if (get_option_bool(env, args[3], "fillSilence", &params.fillSilence) != napi_ok) {
+        params.fillSilence = false;
+      }
+      if (get_option_bool(env, args[3], "gapEvents", &params.gapEvents) != napi_ok) {
+        params.gapEvents = false;
+      }
+
+      if (params.maxConcealMs < 0) {
+        napi_throw_range_error(env, NULL, "maxConcealMs must not be negative");
+        status = napi_invalid_arg;
+      }
+    }
+
+    // Extract optional jitter buffer settings. jitterStats is an Int32Array
+    // over a SharedArrayBuffer, laid out as described in jitter_buffer.h.
+    if (status == napi_ok) {
+      if (get_option_int32(env, args[3], "jitterMinDelayMs", &params.jitterMinDelayMs) != napi_ok) {
+        params.jitterMinDelayMs = 0;
+      }
+      if (get_option_int32(env, args[3], "jitterMaxDelayMs", &params.jitterMaxDelayMs) != napi_ok) {
+        params.jitterMaxDelayMs = 0;
+      }
+
+      if (get_option_bool(env, args[3], "clockedOutput", &params.clockedOutput) != napi_ok) {
+        params.clockedOutput = false;
+      }
+
+      if (params.jitterMinDelayMs < 0 || params.jitterMaxDelayMs > 1000 || params.jitterMinDelayMs > params.jitterMaxDelayMs) {
+        napi_throw_range_error(env, NULL, "jitter buffer delays must be between 0 and 1000, and minDelayMs must not be greater than maxDelayMs");
+        status = napi_invalid_arg;
+      } else if (params.clockedOutput && params.jitterMaxDelayMs == 0) {
+        napi_throw_error(env, NULL, "clockedOutput requires the jitter buffer");
+        status = napi_invalid_arg;
+      }
+    }
+
+    // Extract optional voice activity detection settings
+    if (status == napi_ok) {
+      if (get_option_bool(env, args[3], "voiceActivity", &params.voiceActivity) != napi_ok) {
+        params.voiceActivity = false;
+      }
+      if (get_option_int32(env, args[3], "vadThresholdDb", &params.vadThresholdDb) != napi_ok) {
+        params.vadThresholdDb = 12;
+      }
+      if (get_option_int32(env, args[3], "vadHangoverMs", &params.vadHangoverMs) != napi_ok) {
+        params.vadHangoverMs = 300;
+      }
+      if (get_option_bool(env, args[3], "vadGate", &params.vadGate) != napi_ok) {
+        params.vadGate = false;
+      }
+      if (get_option_int32(env, args[3], "vadPreRollMs", &params.vadPreRollMs) != napi_ok) {
+        params.vadPreRollMs = 200;
+      }
+      if (get_option_bool(env, args[3], "speechEvents", &params.speechEvents) != napi_ok) {
+        params.speechEvents = false;
+      }
+
+      if (params.vadThresholdDb < 1 || params.vadThresholdDb > 60) {
+        napi_throw_range_error(env, NULL, "vadThresholdDb must be between 1 and 60");
+        status = napi_invalid_arg;
+      } else if (params.vadHangoverMs < 0 || params.vadHangoverMs > 10000) {
+        napi_throw_range_error(env, NULL, "vadHangoverMs must be between 0 and 10000");
+        status = napi_invalid_arg;
+      } else if (params.vadPreRollMs < 0 || params.vadPreRollMs > 1000) {
+        napi_throw_range_error(env, NULL, "vadPreRollMs must be between 0 and 1000");
+        status = napi_invalid_arg;
+      } else if ((params.vadGate || params.speechEvents) && !params.voiceActivity) {
+        napi_throw_error(env, NULL, "vadGate and speechEvents require voiceActivity");
+        status = napi_invalid_arg;
+      }
+    }
+
+    if (status == napi_ok) {
+      napi_value prop_value;
+      bool is_typedarray = false;
+      napi_get_named_property(env, args[3], "jitterStats", &prop_value);
+      napi_is_typedarray(env, prop_value, &is_typedarray);
+      if (is_typedarray) {
+        napi_typedarray_type type;
+        size_t length;
+        void *data;
+        status = napi_get_typedarray_info(env, prop_value, &type, &length, &data, NULL, NULL);
+        if (status == napi_ok) {
+          if (type != napi_int32_array || length * sizeof(int32_t) < JITTER_BUFFER_STATS_SIZE) {
+            napi_throw_error(env, NULL, "jitterStats must be an Int32Array of at least 4 elements");
+            status = napi_invalid_arg;
+          } else {
+            params.jitterStats = (int32_t *)data;
+          }
+        } else {
+          GET_AND_THROW_LAST_ERROR(env);
+        }
+      }
+    }
+
+    if (status == napi_ok) {
+      napi_value prop_value;
+      bool is_typedarray = false;
+      napi_get_named_property(env, args[3], "control", &prop_value);
+      napi_is_typedarray(env, prop_value, &is_typedarray);
+      if (is_typedarray) {
+        napi_typedarray_type type;
+        size_t length;
+        void *data;
+        status = napi_get_typedarray_info(env, prop_value, &type, &length, &data, NULL, NULL);
+        if (status == napi_ok) {
+          if (type != napi_int32_array || length * sizeof(int32_t) < DECODER_CONTROL_SIZE) {
+            napi_throw_error(env, NULL, "control must be an Int32Array of at least 4 elements");
+            status = napi_invalid_arg;
+          } else {
+            params.control = (int32_t *)data;
+          }
+        } else {
+          GET_AND_THROW_LAST_ERROR(env);
+        }
+      }
+    }
+
+    // Extract optional outputRing. This is a Uint8Array over a
+    // SharedArrayBuffer, laid out as described in pcm_output_ring.h.
+    napi_value on_reader_wakeup = NULL;
+    if (status == napi_ok) {
+      napi_value prop_value;
+      bool is_typedarray = false;
+      napi_get_named_property(env, args[3], "outputRing", &prop_value);
+      napi_is_typedarray(env, prop_value, &is_typedarray);
+      if (is_typedarray) {
+        napi_typedarray_type type;
+        size_t length;
+        void *data;
+        status = napi_get_typedarray_info(env, prop_value, &type, &length, &data, NULL, NULL);
+        if (status == napi_ok) {
+          if (type != napi_uint8_array || pcm_output_ring_init(&params.outputRing, data, length) != 0) {
+            napi_throw_error(env, NULL, "outputRing must be a Uint8Array over an initialized PCM output ring");
+            status = napi_invalid_arg;
+          } else if (params.floatSamples) {
+            napi_throw_error(env, NULL, "outputRing only supports 16-bit samples");
+            status = napi_invalid_arg;
+          }
+        } else {
+          GET_AND_THROW_LAST_ERROR(env);
+        }
+
+        if (status == napi_ok) {
+          napi_valuetype wakeup_type;
+          napi_get_named_property(env, args[3], "onReaderWakeup", &on_reader_wakeup);
+          napi_typeof(env, on_reader_wakeup, &wakeup_type);
+          if (wakeup_type != napi_function) {
+            on_reader_wakeup = NULL;
+          }
+        }
+      }
+    }
+
+    if (status == napi_ok) {
+      status = get_option_decoder_sinks(env, args[3], &params);
+    }
+
+    if (status == napi_ok) {
+      status = get_option_decoder_relays(env, args[3], &params);
+    }
+
+    if (status == napi_ok && params.sinkCount > 0 && valuetype1 != napi_function) {
+      napi_throw_type_error(env, NULL, "sinks require a callback");
+      status = napi_invalid_arg;
+    }
+
     if (status != napi_ok) {
       av_freep(&params.sdpBase64);
+      free_decoder_relays(&params);
       return NULL;
     }
 
-    napi_value on_audio_callback = args[1];
+    // onAudioData is optional when decoding into outputRing, or with only
+    // sinks and relays
+    napi_value on_audio_callback = valuetype1 == napi_function ? args[1] : NULL;
     napi_value abort_signal = args[2];
     napi_value external;
 
-    status = start_audio_decode_thread(env, params, abort_signal, on_audio_callback, &external, &promise);
+    status = start_audio_decode_thread(env, params, abort_signal, on_audio_callback, on_reader_wakeup, args[3], &external, &promise);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = napi_create_object(env, &ret);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = napi_set_named_property(env, ret, "external", external);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = napi_set_named_property(env, ret, "promise", promise);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    return ret;
+  }
+
+  // Starts the thread that mixes the decoders of a consumer group. options has
+  // sampleRate, loudest, rings (an array of Uint8Arrays over PCM output
+  // rings) and sources (an Int32Array laid out as described in
+  // group_mixer_thread.h).
+  napi_value startGroupMixerThread(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 3;
+    napi_value args[3];
+    napi_value ret;
+    napi_status status = napi_ok;
+    napi_value promise;
+    napi_value external;
+
+    struct GroupMixerThreadParams params = {};
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    napi_valuetype callback_type;
+    napi_typeof(env, args[0], &callback_type);
+    if (callback_type != napi_function) {
+      napi_throw_type_error(env, NULL, "Expects a function as first argument");
+      return NULL;
+    }
+
+    status = get_option_int32(env, args[2], "sampleRate", &params.sampleRate);
+    if (status != napi_ok || params.sampleRate < 8000 || params.sampleRate > 192000) {
+      napi_throw_range_error(env, NULL, "sampleRate must be between 8000 and 192000");
+      return NULL;
+    }
+
+    if (get_option_int32(env, args[2], "loudest", &params.loudest) != napi_ok || params.loudest < 0) {
+      params.loudest = 0;
+    }
+
+    napi_value rings;
+    uint32_t ring_count = 0;
+    bool is_array = false;
+    napi_get_named_property(env, args[2], "rings", &rings);
+    napi_is_array(env, rings, &is_array);
+    if (!is_array || napi_get_array_length(env, rings, &ring_count) != napi_ok || ring_count == 0 || ring_count > GROUP_MIXER_MAX_SOURCES) {
+      napi_throw_range_error(env, NULL, "rings must be an array of 1 to 32 PCM output rings");
+      return NULL;
+    }
+
+    for (uint32_t i = 0; i < ring_count; i++) {
+      napi_value element;
+      napi_typedarray_type type;
+      size_t length;
+      void *data;
+      status = napi_get_element(env, rings, i, &element);
+      if (status == napi_ok) {
+        status = napi_get_typedarray_info(env, element, &type, &length, &data, NULL, NULL);
+      }
+      if (status != napi_ok || type != napi_uint8_array || pcm_output_ring_init(&params.rings[i], data, length) != 0) {
+        napi_throw_error(env, NULL, "rings must be Uint8Arrays over initialized PCM output rings");
+        return NULL;
+      }
+    }
+    params.sourceCount = ring_count;
+
+    napi_value sources;
+    bool is_typedarray = false;
+    napi_get_named_property(env, args[2], "sources", &sources);
+    napi_is_typedarray(env, sources, &is_typedarray);
+    if (is_typedarray) {
+      napi_typedarray_type type;
+      size_t length;
+      void *data;
+      status = napi_get_typedarray_info(env, sources, &type, &length, &data, NULL, NULL);
+      if (status == napi_ok && type == napi_int32_array && length * sizeof(int32_t) >= ring_count * GROUP_MIXER_SOURCE_SIZE) {
+        params.sources = (int32_t *)data;
+      }
+    }
+    if (params.sources == NULL) {
+      napi_throw_error(env, NULL, "sources must be an Int32Array with 8 elements for each ring");
+      return NULL;
+    }
+
+    status = start_group_mixer_thread(env, params, args[1], args[0], args[2], &external, &promise);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
     status = napi_create_object(env, &ret);
@@ -360,6 +942,47 @@ namespace hilokal {
     return ret;
   }
 
+  // Returns a decoded audio buffer to its pool without waiting for it to be
+  // garbage collected. Detaching the ArrayBuffer runs its finalizer, and leaves
+  // any views of it empty, so the memory can't be read after it's reused.
+  napi_value releaseAudioBuffer(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 1;
+    napi_value args[1];
+    napi_status status = napi_ok;
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) {
+      GET_AND_THROW_LAST_ERROR(env);
+      return NULL;
+    }
+
+    napi_typedarray_type type;
+    napi_value arraybuffer;
+    size_t byte_offset;
+    status = napi_get_typedarray_info(env, args[0], &type, NULL, NULL, &arraybuffer, &byte_offset);
+    if (status != napi_ok) {
+      GET_AND_THROW_LAST_ERROR(env);
+      return NULL;
+    }
+
+    // Buffers from the decoder always cover their whole ArrayBuffer
+    if (type != napi_uint8_array || byte_offset != 0) {
+      napi_throw_type_error(env, NULL, "Expected a Buffer that was passed to onAudioData");
+      return NULL;
+    }
+
+    bool is_detached;
+    status = napi_is_detached_arraybuffer(env, arraybuffer, &is_detached);
+    if (status == napi_ok && !is_detached) {
+      status = napi_detach_arraybuffer(env, arraybuffer);
+    }
+    if (status != napi_ok) {
+      GET_AND_THROW_LAST_ERROR(env);
+    }
+
+    return NULL;
+  }
+
   napi_value postDemuxerReset(napi_env env, napi_callback_info cbinfo) {
     size_t argsLength = 1;
     napi_value args[1];
@@ -444,15 +1067,16 @@ namespace hilokal {
     status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
-    AVThreadMessageQueue *message_queue;
-    status = napi_get_value_external(env, args[0], (void **)&message_queue);
+    EncoderControl *control;
+    status = napi_get_value_external(env, args[0], (void **)&control);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
     int32_t bitrate;
     status = napi_get_value_int32(env, args[1], &bitrate);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
-    post_set_bitrate_to_thread(message_queue, bitrate);
+    post_set_bitrate_to_thread(control->queue, bitrate);
+    wake_encoder(control);
     return NULL;
   }
 
@@ -464,15 +1088,16 @@ namespace hilokal {
     status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
-    AVThreadMessageQueue *message_queue;
-    status = napi_get_value_external(env, args[0], (void **)&message_queue);
+    EncoderControl *control;
+    status = napi_get_value_external(env, args[0], (void **)&control);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
     bool enable;
     status = napi_get_value_bool(env, args[1], &enable);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
-    post_set_fec_to_thread(message_queue, enable);
+    post_set_fec_to_thread(control->queue, enable);
+    wake_encoder(control);
     return NULL;
   }
 
@@ -484,15 +1109,16 @@ namespace hilokal {
     status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
-    AVThreadMessageQueue *message_queue;
-    status = napi_get_value_external(env, args[0], (void **)&message_queue);
+    EncoderControl *control;
+    status = napi_get_value_external(env, args[0], (void **)&control);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
     int32_t percent;
     status = napi_get_value_int32(env, args[1], &percent);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
-    post_set_packet_loss_perc_to_thread(message_queue, percent);
+    post_set_packet_loss_perc_to_thread(control->queue, percent);
+    wake_encoder(control);
     return NULL;
   }
 
@@ -538,6 +1164,29 @@ namespace hilokal {
     status = get_option_int32(env, args[1], "sampleRate", &params.sampleRate);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
+    status = get_option_int32(env, args[1], "audioLevelExtensionId", &params.audioLevelExtensionId);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    // Extract optional catch-up mode settings
+    if (get_option_int32(env, args[1], "catchUpThresholdMs", &params.catchUpThresholdMs) != napi_ok) {
+      params.catchUpThresholdMs = 0;
+    }
+    if (params.catchUpThresholdMs > 0) {
+      params.catchUpTargetMs = params.catchUpThresholdMs / 2;
+      get_option_int32(env, args[1], "catchUpTargetMs", &params.catchUpTargetMs);
+
+      params.catchUpRate = 1.15;
+      get_option_double(env, args[1], "catchUpRate", &params.catchUpRate);
+
+      if (params.catchUpRate < 1.0 || params.catchUpRate > 2.0) {
+        napi_throw_range_error(env, NULL, "catchUpRate must be between 1 and 2");
+        status = napi_invalid_arg;
+      } else if (params.catchUpTargetMs < 0 || params.catchUpTargetMs >= params.catchUpThresholdMs) {
+        napi_throw_range_error(env, NULL, "catchUpTargetMs must be at least 0 and less than thresholdMs");
+        status = napi_invalid_arg;
+      }
+    }
+
     // Extract optional queueDepth (defaults to 8192)
     int32_t queue_depth_i32 = 0;
     unsigned int queue_depth = 8192;
@@ -547,18 +1196,40 @@ namespace hilokal {
 
     // Extract optional onDrain callback
     napi_value on_drain_callback = NULL;
-    {
-      napi_value js_key;
+    get_option_function(env, args[1], "onDrain", &on_drain_callback);
+
+    // Extract optional pcmRing. This is an Int16Array over a SharedArrayBuffer,
+    // laid out as described in pcm_ring_buffer.h.
+    if (status == napi_ok) {
       napi_value prop_value;
-      napi_create_string_utf8(env, "onDrain", NAPI_AUTO_LENGTH, &js_key);
-      napi_get_property(env, args[1], js_key, &prop_value);
-      napi_valuetype prop_type;
-      napi_typeof(env, prop_value, &prop_type);
-      if (prop_type == napi_function) {
-        on_drain_callback = prop_value;
+      bool is_typedarray = false;
+      napi_get_named_property(env, args[1], "pcmRing", &prop_value);
+      napi_is_typedarray(env, prop_value, &is_typedarray);
+      if (is_typedarray) {
+        napi_typedarray_type type;
+        size_t length;
+        void *data;
+        status = napi_get_typedarray_info(env, prop_value, &type, &length, &data, NULL, NULL);
+        if (status == napi_ok) {
+          if (type != napi_int16_array || pcm_ring_init(&params.pcmRing, data, length * sizeof(int16_t)) != 0) {
+            napi_throw_error(env, NULL, "pcmRing must be an Int16Array with a 32 byte header and a power of two capacity");
+            status = napi_invalid_arg;
+          }
+        } else {
+          GET_AND_THROW_LAST_ERROR(env);
+        }
       }
     }
 
+    // Extract optional bufferedAudio
+    if (status == napi_ok) {
+      status = get_option_buffered_audio(env, args[1], &params.bufferedAudio);
+    }
+
+    if (status == napi_ok) {
+      status = get_option_mixer_inputs(env, args[1], &params);
+    }
+
     if (status != napi_ok) {
         av_freep(&params.rtpUrl);
         av_freep(&params.ssrc);
@@ -571,9 +1242,10 @@ namespace hilokal {
 
     napi_value abort_signal = args[0];
     napi_value external;
+    napi_value control;
     napi_value promise;
 
-    status = start_audio_encode_thread(env, params, abort_signal, on_drain_callback, queue_depth, &external, &promise);
+    status = start_audio_encode_thread(env, params, abort_signal, on_drain_callback, queue_depth, args[1], &external, &control, &promise);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
     status = napi_create_object(env, &ret);
@@ -582,6 +1254,9 @@ namespace hilokal {
     status = napi_set_named_property(env, ret, "external", external);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
+    status = napi_set_named_property(env, ret, "control", control);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
     status = napi_set_named_property(env, ret, "promise", promise);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
@@ -589,9 +1264,9 @@ namespace hilokal {
   }
 
   napi_value postFlushEncoder(napi_env env, napi_callback_info cbinfo) {
-    size_t argsLength = 1;
-    napi_value args[1];
-    napi_status status = napi_ok;
+    size_t argsLength = 2;
+    napi_value args[2];
+    napi_status status = napi_ok;
 
     status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
@@ -600,11 +1275,19 @@ namespace hilokal {
     status = napi_get_value_external(env, args[0], (void **)&message_queue);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
-    post_flush_encoder_to_thread(message_queue);
+    // When the encoder reads from a pcmRing, the second argument is the ring's
+    // write index at the end of the segment.
+    int32_t ring_write_index = 0;
+    if (argsLength >= 2) {
+      status = napi_get_value_int32(env, args[1], &ring_write_index);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+    }
+
+    post_flush_encoder_to_thread(message_queue, ring_write_index);
     return NULL;
   }
 
-  napi_value postClearProducerQueue(napi_env env, napi_callback_info cbinfo) {
+  napi_value postPcmRingWakeup(napi_env env, napi_callback_info cbinfo) {
     size_t argsLength = 1;
     napi_value args[1];
     napi_status status = napi_ok;
@@ -616,10 +1299,59 @@ namespace hilokal {
     status = napi_get_value_external(env, args[0], (void **)&message_queue);
     if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
 
-    post_clear_producer_queue_to_thread(message_queue);
+    post_encoder_wakeup_to_thread(message_queue);
+    return NULL;
+  }
+
+  napi_value postClearProducerQueue(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 1;
+    napi_value args[1];
+    napi_status status = napi_ok;
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    EncoderControl *control;
+    status = napi_get_value_external(env, args[0], (void **)&control);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    post_clear_producer_queue_to_thread(control->queue);
+    wake_encoder(control);
     return NULL;
   }
 
+  // Discards everything that has been posted to the encoder, and the packets
+  // that are waiting to be sent. Returns the buffered audio ticks that were
+  // removed from the message queue.
+  napi_value postInterrupt(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 2;
+    napi_value args[2];
+    napi_status status = napi_ok;
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    EncoderControl *control;
+    status = napi_get_value_external(env, args[0], (void **)&control);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    // When the encoder reads from a pcmRing, the second argument is the ring's
+    // write index at the time of the interrupt.
+    int32_t ring_write_index = 0;
+    if (argsLength >= 2) {
+      status = napi_get_value_int32(env, args[1], &ring_write_index);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+    }
+
+    int64_t discarded = interrupt_encoder(control, ring_write_index);
+
+    napi_value return_value;
+    status = napi_create_double(env, (double)discarded, &return_value);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    return return_value;
+  }
+
   napi_value postPcmToEncoder(napi_env env, napi_callback_info cbinfo) {
     size_t argsLength = 2;
     napi_value args[2];
@@ -668,6 +1400,408 @@ namespace hilokal {
     return return_value;
   }
 
+  // Posts an array of Opus packets as a single message, to be sent as they
+  // are. The durations are at 48kHz. When the encoder reads from a pcmRing, the
+  // last argument is the ring's write index.
+  napi_value postOpusPacketsToEncoder(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 4;
+    napi_value args[4];
+    napi_status status = napi_ok;
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    if (argsLength < 3) {
+      napi_throw_error(env, NULL, "Expected 3 arguments");
+      return NULL;
+    }
+
+    AVThreadMessageQueue *message_queue;
+    status = napi_get_value_external(env, args[0], (void **)&message_queue);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    uint32_t count;
+    status = napi_get_array_length(env, args[1], &count);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    uint32_t durations_count;
+    status = napi_get_array_length(env, args[2], &durations_count);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    if (durations_count != count) {
+      napi_throw_range_error(env, NULL, "Expected a duration for each packet");
+      return NULL;
+    }
+
+    int32_t ring_write_index = 0;
+    if (argsLength >= 4) {
+      status = napi_get_value_int32(env, args[3], &ring_write_index);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+    }
+
+    void **packets = (void **)av_malloc_array(count > 0 ? count : 1, sizeof(void *));
+    size_t *sizes = (size_t *)av_malloc_array(count > 0 ? count : 1, sizeof(size_t));
+    int32_t *durations = (int32_t *)av_malloc_array(count > 0 ? count : 1, sizeof(int32_t));
+    bool success = true;
+    napi_value return_value = NULL;
+
+    if (packets == NULL || sizes == NULL || durations == NULL) {
+      throw_ffmpeg_error(env, AVERROR(ENOMEM));
+      goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      napi_value element;
+      status = napi_get_element(env, args[1], i, &element);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+      status = napi_get_buffer_info(env, element, &packets[i], &sizes[i]);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+      status = napi_get_element(env, args[2], i, &element);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+      status = napi_get_value_int32(env, element, &durations[i]);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+      if (sizes[i] == 0 || sizes[i] > MAX_OPUS_PACKET_SIZE || durations[i] <= 0 || durations[i] > MAX_OPUS_PACKET_DURATION) {
+        napi_throw_range_error(env, NULL, "Invalid Opus packet");
+        goto cleanup;
+      }
+    }
+
+    {
+      int ret = post_opus_packets_to_thread(message_queue, packets, sizes, durations, count, ring_write_index);
+      if (ret == AVERROR(EAGAIN)) {
+        success = false;
+      } else if (ret != 0) {
+        throw_ffmpeg_error(env, ret);
+        goto cleanup;
+      }
+    }
+
+    status = napi_get_boolean(env, success, &return_value);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+  cleanup:
+    av_free(packets);
+    av_free(sizes);
+    av_free(durations);
+    return return_value;
+  }
+
+  // Loads a clip into memory on the libuv thread pool. options has either a
+  // path, which is memory-mapped, or a data Buffer, which is copied. format is
+  // "ogg" or "pcm", and PCM is encoded with sampleRate and bitrate.
+  napi_value loadClip(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 1;
+    napi_value args[1];
+    napi_status status = napi_ok;
+    napi_value promise = NULL;
+    napi_value data_value;
+    bool data_nullish;
+    char *format = NULL;
+
+    ClipLoadParams params = {};
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    if (argsLength < 1) {
+      napi_throw_error(env, NULL, "Expected 1 argument");
+      return NULL;
+    }
+
+    status = get_option_string(env, args[0], "format", &format);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+    if (format != NULL && strcmp(format, "ogg") == 0) {
+      params.format = CLIP_FORMAT_OGG;
+    } else if (format != NULL && strcmp(format, "pcm") == 0) {
+      params.format = CLIP_FORMAT_PCM;
+    } else {
+      napi_throw_range_error(env, NULL, "format must be \"ogg\" or \"pcm\"");
+      goto cleanup;
+    }
+
+    status = get_option_int32(env, args[0], "sampleRate", &params.sampleRate);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+    status = get_option_int32(env, args[0], "bitrate", &params.bitrate);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+    status = get_option_string(env, args[0], "path", &params.path);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+    status = napi_get_named_property(env, args[0], "data", &data_value);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+    status = is_nullish(env, data_value, &data_nullish);
+    if (status != napi_ok) { goto cleanup; }
+
+    if (!data_nullish) {
+      void *data;
+      size_t length;
+      status = napi_get_buffer_info(env, data_value, &data, &length);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+      // The Buffer may change once this returns, so the loader gets a copy
+      params.data = av_buffer_alloc(length + AV_INPUT_BUFFER_PADDING_SIZE);
+      if (params.data == NULL) {
+        throw_ffmpeg_error(env, AVERROR(ENOMEM));
+        goto cleanup;
+      }
+      memcpy(params.data->data, data, length);
+      memset(params.data->data + length, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+      params.data->size = length;
+    }
+
+    if ((params.path == NULL) == (params.data == NULL)) {
+      napi_throw_error(env, NULL, "Expected either path or data");
+      goto cleanup;
+    }
+
+    status = load_clip(env, &params, &promise);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+  cleanup:
+    av_free(format);
+    av_free(params.path);
+    av_buffer_unref(&params.data);
+    return promise;
+  }
+
+  // Posts a clip from loadClip() to be sent as it is. When the encoder reads
+  // from a pcmRing, the last argument is the ring's write index.
+  napi_value postClipToEncoder(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 3;
+    napi_value args[3];
+    napi_status status = napi_ok;
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    if (argsLength < 2) {
+      napi_throw_error(env, NULL, "Expected 2 arguments");
+      return NULL;
+    }
+
+    AVThreadMessageQueue *message_queue;
+    status = napi_get_value_external(env, args[0], (void **)&message_queue);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    AVBufferRef *clip;
+    status = napi_get_value_external(env, args[1], (void **)&clip);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    int32_t ring_write_index = 0;
+    if (argsLength >= 3) {
+      status = napi_get_value_int32(env, args[2], &ring_write_index);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+    }
+
+    bool success = true;
+    int ret = post_clip_to_thread(message_queue, clip, ring_write_index);
+    if (ret == AVERROR(EAGAIN)) {
+      success = false;
+    } else if (ret != 0) {
+      throw_ffmpeg_error(env, ret);
+      return NULL;
+    }
+
+    napi_value return_value;
+    status = napi_get_boolean(env, success, &return_value);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    return return_value;
+  }
+
+  // Like postPcmToEncoder, but takes an array of buffers and posts them as a
+  // single message.
+  napi_value postPcmBuffersToEncoder(napi_env env, napi_callback_info cbinfo);
+
+  EncoderControl *get_mixer_input(napi_env env, napi_value control_value, napi_value index_value, int32_t *index) {
+    EncoderControl *control;
+    napi_status status = napi_get_value_external(env, control_value, (void **)&control);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    status = napi_get_value_int32(env, index_value, index);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    if (*index < 0 || *index >= control->mixer_input_count) {
+      napi_throw_range_error(env, NULL, "No such mixer input");
+      return NULL;
+    }
+
+    return control;
+  }
+
+  // Posts an array of PCM buffers to a mixer input as a single message
+  napi_value postPcmToMixerInput(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 3;
+    napi_value args[3];
+    napi_status status = napi_ok;
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    if (argsLength < 3) {
+      napi_throw_error(env, NULL, "Expected 3 arguments");
+      return NULL;
+    }
+
+    int32_t index;
+    EncoderControl *control = get_mixer_input(env, args[0], args[1], &index);
+    if (control == NULL) {
+      return NULL;
+    }
+
+    uint32_t count;
+    status = napi_get_array_length(env, args[2], &count);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    void **buffers = (void **)av_malloc_array(count > 0 ? count : 1, sizeof(void *));
+    size_t *lengths = (size_t *)av_malloc_array(count > 0 ? count : 1, sizeof(size_t));
+    bool success = true;
+    napi_value return_value = NULL;
+
+    if (buffers == NULL || lengths == NULL) {
+      throw_ffmpeg_error(env, AVERROR(ENOMEM));
+      goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      napi_value element;
+      status = napi_get_element(env, args[2], i, &element);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+      status = napi_get_buffer_info(env, element, &buffers[i], &lengths[i]);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+    }
+
+    {
+      int ret = post_pcm_to_mixer_input(control, index, buffers, lengths, count);
+      if (ret == AVERROR(EAGAIN)) {
+        success = false;
+      } else if (ret != 0) {
+        throw_ffmpeg_error(env, ret);
+        goto cleanup;
+      }
+    }
+
+    status = napi_get_boolean(env, success, &return_value);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+  cleanup:
+    av_free(buffers);
+    av_free(lengths);
+    return return_value;
+  }
+
+  // Drops the audio that is waiting in a mixer input. Returns the ticks of
+  // buffered audio that were removed from its queue.
+  napi_value clearMixerInput(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 2;
+    napi_value args[2];
+    napi_status status = napi_ok;
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    if (argsLength < 2) {
+      napi_throw_error(env, NULL, "Expected 2 arguments");
+      return NULL;
+    }
+
+    int32_t index;
+    EncoderControl *control = get_mixer_input(env, args[0], args[1], &index);
+    if (control == NULL) {
+      return NULL;
+    }
+
+    int64_t discarded = mixer_clear_input(&control->mixer_inputs[index]);
+
+    napi_value return_value;
+    status = napi_create_double(env, (double)discarded, &return_value);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    return return_value;
+  }
+
+  // Wakes up the encoder if it's waiting for the mixer inputs, e.g. after one
+  // was resumed
+  napi_value postMixerWakeup(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 1;
+    napi_value args[1];
+    napi_status status = napi_ok;
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    EncoderControl *control;
+    status = napi_get_value_external(env, args[0], (void **)&control);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    if (mixer_take_waiting(&control->mixer_waiting)) {
+      wake_encoder(control);
+    }
+    return NULL;
+  }
+
+  napi_value postPcmBuffersToEncoder(napi_env env, napi_callback_info cbinfo) {
+    size_t argsLength = 2;
+    napi_value args[2];
+    napi_status status = napi_ok;
+
+    status = napi_get_cb_info(env, cbinfo, &argsLength, args, NULL, 0);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    AVThreadMessageQueue *message_queue;
+    status = napi_get_value_external(env, args[0], (void **)&message_queue);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    uint32_t count;
+    status = napi_get_array_length(env, args[1], &count);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); return NULL; }
+
+    void **buffers = (void **)av_malloc_array(count > 0 ? count : 1, sizeof(void *));
+    size_t *lengths = (size_t *)av_malloc_array(count > 0 ? count : 1, sizeof(size_t));
+    bool success = true;
+    napi_value return_value = NULL;
+
+    if (buffers == NULL || lengths == NULL) {
+      throw_ffmpeg_error(env, AVERROR(ENOMEM));
+      goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      napi_value element;
+      status = napi_get_element(env, args[1], i, &element);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+      status = napi_get_buffer_info(env, element, &buffers[i], &lengths[i]);
+      if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+    }
+
+    {
+      int ret = post_pcm_buffers_to_thread(message_queue, buffers, lengths, count);
+      if (ret == AVERROR(EAGAIN)) {
+        success = false;
+      } else if (ret != 0) {
+        throw_ffmpeg_error(env, ret);
+        goto cleanup;
+      }
+    }
+
+    status = napi_get_boolean(env, success, &return_value);
+    if (status != napi_ok) { GET_AND_THROW_LAST_ERROR(env); goto cleanup; }
+
+  cleanup:
+    av_free(buffers);
+    av_free(lengths);
+    return return_value;
+  }
+
   napi_status create_function_property(napi_env env, napi_value object, const char *fnName, napi_callback cb) {
     napi_status status;
     napi_value js_function;
@@ -718,6 +1852,9 @@ namespace hilokal {
     status = create_function_property(env, exports, "postOggBuffer", postOggBuffer);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
+    status = create_function_property(env, exports, "releaseAudioBuffer", releaseAudioBuffer);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
     status = create_function_property(env, exports, "postDemuxerReset", postDemuxerReset);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
@@ -730,6 +1867,9 @@ namespace hilokal {
     status = create_function_property(env, exports, "startAudioDecodeThread", startAudioDecodeThread);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
+    status = create_function_property(env, exports, "startGroupMixerThread", startGroupMixerThread);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
     status = create_function_property(env, exports, "startProducerJob", startProducerJob);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
@@ -742,6 +1882,30 @@ namespace hilokal {
     status = create_function_property(env, exports, "postPcmToEncoder", postPcmToEncoder);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
+    status = create_function_property(env, exports, "postPcmBuffersToEncoder", postPcmBuffersToEncoder);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = create_function_property(env, exports, "postOpusPacketsToEncoder", postOpusPacketsToEncoder);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = create_function_property(env, exports, "loadClip", loadClip);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = create_function_property(env, exports, "postClipToEncoder", postClipToEncoder);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = create_function_property(env, exports, "postPcmToMixerInput", postPcmToMixerInput);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = create_function_property(env, exports, "clearMixerInput", clearMixerInput);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = create_function_property(env, exports, "postMixerWakeup", postMixerWakeup);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
+    status = create_function_property(env, exports, "postPcmRingWakeup", postPcmRingWakeup);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
     status = create_function_property(env, exports, "postSetBitrate", postSetBitrate);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
@@ -757,6 +1921,9 @@ namespace hilokal {
     status = create_function_property(env, exports, "postClearProducerQueue", postClearProducerQueue);
     if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
 
+    status = create_function_property(env, exports, "postInterrupt", postInterrupt);
+    if (status != napi_ok) GET_AND_THROW_LAST_ERROR(env);
+
     av_log_set_callback(av_log_override_callback);
 
     old_siguser2_handler = signal(SIGUSR2, sigusr2_handler);
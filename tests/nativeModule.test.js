@@ -1,9 +1,14 @@
 const {
   produceRtp,
+  produceRtpFromOgg,
   consumeRtp,
+  consumeRtpGroup,
   createSrtpParameters,
   createRtpParameters,
   createSDP,
+  PcmRingReader,
+  loadClip,
+  unloadClip,
 } = require("../src/index.ts");
 
 const { exec } = require("child_process");
@@ -23,6 +28,9 @@ async function runProducer({
   srtpParameters,
   signal,
   queueDepth,
+  ringBufferMs,
+  highWaterMarkMs,
+  catchUp,
 }) {
   let resolveDrain;
   let drainCount = 0;
@@ -51,6 +59,9 @@ async function runProducer({
       packetLossPercent: 10,
     },
     queueDepth,
+    ringBufferMs,
+    highWaterMarkMs,
+    catchUp,
   });
 
   // LJ025-0076.wav from https://keithito.com/LJ-Speech-Dataset/
@@ -63,6 +74,7 @@ async function runProducer({
 
   // Send PCM data in chunks: 480 samples * 2 bytes = 960 bytes per 20ms frame
   const chunkSize = 960;
+  let maxBufferedMs = 0;
   for (let offset = 0; offset < pcmData.length; offset += chunkSize) {
     const chunk = pcmData.subarray(
       offset,
@@ -74,12 +86,56 @@ async function runProducer({
         resolveDrain = resolve;
       });
     }
+    maxBufferedMs = Math.max(maxBufferedMs, producer.bufferedMs());
   }
   producer.end();
 
-  return { done: producer.done, drainCount };
+  return {
+    done: producer.done,
+    interrupt: producer.interrupt,
+    bufferedMs: producer.bufferedMs,
+    drainCount,
+    maxBufferedMs,
+  };
 }
 
+it("negotiates the audio level header extension", () => {
+  const rtpParameters = createRtpParameters();
+
+  expect(rtpParameters.headerExtensions).toEqual([
+    {
+      uri: "urn:ietf:params:rtp-hdrext:ssrc-audio-level",
+      id: 10,
+      parameters: { vad: "on" },
+    },
+  ]);
+
+  const sdp = createSDP({
+    subject: "Unit Test",
+    rtpParameters,
+    originIpAddress: "127.0.0.1",
+    destinationIpAddress: "127.0.0.1",
+    rtpPort: RTP_PORT,
+    rtcpPort: RTP_PORT + 1,
+    language: "en",
+  });
+  expect(sdp).toContain(
+    "a=extmap:10 urn:ietf:params:rtp-hdrext:ssrc-audio-level vad=on",
+  );
+
+  // Only the one-byte header format is supported
+  rtpParameters.headerExtensions[0].id = 15;
+  expect(() =>
+    produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      sampleRate: encodeSampleRate,
+    }),
+  ).toThrow("audio level header extension id must be between 1 and 14");
+});
+
 it("aborts a producer thread", async () => {
   const rtpParameters = createRtpParameters();
   const srtpParameters = createSrtpParameters();
@@ -98,6 +154,392 @@ it("aborts a producer thread", async () => {
   await done();
 });
 
+it(
+  "encodes from a shared ring buffer",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const abortController = new AbortController();
+
+    // The ring only holds 100ms, so writing the whole file has to wait for the
+    // encoder to drain it many times.
+    const { done, drainCount } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+      ringBufferMs: 100,
+    });
+
+    expect(drainCount).toBeGreaterThan(0);
+
+    abortController.abort();
+
+    await done();
+  },
+  10 * 1000,
+);
+
+it(
+  "interrupts a producer thread",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const { done, interrupt, bufferedMs } = await runProducer({
+      rtpParameters,
+    });
+
+    // The whole file is queued up ahead of real-time
+    expect(bufferedMs()).toBeGreaterThan(1000);
+
+    interrupt();
+
+    // This should finish right away instead of sending the rest of the file
+    await done();
+
+    expect(bufferedMs()).toBeLessThan(100);
+  },
+  3 * 1000,
+);
+
+it(
+  "sends pre-encoded Opus in order with PCM",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const producer = produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      sampleRate: encodeSampleRate,
+    });
+
+    // A 20ms CELT frame of silence
+    const silence = Buffer.from([0xf8, 0xff, 0xfe]);
+
+    expect(() => producer.writeOpus(Buffer.alloc(0))).toThrow();
+
+    // 30ms of PCM leaves a partial frame, which is padded before the packets
+    const pcm = Buffer.alloc((encodeSampleRate / 1000) * 30 * 2);
+    expect(producer.write(pcm)).toBe(true);
+    expect(producer.writevOpus(new Array(25).fill(silence))).toBe(true);
+    expect(producer.writeOpus(silence, 480)).toBe(true);
+    expect(producer.write(pcm)).toBe(true);
+
+    // The packets are counted with their durations, although the producer may
+    // have sent the first frame already
+    expect(producer.bufferedMs()).toBeGreaterThan(500);
+    expect(producer.bufferedMs()).toBeLessThanOrEqual(30 + 500 + 10 + 30);
+
+    // Discarded packets are released like PCM
+    producer.interrupt();
+    producer.end();
+    await producer.done();
+
+    expect(producer.bufferedMs()).toBeLessThan(100);
+  },
+  3 * 1000,
+);
+
+it(
+  "plays clips from the clip cache",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const greeting = await loadClip(
+      "greeting",
+      path.join(__dirname, "test.opus"),
+    );
+    expect(greeting.packetCount).toBeGreaterThan(0);
+
+    const silence = await loadClip(
+      "silence",
+      Buffer.alloc(encodeSampleRate * 2),
+      { sampleRate: encodeSampleRate },
+    );
+    expect(silence.durationMs).toBe(1000);
+    expect(silence.packetCount).toBe(50);
+
+    await expect(
+      loadClip("missing", path.join(__dirname, "missing.opus")),
+    ).rejects.toThrow();
+
+    const producer = produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      sampleRate: encodeSampleRate,
+    });
+
+    expect(() => producer.playClip("missing")).toThrow();
+    expect(producer.playClip("greeting")).toBe(true);
+    expect(producer.playClip("silence")).toBe(true);
+
+    // The producer still holds the clip that it queued
+    expect(unloadClip("silence")).toBe(true);
+    expect(() => producer.playClip("silence")).toThrow();
+
+    expect(producer.bufferedMs()).toBeGreaterThan(greeting.durationMs + 900);
+
+    producer.interrupt();
+    producer.end();
+    await producer.done();
+
+    expect(producer.bufferedMs()).toBeLessThan(100);
+    unloadClip("greeting");
+  },
+  3 * 1000,
+);
+
+it(
+  "mixes extra inputs under the main input",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const producer = produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      sampleRate: encodeSampleRate,
+      inputs: {
+        music: { sampleRate: 44100, gain: 0.5 },
+      },
+    });
+
+    expect(() => producer.input("missing")).toThrow();
+
+    const music = producer.input("music");
+    expect(() => music.setGain(9)).toThrow();
+
+    // A paused input keeps its audio queued until it's cleared
+    music.pause();
+    expect(music.write(Buffer.alloc(44100 * 2))).toBe(true);
+    expect(music.bufferedMs()).toBe(1000);
+    music.clear();
+    expect(music.bufferedMs()).toBe(0);
+
+    expect(music.write(Buffer.alloc(44100 * 2))).toBe(true);
+    music.setGain(0.25);
+    music.resume();
+    expect(producer.write(Buffer.alloc(encodeSampleRate))).toBe(true);
+
+    producer.end();
+    await producer.done();
+
+    // Everything that was queued for the input was mixed in before the end
+    expect(music.bufferedMs()).toBe(0);
+    expect(producer.bufferedMs()).toBeLessThan(100);
+  },
+  5 * 1000,
+);
+
+it(
+  "limits buffered audio to the high water mark",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const { done, drainCount, maxBufferedMs } = await runProducer({
+      rtpParameters,
+      highWaterMarkMs: 200,
+    });
+
+    expect(drainCount).toBeGreaterThan(0);
+    expect(maxBufferedMs).toBeLessThanOrEqual(200);
+
+    await done();
+  },
+  15 * 1000,
+);
+
+it(
+  "speeds up to work off a backlog in catch-up mode",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    expect(() =>
+      produceRtp({
+        ipAddress: "127.0.0.1",
+        rtpPort: RTP_PORT,
+        rtcpPort: RTP_PORT + 1,
+        rtpParameters,
+        sampleRate: encodeSampleRate,
+        catchUp: { thresholdMs: 500, targetMs: 500 },
+      }),
+    ).toThrow();
+
+    const startedAt = Date.now();
+    const { done, bufferedMs, maxBufferedMs } = await runProducer({
+      rtpParameters,
+      catchUp: { thresholdMs: 500, rate: 1.5 },
+    });
+
+    // The whole file was written at once, far beyond the threshold
+    expect(maxBufferedMs).toBeGreaterThan(5000);
+
+    await done();
+
+    // About 8.4 seconds of audio, mostly sent 1.5 times as fast
+    const elapsed = (Date.now() - startedAt) / 1000;
+    expect(elapsed).toBeLessThan(7);
+
+    // Samples that were dropped or padded by the time stretch were released
+    // along with the rest
+    expect(bufferedMs()).toBeLessThan(20);
+  },
+  15 * 1000,
+);
+
+it(
+  "sends Ogg Opus over RTP in chunks that split pages",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    const abortController = new AbortController();
+
+    let buffersReceived = 0;
+    let resolveReceived;
+    const received = new Promise((resolve) => {
+      resolveReceived = resolve;
+    });
+
+    const { done: consumerDone } = consumeRtp({
+      sdp,
+      onAudioData: ({ buffer }) => {
+        expect(buffer.byteLength).toBeGreaterThan(0);
+        if (++buffersReceived === 50) {
+          resolveReceived();
+        }
+      },
+      sampleRate: decodeSampleRate,
+      signal: abortController.signal,
+    });
+
+    let resolveDrain;
+    let drainCount = 0;
+    const producer = produceRtpFromOgg({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      signal: abortController.signal,
+      highWaterMarkMs: 300,
+      onDrain: () => {
+        drainCount++;
+        if (resolveDrain) {
+          resolveDrain();
+          resolveDrain = undefined;
+        }
+      },
+    });
+
+    // Chunk boundaries fall in the middle of pages, so those pages have to be
+    // put back together by the demuxer
+    const oggData = fs.readFileSync(path.join(__dirname, "test.opus"));
+    const chunkSize = 16 * 1024;
+    for (let offset = 0; offset < oggData.length; offset += chunkSize) {
+      const chunk = oggData.subarray(offset, offset + chunkSize);
+      while (!producer.write(chunk)) {
+        await new Promise((resolve) => {
+          resolveDrain = resolve;
+        });
+      }
+      if (buffersReceived >= 50) {
+        break;
+      }
+
+      // Give the demuxer time to count the chunk, so that the next write sees
+      // the high water mark
+      await new Promise((resolve) => setTimeout(resolve, 50));
+    }
+
+    await received;
+
+    expect(drainCount).toBeGreaterThan(0);
+
+    abortController.abort();
+
+    await producer.done();
+    await consumerDone();
+  },
+  15 * 1000,
+);
+
+it(
+  "starts a new Ogg stream after a reset in the middle of a page",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    const abortController = new AbortController();
+
+    // The cut off stream has about 50 packets, so the rest have to come from
+    // the second one
+    let buffersReceived = 0;
+    let resolveReceived;
+    const received = new Promise((resolve) => {
+      resolveReceived = resolve;
+    });
+
+    const { done: consumerDone } = consumeRtp({
+      sdp,
+      onAudioData: () => {
+        if (++buffersReceived === 100) {
+          resolveReceived();
+        }
+      },
+      sampleRate: decodeSampleRate,
+      signal: abortController.signal,
+    });
+
+    const producer = produceRtpFromOgg({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    const oggData = fs.readFileSync(path.join(__dirname, "test.opus"));
+    expect(producer.write(oggData.subarray(0, 10000))).toBe(true);
+    producer.reset();
+
+    const chunkSize = 1000;
+    for (let offset = 0; offset < oggData.length; offset += chunkSize) {
+      expect(producer.write(oggData.subarray(offset, offset + chunkSize))).toBe(
+        true,
+      );
+    }
+
+    await received;
+
+    abortController.abort();
+
+    await producer.done();
+    await consumerDone();
+  },
+  15 * 1000,
+);
+
 it(
   "starts an audio encode/decode thread",
   async () => {
@@ -165,6 +607,1078 @@ it(
   10 * 1000,
 );
 
+it(
+  "delivers decoded audio in batches of fixed size chunks",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    // 100ms at 16kHz
+    const chunkBytes = (decodeSampleRate / 10) * 2;
+    let callbacks = 0;
+    let chunks = 0;
+    let fullChunks = 0;
+    function onAudioBatch(batch) {
+      expect(batch.length).toBeGreaterThan(0);
+      callbacks++;
+      for (const { buffer } of batch) {
+        expect(buffer.byteLength).toBeLessThanOrEqual(chunkBytes);
+        chunks++;
+        if (buffer.byteLength === chunkBytes) {
+          fullChunks++;
+        }
+      }
+    }
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioBatch,
+      sampleRate: decodeSampleRate,
+      chunkMs: 100,
+      maxLatencyMs: 200,
+      signal: abortController.signal,
+    });
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    await producerDone();
+    abortController.abort();
+    await consumer.done();
+
+    // About 8.4 seconds of audio, so about 84 chunks instead of 420 frames
+    expect(fullChunks).toBeGreaterThan(75);
+    expect(chunks).toBeLessThan(100);
+    expect(callbacks).toBeLessThanOrEqual(chunks);
+  },
+  10 * 1000,
+);
+
+it(
+  "returns released buffers to the pool without disturbing others",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    // 20ms at 16kHz
+    const frameBytes = (decodeSampleRate / 50) * 2;
+    let released = 0;
+    let audible = 0;
+    const kept = [];
+    function onAudioData({ buffer }) {
+      expect(buffer.byteLength).toBe(frameBytes);
+      if (buffer.some((byte) => byte !== 0)) {
+        audible++;
+      }
+
+      // Keep every other frame, with a copy to check it against later. The
+      // rest go straight back to the pool, so the blocks of later frames are
+      // reused while the kept ones are still alive.
+      if (kept.length < released) {
+        kept.push({ buffer, copy: Buffer.from(buffer) });
+      } else {
+        consumer.release(buffer);
+        expect(buffer.byteLength).toBe(0);
+        released++;
+      }
+    }
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioData,
+      sampleRate: decodeSampleRate,
+      signal: abortController.signal,
+    });
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    await producerDone();
+    abortController.abort();
+    await consumer.done();
+
+    expect(released).toBeGreaterThan(200);
+    expect(kept.length).toBeGreaterThan(200);
+    expect(audible).toBeGreaterThan(100);
+    for (const { buffer, copy } of kept) {
+      expect(buffer.equals(copy)).toBe(true);
+    }
+  },
+  10 * 1000,
+);
+
+it(
+  "decodes to stereo float samples at a resampled rate",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    let bytesReceived = 0;
+    function onAudioData({ buffer }) {
+      // Whole stereo float samples
+      expect(buffer.byteLength % 8).toBe(0);
+      const samples = new Float32Array(
+        buffer.buffer,
+        buffer.byteOffset,
+        buffer.byteLength / 4,
+      );
+      for (const sample of samples) {
+        expect(Math.abs(sample)).toBeLessThanOrEqual(2);
+      }
+      bytesReceived += buffer.byteLength;
+    }
+
+    const abortController = new AbortController();
+
+    const { done: consumerDone } = consumeRtp({
+      sdp,
+      onAudioData,
+      sampleRate: 44100,
+      channels: 2,
+      sampleFormat: "f32",
+      signal: abortController.signal,
+    });
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    await producerDone();
+    abortController.abort();
+    await consumerDone();
+
+    // About 8.4 seconds of audio
+    const seconds = bytesReceived / (44100 * 2 * 4);
+    expect(seconds).toBeGreaterThan(8);
+    expect(seconds).toBeLessThan(9);
+  },
+  10 * 1000,
+);
+
+it(
+  "decodes once for several sinks and relays the packets",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    // The relay re-encrypts with keys of its own
+    const relayRtpParameters = createRtpParameters();
+    const relaySrtpParameters = createSrtpParameters();
+    const relaySdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters: relayRtpParameters,
+      srtpParameters: relaySrtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT + 2,
+      rtcpPort: RTP_PORT + 3,
+      language: "en",
+    });
+
+    let mainBytes = 0;
+    let sinkBytes = 0;
+    let relayBytes = 0;
+
+    const abortController = new AbortController();
+
+    const { done: relayConsumerDone } = consumeRtp({
+      sdp: relaySdp,
+      onAudioData: ({ buffer }) => {
+        relayBytes += buffer.byteLength;
+      },
+      sampleRate: decodeSampleRate,
+      signal: abortController.signal,
+    });
+
+    const { done: consumerDone } = consumeRtp({
+      sdp,
+      onAudioData: ({ buffer }) => {
+        mainBytes += buffer.byteLength;
+      },
+      sampleRate: decodeSampleRate,
+      sinks: [
+        {
+          sampleRate: 48000,
+          channels: 2,
+          sampleFormat: "f32",
+          chunkMs: 100,
+          onAudioData: ({ buffer }) => {
+            // Whole 100ms chunks of stereo float samples, except the last
+            expect(buffer.byteLength % 8).toBe(0);
+            expect(buffer.byteLength).toBeLessThanOrEqual(4800 * 8);
+            sinkBytes += buffer.byteLength;
+          },
+        },
+      ],
+      relays: [
+        {
+          ipAddress: "127.0.0.1",
+          rtpPort: RTP_PORT + 2,
+          rtpParameters: relayRtpParameters,
+          srtpParameters: relaySrtpParameters,
+        },
+      ],
+      signal: abortController.signal,
+    });
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    await producerDone();
+
+    // Let the relay catch up before stopping
+    await new Promise((resolve) => setTimeout(resolve, 500));
+    abortController.abort();
+    await consumerDone();
+    await relayConsumerDone();
+
+    // About 8.4 seconds of audio from each
+    const mainSeconds = mainBytes / (decodeSampleRate * 2);
+    const sinkSeconds = sinkBytes / (48000 * 2 * 4);
+    const relaySeconds = relayBytes / (decodeSampleRate * 2);
+    expect(mainSeconds).toBeGreaterThan(8);
+    expect(mainSeconds).toBeLessThan(9);
+    expect(sinkSeconds).toBeCloseTo(mainSeconds, 0);
+    expect(relaySeconds).toBeGreaterThan(7.5);
+    expect(relaySeconds).toBeLessThan(9);
+  },
+  15 * 1000,
+);
+
+it(
+  "decodes into a shared output ring",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      sampleRate: decodeSampleRate,
+      outputRingMs: 1000,
+      signal: abortController.signal,
+    });
+
+    // The main thread can't block, so poll the ring
+    const reader = new PcmRingReader(consumer.outputRing);
+    let framesRead = 0;
+    let lastPts = -1;
+    const interval = setInterval(() => {
+      let frame;
+      while ((frame = reader.read()) !== null) {
+        expect(frame.samples.length).toBeGreaterThan(0);
+        if (frame.pts !== null) {
+          expect(frame.pts).toBeGreaterThan(lastPts);
+          lastPts = frame.pts;
+        }
+        framesRead++;
+      }
+    }, 50);
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    await producerDone();
+    abortController.abort();
+    await consumer.done();
+    clearInterval(interval);
+
+    while (reader.read() !== null) {
+      framesRead++;
+    }
+
+    expect(reader.ended).toBe(true);
+    expect(reader.droppedFrames).toBe(0);
+    expect(framesRead).toBeGreaterThan(410);
+  },
+  10 * 1000,
+);
+
+it(
+  "decodes through a jitter buffer",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    let bytesReceived = 0;
+    let lastPts = -1;
+    function onAudioData({ buffer, pts }) {
+      expect(pts).toBeGreaterThan(lastPts);
+      lastPts = pts;
+      bytesReceived += buffer.byteLength;
+    }
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioData,
+      sampleRate: decodeSampleRate,
+      jitterBuffer: { minDelayMs: 40, maxDelayMs: 100 },
+      signal: abortController.signal,
+    });
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    await producerDone();
+    abortController.abort();
+    await consumer.done();
+
+    const { delayMs, latePackets } = consumer.jitterStats();
+    expect(delayMs).toBeGreaterThanOrEqual(40);
+    expect(delayMs).toBeLessThanOrEqual(100);
+    expect(latePackets).toBe(0);
+
+    // About 8.4 seconds of audio. Packets still in the jitter buffer are
+    // decoded before the consumer exits.
+    const seconds = bytesReceived / (decodeSampleRate * 2);
+    expect(seconds).toBeGreaterThan(8);
+    expect(seconds).toBeLessThan(9);
+  },
+  10 * 1000,
+);
+
+it(
+  "reports a pause by the sender as silence",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    const gaps = [];
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioData: () => {},
+      onGap: (gap) => gaps.push(gap),
+      sampleRate: decodeSampleRate,
+      signal: abortController.signal,
+    });
+
+    const producer = produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      signal: abortController.signal,
+      sampleRate: encodeSampleRate,
+    });
+
+    const sourceAudio = path.join(__dirname, "LJ025-0076_24k_mono.wav");
+    const pcmData = fs.readFileSync(sourceAudio).subarray(44);
+    const oneSecond = encodeSampleRate * 2;
+
+    // Let the first second play out, and wait a second more. The second
+    // segment is rebased to the wall clock, which leaves a gap that is much
+    // longer than maxConcealMs.
+    producer.write(pcmData.subarray(0, oneSecond));
+    await new Promise((resolve) => setTimeout(resolve, 2000));
+    producer.interrupt();
+    producer.write(pcmData.subarray(oneSecond, oneSecond * 2));
+    producer.end();
+
+    await producer.done();
+    abortController.abort();
+    await consumer.done();
+
+    expect(gaps.length).toBe(1);
+    expect(gaps[0].type).toBe("silence");
+    expect(gaps[0].durationMs).toBeGreaterThan(500);
+    expect(gaps[0].durationMs).toBeLessThan(1500);
+  },
+  10 * 1000,
+);
+
+it(
+  "emits continuous audio on a local clock",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    let samplesReceived = 0;
+    let silentFrames = 0;
+    let nextPts = null;
+    function onAudioData({ buffer, pts }) {
+      // No gaps, even across the pause
+      if (nextPts !== null) {
+        expect(pts).toBe(nextPts);
+      }
+      const samples = buffer.byteLength / 2;
+      nextPts = pts + (samples * 48000) / decodeSampleRate;
+      samplesReceived += samples;
+      if (buffer.every((byte) => byte === 0)) {
+        silentFrames++;
+      }
+    }
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioData,
+      sampleRate: decodeSampleRate,
+      clockedOutput: true,
+      signal: abortController.signal,
+    });
+
+    const producer = produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      signal: abortController.signal,
+      sampleRate: encodeSampleRate,
+    });
+
+    const sourceAudio = path.join(__dirname, "LJ025-0076_24k_mono.wav");
+    const pcmData = fs.readFileSync(sourceAudio).subarray(44);
+    const oneSecond = encodeSampleRate * 2;
+
+    producer.write(pcmData.subarray(0, oneSecond));
+    await new Promise((resolve) => setTimeout(resolve, 2000));
+    producer.interrupt();
+    producer.write(pcmData.subarray(oneSecond, oneSecond * 2));
+    producer.end();
+
+    await producer.done();
+    abortController.abort();
+    await consumer.done();
+
+    // Two seconds of audio and about a second of silence between them
+    const seconds = samplesReceived / decodeSampleRate;
+    expect(seconds).toBeGreaterThan(2.5);
+    expect(silentFrames).toBeGreaterThan(25);
+  },
+  10 * 1000,
+);
+
+it(
+  "mixes a group of streams into one",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    const abortController = new AbortController();
+
+    let framesReceived = 0;
+    let mixedWhileTalking = 0;
+    const group = consumeRtpGroup({
+      sampleRate: decodeSampleRate,
+      maxParticipants: 2,
+      loudest: 1,
+      onAudioData: ({ buffer }) => {
+        expect(buffer.byteLength).toBe((decodeSampleRate / 50) * 2);
+        framesReceived++;
+        if (group.activity().some((participant) => participant.mixed)) {
+          mixedWhileTalking++;
+        }
+        group.release(buffer);
+      },
+      signal: abortController.signal,
+    });
+
+    group.add("speaker", { sdp, gain: 0.5 });
+    expect(() => group.add("speaker", { sdp })).toThrow();
+    expect(() => group.setGain("speaker", 9)).toThrow();
+
+    const producer = produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      signal: abortController.signal,
+      sampleRate: encodeSampleRate,
+    });
+
+    const sourceAudio = path.join(__dirname, "LJ025-0076_24k_mono.wav");
+    const pcmData = fs.readFileSync(sourceAudio).subarray(44);
+    producer.write(pcmData.subarray(0, encodeSampleRate * 2));
+    producer.end();
+    await producer.done();
+
+    const [speaker] = group.activity();
+    expect(speaker.id).toBe("speaker");
+    expect(speaker.mixedMs).toBeGreaterThan(500);
+
+    await group.remove("speaker");
+    expect(group.activity()).toEqual([]);
+
+    abortController.abort();
+    await group.done();
+
+    expect(framesReceived).toBeGreaterThan(25);
+    expect(mixedWhileTalking).toBeGreaterThan(25);
+  },
+  10 * 1000,
+);
+
+it(
+  "timestamps decoded audio with sender and arrival times",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    let lastReceivedAt = -Infinity;
+    let lastSenderTime = -Infinity;
+    let senderTimes = 0;
+    function onAudioData({ receivedAt, senderTime }) {
+      expect(receivedAt).not.toBeNull();
+      expect(receivedAt).toBeGreaterThanOrEqual(lastReceivedAt);
+      expect(receivedAt).toBeLessThanOrEqual(
+        Number(process.hrtime.bigint()) / 1e6,
+      );
+      lastReceivedAt = receivedAt;
+
+      if (senderTime !== null) {
+        // Same machine, so the sender's clock is ours
+        expect(senderTime).toBeGreaterThan(lastSenderTime);
+        expect(Math.abs(Date.now() - senderTime)).toBeLessThan(1000);
+        lastSenderTime = senderTime;
+        senderTimes++;
+      }
+    }
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioData,
+      sampleRate: decodeSampleRate,
+      signal: abortController.signal,
+    });
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    await producerDone();
+    abortController.abort();
+    await consumer.done();
+
+    expect(senderTimes).toBeGreaterThan(0);
+  },
+  10 * 1000,
+);
+
+it(
+  "delivers only speech when gated by voice activity",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    let speaking = false;
+    let starts = 0;
+    let ends = 0;
+    function onSpeech({ type }) {
+      if (type === "speechStart") {
+        expect(speaking).toBe(false);
+        speaking = true;
+        starts++;
+      } else {
+        expect(speaking).toBe(true);
+        speaking = false;
+        ends++;
+      }
+    }
+
+    let samplesReceived = 0;
+    function onAudioData({ buffer }) {
+      // Including the pre-roll, which follows the start event
+      expect(speaking).toBe(true);
+      samplesReceived += buffer.byteLength / 2;
+    }
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioData,
+      onSpeech,
+      sampleRate: decodeSampleRate,
+      voiceActivity: { gate: true, preRollMs: 100 },
+      signal: abortController.signal,
+    });
+
+    const producer = produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      signal: abortController.signal,
+      sampleRate: encodeSampleRate,
+    });
+
+    const sourceAudio = path.join(__dirname, "LJ025-0076_24k_mono.wav");
+    const pcmData = fs.readFileSync(sourceAudio).subarray(44);
+    const oneSecond = encodeSampleRate * 2;
+
+    producer.write(pcmData.subarray(0, oneSecond));
+    await new Promise((resolve) => setTimeout(resolve, 2000));
+    producer.interrupt();
+    producer.write(pcmData.subarray(oneSecond, oneSecond * 2));
+    producer.end();
+
+    await producer.done();
+    abortController.abort();
+    await consumer.done();
+
+    // One segment on each side of the pause, each closed before the next
+    expect(starts).toBeGreaterThanOrEqual(2);
+    expect(ends).toBe(starts);
+
+    // No more than the two seconds of speech and a little pre-roll
+    const seconds = samplesReceived / decodeSampleRate;
+    expect(seconds).toBeGreaterThan(1);
+    expect(seconds).toBeLessThan(2.5);
+  },
+  10 * 1000,
+);
+
+it(
+  "learns a background that gets louder and ends speech",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    let speaking = false;
+    let starts = 0;
+    let ends = 0;
+    function onSpeech({ type }) {
+      if (type === "speechStart") {
+        speaking = true;
+        starts++;
+      } else {
+        speaking = false;
+        ends++;
+      }
+    }
+
+    // Counts what arrives after speech ended by itself, before the stream
+    // ending could end it instead
+    let samplesAfterEnd = 0;
+    function onAudioData({ buffer }) {
+      if (ends > 0 && !speaking) {
+        samplesAfterEnd += buffer.byteLength / 2;
+      }
+    }
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioData,
+      onSpeech,
+      sampleRate: decodeSampleRate,
+      voiceActivity: { thresholdDb: 20 },
+      signal: abortController.signal,
+    });
+
+    const producer = produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      signal: abortController.signal,
+      sampleRate: encodeSampleRate,
+    });
+
+    // A low hum, like a fan, that steps up 40dB after half a second. It has
+    // few zero crossings, so nothing but the noise floor tells it from speech.
+    const hum = new Int16Array(encodeSampleRate * 8.5);
+    for (let i = 0; i < hum.length; i++) {
+      const amplitude = i < encodeSampleRate / 2 ? 0.001 : 0.1;
+      const phase = (2 * Math.PI * 200 * i) / encodeSampleRate;
+      hum[i] = Math.round(32767 * amplitude * Math.sin(phase));
+    }
+
+    producer.write(Buffer.from(hum.buffer));
+    producer.end();
+
+    await producer.done();
+    abortController.abort();
+    await consumer.done();
+
+    // The step looks like speech at first, until the floor catches up
+    expect(starts).toBeGreaterThanOrEqual(1);
+    expect(ends).toBe(starts);
+    expect(samplesAfterEnd / decodeSampleRate).toBeGreaterThan(1);
+  },
+  15 * 1000,
+);
+
+it(
+  "skips decoding while paused",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    let paused = false;
+    let bytesReceived = 0;
+    function onAudioData({ buffer }) {
+      expect(paused).toBe(false);
+      bytesReceived += buffer.byteLength;
+    }
+
+    const gaps = [];
+    function onGap(gap) {
+      gaps.push(gap);
+    }
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioData,
+      onGap,
+      sampleRate: decodeSampleRate,
+      signal: abortController.signal,
+    });
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    await new Promise((resolve) => setTimeout(resolve, 2000));
+    consumer.pause();
+    // Frames decoded before the pause took effect may still be on their way
+    await new Promise((resolve) => setTimeout(resolve, 100));
+    paused = true;
+    await new Promise((resolve) => setTimeout(resolve, 2000));
+    paused = false;
+    consumer.resume();
+
+    await producerDone();
+    abortController.abort();
+    await consumer.done();
+
+    // Resuming is marked as a jump over the time spent paused
+    const discontinuities = gaps.filter(
+      ({ type }) => type === "discontinuity",
+    );
+    expect(discontinuities.length).toBe(1);
+    expect(discontinuities[0].durationMs).toBeGreaterThan(1500);
+
+    // About 8.4 seconds of audio, less the two seconds paused
+    const seconds = bytesReceived / (decodeSampleRate * 2);
+    expect(seconds).toBeGreaterThan(5);
+    expect(seconds).toBeLessThan(7);
+  },
+  15 * 1000,
+);
+
+it(
+  "delivers nothing on a local clock while paused",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    let paused = false;
+    let framesReceived = 0;
+    function onAudioData() {
+      expect(paused).toBe(false);
+      framesReceived++;
+    }
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      onAudioData,
+      sampleRate: decodeSampleRate,
+      clockedOutput: true,
+      signal: abortController.signal,
+    });
+
+    const producer = produceRtp({
+      ipAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      rtpParameters,
+      signal: abortController.signal,
+      sampleRate: encodeSampleRate,
+    });
+
+    const sourceAudio = path.join(__dirname, "LJ025-0076_24k_mono.wav");
+    const pcmData = fs.readFileSync(sourceAudio).subarray(44);
+    producer.write(pcmData.subarray(0, encodeSampleRate * 2));
+    producer.end();
+
+    await new Promise((resolve) => setTimeout(resolve, 500));
+    consumer.pause();
+    // Frames emitted before the pause took effect may still be on their way
+    await new Promise((resolve) => setTimeout(resolve, 100));
+    paused = true;
+
+    // The sender stops while paused. The clock mustn't fill in for it.
+    await producer.done();
+    await new Promise((resolve) => setTimeout(resolve, 1500));
+
+    abortController.abort();
+    await consumer.done();
+
+    expect(framesReceived).toBeGreaterThan(0);
+  },
+  10 * 1000,
+);
+
+it(
+  "delivers audio through a stream with a bounded buffer",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      sampleRate: decodeSampleRate,
+      stream: { bufferMs: 500, overflow: "dropOldest" },
+      signal: abortController.signal,
+    });
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    producerDone().then(() => abortController.abort());
+
+    // Read slowly at first, so the buffer overflows
+    let bytesReceived = 0;
+    let lastPts = -1;
+    let reads = 0;
+    for await (const { buffer, pts } of consumer.stream) {
+      expect(pts).toBeGreaterThan(lastPts);
+      lastPts = pts;
+      bytesReceived += buffer.byteLength;
+      if (++reads === 1) {
+        await new Promise((resolve) => setTimeout(resolve, 2000));
+        expect(consumer.deliveryStats().bufferedMs).toBeLessThanOrEqual(500);
+      }
+    }
+
+    await consumer.done();
+
+    const { overflowedChunks, droppedChunks, bufferedMs } =
+      consumer.deliveryStats();
+    expect(overflowedChunks).toBeGreaterThan(50);
+    expect(droppedChunks).toBe(0);
+    expect(bufferedMs).toBe(0);
+
+    // About 8.4 seconds of audio, less the 1.5 seconds that overflowed
+    const seconds = bytesReceived / (decodeSampleRate * 2);
+    expect(seconds).toBeGreaterThan(6);
+    expect(seconds).toBeLessThan(7.5);
+  },
+  15 * 1000,
+);
+
+it(
+  "stops the consumer when its stream is cancelled",
+  async () => {
+    const rtpParameters = createRtpParameters();
+
+    const sdp = createSDP({
+      subject: "Unit Test",
+      rtpParameters,
+      originIpAddress: "127.0.0.1",
+      destinationIpAddress: "127.0.0.1",
+      rtpPort: RTP_PORT,
+      rtcpPort: RTP_PORT + 1,
+      language: "en",
+    });
+
+    const abortController = new AbortController();
+
+    const consumer = consumeRtp({
+      sdp,
+      sampleRate: decodeSampleRate,
+      stream: {},
+      signal: abortController.signal,
+    });
+
+    const { done: producerDone } = await runProducer({
+      rtpParameters,
+      signal: abortController.signal,
+    });
+
+    let producerFinished = false;
+    const producerPromise = producerDone().then(() => {
+      producerFinished = true;
+    });
+
+    // Breaking out of the loop cancels the stream
+    let reads = 0;
+    for await (const _data of consumer.stream) {
+      if (++reads === 10) {
+        break;
+      }
+    }
+
+    // Without aborting the signal, and long before the producer is done
+    await consumer.done();
+    expect(producerFinished).toBe(false);
+
+    abortController.abort();
+    await producerPromise;
+  },
+  10 * 1000,
+);
+
 afterAll(() => {
   return checkForMemoryLeaks();
 });